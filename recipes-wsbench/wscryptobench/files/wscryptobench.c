@@ -0,0 +1,773 @@
+/**
+ * @file   wscryptobench.c
+ * @brief  Throughput and latency benchmark for the AES, SHA256 and RSA offload paths, in the spirit
+ * of `openssl speed`. Every path is run for each payload size and thread count and reported next
+ * to pure-software OpenSSL doing the same work, as JSON on stdout (or -o FILE).
+ *
+ *   aes-256-cbc     driver (raw /dev/wsaeschar), lib (libwsaescbc), engine (wsaes engine), openssl
+ *   sha256          engine (wssha256 engine), openssl
+ *   rsa1024-modexp  driver (raw /dev/wsrsachar), openssl
+ *
+ * Before a path is timed at a size, its first result is checked against OpenSSL's default
+ * provider doing the same operation; a path that gets it wrong is reported with "verified": false
+ * and no rates, and the exit status is 1.
+ *
+ * The SHA256 driver protocol belongs to the external wssha256-kmod tree, so it is only reached
+ * through its engine here. Paths whose device or engine can't be opened are skipped with a
+ * message on stderr. WSAES_DEVICE and WSRSA_DEVICE select other device nodes, e.g. the emulators.
+ *
+ * usage: wscryptobench [-a aes,sha,rsa] [-p driver,lib,engine,openssl] [-s 16,64,...]
+ *                      [-t 1,2,4] [-d seconds] [-o file] [-E aesengine.so] [-S shaengine.so]
+ */
+#define OPENSSL_SUPPRESS_DEPRECATED  // the offload engines still use the ENGINE API
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <openssl/evp.h>
+#include <openssl/bn.h>
+#include <openssl/engine.h>
+
+#include "wsaescbc.h"
+#include "wsaeskern.h"
+#include "wscryptobench.h"
+
+#define MAXLIST 16
+#define MAXRESULTS 256
+
+typedef struct worker worker_t;
+
+typedef struct {
+    const char *algo;
+    const char *path;
+    int fixedsize;                      // payload size if the operation has only one, else 0
+    int (*init)(void);                  // once per path, nonzero to skip it
+    int (*setup)(worker_t *w);          // per thread
+    int (*op)(worker_t *w);             // one operation of w->size bytes
+    void (*teardown)(worker_t *w);
+    void (*fini)(void);                 // once per path after its last run, lets go of the device
+} benchpath_t;
+
+struct worker {
+    const benchpath_t *bp;
+    uint32_t size;
+    uint8_t *in;
+    uint8_t *out;
+    void *state;
+    double *lat;        // per-op latencies in seconds
+    size_t nlat;
+    size_t latcap;
+    uint64_t ops;
+    int errors;
+    pthread_t tid;
+};
+
+typedef struct {
+    const char *algo;
+    uint32_t size;
+    int threads;
+    double bps;
+} swresult_t;
+
+static uint8_t benchkey[AESKEYSIZE];
+static uint8_t benchiv[AESIVSIZE];
+
+static const char *aesenginepath = "/usr/lib/libwsaesengine.so";
+static const char *shaenginepath = "/usr/lib/libwssha256engine.so";
+static ENGINE *aesengine;
+static ENGINE *shaengine;
+
+static int aesdrvfd = -1;
+static int rsadrvfd = -1;
+static pthread_mutex_t drvlock = PTHREAD_MUTEX_INITIALIZER;  // the raw devices hold one request at a time
+
+static pthread_barrier_t startbarrier;
+static double deadline;
+
+static swresult_t swresults[MAXRESULTS];
+static int nswresults;
+
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cputime(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+
+/*
+ * Loads an engine shared object through the dynamic engine, as the engine test programs do
+ */
+static ENGINE *loadengine(const char *sopath)
+{
+    ENGINE *e;
+
+    ENGINE_load_dynamic();
+    e = ENGINE_by_id("dynamic");
+    if (e == NULL)
+        return NULL;
+    if (!ENGINE_ctrl_cmd_string(e, "SO_PATH", sopath, 0) ||
+        !ENGINE_ctrl_cmd_string(e, "LOAD", NULL, 0) ||
+        !ENGINE_init(e))
+    {
+        ENGINE_free(e);
+        return NULL;
+    }
+    return e;
+}
+
+
+/*
+ * AES-256-CBC
+ */
+
+static int aesdrv_init(void)
+{
+    const char *devstr = getenv("WSAES_DEVICE") ? getenv("WSAES_DEVICE") : "/dev/wsaeschar";
+
+    if (aesdrvfd < 0)
+        aesdrvfd = open(devstr, O_RDWR);
+    return (aesdrvfd < 0) ? errno : 0;
+}
+
+// the drivers allow one open at a time, so the next path could not get at the device otherwise
+static void aesdrv_fini(void)
+{
+    close(aesdrvfd);
+    aesdrvfd = -1;
+}
+
+// the full driver sequence for one message, with no caching of key or IV
+static int aesdrv_op(worker_t *w)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&drvlock);
+    if (ioctl(aesdrvfd, IOCTL_SET_MODE, SET_KEY) < 0 || write(aesdrvfd, benchkey, AESKEYSIZE) < 0 ||
+        ioctl(aesdrvfd, IOCTL_SET_MODE, SET_IV) < 0 || write(aesdrvfd, benchiv, AESIVSIZE) < 0 ||
+        ioctl(aesdrvfd, IOCTL_SET_MODE, RESET) < 0 || ioctl(aesdrvfd, IOCTL_SET_MODE, ENCRYPT) < 0)
+    {
+        ret = errno;
+    }
+    for (uint32_t i=0; ret==0 && i<w->size; i+=AESBLKSIZE)
+    {
+        if (write(aesdrvfd, &w->in[i], AESBLKSIZE) < 0 || read(aesdrvfd, &w->out[i], AESBLKSIZE) < 0)
+            ret = errno;
+    }
+    pthread_mutex_unlock(&drvlock);
+    return ret;
+}
+
+static int aeslib_init(void)
+{
+    int saved, ret;
+
+    // aes256init() reports on stdout, which carries the JSON
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    ret = aes256init();
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    return ret;
+}
+
+static int aeslib_setup(worker_t *w)
+{
+    w->state = aes256keyctx_new(benchkey);
+    return (w->state == NULL) ? ENOMEM : 0;
+}
+
+// messages longer than one request go through as chained unpadded pieces
+static int aeslib_op(worker_t *w)
+{
+    uint8_t *ivp = benchiv;
+    uint32_t olen;
+    int32_t ret;
+
+    for (uint32_t pos=0; pos<w->size; pos+=AESMAXDATASIZE)
+    {
+        uint32_t len = (w->size - pos > AESMAXDATASIZE) ? AESMAXDATASIZE : w->size - pos;
+
+        ret = aes256ctx(w->state, ENCRYPT | AESNOPAD, ivp, &w->in[pos], len, &w->out[pos], &olen);
+        if (ret != 0)
+            return ret;
+        ivp = &w->out[pos + len - AESBLKSIZE];
+    }
+    return 0;
+}
+
+static void aeslib_teardown(worker_t *w)
+{
+    aes256keyctx_free(w->state);
+}
+
+static void aeslib_fini(void)
+{
+    aes256shutdown();
+}
+
+static int aesengine_init(void)
+{
+    if (aesengine == NULL)
+        aesengine = loadengine(aesenginepath);
+    return (aesengine == NULL) ? -1 : 0;
+}
+
+static void aesengine_fini(void)
+{
+    ENGINE_finish(aesengine);
+    ENGINE_free(aesengine);
+    aesengine = NULL;
+}
+
+static int aesevp_setup(worker_t *w, ENGINE *e)
+{
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+
+    if (ctx == NULL || !EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), e, benchkey, benchiv))
+    {
+        EVP_CIPHER_CTX_free(ctx);
+        return -1;
+    }
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+    w->state = ctx;
+    return 0;
+}
+
+static int aesengine_setup(worker_t *w)
+{
+    return aesevp_setup(w, aesengine);
+}
+
+static int aesopenssl_setup(worker_t *w)
+{
+    return aesevp_setup(w, NULL);
+}
+
+static int aesevp_op(worker_t *w)
+{
+    int olen;
+
+    if (!EVP_EncryptInit_ex(w->state, NULL, NULL, NULL, benchiv) ||
+        !EVP_EncryptUpdate(w->state, w->out, &olen, w->in, w->size))
+        return -1;
+    return 0;
+}
+
+static void aesevp_teardown(worker_t *w)
+{
+    EVP_CIPHER_CTX_free(w->state);
+}
+
+
+/*
+ * SHA256
+ */
+
+static int shaengine_init(void)
+{
+    if (shaengine == NULL)
+        shaengine = loadengine(shaenginepath);
+    return (shaengine == NULL) ? -1 : 0;
+}
+
+static void shaengine_fini(void)
+{
+    ENGINE_finish(shaengine);
+    ENGINE_free(shaengine);
+    shaengine = NULL;
+}
+
+static int shaevp_setup(worker_t *w)
+{
+    w->state = EVP_MD_CTX_new();
+    return (w->state == NULL) ? ENOMEM : 0;
+}
+
+static int shaevp_digest(worker_t *w, ENGINE *e)
+{
+    unsigned int olen;
+
+    if (!EVP_DigestInit_ex(w->state, EVP_sha256(), e) ||
+        !EVP_DigestUpdate(w->state, w->in, w->size) ||
+        !EVP_DigestFinal_ex(w->state, w->out, &olen))
+        return -1;
+    return 0;
+}
+
+static int shaengine_op(worker_t *w)
+{
+    return shaevp_digest(w, shaengine);
+}
+
+static int shaopenssl_op(worker_t *w)
+{
+    return shaevp_digest(w, NULL);
+}
+
+static void shaevp_teardown(worker_t *w)
+{
+    EVP_MD_CTX_free(w->state);
+}
+
+
+/*
+ * RSA-1024 modular exponentiation
+ */
+
+static int rsadrv_init(void)
+{
+    if (rsadrvfd < 0)
+        rsadrvfd = rsadrv_open();
+    return (rsadrvfd < 0) ? errno : 0;
+}
+
+static void rsadrv_fini(void)
+{
+    close(rsadrvfd);
+    rsadrvfd = -1;
+}
+
+static int rsadrv_op(worker_t *w)
+{
+    int32_t ret;
+
+    pthread_mutex_lock(&drvlock);
+    ret = rsadrv_modexp(rsadrvfd, w->out);
+    pthread_mutex_unlock(&drvlock);
+
+    if (ret == 0 && memcmp(w->out, rsabench_result, RSA_BYTES) != 0)
+        ret = EIO;
+    return ret;
+}
+
+typedef struct {
+    BN_CTX *bnctx;
+    BIGNUM *base, *exp, *mod, *res;
+} rsasw_t;
+
+static int rsaopenssl_setup(worker_t *w)
+{
+    rsasw_t *sw = calloc(1, sizeof(rsasw_t));
+
+    if (sw == NULL)
+        return ENOMEM;
+    sw->bnctx = BN_CTX_new();
+    sw->base = BN_lebin2bn(rsabench_base, RSA_BYTES, NULL);
+    sw->exp = BN_lebin2bn(rsabench_exp, RSA_BYTES, NULL);
+    sw->mod = BN_lebin2bn(rsabench_mod, RSA_BYTES, NULL);
+    sw->res = BN_new();
+    w->state = sw;
+    return (sw->bnctx && sw->base && sw->exp && sw->mod && sw->res) ? 0 : ENOMEM;
+}
+
+static int rsaopenssl_op(worker_t *w)
+{
+    rsasw_t *sw = w->state;
+
+    if (!BN_mod_exp_mont(sw->res, sw->base, sw->exp, sw->mod, sw->bnctx, NULL) ||
+        BN_bn2lebinpad(sw->res, w->out, RSA_BYTES) != RSA_BYTES)
+        return -1;
+    return memcmp(w->out, rsabench_result, RSA_BYTES) ? EIO : 0;
+}
+
+static void rsaopenssl_teardown(worker_t *w)
+{
+    rsasw_t *sw = w->state;
+
+    BN_free(sw->base);
+    BN_free(sw->exp);
+    BN_free(sw->mod);
+    BN_free(sw->res);
+    BN_CTX_free(sw->bnctx);
+    free(sw);
+}
+
+
+// software first, so the offload rows can be compared against it
+static const benchpath_t paths[] = {
+    { "aes-256-cbc",    "openssl", 0,         NULL,           aesopenssl_setup, aesevp_op,     aesevp_teardown,     NULL },
+    { "aes-256-cbc",    "driver",  0,         aesdrv_init,    NULL,             aesdrv_op,     NULL,                aesdrv_fini },
+    { "aes-256-cbc",    "lib",     0,         aeslib_init,    aeslib_setup,     aeslib_op,     aeslib_teardown,     aeslib_fini },
+    { "aes-256-cbc",    "engine",  0,         aesengine_init, aesengine_setup,  aesevp_op,     aesevp_teardown,     aesengine_fini },
+    { "sha256",         "openssl", 0,         NULL,           shaevp_setup,     shaopenssl_op, shaevp_teardown,     NULL },
+    { "sha256",         "engine",  0,         shaengine_init, shaevp_setup,     shaengine_op,  shaevp_teardown,     shaengine_fini },
+    { "rsa1024-modexp", "openssl", RSA_BYTES, NULL,           rsaopenssl_setup, rsaopenssl_op, rsaopenssl_teardown, NULL },
+    { "rsa1024-modexp", "driver",  RSA_BYTES, rsadrv_init,    NULL,             rsadrv_op,     NULL,                rsadrv_fini },
+};
+
+
+static void *benchthread(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+
+    pthread_barrier_wait(&startbarrier);
+
+    while (1)
+    {
+        double start = now();
+
+        if (start >= deadline)
+            break;
+        if (w->bp->op(w) != 0)
+            w->errors++;
+
+        if (w->nlat == w->latcap)
+        {
+            double *lat = realloc(w->lat, 2 * w->latcap * sizeof(double));
+            if (lat == NULL)
+                break;
+            w->lat = lat;
+            w->latcap *= 2;
+        }
+        w->lat[w->nlat++] = now() - start;
+        w->ops++;
+    }
+    return NULL;
+}
+
+/*
+ * Runs one operation on w and compares its output with OpenSSL's default provider computing the
+ * same thing, so that a fast but broken offload is not reported as a result
+ */
+static int verifyone(worker_t *w)
+{
+    const char *algo = w->bp->algo;
+    uint8_t *ref;
+    int ok = 0;
+
+    if (w->bp->op(w) != 0)
+        return 0;
+    ref = malloc(w->size + EVP_MAX_BLOCK_LENGTH + EVP_MAX_MD_SIZE);
+    if (ref == NULL)
+        return 0;
+
+    if (strcmp(algo, "aes-256-cbc") == 0)
+    {
+        EVP_CIPHER *cipher = EVP_CIPHER_fetch(NULL, "AES-256-CBC", "provider=default");
+        EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+        int len;
+
+        ok = cipher != NULL && ctx != NULL && EVP_EncryptInit_ex2(ctx, cipher, benchkey, benchiv, NULL) &&
+             EVP_CIPHER_CTX_set_padding(ctx, 0) && EVP_EncryptUpdate(ctx, ref, &len, w->in, w->size) &&
+             memcmp(w->out, ref, w->size) == 0;
+        EVP_CIPHER_CTX_free(ctx);
+        EVP_CIPHER_free(cipher);
+    }
+    else if (strcmp(algo, "sha256") == 0)
+    {
+        EVP_MD *md = EVP_MD_fetch(NULL, "SHA256", "provider=default");
+        unsigned int len;
+
+        ok = md != NULL && EVP_Digest(w->in, w->size, ref, &len, md, NULL) &&
+             memcmp(w->out, ref, len) == 0;
+        EVP_MD_free(md);
+    }
+    else
+    {
+        // the operand set is fixed and its result was worked out with BN_mod_exp()
+        ok = memcmp(w->out, rsabench_result, RSA_BYTES) == 0;
+    }
+
+    free(ref);
+    return ok;
+}
+
+static int cmpdouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, size_t n, double p)
+{
+    if (n == 0)
+        return 0;
+    size_t idx = (size_t)(p / 100.0 * (n - 1) + 0.5);
+    return sorted[idx];
+}
+
+
+/*
+ * Runs one path at one size and thread count and appends its JSON object to out. *failedp is set
+ * when the path's output was wrong.
+ */
+static int runone(FILE *out, const benchpath_t *bp, uint32_t size, int nthreads, double duration, int first,
+                  int *failedp)
+{
+    worker_t workers[nthreads];
+    uint64_t ops = 0;
+    int errors = 0, ret = 0;
+    size_t nlat = 0;
+
+    memset(workers, 0, sizeof(workers));
+    for (int t=0; t<nthreads; t++)
+    {
+        worker_t *w = &workers[t];
+
+        w->bp = bp;
+        w->size = size;
+        w->in = malloc(size);
+        w->out = malloc(size + EVP_MAX_MD_SIZE);
+        w->latcap = 4096;
+        w->lat = malloc(w->latcap * sizeof(double));
+        if (w->in == NULL || w->out == NULL || w->lat == NULL)
+            ret = ENOMEM;
+        else
+        {
+            for (uint32_t i=0; i<size; i++)
+                w->in[i] = (uint8_t)(i + t);
+            if (bp->setup && bp->setup(w) != 0)
+                ret = -1;
+        }
+    }
+
+    if (ret == 0 && !verifyone(&workers[0]))
+    {
+        fprintf(out, "%s    {\"algo\": \"%s\", \"path\": \"%s\", \"size\": %u, \"threads\": %d, "
+                "\"verified\": false}", first ? "" : ",\n", bp->algo, bp->path, size, nthreads);
+        fflush(out);
+        fprintf(stderr, "%-15s %-8s %6u bytes %3d threads: FAILED, output does not match OpenSSL\n",
+                bp->algo, bp->path, size, nthreads);
+        *failedp = 1;
+    }
+    else if (ret == 0)
+    {
+        pthread_barrier_init(&startbarrier, NULL, nthreads + 1);
+        for (int t=0; t<nthreads; t++)
+            pthread_create(&workers[t].tid, NULL, benchthread, &workers[t]);
+
+        double cpustart = cputime();
+        double start = now();
+        deadline = start + duration;
+        pthread_barrier_wait(&startbarrier);
+
+        for (int t=0; t<nthreads; t++)
+            pthread_join(workers[t].tid, NULL);
+        double elapsed = now() - start;
+        double cpu = cputime() - cpustart;
+        pthread_barrier_destroy(&startbarrier);
+
+        for (int t=0; t<nthreads; t++)
+        {
+            ops += workers[t].ops;
+            errors += workers[t].errors;
+            nlat += workers[t].nlat;
+        }
+
+        double *lat = malloc((nlat ? nlat : 1) * sizeof(double));
+        size_t k = 0;
+        for (int t=0; t<nthreads; t++)
+        {
+            memcpy(&lat[k], workers[t].lat, workers[t].nlat * sizeof(double));
+            k += workers[t].nlat;
+        }
+        qsort(lat, nlat, sizeof(double), cmpdouble);
+
+        double bps = (double)ops * size / elapsed;
+        double swbps = 0;
+
+        if (strcmp(bp->path, "openssl") == 0 && nswresults < MAXRESULTS)
+            swresults[nswresults++] = (swresult_t){ bp->algo, size, nthreads, bps };
+        for (int i=0; i<nswresults; i++)
+        {
+            if (strcmp(swresults[i].algo, bp->algo) == 0 && swresults[i].size == size &&
+                swresults[i].threads == nthreads)
+                swbps = swresults[i].bps;
+        }
+
+        fprintf(out, "%s    {\"algo\": \"%s\", \"path\": \"%s\", \"size\": %u, \"threads\": %d, "
+                "\"verified\": true, \"ops\": %llu, \"errors\": %d, \"seconds\": %.6f, \"bytes_per_sec\": %.1f, "
+                "\"ops_per_sec\": %.1f, \"latency_us\": {\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, "
+                "\"p999\": %.3f, \"max\": %.3f}, \"cpu_percent\": %.1f",
+                first ? "" : ",\n", bp->algo, bp->path, size, nthreads, (unsigned long long)ops, errors,
+                elapsed, bps, ops / elapsed, percentile(lat, nlat, 50) * 1e6, percentile(lat, nlat, 90) * 1e6,
+                percentile(lat, nlat, 99) * 1e6, percentile(lat, nlat, 99.9) * 1e6,
+                percentile(lat, nlat, 100) * 1e6, 100.0 * cpu / elapsed);
+        if (swbps > 0 && strcmp(bp->path, "openssl") != 0)
+            fprintf(out, ", \"vs_openssl\": %.3f", bps / swbps);
+        fprintf(out, "}");
+        fflush(out);
+
+        fprintf(stderr, "%-15s %-8s %6u bytes %3d threads: %12.1f ops/s %14.1f bytes/s\n",
+                bp->algo, bp->path, size, nthreads, ops / elapsed, bps);
+        free(lat);
+    }
+
+    for (int t=0; t<nthreads; t++)
+    {
+        if (bp->teardown && workers[t].state)
+            bp->teardown(&workers[t]);
+        free(workers[t].in);
+        free(workers[t].out);
+        free(workers[t].lat);
+    }
+    return ret;
+}
+
+
+/*
+ * Parses a comma separated list of at most MAXLIST numbers into vals, -1 if there are more
+ */
+static int parselist(const char *arg, int *vals)
+{
+    char *copy = strdup(arg), *tok, *save;
+    int n = 0;
+
+    for (tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save))
+    {
+        if (n == MAXLIST)
+        {
+            n = -1;
+            break;
+        }
+        vals[n++] = atoi(tok);
+    }
+    free(copy);
+    return n;
+}
+
+static int listed(const char *list, const char *name)
+{
+    size_t len = strlen(name);
+
+    for (const char *p = strstr(list, name); p != NULL; p = strstr(p + 1, name))
+    {
+        if ((p == list || p[-1] == ',') && (p[len] == ',' || p[len] == '\0'))
+            return 1;
+    }
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-a aes,sha,rsa] [-p driver,lib,engine,openssl] [-s 16,64,...]\n"
+            "       %*s [-t 1,2,4] [-d seconds] [-o file] [-E aesengine.so] [-S shaengine.so]\n"
+            "sizes must be multiples of %d bytes, at most %d sizes and thread counts\n", prog,
+            (int)strlen(prog), "", AESBLKSIZE, MAXLIST);
+}
+
+int main(int argc, char **argv)
+{
+    const char *algos = "aes,sha,rsa";
+    const char *pathlist = "driver,lib,engine,openssl";
+    int sizes[MAXLIST] = { 16, 64, 256, 1024, 8192 }, nsizes = 5;
+    int threads[MAXLIST] = { 1, 2, 4 }, nthreads = 3;
+    double duration = 1.0;
+    FILE *out = stdout;
+    int opt, first = 1, failed = 0;
+
+    while ((opt = getopt(argc, argv, "a:p:s:t:d:o:E:S:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'a': algos = optarg; break;
+            case 'p': pathlist = optarg; break;
+            case 's': nsizes = parselist(optarg, sizes); break;
+            case 't': nthreads = parselist(optarg, threads); break;
+            case 'd': duration = atof(optarg); break;
+            case 'o':
+                out = fopen(optarg, "w");
+                if (out == NULL)
+                {
+                    perror("ERROR: can't open output file");
+                    return 1;
+                }
+                break;
+            case 'E': aesenginepath = optarg; break;
+            case 'S': shaenginepath = optarg; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (nsizes < 0 || nthreads < 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    for (int i=0; i<nsizes; i++)
+    {
+        if (sizes[i] <= 0 || sizes[i] % AESBLKSIZE != 0)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    for (int i=0; i<nthreads; i++)
+    {
+        if (threads[i] <= 0)
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (duration <= 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    for (int i=0; i<AESKEYSIZE; i++)
+        benchkey[i] = (uint8_t)i;
+    for (int i=0; i<AESIVSIZE; i++)
+        benchiv[i] = (uint8_t)(0xA0 + i);
+
+    fprintf(out, "{\n  \"tool\": \"wscryptobench\",\n  \"duration\": %.3f,\n  \"results\": [\n", duration);
+
+    for (size_t p=0; p<sizeof(paths)/sizeof(paths[0]); p++)
+    {
+        const benchpath_t *bp = &paths[p];
+        char algo[4];
+
+        snprintf(algo, sizeof(algo), "%s", bp->algo);
+        if (!listed(algos, algo) || !listed(pathlist, bp->path))
+            continue;
+        if (bp->init && bp->init() != 0)
+        {
+            fprintf(stderr, "Skipping %s via %s: not available\n", bp->algo, bp->path);
+            continue;
+        }
+
+        for (int s=0; s<nsizes; s++)
+        {
+            if (bp->fixedsize && s > 0)
+                break;
+            for (int t=0; t<nthreads; t++)
+            {
+                if (runone(out, bp, bp->fixedsize ? bp->fixedsize : sizes[s], threads[t], duration, first,
+                           &failed) == 0)
+                    first = 0;
+                else
+                    fprintf(stderr, "Skipping %s via %s: setup failed\n", bp->algo, bp->path);
+            }
+        }
+        if (bp->fini)
+            bp->fini();
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+
+    if (out != stdout)
+        fclose(out);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+/*
+ * Pieces of wscryptobench that live in their own translation units
+ */
+
+#include <stdint.h>
+
+#define RSA_BYTES 128
+#define RSA_WORDS (RSA_BYTES / 4)
+
+// the fixed 1024-bit operand set, little-endian as the block takes it
+extern const uint8_t *rsabench_base;
+extern const uint8_t *rsabench_exp;
+extern const uint8_t *rsabench_mod;
+extern const uint8_t *rsabench_result;  // base^exp mod modulus
+
+int rsadrv_open(void);
+int32_t rsadrv_modexp(int fd, uint8_t *outp);
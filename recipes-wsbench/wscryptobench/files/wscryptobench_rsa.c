@@ -0,0 +1,68 @@
+/**
+ * @file   wscryptobench_rsa.c
+ * @brief  Raw /dev/wsrsachar access for wscryptobench. Kept in its own file because wsrsakern.h
+ * and wsaeskern.h define the same names.
+ *
+ * The block needs precomputed Montgomery operands (xbar, Mbar) alongside the modulus, so the
+ * benchmark uses the known-good operand set from wsrsatest rather than generating its own.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "wsrsakern.h"
+#include "wscryptobench.h"
+
+static const uint32_t publexp_arr[RSA_WORDS] = {0x10001};
+static const uint32_t base_arr[RSA_WORDS] = {0x726C6421,0x2C20576F,0x656C6C6F,0x00000048};
+static const uint8_t modulus_arr[] = {0x49,0xF5,0xEB,0x73,0x5B,0x82,0x9C,0xEB,0x4B,0xC2,0xAF,0x74,0x64,0x29,0x38,0xA8,0xAF,0x7E,0xA4,0x77,0xBA,0x9C,0x79,0xB6,0x9B,0x5E,0x65,0xBC,0xBA,0x74,0x84,0x3E,0x84,0xBF,0x5C,0xD4,0xD1,0xF4,0xEC,0xD4,0x83,0x3D,0xC6,0x9B,0x7B,0x52,0x5C,0x2F,0x25,0x79,0x6D,0x21,0x79,0xB3,0x31,0x7A,0x0D,0xAD,0xB1,0xB9,0xDC,0x5F,0xE5,0x3D,0x13,0x21,0xF6,0xFB,0x97,0x1A,0xFB,0xB9,0x7F,0x4D,0x26,0x0F,0x10,0x37,0xEA,0xEA,0xEC,0x97,0xA4,0x79,0x37,0xFB,0x62,0x33,0x9E,0xB3,0x28,0xC4,0x30,0x8A,0xA6,0x94,0x9A,0x9F,0x0D,0xDF,0xE2,0xF5,0xB4,0x1F,0x25,0x4F,0xE1,0x6F,0x35,0xBF,0x82,0xBF,0xE6,0xA2,0xA0,0x15,0x80,0xA1,0x69,0x97,0xD8,0x3D,0x85,0x88,0x9E,0x88,0x4D,0xD9};
+static const uint32_t xbar_arr[] = {0x26b27761, 0x777ac227, 0x68965e7f, 0xea5f5d19, 0x407d40ca, 0x901eb0da, 0xe04b0a1d, 0x20f26065, 0x6b5975cf, 0x3bd74c61, 0xcc9d04c8, 0x865b6813, 0x1515c8ef, 0xf0d9b280, 0x4604e568, 0x409deec, 0xc21aa023, 0x464e52f2, 0x85ce4c86, 0xde9286da, 0xd0a3ad84, 0x6439c27c, 0x2b130b2e, 0x2ba3407b, 0xc17b8b45, 0x439aa164, 0x49866345, 0x885b8150, 0x57c7d69b, 0x8b503db4, 0x14637da4, 0x8c140ab7};
+static const uint32_t Mbar_arr[] = {0xcac00639, 0x454e47a7, 0xcdca9033, 0xe4ad317e, 0x95421d69, 0x98c6defe, 0x79ae2246, 0x321bd1ad, 0x60cdabe2, 0x0ba4154d, 0x1202ea26, 0x35e55c32, 0x6f443311, 0xd267d8b6, 0x9f989823, 0x67626490, 0x4dbf2c73, 0xcadac30b, 0xe1aa3964, 0xe12e61c6, 0x4cbb5fde, 0x42fe3a02, 0xf21d4c95, 0x9f2209e4, 0xa2f7e5d7, 0xc3eff321, 0xaf6a4878, 0xe0374acf, 0x095cc07e, 0xb77c7ec3, 0xaf932c98, 0x8890548f};
+static const uint8_t ciphertext_golden_ans[] = {0xF0,0xCA,0x37,0xC7,0xFA,0x38,0xB3,0xDF,0x00,0xA6,0xFA,0x10,0x14,0xEA,0xD7,0x36,0x83,0x61,0x5F,0x12,0x29,0x6C,0x19,0xC3,0x3A,0xC6,0x03,0xC9,0x74,0xF2,0x9E,0x57,0x68,0x2C,0xA8,0xAD,0xE6,0xAF,0x27,0x35,0xEF,0xD6,0x33,0x34,0xA8,0x0F,0x8E,0x2D,0x84,0xA5,0xA9,0xF3,0xC6,0x9A,0xF7,0xC9,0xB6,0x9B,0x12,0x0E,0xF3,0x40,0x6E,0x8E,0x2A,0x40,0x4B,0x6C,0x63,0x6B,0x42,0xEC,0xE6,0xB5,0x2E,0x1D,0x5A,0x95,0xFF,0x8E,0xAF,0xB3,0x24,0x8D,0x88,0x01,0x61,0x42,0x1D,0xA9,0x80,0x93,0xD2,0xE9,0x04,0x30,0x63,0x43,0x16,0xC1,0xD0,0xCC,0xFD,0xD1,0xA0,0xA8,0xC3,0xD0,0x73,0xF6,0x66,0x38,0x95,0x42,0xA1,0x75,0x77,0xD1,0xE2,0xBB,0xB8,0x49,0x7B,0x78,0x6F,0x66,0x44,0x93};
+
+const uint8_t *rsabench_base = (const uint8_t *)base_arr;
+const uint8_t *rsabench_exp = (const uint8_t *)publexp_arr;
+const uint8_t *rsabench_mod = modulus_arr;
+const uint8_t *rsabench_result = ciphertext_golden_ans;
+
+
+/*
+ * Opens the RSA device, or $WSRSA_DEVICE when it is set
+ */
+int rsadrv_open(void)
+{
+    const char *devstr = getenv("WSRSA_DEVICE") ? getenv("WSRSA_DEVICE") : "/dev/wsrsachar";
+    int fd = open(devstr, O_RDWR);
+
+    if (fd < 0)
+        perror("ERROR: Failed to open the RSA device");
+    return fd;
+}
+
+
+/*
+ * One exponentiation of the fixed operand set: write the operands, start the block, read back
+ */
+int32_t rsadrv_modexp(int fd, uint8_t *outp)
+{
+    RSAPublic_t pubdata;
+
+    memcpy(pubdata.base, base_arr, RSA_SIZE_BYTES);
+    memcpy(pubdata.exponent, publexp_arr, RSA_SIZE_BYTES);
+    memcpy(pubdata.modulus, modulus_arr, RSA_SIZE_BYTES);
+    memcpy(pubdata.xbar, xbar_arr, RSA_SIZE_BYTES);
+    memcpy(pubdata.Mbar, Mbar_arr, RSA_SIZE_BYTES);
+
+    if (write(fd, &pubdata, sizeof(RSAPublic_t)) < 0)
+        return errno;
+    if (ioctl(fd, IOCTL_SET_MODE, INIT) < 0)
+        return errno;
+    if (read(fd, outp, RSA_SIZE_BYTES) < 0)
+        return errno;
+    return 0;
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+/*
+ * wsbroker: a daemon that owns the crypto devices and serves many client processes.
+ *
+ * A client connects to the broker's unix socket and gets back a shared-memory segment and two
+ * eventfds. The segment holds WSB_SLOTS request slots plus a submission and a completion ring of
+ * slot indices, io_uring style. The client fills a free slot, pushes its index on the submission
+ * ring and signals the first eventfd; the broker pushes finished slots on the completion ring and
+ * signals the second. Since there are only as many slots as ring entries, neither ring can
+ * overflow; a client that runs out of free slots has hit backpressure and must reap first.
+ * Submitting a slot again before its completion has been posted gets the client disconnected.
+ */
+
+#include <stdint.h>
+
+#define WSB_VERSION 2
+#define WSB_SLOTS 64            // per client, power of two
+#define WSB_MAXCLIENTS 32
+#define WSB_MAXIN 768           // an RSAPublic_t and an expected result
+#define WSB_MAXOUT 272          // AESMAXDATASIZE plus a padding block
+#define WSB_RSA_PUBLEN 640      // an RSAPublic_t
+#define WSB_RSA_VERIFYLEN (WSB_RSA_PUBLEN + 128)
+
+#define WSB_DEFAULT_SOCKET "/run/wsbroker.sock"
+#define WSB_STATS_NAME "/wsbroker-stats"
+
+typedef enum { WSB_DEV_AES = 0, WSB_DEV_SHA256, WSB_DEV_RSA, WSB_NDEV } wsbdev_t;
+
+typedef enum {
+    WSB_OP_AES_ENCRYPT = 1,     // key, iv, in[len] -> padded ciphertext
+    WSB_OP_AES_DECRYPT,         // key, iv, in[len] -> plaintext
+    WSB_OP_SHA256,              // in[len] -> 32-byte digest
+    WSB_OP_RSA_MODEXP,          // in = RSAPublic_t -> 128-byte result
+    WSB_OP_RSA_VERIFY           // in = RSAPublic_t with the signature as base, then the expected
+                                // 128-byte result (the encoded digest) -> status 0 or EBADMSG
+} wsbop_t;
+
+typedef struct {
+    uint32_t op;
+    uint32_t len;
+    int32_t status;             // written by the broker: 0 or an errno value
+    uint32_t outlen;
+    uint8_t key[32];
+    uint8_t iv[16];
+    uint8_t in[WSB_MAXIN];
+    uint8_t out[WSB_MAXOUT];
+} wsbslot_t;
+
+typedef struct {
+    uint32_t sqhead;            // advanced by the broker
+    uint32_t sqtail;            // advanced by the client
+    uint32_t cqhead;            // advanced by the client
+    uint32_t cqtail;            // advanced by the broker
+    uint32_t sq[WSB_SLOTS];
+    uint32_t cq[WSB_SLOTS];
+    wsbslot_t slots[WSB_SLOTS];
+} wsbshm_t;
+
+/* connection handshake; the broker's reply carries the shm fd and the two eventfds */
+typedef struct {
+    uint32_t version;
+    int32_t pid;                // informational; the broker goes by the socket's SO_PEERCRED
+} wsbhello_t;
+
+typedef struct {
+    uint32_t version;
+    int32_t status;
+} wsbwelcome_t;
+
+/*
+ * Live statistics, kept by the broker in the shared memory object WSB_STATS_NAME
+ */
+typedef struct {
+    uint64_t requests;
+    uint64_t completed;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t busyns;            // summed request service time
+    uint32_t queued;            // waiting in the broker
+    uint32_t inflight;          // handed to the device
+} wsbdevstats_t;
+
+typedef struct {
+    int32_t pid;                // 0 if the entry is free
+    uint32_t queued;
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t stalls;            // times the broker left requests in the ring because of backpressure
+} wsbclientstats_t;
+
+/*
+ * The broker remembers the outcome of RSA verifications, keyed by all of their input (public key,
+ * Montgomery operands, signature and expected result), so a certificate chain presented again
+ * skips the device. Least recently used entries go first.
+ */
+typedef struct {
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t insertions;
+    uint64_t evictions;
+    uint32_t entries;
+    uint32_t capacity;          // 0 when the cache is off
+} wsbcachestats_t;
+
+typedef struct {
+    uint32_t version;
+    uint32_t clients;
+    uint64_t connects;
+    uint64_t rejects;           // connections refused because the client or hello table was full
+    wsbdevstats_t dev[WSB_NDEV];
+    wsbcachestats_t rsacache;
+    wsbclientstats_t client[WSB_MAXCLIENTS];
+} wsbstats_t;
+
+/*
+ * Client library. A wsbclient_t is not thread-safe; give each thread its own connection.
+ */
+typedef struct wsbclient wsbclient_t;
+
+typedef struct {
+    void *userdata;
+    int32_t status;
+    uint32_t outlen;
+} wsbcompletion_t;
+
+/* NULL uses $WSBROKER_SOCKET, or WSB_DEFAULT_SOCKET */
+wsbclient_t *wsb_connect(const char *sockpath);
+void wsb_disconnect(wsbclient_t *c);
+
+/* The eventfd that turns readable when completions are waiting */
+int wsb_fd(wsbclient_t *c);
+
+/* Queue a request; EAGAIN when all slots are in use. outp receives the result when it is reaped */
+int32_t wsb_submit(wsbclient_t *c, wsbop_t op, const uint8_t *keyp, const uint8_t *ivp,
+                   const uint8_t *inp, uint32_t inlen, uint8_t *outp, void *userdata);
+int wsb_reap(wsbclient_t *c, wsbcompletion_t *comps, int max);
+
+/* Blocking wrappers */
+int32_t wsb_aes256(wsbclient_t *c, int encrypt, const uint8_t *keyp, const uint8_t *ivp,
+                   const uint8_t *inp, uint32_t inlen, uint8_t *outp, uint32_t *outlenp);
+int32_t wsb_rsa_modexp(wsbclient_t *c, const void *pubdata, uint8_t *outp);
+/* 0 if pubdata's base is a valid signature, i.e. its modexp equals expected; EBADMSG if not */
+int32_t wsb_rsa_verify(wsbclient_t *c, const void *pubdata, const uint8_t *expected);
+
+/* Copies the broker's live statistics */
+int32_t wsb_stats(wsbstats_t *stats);
@@ -0,0 +1,332 @@
+/**
+ * @file   wsbroker_client.c
+ * @brief  Client side of the wsbroker shared-memory protocol (see wsbroker.h)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "wsbroker.h"
+
+struct wsbclient {
+    int sock;
+    int sqefd;
+    int cqefd;
+    wsbshm_t *shm;
+    uint32_t freeslots[WSB_SLOTS];
+    int nfree;
+    uint8_t *outp[WSB_SLOTS];
+    void *userdata[WSB_SLOTS];
+    // completions taken off the ring by a blocking call but not yet handed to wsb_reap()
+    wsbcompletion_t held[WSB_SLOTS];
+    int nheld;
+};
+
+
+/*
+ * Receives the broker's reply to the hello along with its three descriptors
+ */
+static int32_t wsbrecvwelcome(int sock, wsbwelcome_t *welcome, int *fds)
+{
+    char cbuf[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = { welcome, sizeof(*welcome) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+
+    if (recvmsg(sock, &msg, 0) != sizeof(*welcome))
+        return errno ? errno : EPROTO;
+    if (welcome->status != 0)
+        return welcome->status;
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+        return EPROTO;
+    memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+    return 0;
+}
+
+
+wsbclient_t *wsb_connect(const char *sockpath)
+{
+    struct sockaddr_un addr;
+    wsbhello_t hello = { WSB_VERSION, (int32_t)getpid() };
+    wsbwelcome_t welcome;
+    wsbclient_t *c;
+    int fds[3];
+    int32_t ret;
+
+    if (sockpath == NULL)
+        sockpath = getenv("WSBROKER_SOCKET") ? getenv("WSBROKER_SOCKET") : WSB_DEFAULT_SOCKET;
+
+    c = calloc(1, sizeof(wsbclient_t));
+    if (c == NULL)
+        return NULL;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sockpath, sizeof(addr.sun_path) - 1);
+
+    c->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (c->sock < 0 || connect(c->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror("ERROR: failed to connect to the crypto broker");
+        goto fail;
+    }
+
+    if (write(c->sock, &hello, sizeof(hello)) != sizeof(hello))
+    {
+        perror("ERROR: failed to send hello to the crypto broker");
+        goto fail;
+    }
+    ret = wsbrecvwelcome(c->sock, &welcome, fds);
+    if (ret != 0)
+    {
+        fprintf(stderr, "ERROR: crypto broker refused the connection: %s\n", strerror(ret));
+        goto fail;
+    }
+
+    c->shm = mmap(NULL, sizeof(wsbshm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    c->sqefd = fds[1];
+    c->cqefd = fds[2];
+    if (c->shm == MAP_FAILED)
+    {
+        perror("ERROR: failed to map the broker rings");
+        close(c->sqefd);
+        close(c->cqefd);
+        goto fail;
+    }
+
+    for (int i=0; i<WSB_SLOTS; i++)
+        c->freeslots[i] = WSB_SLOTS - 1 - i;
+    c->nfree = WSB_SLOTS;
+    return c;
+
+fail:
+    if (c->sock >= 0)
+        close(c->sock);
+    free(c);
+    return NULL;
+}
+
+
+void wsb_disconnect(wsbclient_t *c)
+{
+    munmap(c->shm, sizeof(wsbshm_t));
+    close(c->sqefd);
+    close(c->cqefd);
+    close(c->sock);
+    free(c);
+}
+
+
+int wsb_fd(wsbclient_t *c)
+{
+    return c->cqefd;
+}
+
+
+int32_t wsb_submit(wsbclient_t *c, wsbop_t op, const uint8_t *keyp, const uint8_t *ivp,
+                   const uint8_t *inp, uint32_t inlen, uint8_t *outp, void *userdata)
+{
+    uint64_t one = 1;
+    uint32_t idx, tail;
+    wsbslot_t *slot;
+
+    switch (op)
+    {
+        case WSB_OP_AES_ENCRYPT:
+        case WSB_OP_AES_DECRYPT:
+            if (inlen == 0 || inlen > WSB_MAXOUT - 16 || keyp == NULL || ivp == NULL)
+                return EINVAL;
+            break;
+        case WSB_OP_SHA256:
+            if (inlen > WSB_MAXIN)
+                return EINVAL;
+            break;
+        case WSB_OP_RSA_MODEXP:
+            if (inlen != WSB_RSA_PUBLEN)
+                return EINVAL;
+            break;
+        case WSB_OP_RSA_VERIFY:
+            if (inlen != WSB_RSA_VERIFYLEN)
+                return EINVAL;
+            break;
+        default:
+            return EINVAL;
+    }
+
+    if (c->nfree == 0)
+        return EAGAIN;
+    idx = c->freeslots[--c->nfree];
+
+    slot = &c->shm->slots[idx];
+    slot->op = op;
+    slot->len = inlen;
+    if (keyp)
+        memcpy(slot->key, keyp, sizeof(slot->key));
+    if (ivp)
+        memcpy(slot->iv, ivp, sizeof(slot->iv));
+    memcpy(slot->in, inp, inlen);
+    c->outp[idx] = outp;
+    c->userdata[idx] = userdata;
+
+    tail = c->shm->sqtail;
+    c->shm->sq[tail % WSB_SLOTS] = idx;
+    __atomic_store_n(&c->shm->sqtail, tail + 1, __ATOMIC_RELEASE);
+
+    if (write(c->sqefd, &one, sizeof(one)) != sizeof(one))
+        return errno;
+    return 0;
+}
+
+
+/*
+ * Takes up to max completions off the ring, copying each result out and freeing its slot
+ */
+static int wsbpop(wsbclient_t *c, wsbcompletion_t *comps, int max)
+{
+    uint32_t head = c->shm->cqhead;
+    uint32_t tail = __atomic_load_n(&c->shm->cqtail, __ATOMIC_ACQUIRE);
+    int n = 0;
+
+    while (head != tail && n < max)
+    {
+        uint32_t idx = c->shm->cq[head % WSB_SLOTS] % WSB_SLOTS;
+        wsbslot_t *slot = &c->shm->slots[idx];
+        uint32_t outlen = (slot->outlen > WSB_MAXOUT) ? WSB_MAXOUT : slot->outlen;
+
+        comps[n].userdata = c->userdata[idx];
+        comps[n].status = slot->status;
+        comps[n].outlen = outlen;
+        if (slot->status == 0 && c->outp[idx] != NULL)
+            memcpy(c->outp[idx], slot->out, outlen);
+        c->freeslots[c->nfree++] = idx;
+        head++;
+        n++;
+    }
+    __atomic_store_n(&c->shm->cqhead, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+
+int wsb_reap(wsbclient_t *c, wsbcompletion_t *comps, int max)
+{
+    uint64_t count;
+    int n = 0;
+
+    while (c->nheld > 0 && n < max)
+        comps[n++] = c->held[--c->nheld];
+
+    // clear the eventfd before looking at the ring so a later completion re-arms it
+    if (read(c->cqefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        return -errno;
+    n += wsbpop(c, &comps[n], max - n);
+
+    // leave the eventfd readable if entries are still waiting
+    if (n == max && (c->nheld > 0 || c->shm->cqhead != __atomic_load_n(&c->shm->cqtail, __ATOMIC_ACQUIRE)))
+    {
+        count = 1;
+        if (write(c->cqefd, &count, sizeof(count)) < 0)
+            return -errno;
+    }
+    return n;
+}
+
+
+/*
+ * Submits and waits for one request, holding on to any other completions that turn up meanwhile
+ */
+static int32_t wsbcall(wsbclient_t *c, wsbop_t op, const uint8_t *keyp, const uint8_t *ivp,
+                       const uint8_t *inp, uint32_t inlen, uint8_t *outp, uint32_t *outlenp)
+{
+    int marker;
+    int32_t ret;
+
+    ret = wsb_submit(c, op, keyp, ivp, inp, inlen, outp, &marker);
+    if (ret != 0)
+        return ret;
+
+    for (;;)
+    {
+        wsbcompletion_t comp;
+        struct pollfd pfd = { c->cqefd, POLLIN, 0 };
+        uint64_t count;
+
+        if (read(c->cqefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+            return errno;
+        while (wsbpop(c, &comp, 1) == 1)
+        {
+            if (comp.userdata == &marker)
+            {
+                if (outlenp)
+                    *outlenp = comp.outlen;
+                // wake up an event loop that may be waiting for the held ones
+                if (c->nheld > 0)
+                {
+                    count = 1;
+                    if (write(c->cqefd, &count, sizeof(count)) < 0)
+                        return errno;
+                }
+                return comp.status;
+            }
+            c->held[c->nheld++] = comp;
+        }
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+            return errno;
+    }
+}
+
+
+int32_t wsb_aes256(wsbclient_t *c, int encrypt, const uint8_t *keyp, const uint8_t *ivp,
+                   const uint8_t *inp, uint32_t inlen, uint8_t *outp, uint32_t *outlenp)
+{
+    return wsbcall(c, encrypt ? WSB_OP_AES_ENCRYPT : WSB_OP_AES_DECRYPT, keyp, ivp, inp, inlen, outp, outlenp);
+}
+
+
+int32_t wsb_rsa_modexp(wsbclient_t *c, const void *pubdata, uint8_t *outp)
+{
+    return wsbcall(c, WSB_OP_RSA_MODEXP, NULL, NULL, pubdata, WSB_RSA_PUBLEN, outp, NULL);
+}
+
+
+int32_t wsb_rsa_verify(wsbclient_t *c, const void *pubdata, const uint8_t *expected)
+{
+    uint8_t in[WSB_RSA_VERIFYLEN];
+
+    memcpy(in, pubdata, WSB_RSA_PUBLEN);
+    memcpy(in + WSB_RSA_PUBLEN, expected, WSB_RSA_VERIFYLEN - WSB_RSA_PUBLEN);
+    return wsbcall(c, WSB_OP_RSA_VERIFY, NULL, NULL, in, WSB_RSA_VERIFYLEN, NULL, NULL);
+}
+
+
+int32_t wsb_stats(wsbstats_t *stats)
+{
+    int fd = shm_open(WSB_STATS_NAME, O_RDONLY, 0);
+    wsbstats_t *shared;
+
+    if (fd < 0)
+        return errno;
+    shared = mmap(NULL, sizeof(wsbstats_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED)
+        return errno;
+    memcpy(stats, shared, sizeof(wsbstats_t));
+    munmap(shared, sizeof(wsbstats_t));
+    return 0;
+}
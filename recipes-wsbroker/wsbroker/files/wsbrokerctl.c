@@ -0,0 +1,304 @@
+/**
+ * @file   wsbrokerctl.c
+ * @brief  Command line client for wsbrokerd: prints its live statistics, or exercises it with
+ * several concurrent clients, each doing AES encrypt/decrypt round trips with a window of
+ * requests in flight, or replays the RSA verifications of a certificate chain for a number of
+ * reconnecting peers to show the broker's verification cache.
+ *
+ * The chain is made from the known-good operand set of wsrsatest, with the base (the
+ * "signature") varied per certificate; each expected result is taken from a plain modexp first.
+ *
+ * usage: wsbrokerctl stats
+ *        wsbrokerctl bench [clients] [requests] [window]
+ *        wsbrokerctl verify [peers] [chain length]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+
+#include "wsbroker.h"
+
+#define DEFAULT_CLIENTS 4
+#define DEFAULT_REQUESTS 1000
+#define DEFAULT_WINDOW 16
+#define MSGLEN 100
+#define DEFAULT_PEERS 100
+#define DEFAULT_CHAINLEN 3
+#define RSABYTES 128
+#define RSAWORDS (RSABYTES / 4)
+
+static const char *devnames[WSB_NDEV] = { "aes", "sha256", "rsa" };
+
+// an RSAPublic_t: base, exponent, modulus, xbar, Mbar, little-endian 32-bit words
+static const uint32_t publexp_arr[RSAWORDS] = {0x10001};
+static const uint32_t base_arr[RSAWORDS] = {0x726C6421,0x2C20576F,0x656C6C6F,0x00000048};
+static const uint8_t modulus_arr[] = {0x49,0xF5,0xEB,0x73,0x5B,0x82,0x9C,0xEB,0x4B,0xC2,0xAF,0x74,0x64,0x29,0x38,0xA8,0xAF,0x7E,0xA4,0x77,0xBA,0x9C,0x79,0xB6,0x9B,0x5E,0x65,0xBC,0xBA,0x74,0x84,0x3E,0x84,0xBF,0x5C,0xD4,0xD1,0xF4,0xEC,0xD4,0x83,0x3D,0xC6,0x9B,0x7B,0x52,0x5C,0x2F,0x25,0x79,0x6D,0x21,0x79,0xB3,0x31,0x7A,0x0D,0xAD,0xB1,0xB9,0xDC,0x5F,0xE5,0x3D,0x13,0x21,0xF6,0xFB,0x97,0x1A,0xFB,0xB9,0x7F,0x4D,0x26,0x0F,0x10,0x37,0xEA,0xEA,0xEC,0x97,0xA4,0x79,0x37,0xFB,0x62,0x33,0x9E,0xB3,0x28,0xC4,0x30,0x8A,0xA6,0x94,0x9A,0x9F,0x0D,0xDF,0xE2,0xF5,0xB4,0x1F,0x25,0x4F,0xE1,0x6F,0x35,0xBF,0x82,0xBF,0xE6,0xA2,0xA0,0x15,0x80,0xA1,0x69,0x97,0xD8,0x3D,0x85,0x88,0x9E,0x88,0x4D,0xD9};
+static const uint32_t xbar_arr[] = {0x26b27761, 0x777ac227, 0x68965e7f, 0xea5f5d19, 0x407d40ca, 0x901eb0da, 0xe04b0a1d, 0x20f26065, 0x6b5975cf, 0x3bd74c61, 0xcc9d04c8, 0x865b6813, 0x1515c8ef, 0xf0d9b280, 0x4604e568, 0x409deec, 0xc21aa023, 0x464e52f2, 0x85ce4c86, 0xde9286da, 0xd0a3ad84, 0x6439c27c, 0x2b130b2e, 0x2ba3407b, 0xc17b8b45, 0x439aa164, 0x49866345, 0x885b8150, 0x57c7d69b, 0x8b503db4, 0x14637da4, 0x8c140ab7};
+static const uint32_t Mbar_arr[] = {0xcac00639, 0x454e47a7, 0xcdca9033, 0xe4ad317e, 0x95421d69, 0x98c6defe, 0x79ae2246, 0x321bd1ad, 0x60cdabe2, 0x0ba4154d, 0x1202ea26, 0x35e55c32, 0x6f443311, 0xd267d8b6, 0x9f989823, 0x67626490, 0x4dbf2c73, 0xcadac30b, 0xe1aa3964, 0xe12e61c6, 0x4cbb5fde, 0x42fe3a02, 0xf21d4c95, 0x9f2209e4, 0xa2f7e5d7, 0xc3eff321, 0xaf6a4878, 0xe0374acf, 0x095cc07e, 0xb77c7ec3, 0xaf932c98, 0x8890548f};
+
+static int requests = DEFAULT_REQUESTS;
+static int window = DEFAULT_WINDOW;
+
+typedef struct {
+    int id;
+    int done;
+    int errors;
+} benchclient_t;
+
+typedef struct {
+    uint8_t plain[MSGLEN];
+    uint8_t cipher[WSB_MAXOUT];
+    int inuse;
+} benchmsg_t;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int printstats(void)
+{
+    wsbstats_t s;
+    int32_t ret = wsb_stats(&s);
+
+    if (ret != 0)
+    {
+        fprintf(stderr, "ERROR: can't read broker statistics: %s\n", strerror(ret));
+        return 1;
+    }
+
+    printf("clients: %u connected, %llu connects, %llu refused\n", s.clients,
+           (unsigned long long)s.connects, (unsigned long long)s.rejects);
+    printf("%8s %10s %10s %8s %12s %10s %8s %8s\n", "device", "requests", "completed", "errors",
+           "bytes", "avg us", "queued", "inflight");
+    for (int d=0; d<WSB_NDEV; d++)
+    {
+        wsbdevstats_t *ds = &s.dev[d];
+        printf("%8s %10llu %10llu %8llu %12llu %10.1f %8u %8u\n", devnames[d],
+               (unsigned long long)ds->requests, (unsigned long long)ds->completed,
+               (unsigned long long)ds->errors, (unsigned long long)ds->bytes,
+               ds->completed ? ds->busyns / 1e3 / ds->completed : 0.0, ds->queued, ds->inflight);
+    }
+    printf("%8s %10s %10s %8s %8s\n", "pid", "submitted", "completed", "queued", "stalls");
+    for (int c=0; c<WSB_MAXCLIENTS; c++)
+    {
+        wsbclientstats_t *cs = &s.client[c];
+        if (cs->pid == 0)
+            continue;
+        printf("%8d %10llu %10llu %8u %8llu\n", cs->pid, (unsigned long long)cs->submitted,
+               (unsigned long long)cs->completed, cs->queued, (unsigned long long)cs->stalls);
+    }
+
+    if (s.rsacache.capacity == 0)
+        printf("rsa verify cache: off\n");
+    else
+        printf("rsa verify cache: %u of %u entries, %llu lookups, %llu hits (%.1f%%), %llu evictions\n",
+               s.rsacache.entries, s.rsacache.capacity, (unsigned long long)s.rsacache.lookups,
+               (unsigned long long)s.rsacache.hits,
+               s.rsacache.lookups ? 100.0 * s.rsacache.hits / s.rsacache.lookups : 0.0,
+               (unsigned long long)s.rsacache.evictions);
+    return 0;
+}
+
+/*
+ * Keeps up to window encryptions going; each one that finishes is decrypted synchronously and
+ * checked against what was sent
+ */
+static void *benchclient(void *arg)
+{
+    benchclient_t *bc = (benchclient_t *)arg;
+    benchmsg_t *msgs = calloc(window, sizeof(benchmsg_t));
+    uint8_t key[32], iv[16], check[WSB_MAXOUT];
+    wsbcompletion_t comps[16];
+    wsbclient_t *c = wsb_connect(NULL);
+    int started = 0;
+
+    if (c == NULL || msgs == NULL)
+    {
+        bc->errors = requests;
+        free(msgs);
+        return NULL;
+    }
+
+    for (int i=0; i<32; i++)
+        key[i] = (uint8_t)(bc->id * 13 + i);
+    for (int i=0; i<16; i++)
+        iv[i] = (uint8_t)(bc->id + i);
+
+    while (bc->done < requests)
+    {
+        for (int w=0; w<window && started<requests; w++)
+        {
+            if (msgs[w].inuse)
+                continue;
+            for (int i=0; i<MSGLEN; i++)
+                msgs[w].plain[i] = (uint8_t)(started + i);
+            if (wsb_submit(c, WSB_OP_AES_ENCRYPT, key, iv, msgs[w].plain, MSGLEN, msgs[w].cipher, &msgs[w]) != 0)
+                break;
+            msgs[w].inuse = 1;
+            started++;
+        }
+
+        struct pollfd pfd = { wsb_fd(c), POLLIN, 0 };
+        poll(&pfd, 1, -1);
+
+        int n = wsb_reap(c, comps, 16);
+        for (int i=0; i<n; i++)
+        {
+            benchmsg_t *m = (benchmsg_t *)comps[i].userdata;
+            uint32_t plen;
+
+            if (comps[i].status != 0 ||
+                wsb_aes256(c, 0, key, iv, m->cipher, comps[i].outlen, check, &plen) != 0 ||
+                plen < MSGLEN || memcmp(check, m->plain, MSGLEN) != 0)
+                bc->errors++;
+            m->inuse = 0;
+            bc->done++;
+        }
+    }
+
+    wsb_disconnect(c);
+    free(msgs);
+    return NULL;
+}
+
+static int bench(int nclients)
+{
+    pthread_t tids[nclients];
+    benchclient_t bcs[nclients];
+    int errors = 0;
+    double start = now();
+
+    for (int i=0; i<nclients; i++)
+    {
+        memset(&bcs[i], 0, sizeof(benchclient_t));
+        bcs[i].id = i;
+        pthread_create(&tids[i], NULL, benchclient, &bcs[i]);
+    }
+    for (int i=0; i<nclients; i++)
+    {
+        pthread_join(tids[i], NULL);
+        errors += bcs[i].errors;
+    }
+
+    double elapsed = now() - start;
+    printf("%d clients x %d round trips (window %d): %.3f s, %.1f requests/s, %d errors\n",
+           nclients, requests, window, elapsed, 2.0 * nclients * requests / elapsed, errors);
+    return errors ? 1 : 0;
+}
+
+/*
+ * Every peer reconnects and presents the same chain, whose signatures are verified in order
+ */
+static int verify(int peers, int chainlen)
+{
+    uint8_t (*pub)[WSB_RSA_PUBLEN] = calloc(chainlen, WSB_RSA_PUBLEN);
+    uint8_t (*expected)[RSABYTES] = calloc(chainlen, RSABYTES);
+    wsbclient_t *c = wsb_connect(NULL);
+    wsbstats_t before, after;
+    double start, modexpsecs, verifysecs;
+    int failed = 0;
+    int32_t ret = 0;
+
+    if (c == NULL || pub == NULL || expected == NULL)
+    {
+        free(pub);
+        free(expected);
+        if (c != NULL)
+            wsb_disconnect(c);
+        return 1;
+    }
+
+    start = now();
+    for (int i=0; i<chainlen && ret==0; i++)
+    {
+        uint32_t base[RSAWORDS];
+
+        memcpy(base, base_arr, sizeof(base));
+        base[RSAWORDS / 2] = i;
+        memcpy(pub[i], base, RSABYTES);
+        memcpy(pub[i] + RSABYTES, publexp_arr, RSABYTES);
+        memcpy(pub[i] + 2 * RSABYTES, modulus_arr, RSABYTES);
+        memcpy(pub[i] + 3 * RSABYTES, xbar_arr, RSABYTES);
+        memcpy(pub[i] + 4 * RSABYTES, Mbar_arr, RSABYTES);
+        ret = wsb_rsa_modexp(c, pub[i], expected[i]);
+    }
+    modexpsecs = now() - start;
+    if (ret != 0)
+    {
+        fprintf(stderr, "ERROR: modexp through the broker failed: %s\n", strerror(ret));
+        wsb_disconnect(c);
+        free(pub);
+        free(expected);
+        return 1;
+    }
+
+    wsb_stats(&before);
+    start = now();
+    for (int p=0; p<peers; p++)
+    {
+        for (int i=0; i<chainlen; i++)
+        {
+            if (wsb_rsa_verify(c, pub[i], expected[i]) != 0)
+                failed++;
+        }
+    }
+    verifysecs = now() - start;
+    wsb_stats(&after);
+
+    // a signature checked against another certificate's result must not pass, cached or not
+    if (chainlen > 1 && wsb_rsa_verify(c, pub[0], expected[1]) != EBADMSG)
+        failed++;
+
+    printf("%d peers x %d-certificate chain: %.3f s, %.0f verifications/s (uncached modexp %.0f/s), %d failed\n",
+           peers, chainlen, verifysecs, peers * chainlen / verifysecs, chainlen / modexpsecs, failed);
+    printf("cache: %llu lookups, %llu hits (%.1f%%), %llu evictions\n",
+           (unsigned long long)(after.rsacache.lookups - before.rsacache.lookups),
+           (unsigned long long)(after.rsacache.hits - before.rsacache.hits),
+           (after.rsacache.lookups > before.rsacache.lookups) ?
+               100.0 * (after.rsacache.hits - before.rsacache.hits) / (after.rsacache.lookups - before.rsacache.lookups) : 0.0,
+           (unsigned long long)(after.rsacache.evictions - before.rsacache.evictions));
+
+    wsb_disconnect(c);
+    free(pub);
+    free(expected);
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "stats") == 0)
+        return printstats();
+
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+    {
+        int nclients = (argc > 2) ? atoi(argv[2]) : DEFAULT_CLIENTS;
+
+        if (argc > 3)
+            requests = atoi(argv[3]);
+        if (argc > 4)
+            window = atoi(argv[4]);
+        if (nclients > 0 && requests > 0 && window > 0 && window < WSB_SLOTS)
+            return bench(nclients);
+    }
+
+    if (argc > 1 && strcmp(argv[1], "verify") == 0)
+    {
+        int peers = (argc > 2) ? atoi(argv[2]) : DEFAULT_PEERS;
+        int chainlen = (argc > 3) ? atoi(argv[3]) : DEFAULT_CHAINLEN;
+
+        if (peers > 0 && chainlen > 0)
+            return verify(peers, chainlen);
+    }
+
+    fprintf(stderr, "usage: %s stats\n       %s bench [clients] [requests] [window]\n"
+            "       %s verify [peers] [chain length]\n", argv[0], argv[0], argv[0]);
+    return 1;
+}
@@ -0,0 +1,812 @@
+/**
+ * @file   wsbrokerd.c
+ * @brief  Crypto broker daemon. Owns the AES and RSA devices and serves any number of client
+ * processes through the shared-memory rings described in wsbroker.h.
+ *
+ * The main thread runs an epoll loop over the listening socket, the clients' sockets and their
+ * submission eventfds. New connections are non-blocking and wait in that loop for their hello,
+ * for at most WSB_HELLO_TIMEOUT; the client's pid is taken from the socket's credentials. Requests are pulled off each client's ring into a per-client, per-device
+ * FIFO, and each device is fed from those FIFOs round-robin, one request per client per turn, so
+ * a busy client can't starve a quiet one. Each device takes a bounded number of requests at a
+ * time: AES ones go to libwsaescbc's worker, which batches everything queued to it, and RSA ones
+ * to a thread holding the single-open /dev/wsrsachar. When a device's queue in the broker is full
+ * the broker stops draining rings, so clients run out of slots and see EAGAIN.
+ *
+ * RSA verifications are answered from an LRU cache of earlier outcomes when the same input was
+ * verified before (wsbrokerd_rsacache.c), so reconnecting peers that present the same
+ * certificate chain never reach the device. -c sets its size in entries, 0 turning it off.
+ *
+ * The SHA256 driver protocol lives in the external wssha256-kmod tree, so SHA256 requests are
+ * answered with ENOTSUP for now.
+ *
+ * Live statistics are kept in the shared memory object WSB_STATS_NAME; `wsbrokerctl stats`
+ * prints them.
+ *
+ * usage: wsbrokerd [-s socketpath] [-c cache entries]
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "wsaescbc.h"
+#include "wsbroker.h"
+#include "wsbrokerd.h"
+
+#define WSB_NONE UINT32_MAX
+#define WSB_DEVQUEUE_MAX 256    // requests held in the broker per device before backpressure
+#define WSB_AES_INFLIGHT 8      // handed to libwsaescbc at once, enough for it to batch
+#define WSB_RSACACHE_ENTRIES 1024
+#define WSB_MAXPENDING 16       // connections accepted but still waiting for their hello
+#define WSB_HELLO_TIMEOUT 1.0   // seconds a new connection has to send its hello
+
+// epoll tags for the non-client descriptors
+#define TAG_LISTEN ((void *)1)
+#define TAG_DONE   ((void *)2)
+
+typedef struct {
+    int sock;
+    int sqefd;
+    int cqefd;
+    int shmfd;
+    wsbshm_t *shm;
+    int active;                 // cleared on disconnect; the entry is reused once refs drops to 0
+    int refs;                   // requests queued in the broker or on a device
+    pthread_mutex_t cqlock;     // completions are posted from the device threads
+    uint32_t qhead[WSB_NDEV];   // per-device FIFO of slot indices, linked through next[]
+    uint32_t qtail[WSB_NDEV];
+    uint32_t next[WSB_SLOTS];
+    uint8_t owned[WSB_SLOTS];   // taken off the ring and not yet completed, cleared in complete()
+    // what was validated when the request was taken off the ring
+    uint32_t op[WSB_SLOTS];
+    uint32_t len[WSB_SLOTS];
+    double start[WSB_SLOTS];
+} client_t;
+
+typedef struct {
+    int queued;                 // waiting in client FIFOs
+    int inflight;               // handed to the device
+    int maxinflight;
+    int rr;                     // next client to serve
+} device_t;
+
+typedef struct {
+    int client;
+    uint32_t slot;
+} rsajob_t;
+
+typedef struct {
+    int sock;                   // -1 when free
+    double since;
+} pending_t;
+
+static client_t clients[WSB_MAXCLIENTS];
+static pending_t pending[WSB_MAXPENDING];
+static int npending;
+static device_t devices[WSB_NDEV];
+static wsbstats_t *stats;
+static int epfd;
+static int donefd;              // device threads signal the main loop here when they free up
+
+// the RSA device thread takes one job at a time
+static pthread_mutex_t rsalock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rsacond = PTHREAD_COND_INITIALIZER;
+static rsajob_t rsajob;
+static int rsapending = 0;
+static int rsafd = -1;
+
+static volatile sig_atomic_t stopping = 0;
+
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int devfor(uint32_t op)
+{
+    switch (op)
+    {
+        case WSB_OP_AES_ENCRYPT:
+        case WSB_OP_AES_DECRYPT:
+            return WSB_DEV_AES;
+        case WSB_OP_SHA256:
+            return WSB_DEV_SHA256;
+        case WSB_OP_RSA_MODEXP:
+        case WSB_OP_RSA_VERIFY:
+            return WSB_DEV_RSA;
+        default:
+            return -1;
+    }
+}
+
+
+/*
+ * Posts a finished slot on its client's completion ring. Called from the main loop and from the
+ * device threads.
+ */
+static void complete(int ci, uint32_t idx, int dev, int32_t status, uint32_t outlen)
+{
+    client_t *c = &clients[ci];
+    wsbslot_t *slot = &c->shm->slots[idx];
+    uint64_t one = 1;
+    uint32_t tail;
+
+    slot->status = status;
+    slot->outlen = (status == 0) ? outlen : 0;
+
+    // the client may reuse the slot as soon as it sees the completion
+    __atomic_store_n(&c->owned[idx], 0, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&c->cqlock);
+    tail = c->shm->cqtail;
+    c->shm->cq[tail % WSB_SLOTS] = idx;
+    __atomic_store_n(&c->shm->cqtail, tail + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&c->cqlock);
+
+    if (write(c->cqefd, &one, sizeof(one)) < 0)
+        perror("WARNING: failed to signal client");
+
+    __atomic_add_fetch(&stats->dev[dev].completed, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->dev[dev].bytes, c->len[idx], __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->dev[dev].busyns, (uint64_t)((now() - c->start[idx]) * 1e9), __ATOMIC_RELAXED);
+    if (status != 0)
+        __atomic_add_fetch(&stats->dev[dev].errors, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats->client[ci].completed, 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL);
+}
+
+
+/*
+ * libwsaescbc completion callback, runs on its worker thread
+ */
+static void aesdone(aes256req_t *req, int32_t status, void *arg)
+{
+    uintptr_t tag = (uintptr_t)arg;
+    int ci = tag / WSB_SLOTS;
+    uint32_t idx = tag % WSB_SLOTS;
+    uint64_t one = 1;
+
+    (void)req;
+    complete(ci, idx, WSB_DEV_AES, status, clients[ci].shm->slots[idx].outlen);
+    __atomic_sub_fetch(&devices[WSB_DEV_AES].inflight, 1, __ATOMIC_ACQ_REL);
+    if (write(donefd, &one, sizeof(one)) < 0)
+        perror("WARNING: failed to signal main loop");
+}
+
+
+/*
+ * Works from a private copy of the input: the slot stays writable by the client, and what goes
+ * into the cache must be exactly what the device was given
+ */
+static int32_t rsaverify(const uint8_t *slotin)
+{
+    uint8_t in[WSB_RSA_VERIFYLEN], result[WSB_RSA_BYTES];
+    uint8_t diff = 0;
+    int32_t status;
+
+    memcpy(in, slotin, sizeof(in));
+    status = rsadev_modexp(rsafd, in, result);
+    if (status != 0)
+        return status;
+
+    for (int i=0; i<WSB_RSA_BYTES; i++)
+        diff |= result[i] ^ in[WSB_RSA_PUBLEN + i];
+    status = diff ? EBADMSG : 0;
+    rsacache_insert(in, status);
+    return status;
+}
+
+
+static void *rsathread(void *arg)
+{
+    uint64_t one = 1;
+
+    (void)arg;
+    for (;;)
+    {
+        rsajob_t job;
+        int32_t status;
+
+        pthread_mutex_lock(&rsalock);
+        while (!rsapending && !stopping)
+            pthread_cond_wait(&rsacond, &rsalock);
+        if (!rsapending)
+        {
+            pthread_mutex_unlock(&rsalock);
+            break;
+        }
+        job = rsajob;
+        pthread_mutex_unlock(&rsalock);
+
+        wsbslot_t *slot = &clients[job.client].shm->slots[job.slot];
+        if (clients[job.client].op[job.slot] == WSB_OP_RSA_VERIFY)
+        {
+            status = rsaverify(slot->in);
+            complete(job.client, job.slot, WSB_DEV_RSA, status, 0);
+        }
+        else
+        {
+            status = rsadev_modexp(rsafd, slot->in, slot->out);
+            complete(job.client, job.slot, WSB_DEV_RSA, status, WSB_RSA_BYTES);
+        }
+
+        pthread_mutex_lock(&rsalock);
+        rsapending = 0;
+        pthread_mutex_unlock(&rsalock);
+        __atomic_sub_fetch(&devices[WSB_DEV_RSA].inflight, 1, __ATOMIC_ACQ_REL);
+        if (write(donefd, &one, sizeof(one)) < 0)
+            perror("WARNING: failed to signal main loop");
+    }
+    return NULL;
+}
+
+
+/*
+ * Hands one request to its device
+ */
+static void dispatch(int dev, int ci, uint32_t idx)
+{
+    client_t *c = &clients[ci];
+    wsbslot_t *slot = &c->shm->slots[idx];
+    int32_t ret;
+
+    __atomic_add_fetch(&devices[dev].inflight, 1, __ATOMIC_ACQ_REL);
+
+    switch (dev)
+    {
+        case WSB_DEV_AES:
+            ret = aes256submit((c->op[idx] == WSB_OP_AES_ENCRYPT) ? ENCRYPT : DECRYPT, slot->key, slot->iv,
+                               slot->in, c->len[idx], slot->out, &slot->outlen, aesdone,
+                               (void *)(uintptr_t)(ci * WSB_SLOTS + idx), NULL);
+            if (ret != 0)
+            {
+                __atomic_sub_fetch(&devices[dev].inflight, 1, __ATOMIC_ACQ_REL);
+                complete(ci, idx, dev, ret, 0);
+            }
+            break;
+
+        case WSB_DEV_RSA:
+            pthread_mutex_lock(&rsalock);
+            rsajob.client = ci;
+            rsajob.slot = idx;
+            rsapending = 1;
+            pthread_cond_signal(&rsacond);
+            pthread_mutex_unlock(&rsalock);
+            break;
+
+        default:
+            __atomic_sub_fetch(&devices[dev].inflight, 1, __ATOMIC_ACQ_REL);
+            complete(ci, idx, dev, ENOTSUP, 0);
+            break;
+    }
+}
+
+
+/*
+ * Feeds every device with spare capacity from the client FIFOs, round-robin
+ */
+static void schedule(void)
+{
+    for (int dev=0; dev<WSB_NDEV; dev++)
+    {
+        device_t *d = &devices[dev];
+        int idle = 0;
+
+        while (d->queued > 0 && __atomic_load_n(&d->inflight, __ATOMIC_ACQUIRE) < d->maxinflight &&
+               idle < WSB_MAXCLIENTS)
+        {
+            int ci = d->rr;
+            client_t *c = &clients[ci];
+
+            d->rr = (d->rr + 1) % WSB_MAXCLIENTS;
+            if (c->shm == NULL || c->qhead[dev] == WSB_NONE)
+            {
+                idle++;
+                continue;
+            }
+            idle = 0;
+
+            uint32_t idx = c->qhead[dev];
+            c->qhead[dev] = c->next[idx];
+            if (c->qhead[dev] == WSB_NONE)
+                c->qtail[dev] = WSB_NONE;
+            d->queued--;
+            stats->client[ci].queued--;
+
+            dispatch(dev, ci, idx);
+        }
+        stats->dev[dev].queued = d->queued;
+        stats->dev[dev].inflight = __atomic_load_n(&d->inflight, __ATOMIC_ACQUIRE);
+    }
+}
+
+
+static void dropclient(int ci);
+
+
+/*
+ * Moves requests from a client's submission ring into its per-device FIFOs, stopping at the
+ * first one whose device queue is full so the client's ordering per device is kept. A client
+ * that submits a slot the broker still holds is dropped: linking it again would turn its FIFO
+ * into a cycle.
+ */
+static void drain(int ci)
+{
+    client_t *c = &clients[ci];
+    uint32_t head = c->shm->sqhead;
+    uint32_t tail = __atomic_load_n(&c->shm->sqtail, __ATOMIC_ACQUIRE);
+
+    // a client can't have more requests out than it has slots
+    if (tail - head > WSB_SLOTS)
+        tail = head + WSB_SLOTS;
+
+    while (head != tail)
+    {
+        uint32_t idx = c->shm->sq[head % WSB_SLOTS] % WSB_SLOTS;
+        wsbslot_t *slot = &c->shm->slots[idx];
+        uint32_t op = slot->op, len = slot->len;
+        int dev = devfor(op);
+        int32_t status;
+
+        if (dev >= 0 && devices[dev].queued >= WSB_DEVQUEUE_MAX)
+        {
+            stats->client[ci].stalls++;
+            break;
+        }
+        if (__atomic_load_n(&c->owned[idx], __ATOMIC_ACQUIRE))
+        {
+            fprintf(stderr, "WARNING: client %d submitted slot %u while it was in use, dropping it\n", ci, idx);
+            dropclient(ci);
+            return;
+        }
+        head++;
+        c->owned[idx] = 1;
+
+        c->op[idx] = op;
+        c->len[idx] = len;
+        c->start[idx] = now();
+        __atomic_add_fetch(&c->refs, 1, __ATOMIC_ACQ_REL);
+        stats->client[ci].submitted++;
+
+        // the slot is in memory the client can scribble on, so check what it asks for here
+        if (dev < 0 || len > WSB_MAXIN || (dev == WSB_DEV_AES && (len == 0 || len > AESMAXDATASIZE)) ||
+            (dev == WSB_DEV_RSA && len != ((op == WSB_OP_RSA_VERIFY) ? WSB_RSA_VERIFYLEN : WSB_RSA_PUBLEN)))
+        {
+            complete(ci, idx, (dev < 0) ? WSB_DEV_AES : dev, EINVAL, 0);
+            continue;
+        }
+        __atomic_add_fetch(&stats->dev[dev].requests, 1, __ATOMIC_RELAXED);
+
+        // a verification seen before is answered without queueing for the device
+        if (op == WSB_OP_RSA_VERIFY && rsacache_lookup(slot->in, &status))
+        {
+            complete(ci, idx, dev, status, 0);
+            continue;
+        }
+
+        c->next[idx] = WSB_NONE;
+        if (c->qtail[dev] == WSB_NONE)
+            c->qhead[dev] = idx;
+        else
+            c->next[c->qtail[dev]] = idx;
+        c->qtail[dev] = idx;
+        devices[dev].queued++;
+        stats->client[ci].queued++;
+    }
+    __atomic_store_n(&c->shm->sqhead, head, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Sends the client its rings and eventfds
+ */
+static int sendwelcome(int sock, int32_t status, int *fds)
+{
+    wsbwelcome_t welcome = { WSB_VERSION, status };
+    char cbuf[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = { &welcome, sizeof(welcome) };
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (status == 0)
+    {
+        struct cmsghdr *cmsg;
+
+        memset(cbuf, 0, sizeof(cbuf));
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(3 * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, 3 * sizeof(int));
+    }
+    return (sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(welcome)) ? 0 : -1;
+}
+
+
+/*
+ * Takes a new connection and waits for its hello in the epoll loop, so a peer that sends nothing
+ * holds up no one
+ */
+static void acceptclient(int lsock)
+{
+    struct epoll_event ev;
+    int sock, p;
+
+    sock = accept4(lsock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (sock < 0)
+        return;
+
+    for (p=0; p<WSB_MAXPENDING; p++)
+    {
+        if (pending[p].sock < 0)
+            break;
+    }
+    if (p == WSB_MAXPENDING)
+    {
+        stats->rejects++;
+        sendwelcome(sock, EBUSY, NULL);
+        close(sock);
+        return;
+    }
+
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = &pending[p];
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) < 0)
+    {
+        close(sock);
+        return;
+    }
+    pending[p].sock = sock;
+    pending[p].since = now();
+    npending++;
+}
+
+
+static void droppending(pending_t *pc)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, pc->sock, NULL);
+    close(pc->sock);
+    pc->sock = -1;
+    npending--;
+}
+
+
+/*
+ * Closes connections that have not sent their hello in time
+ */
+static void expirepending(void)
+{
+    double t = now();
+
+    for (int p=0; p<WSB_MAXPENDING; p++)
+    {
+        if (pending[p].sock >= 0 && t - pending[p].since > WSB_HELLO_TIMEOUT)
+            droppending(&pending[p]);
+    }
+}
+
+
+/*
+ * A pending connection turned readable: checks its hello and sets up its rings. The client
+ * library sends the hello in one write, so anything shorter is refused rather than waited for.
+ */
+static void greetclient(pending_t *pc)
+{
+    struct epoll_event ev;
+    struct ucred cred;
+    socklen_t credlen = sizeof(cred);
+    wsbhello_t hello;
+    char name[64];
+    int sock = pc->sock, ci, fds[3];
+    ssize_t n;
+    client_t *c;
+
+    n = read(sock, &hello, sizeof(hello));
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+
+    // from here on the connection is either a client or gone
+    epoll_ctl(epfd, EPOLL_CTL_DEL, sock, NULL);
+    pc->sock = -1;
+    npending--;
+
+    if (n != sizeof(hello) || hello.version != WSB_VERSION ||
+        getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) < 0)
+    {
+        sendwelcome(sock, EPROTO, NULL);
+        close(sock);
+        return;
+    }
+
+    for (ci=0; ci<WSB_MAXCLIENTS; ci++)
+    {
+        if (!clients[ci].active && clients[ci].shm == NULL)
+            break;
+    }
+    if (ci == WSB_MAXCLIENTS)
+    {
+        stats->rejects++;
+        sendwelcome(sock, EBUSY, NULL);
+        close(sock);
+        return;
+    }
+    c = &clients[ci];
+
+    // an anonymous segment: open a unique name and unlink it straight away
+    snprintf(name, sizeof(name), "/wsbroker-%d-%d", (int)getpid(), ci);
+    c->shmfd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    shm_unlink(name);
+    c->sqefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    c->cqefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (c->shmfd < 0 || c->sqefd < 0 || c->cqefd < 0 || ftruncate(c->shmfd, sizeof(wsbshm_t)) < 0 ||
+        (c->shm = mmap(NULL, sizeof(wsbshm_t), PROT_READ | PROT_WRITE, MAP_SHARED, c->shmfd, 0)) == MAP_FAILED)
+    {
+        perror("ERROR: failed to set up client rings");
+        sendwelcome(sock, ENOMEM, NULL);
+        goto fail;
+    }
+
+    fds[0] = c->shmfd;
+    fds[1] = c->sqefd;
+    fds[2] = c->cqefd;
+    if (sendwelcome(sock, 0, fds) != 0)
+        goto fail;
+    close(c->shmfd);
+    c->shmfd = -1;
+
+    c->sock = sock;
+    c->active = 1;
+    c->refs = 0;
+    for (int dev=0; dev<WSB_NDEV; dev++)
+        c->qhead[dev] = c->qtail[dev] = WSB_NONE;
+    memset(c->owned, 0, sizeof(c->owned));
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &clients[ci].sqefd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->sqefd, &ev);
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = &clients[ci].sock;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->sock, &ev);
+
+    memset(&stats->client[ci], 0, sizeof(wsbclientstats_t));
+    stats->client[ci].pid = cred.pid;
+    stats->clients++;
+    stats->connects++;
+    return;
+
+fail:
+    if (c->shm != NULL && c->shm != MAP_FAILED)
+        munmap(c->shm, sizeof(wsbshm_t));
+    c->shm = NULL;
+    if (c->shmfd >= 0)
+        close(c->shmfd);
+    if (c->sqefd >= 0)
+        close(c->sqefd);
+    if (c->cqefd >= 0)
+        close(c->cqefd);
+    close(sock);
+}
+
+
+/*
+ * Drops a client's queued requests and stops listening to it. Requests already on a device
+ * still complete into its rings, so the mapping is kept until they have.
+ */
+static void dropclient(int ci)
+{
+    client_t *c = &clients[ci];
+
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->sqefd, NULL);
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->sock, NULL);
+    close(c->sock);
+    c->active = 0;
+
+    for (int dev=0; dev<WSB_NDEV; dev++)
+    {
+        for (uint32_t idx = c->qhead[dev]; idx != WSB_NONE; idx = c->next[idx])
+        {
+            devices[dev].queued--;
+            __atomic_sub_fetch(&c->refs, 1, __ATOMIC_ACQ_REL);
+        }
+        c->qhead[dev] = c->qtail[dev] = WSB_NONE;
+    }
+    stats->client[ci].pid = 0;
+    stats->client[ci].queued = 0;
+    stats->clients--;
+}
+
+static void reapclients(void)
+{
+    for (int ci=0; ci<WSB_MAXCLIENTS; ci++)
+    {
+        client_t *c = &clients[ci];
+
+        if (!c->active && c->shm != NULL && __atomic_load_n(&c->refs, __ATOMIC_ACQUIRE) == 0)
+        {
+            munmap(c->shm, sizeof(wsbshm_t));
+            c->shm = NULL;
+            close(c->sqefd);
+            close(c->cqefd);
+        }
+    }
+}
+
+
+static void onsignal(int sig)
+{
+    (void)sig;
+    stopping = 1;
+}
+
+int main(int argc, char **argv)
+{
+    const char *sockpath = getenv("WSBROKER_SOCKET") ? getenv("WSBROKER_SOCKET") : WSB_DEFAULT_SOCKET;
+    struct sockaddr_un addr;
+    struct epoll_event ev;
+    pthread_t rsatid;
+    int lsock, statsfd, opt;
+    long cachesize = WSB_RSACACHE_ENTRIES;
+
+    while ((opt = getopt(argc, argv, "s:c:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 's': sockpath = optarg; break;
+            case 'c': cachesize = atol(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-s socketpath] [-c cache entries]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (cachesize < 0 || cachesize > UINT32_MAX / 2)
+    {
+        fprintf(stderr, "usage: %s [-s socketpath] [-c cache entries]\n", argv[0]);
+        return 1;
+    }
+
+    signal(SIGINT, onsignal);
+    signal(SIGTERM, onsignal);
+    signal(SIGPIPE, SIG_IGN);
+
+    // statistics are world-readable
+    statsfd = shm_open(WSB_STATS_NAME, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (statsfd < 0 || ftruncate(statsfd, sizeof(wsbstats_t)) < 0 ||
+        (stats = mmap(NULL, sizeof(wsbstats_t), PROT_READ | PROT_WRITE, MAP_SHARED, statsfd, 0)) == MAP_FAILED)
+    {
+        perror("ERROR: failed to create the statistics segment");
+        return 1;
+    }
+    close(statsfd);
+    memset(stats, 0, sizeof(wsbstats_t));
+    stats->version = WSB_VERSION;
+    if (rsacache_init(cachesize, &stats->rsacache) != 0)
+        return 1;
+
+    for (int ci=0; ci<WSB_MAXCLIENTS; ci++)
+        pthread_mutex_init(&clients[ci].cqlock, NULL);
+    for (int p=0; p<WSB_MAXPENDING; p++)
+        pending[p].sock = -1;
+
+    // devices that fail to open stay in the table and fail their requests with ENODEV
+    devices[WSB_DEV_AES].maxinflight = WSB_AES_INFLIGHT;
+    devices[WSB_DEV_SHA256].maxinflight = 1;
+    devices[WSB_DEV_RSA].maxinflight = 1;
+    if (aes256init() != 0)
+        fprintf(stderr, "WARNING: AES device not available\n");
+    rsafd = rsadev_open();
+    if (rsafd < 0)
+        fprintf(stderr, "WARNING: RSA device not available\n");
+    pthread_create(&rsatid, NULL, rsathread, NULL);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sockpath, sizeof(addr.sun_path) - 1);
+    unlink(sockpath);
+    lsock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (lsock < 0 || bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lsock, 16) < 0)
+    {
+        perror("ERROR: failed to listen on the broker socket");
+        return 1;
+    }
+    chmod(sockpath, 0666);
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    donefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ev.events = EPOLLIN;
+    ev.data.ptr = TAG_LISTEN;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, lsock, &ev);
+    ev.data.ptr = TAG_DONE;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, donefd, &ev);
+
+    printf("wsbrokerd listening on %s\n", sockpath);
+
+    while (!stopping)
+    {
+        struct epoll_event events[32];
+        // wake up now and then while connections are waiting for their hello
+        int nev = epoll_wait(epfd, events, 32, npending ? (int)(WSB_HELLO_TIMEOUT * 1000 / 4) : -1);
+
+        if (nev < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("ERROR: epoll_wait failed");
+            break;
+        }
+
+        for (int i=0; i<nev; i++)
+        {
+            void *tag = events[i].data.ptr;
+            uint64_t count;
+
+            if (tag == TAG_LISTEN)
+                acceptclient(lsock);
+            else if ((pending_t *)tag >= pending && (pending_t *)tag < pending + WSB_MAXPENDING)
+                greetclient((pending_t *)tag);
+            else if (tag == TAG_DONE)
+            {
+                if (read(donefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                    perror("WARNING: failed to read completion signal");
+            }
+            else
+            {
+                int *fdp = (int *)tag;
+                int ci = ((char *)fdp - (char *)clients) / sizeof(client_t);
+
+                if (fdp == &clients[ci].sock)
+                {
+                    if (clients[ci].active)
+                        dropclient(ci);
+                }
+                else if (read(*fdp, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                    perror("WARNING: failed to read submission signal");
+            }
+        }
+
+        // rings are drained on every pass, since room freed on a device may unblock any client
+        for (int ci=0; ci<WSB_MAXCLIENTS; ci++)
+        {
+            if (clients[ci].active)
+                drain(ci);
+        }
+        schedule();
+        reapclients();
+        if (npending)
+            expirepending();
+    }
+
+    printf("wsbrokerd shutting down\n");
+    close(lsock);
+    unlink(sockpath);
+
+    pthread_mutex_lock(&rsalock);
+    pthread_cond_signal(&rsacond);
+    pthread_mutex_unlock(&rsalock);
+    pthread_join(rsatid, NULL);
+    aes256shutdown();
+    if (rsafd >= 0)
+        close(rsafd);
+    rsacache_free();
+    shm_unlink(WSB_STATS_NAME);
+    return 0;
+}
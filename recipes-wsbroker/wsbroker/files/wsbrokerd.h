@@ -0,0 +1,20 @@
+#pragma once
+
+/*
+ * RSA device access for wsbrokerd, kept apart because wsrsakern.h and wsaescbc.h define the
+ * same mode names
+ */
+
+#include <stdint.h>
+#include "wsbroker.h"
+
+#define WSB_RSA_BYTES 128
+
+int rsadev_open(void);
+int32_t rsadev_modexp(int fd, const uint8_t *pubdata, uint8_t *outp);
+
+/* Verification outcome cache, wsbrokerd_rsacache.c */
+int rsacache_init(uint32_t maxentries, wsbcachestats_t *stats);
+void rsacache_free(void);
+int rsacache_lookup(const uint8_t *in, int32_t *status);
+void rsacache_insert(const uint8_t *in, int32_t status);
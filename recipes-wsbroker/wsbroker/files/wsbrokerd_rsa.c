@@ -0,0 +1,46 @@
+/**
+ * @file   wsbrokerd_rsa.c
+ * @brief  /dev/wsrsachar access for wsbrokerd
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "wsrsakern.h"
+#include "wsbrokerd.h"
+
+
+/*
+ * Opens the RSA device, or $WSRSA_DEVICE when it is set. The driver allows a single open, which
+ * the broker holds for its lifetime.
+ */
+int rsadev_open(void)
+{
+    const char *devstr = getenv("WSRSA_DEVICE") ? getenv("WSRSA_DEVICE") : "/dev/wsrsachar";
+    int fd = open(devstr, O_RDWR | O_CLOEXEC);
+
+    if (fd < 0)
+        perror("ERROR: Failed to open the RSA device");
+    return fd;
+}
+
+
+/*
+ * One exponentiation: pubdata is an RSAPublic_t as the client laid it out
+ */
+int32_t rsadev_modexp(int fd, const uint8_t *pubdata, uint8_t *outp)
+{
+    if (fd < 0)
+        return ENODEV;
+    if (write(fd, pubdata, sizeof(RSAPublic_t)) < 0)
+        return errno;
+    if (ioctl(fd, IOCTL_SET_MODE, INIT) < 0)
+        return errno;
+    if (read(fd, outp, RSA_SIZE_BYTES) < 0)
+        return errno;
+    return 0;
+}
@@ -0,0 +1,212 @@
+/**
+ * @file   wsbrokerd_rsacache.c
+ * @brief  LRU cache of RSA verification outcomes for wsbrokerd.
+ *
+ * An entry keeps the whole verification input, so a hit is an exact match rather than a hash
+ * match: a client that sends a bogus modulus or Montgomery operands can only create entries that
+ * nobody else will look up. Entries live in one array allocated up front, chained into hash
+ * buckets and into a recency list; once the array is full the least recently used one is reused.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "wsbroker.h"
+#include "wsbrokerd.h"
+
+#define NONE UINT32_MAX
+
+typedef struct {
+    uint8_t in[WSB_RSA_VERIFYLEN];
+    uint64_t hash;
+    int32_t status;
+    uint32_t hnext;             // next entry in the same bucket
+    uint32_t prev;              // recency list, most recent first
+    uint32_t next;
+} rsaentry_t;
+
+// lookups come from the main loop, insertions from the RSA thread
+static pthread_mutex_t cachelock = PTHREAD_MUTEX_INITIALIZER;
+static rsaentry_t *entries = NULL;
+static uint32_t *buckets = NULL;
+static uint32_t nbuckets;
+static uint32_t capacity;
+static uint32_t used;
+static uint32_t mru = NONE;
+static uint32_t lru = NONE;
+static wsbcachestats_t *cstats;
+
+
+/*
+ * FNV-1a; only spreads entries over the buckets, equality is decided by the full input
+ */
+static uint64_t rsacache_hash(const uint8_t *in)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (int i=0; i<WSB_RSA_VERIFYLEN; i++)
+        h = (h ^ in[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+
+/*
+ * The link that points at the entry for in, or at the end of its bucket's chain
+ */
+static uint32_t *rsacache_find(const uint8_t *in, uint64_t h)
+{
+    uint32_t *link = &buckets[h & (nbuckets - 1)];
+
+    while (*link != NONE &&
+           (entries[*link].hash != h || memcmp(entries[*link].in, in, WSB_RSA_VERIFYLEN) != 0))
+        link = &entries[*link].hnext;
+    return link;
+}
+
+
+static void rsacache_unlink(uint32_t e)
+{
+    if (entries[e].prev != NONE)
+        entries[entries[e].prev].next = entries[e].next;
+    else
+        mru = entries[e].next;
+    if (entries[e].next != NONE)
+        entries[entries[e].next].prev = entries[e].prev;
+    else
+        lru = entries[e].prev;
+}
+
+
+static void rsacache_pushfront(uint32_t e)
+{
+    entries[e].prev = NONE;
+    entries[e].next = mru;
+    if (mru != NONE)
+        entries[mru].prev = e;
+    mru = e;
+    if (lru == NONE)
+        lru = e;
+}
+
+
+/*
+ * Sets up a cache of up to maxentries verifications, 0 leaving it off. stats is kept up to date
+ * from then on.
+ */
+int rsacache_init(uint32_t maxentries, wsbcachestats_t *stats)
+{
+    cstats = stats;
+    memset(cstats, 0, sizeof(wsbcachestats_t));
+    if (maxentries == 0)
+        return 0;
+
+    for (nbuckets=1; nbuckets<maxentries; nbuckets<<=1)
+        ;
+    entries = malloc((size_t)maxentries * sizeof(rsaentry_t));
+    buckets = malloc((size_t)nbuckets * sizeof(uint32_t));
+    if (entries == NULL || buckets == NULL)
+    {
+        perror("ERROR: failed to allocate the RSA verification cache");
+        free(entries);
+        free(buckets);
+        entries = NULL;
+        buckets = NULL;
+        return ENOMEM;
+    }
+    memset(buckets, 0xff, (size_t)nbuckets * sizeof(uint32_t));
+    capacity = maxentries;
+    used = 0;
+    mru = lru = NONE;
+    cstats->capacity = capacity;
+    return 0;
+}
+
+
+void rsacache_free(void)
+{
+    free(entries);
+    free(buckets);
+    entries = NULL;
+    buckets = NULL;
+}
+
+
+/*
+ * Returns 1 and the remembered status for a verification input seen before, 0 otherwise
+ */
+int rsacache_lookup(const uint8_t *in, int32_t *status)
+{
+    uint64_t h;
+    uint32_t e;
+
+    if (entries == NULL)
+        return 0;
+    h = rsacache_hash(in);
+
+    pthread_mutex_lock(&cachelock);
+    cstats->lookups++;
+    e = *rsacache_find(in, h);
+    if (e != NONE)
+    {
+        *status = entries[e].status;
+        rsacache_unlink(e);
+        rsacache_pushfront(e);
+        cstats->hits++;
+    }
+    pthread_mutex_unlock(&cachelock);
+    return e != NONE;
+}
+
+
+/*
+ * Remembers the outcome of a verification the device has just done
+ */
+void rsacache_insert(const uint8_t *in, int32_t status)
+{
+    uint64_t h;
+    uint32_t *link;
+    uint32_t e;
+
+    if (entries == NULL)
+        return;
+    h = rsacache_hash(in);
+
+    pthread_mutex_lock(&cachelock);
+    link = rsacache_find(in, h);
+    if (*link != NONE)
+    {
+        // two clients asked for the same verification before either was cached
+        e = *link;
+        entries[e].status = status;
+        rsacache_unlink(e);
+        rsacache_pushfront(e);
+        pthread_mutex_unlock(&cachelock);
+        return;
+    }
+
+    if (used < capacity)
+        e = used++;
+    else
+    {
+        e = lru;
+        rsacache_unlink(e);
+        *rsacache_find(entries[e].in, entries[e].hash) = entries[e].hnext;
+        cstats->evictions++;
+        // the victim may have been in the bucket we were about to extend
+        link = rsacache_find(in, h);
+    }
+
+    memcpy(entries[e].in, in, WSB_RSA_VERIFYLEN);
+    entries[e].hash = h;
+    entries[e].status = status;
+    entries[e].hnext = NONE;
+    *link = e;
+    rsacache_pushfront(e);
+
+    cstats->insertions++;
+    cstats->entries = used;
+    pthread_mutex_unlock(&cachelock);
+}
@@ -0,0 +1,880 @@
+/**
+ * @file   wscryptokern.c
+ * @version 0.1
+ *
+ * Linux loadable kernel module (LKM) that offers the AES-CBC and SHA256 blocks to the kernel's own
+ * crypto users through the crypto API, as the asynchronous "cbc(aes)" skcipher and "sha256" and
+ * "hmac(sha256)" ahashes, next to the character devices used from userspace.
+ *
+ * The blocks themselves are driven by their drivers, which register an ops table with this
+ * module (see wscryptokern.h); the algorithms exist while such a table is registered. Requests for
+ * a block are queued and run one at a time by a worker, which completes them through their
+ * callbacks. Requests that are too small to be worth a trip to a block, that are not laid out in
+ * whole aligned blocks, or that use a key size the AES block lacks, are done synchronously by the
+ * best software implementation instead.
+ */
+
+#include <linux/init.h>           // Macros used to mark up functions e.g. __init __exit
+#include <linux/module.h>         // Core header for loading LKMs into the kernel
+#include <linux/kernel.h>         // Contains types, macros, functions for the kernel
+#include <linux/version.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/scatterlist.h>
+#include <linux/string.h>
+#include <crypto/aes.h>
+#include <crypto/algapi.h>
+#include <crypto/hash.h>
+#include <crypto/internal/hash.h>
+#include <crypto/internal/skcipher.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 11, 0)
+#include <crypto/sha2.h>
+#else
+#include <crypto/sha.h>
+#endif
+
+#include "wscryptokern.h"
+
+// skcipher_alg and crypto_register_skcipher() arrived in 4.8
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
+#error "wscryptokern needs Linux 4.8 or later"
+#endif
+
+#define WSCRYPTO_QLEN 128       // requests queued per block before callers are told to back off
+#define WSCRYPTO_PRIORITY 400   // above the generic and NEON implementations
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+#define wscrypto_complete(areq, err) crypto_request_complete(areq, err)
+#else
+#define wscrypto_complete(areq, err) (areq)->complete(areq, err)
+#endif
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Crypto API algorithms on the wsaes and wssha256 hardware blocks");
+MODULE_VERSION("0.1");
+
+static unsigned int aes_minbytes = 128;
+module_param(aes_minbytes, uint, 0644);
+MODULE_PARM_DESC(aes_minbytes, "cbc(aes) requests shorter than this are done on the CPU");
+
+static unsigned int sha_minbytes = 256;
+module_param(sha_minbytes, uint, 0644);
+MODULE_PARM_DESC(sha_minbytes, "sha256 updates shorter than this are done on the CPU");
+
+// requests run on a block and on the CPU, readable under /sys/module/wscryptokern/parameters
+static atomic_long_t aes_hwreqs, aes_swreqs, sha_hwreqs, sha_swreqs;
+
+static int wscrypto_stat_get(char *buf, const struct kernel_param *kp)
+{
+    return sprintf(buf, "%ld\n", atomic_long_read((atomic_long_t *)kp->arg));
+}
+
+static const struct kernel_param_ops wscrypto_stat_ops = { .get = wscrypto_stat_get };
+module_param_cb(aes_hwreqs, &wscrypto_stat_ops, &aes_hwreqs, 0444);
+module_param_cb(aes_swreqs, &wscrypto_stat_ops, &aes_swreqs, 0444);
+module_param_cb(sha_hwreqs, &wscrypto_stat_ops, &sha_hwreqs, 0444);
+module_param_cb(sha_swreqs, &wscrypto_stat_ops, &sha_swreqs, 0444);
+
+/*
+ * One per block: requests waiting for it and the worker that feeds them to it
+ */
+struct wscrypto_queue {
+    spinlock_t lock;
+    struct crypto_queue queue;
+    struct work_struct work;
+    int (*handle)(struct crypto_async_request *areq);
+};
+
+static struct workqueue_struct *wscrypto_wq;
+static struct wscrypto_queue aesq, shaq;
+
+// the registered blocks; opslock guards the pointers, reglock serializes (un)registration
+static DEFINE_SPINLOCK(opslock);
+static DEFINE_MUTEX(reglock);
+static const struct wscrypto_aes_ops *aesops;
+static const struct wscrypto_sha256_ops *shaops;
+
+// every setkey gets a new generation, so the worker knows when the block's key is stale; keys
+// loaded by anything else (the driver's character device users) bump aesinval instead
+static atomic_t keygen = ATOMIC_INIT(0);
+static atomic_t aesinval = ATOMIC_INIT(0);
+static int aesloaded, aesloadedinval;     // worker only
+
+struct wscrypto_aes_ctx {
+    struct crypto_skcipher *fallback;
+    const struct wscrypto_aes_ops *ops;
+    u8 key[AES_MAX_KEY_SIZE];
+    unsigned int keylen;
+    int keygen;
+};
+
+struct wscrypto_aes_reqctx {
+    int decrypt;
+    struct skcipher_request subreq;     // for the fallback, must be last
+};
+
+struct wscrypto_sha_ctx {
+    struct crypto_shash *fallback;
+    const struct wscrypto_sha256_ops *ops;
+    int hmac;
+    struct sha256_state ipad;           // hmac: midstates after the padded key blocks
+    struct sha256_state opad;
+};
+
+struct wscrypto_sha_reqctx {
+    struct sha256_state st;
+    int final;                          // finup queued: finish after the update
+};
+
+
+/*
+ * True when each segment in the first nbytes of sg starts on an align boundary and all but the
+ * last end on one, so that no unit of align bytes is split between two segments or pages
+ */
+static bool wscrypto_sg_aligned(struct scatterlist *sg, unsigned int nbytes, unsigned int align)
+{
+    for (; sg != NULL && nbytes > 0; sg = sg_next(sg))
+    {
+        unsigned int len = min(sg->length, nbytes);
+
+        if (sg->offset % align || (len < nbytes && len % align))
+            return false;
+        nbytes -= len;
+    }
+    return nbytes == 0;
+}
+
+
+/*
+ * Drains a block's queue; requests are completed with bottom halves off, as they would be from
+ * an interrupt handler
+ */
+static void wscrypto_work(struct work_struct *work)
+{
+    struct wscrypto_queue *q = container_of(work, struct wscrypto_queue, work);
+    struct crypto_async_request *areq, *backlog;
+    int err;
+
+    for (;;)
+    {
+        spin_lock_bh(&q->lock);
+        backlog = crypto_get_backlog(&q->queue);
+        areq = crypto_dequeue_request(&q->queue);
+        spin_unlock_bh(&q->lock);
+        if (areq == NULL)
+            return;
+
+        if (backlog != NULL)
+        {
+            local_bh_disable();
+            wscrypto_complete(backlog, -EINPROGRESS);
+            local_bh_enable();
+        }
+
+        err = q->handle(areq);
+
+        local_bh_disable();
+        wscrypto_complete(areq, err);
+        local_bh_enable();
+        cond_resched();
+    }
+}
+
+
+static int wscrypto_enqueue(struct wscrypto_queue *q, struct crypto_async_request *areq)
+{
+    int ret;
+
+    spin_lock_bh(&q->lock);
+    ret = crypto_enqueue_request(&q->queue, areq);
+    spin_unlock_bh(&q->lock);
+    queue_work(wscrypto_wq, &q->work);
+    return ret;
+}
+
+
+static void wscrypto_queue_init(struct wscrypto_queue *q, int (*handle)(struct crypto_async_request *))
+{
+    spin_lock_init(&q->lock);
+    crypto_init_queue(&q->queue, WSCRYPTO_QLEN);
+    INIT_WORK(&q->work, wscrypto_work);
+    q->handle = handle;
+}
+
+
+/*
+ * cbc(aes)
+ */
+
+static int wscrypto_aes_handle(struct crypto_async_request *areq)
+{
+    struct skcipher_request *req = skcipher_request_cast(areq);
+    struct wscrypto_aes_ctx *ctx = crypto_skcipher_ctx(crypto_skcipher_reqtfm(req));
+    struct wscrypto_aes_reqctx *rctx = skcipher_request_ctx(req);
+    const struct wscrypto_aes_ops *ops = ctx->ops;
+    struct sg_mapping_iter in, out;
+    unsigned int inoff = 0, outoff = 0, nbytes = req->cryptlen;
+    int ret = 0;
+
+    // segments are whole blocks, so every mapped piece of src and dst is too
+    sg_miter_start(&in, req->src, sg_nents(req->src), SG_MITER_FROM_SG);
+    sg_miter_start(&out, req->dst, sg_nents(req->dst), SG_MITER_TO_SG);
+    while (ret == 0 && nbytes > 0)
+    {
+        unsigned int n;
+
+        if (inoff == in.length)
+        {
+            if (!sg_miter_next(&in))
+                break;
+            inoff = 0;
+        }
+        if (outoff == out.length)
+        {
+            if (!sg_miter_next(&out))
+                break;
+            outoff = 0;
+        }
+
+        // the block holds a single key, reload it when another one was used since, by a
+        // transform of ours or by the driver's own users
+        if (aesloaded != ctx->keygen || aesloadedinval != atomic_read(&aesinval))
+        {
+            aesloadedinval = atomic_read(&aesinval);
+            ret = ops->setkey(ops->priv, ctx->key);
+            aesloaded = ret ? 0 : ctx->keygen;
+            if (ret)
+                break;
+        }
+
+        n = min3(in.length - inoff, out.length - outoff, (size_t)nbytes);
+        ret = ops->cbc(ops->priv, rctx->decrypt, req->iv, in.addr + inoff, out.addr + outoff, n / AES_BLOCK_SIZE);
+        inoff += n;
+        outoff += n;
+        nbytes -= n;
+    }
+    sg_miter_stop(&out);
+    sg_miter_stop(&in);
+
+    atomic_long_inc(&aes_hwreqs);
+    return (ret == 0 && nbytes > 0) ? -EINVAL : ret;
+}
+
+
+static int wscrypto_aes_crypt(struct skcipher_request *req, int decrypt)
+{
+    struct wscrypto_aes_ctx *ctx = crypto_skcipher_ctx(crypto_skcipher_reqtfm(req));
+    struct wscrypto_aes_reqctx *rctx = skcipher_request_ctx(req);
+
+    if (req->cryptlen % AES_BLOCK_SIZE)
+        return -EINVAL;
+    if (req->cryptlen == 0)
+        return 0;
+
+    if (ctx->keylen != AES_KEYSIZE_256 || req->cryptlen < aes_minbytes ||
+        !wscrypto_sg_aligned(req->src, req->cryptlen, AES_BLOCK_SIZE) ||
+        !wscrypto_sg_aligned(req->dst, req->cryptlen, AES_BLOCK_SIZE))
+    {
+        atomic_long_inc(&aes_swreqs);
+        skcipher_request_set_tfm(&rctx->subreq, ctx->fallback);
+        skcipher_request_set_callback(&rctx->subreq, req->base.flags, req->base.complete, req->base.data);
+        skcipher_request_set_crypt(&rctx->subreq, req->src, req->dst, req->cryptlen, req->iv);
+        return decrypt ? crypto_skcipher_decrypt(&rctx->subreq) : crypto_skcipher_encrypt(&rctx->subreq);
+    }
+
+    rctx->decrypt = decrypt;
+    return wscrypto_enqueue(&aesq, &req->base);
+}
+
+
+static int wscrypto_aes_encrypt(struct skcipher_request *req)
+{
+    return wscrypto_aes_crypt(req, 0);
+}
+
+
+static int wscrypto_aes_decrypt(struct skcipher_request *req)
+{
+    return wscrypto_aes_crypt(req, 1);
+}
+
+
+/*
+ * Every key goes to the fallback as well; only 256-bit keys can be used on the block
+ */
+static int wscrypto_aes_setkey(struct crypto_skcipher *tfm, const u8 *key, unsigned int keylen)
+{
+    struct wscrypto_aes_ctx *ctx = crypto_skcipher_ctx(tfm);
+    int ret;
+
+    crypto_skcipher_clear_flags(ctx->fallback, CRYPTO_TFM_REQ_MASK);
+    crypto_skcipher_set_flags(ctx->fallback, crypto_skcipher_get_flags(tfm) & CRYPTO_TFM_REQ_MASK);
+    ret = crypto_skcipher_setkey(ctx->fallback, key, keylen);
+    if (ret)
+        return ret;
+
+    memcpy(ctx->key, key, keylen);
+    ctx->keylen = keylen;
+    ctx->keygen = atomic_inc_return(&keygen);
+    return 0;
+}
+
+
+static int wscrypto_aes_init_tfm(struct crypto_skcipher *tfm)
+{
+    struct wscrypto_aes_ctx *ctx = crypto_skcipher_ctx(tfm);
+
+    // pin the block's driver for as long as the transform exists
+    spin_lock(&opslock);
+    ctx->ops = aesops;
+    if (ctx->ops == NULL || !try_module_get(ctx->ops->owner))
+        ctx->ops = NULL;
+    spin_unlock(&opslock);
+    if (ctx->ops == NULL)
+        return -ENODEV;
+
+    ctx->fallback = crypto_alloc_skcipher(crypto_tfm_alg_name(&tfm->base), 0, CRYPTO_ALG_NEED_FALLBACK);
+    if (IS_ERR(ctx->fallback))
+    {
+        printk(KERN_ALERT "wscrypto: no software cbc(aes) to fall back to\n");
+        module_put(ctx->ops->owner);
+        return PTR_ERR(ctx->fallback);
+    }
+
+    crypto_skcipher_set_reqsize(tfm, sizeof(struct wscrypto_aes_reqctx) + crypto_skcipher_reqsize(ctx->fallback));
+    return 0;
+}
+
+
+static void wscrypto_aes_exit_tfm(struct crypto_skcipher *tfm)
+{
+    struct wscrypto_aes_ctx *ctx = crypto_skcipher_ctx(tfm);
+
+    memzero_explicit(ctx->key, sizeof(ctx->key));
+    crypto_free_skcipher(ctx->fallback);
+    module_put(ctx->ops->owner);
+}
+
+
+static struct skcipher_alg wscrypto_cbc_aes = {
+    .base = {
+        .cra_name = "cbc(aes)",
+        .cra_driver_name = "cbc-aes-wscrypto",
+        .cra_priority = WSCRYPTO_PRIORITY,
+        .cra_flags = CRYPTO_ALG_ASYNC | CRYPTO_ALG_NEED_FALLBACK | CRYPTO_ALG_KERN_DRIVER_ONLY,
+        .cra_blocksize = AES_BLOCK_SIZE,
+        .cra_ctxsize = sizeof(struct wscrypto_aes_ctx),
+        .cra_module = THIS_MODULE,
+    },
+    .init = wscrypto_aes_init_tfm,
+    .exit = wscrypto_aes_exit_tfm,
+    .setkey = wscrypto_aes_setkey,
+    .encrypt = wscrypto_aes_encrypt,
+    .decrypt = wscrypto_aes_decrypt,
+    .min_keysize = AES_MIN_KEY_SIZE,
+    .max_keysize = AES_MAX_KEY_SIZE,
+    .ivsize = AES_BLOCK_SIZE,
+};
+
+
+/*
+ * sha256 and hmac(sha256)
+ *
+ * A request's state is a struct sha256_state, which is also what the software sha256 exports, so
+ * a stream can move between the block and the fallback at any point: a short update is done by
+ * importing the state into the fallback, updating and exporting it again.
+ */
+
+static int wscrypto_sha_swupdate(struct wscrypto_sha_ctx *ctx, struct sha256_state *st,
+                                 struct scatterlist *sg, unsigned int nbytes)
+{
+    SHASH_DESC_ON_STACK(desc, ctx->fallback);
+    struct sg_mapping_iter m;
+    int ret;
+
+    desc->tfm = ctx->fallback;
+    ret = crypto_shash_import(desc, st);
+
+    sg_miter_start(&m, sg, sg_nents(sg), SG_MITER_FROM_SG | SG_MITER_ATOMIC);
+    while (ret == 0 && nbytes > 0 && sg_miter_next(&m))
+    {
+        unsigned int len = min_t(unsigned int, m.length, nbytes);
+
+        ret = crypto_shash_update(desc, m.addr, len);
+        nbytes -= len;
+    }
+    sg_miter_stop(&m);
+
+    if (ret == 0)
+        ret = crypto_shash_export(desc, st);
+    shash_desc_zero(desc);
+    return ret;
+}
+
+
+/*
+ * Padding is one or two blocks, never worth the block; for hmac the outer hash is one more
+ */
+static int wscrypto_sha_swfinal(struct wscrypto_sha_ctx *ctx, struct sha256_state *st, u8 *out)
+{
+    SHASH_DESC_ON_STACK(desc, ctx->fallback);
+    u8 inner[SHA256_DIGEST_SIZE];
+    int ret;
+
+    desc->tfm = ctx->fallback;
+    ret = crypto_shash_import(desc, st) ?: crypto_shash_final(desc, ctx->hmac ? inner : out);
+    if (ret == 0 && ctx->hmac)
+        ret = crypto_shash_import(desc, &ctx->opad) ?: crypto_shash_finup(desc, inner, sizeof(inner), out);
+
+    memzero_explicit(inner, sizeof(inner));
+    shash_desc_zero(desc);
+    return ret;
+}
+
+
+/*
+ * Runs an update on the block: whole blocks straight from the mapped data, the ends through the
+ * state's partial block
+ */
+static int wscrypto_sha_hwupdate(const struct wscrypto_sha256_ops *ops, struct sha256_state *st,
+                                 struct scatterlist *sg, unsigned int nbytes)
+{
+    unsigned int partial = st->count % SHA256_BLOCK_SIZE;
+    struct sg_mapping_iter m;
+    int ret = 0;
+
+    st->count += nbytes;
+    sg_miter_start(&m, sg, sg_nents(sg), SG_MITER_FROM_SG);
+    while (ret == 0 && nbytes > 0 && sg_miter_next(&m))
+    {
+        const u8 *p = m.addr;
+        unsigned int len = min_t(unsigned int, m.length, nbytes);
+
+        nbytes -= len;
+        if (partial > 0)
+        {
+            unsigned int n = min_t(unsigned int, len, SHA256_BLOCK_SIZE - partial);
+
+            memcpy(st->buf + partial, p, n);
+            partial += n;
+            p += n;
+            len -= n;
+            if (partial < SHA256_BLOCK_SIZE)
+                continue;
+            ret = ops->compress(ops->priv, st->state, st->buf, 1);
+            partial = 0;
+        }
+        if (ret == 0 && len >= SHA256_BLOCK_SIZE)
+        {
+            ret = ops->compress(ops->priv, st->state, p, len / SHA256_BLOCK_SIZE);
+            p += len - len % SHA256_BLOCK_SIZE;
+            len %= SHA256_BLOCK_SIZE;
+        }
+        memcpy(st->buf, p, len);
+        partial = len;
+    }
+    sg_miter_stop(&m);
+    return (ret == 0 && nbytes > 0) ? -EINVAL : ret;
+}
+
+
+/*
+ * An update is worth the block when it is long enough and leaves every block it compresses
+ * word-aligned in memory
+ */
+static bool wscrypto_sha_usehw(struct sha256_state *st, struct scatterlist *sg, unsigned int nbytes)
+{
+    unsigned int partial = st->count % SHA256_BLOCK_SIZE;
+
+    return nbytes >= sha_minbytes && partial + nbytes >= SHA256_BLOCK_SIZE && partial % 4 == 0 &&
+           wscrypto_sg_aligned(sg, nbytes, 4);
+}
+
+
+static int wscrypto_sha_handle(struct crypto_async_request *areq)
+{
+    struct ahash_request *req = ahash_request_cast(areq);
+    struct wscrypto_sha_ctx *ctx = crypto_ahash_ctx(crypto_ahash_reqtfm(req));
+    struct wscrypto_sha_reqctx *rctx = ahash_request_ctx(req);
+    int ret;
+
+    ret = wscrypto_sha_hwupdate(ctx->ops, &rctx->st, req->src, req->nbytes);
+    if (ret == 0 && rctx->final)
+        ret = wscrypto_sha_swfinal(ctx, &rctx->st, req->result);
+
+    atomic_long_inc(&sha_hwreqs);
+    return ret;
+}
+
+
+static int wscrypto_sha_init(struct ahash_request *req)
+{
+    struct wscrypto_sha_ctx *ctx = crypto_ahash_ctx(crypto_ahash_reqtfm(req));
+    struct wscrypto_sha_reqctx *rctx = ahash_request_ctx(req);
+
+    if (ctx->hmac)
+        rctx->st = ctx->ipad;
+    else
+    {
+        memset(&rctx->st, 0, sizeof(rctx->st));
+        rctx->st.state[0] = SHA256_H0;
+        rctx->st.state[1] = SHA256_H1;
+        rctx->st.state[2] = SHA256_H2;
+        rctx->st.state[3] = SHA256_H3;
+        rctx->st.state[4] = SHA256_H4;
+        rctx->st.state[5] = SHA256_H5;
+        rctx->st.state[6] = SHA256_H6;
+        rctx->st.state[7] = SHA256_H7;
+    }
+    return 0;
+}
+
+
+/*
+ * Update, and finish as well when final is set
+ */
+static int wscrypto_sha_run(struct ahash_request *req, int final)
+{
+    struct wscrypto_sha_ctx *ctx = crypto_ahash_ctx(crypto_ahash_reqtfm(req));
+    struct wscrypto_sha_reqctx *rctx = ahash_request_ctx(req);
+    int ret = 0;
+
+    if (req->nbytes > 0 && wscrypto_sha_usehw(&rctx->st, req->src, req->nbytes))
+    {
+        rctx->final = final;
+        return wscrypto_enqueue(&shaq, &req->base);
+    }
+
+    if (req->nbytes > 0)
+    {
+        atomic_long_inc(&sha_swreqs);
+        ret = wscrypto_sha_swupdate(ctx, &rctx->st, req->src, req->nbytes);
+    }
+    if (ret == 0 && final)
+        ret = wscrypto_sha_swfinal(ctx, &rctx->st, req->result);
+    return ret;
+}
+
+
+static int wscrypto_sha_update(struct ahash_request *req)
+{
+    return wscrypto_sha_run(req, 0);
+}
+
+
+static int wscrypto_sha_finup(struct ahash_request *req)
+{
+    return wscrypto_sha_run(req, 1);
+}
+
+
+static int wscrypto_sha_final(struct ahash_request *req)
+{
+    struct wscrypto_sha_ctx *ctx = crypto_ahash_ctx(crypto_ahash_reqtfm(req));
+    struct wscrypto_sha_reqctx *rctx = ahash_request_ctx(req);
+
+    return wscrypto_sha_swfinal(ctx, &rctx->st, req->result);
+}
+
+
+static int wscrypto_sha_digest(struct ahash_request *req)
+{
+    return wscrypto_sha_init(req) ?: wscrypto_sha_run(req, 1);
+}
+
+
+static int wscrypto_sha_export(struct ahash_request *req, void *out)
+{
+    memcpy(out, &((struct wscrypto_sha_reqctx *)ahash_request_ctx(req))->st, sizeof(struct sha256_state));
+    return 0;
+}
+
+
+static int wscrypto_sha_import(struct ahash_request *req, const void *in)
+{
+    memcpy(&((struct wscrypto_sha_reqctx *)ahash_request_ctx(req))->st, in, sizeof(struct sha256_state));
+    return 0;
+}
+
+
+/*
+ * Hashes the ipad and opad blocks once per key, so every MAC starts from their midstates
+ */
+static int wscrypto_hmac_setkey(struct crypto_ahash *tfm, const u8 *key, unsigned int keylen)
+{
+    struct wscrypto_sha_ctx *ctx = crypto_ahash_ctx(tfm);
+    SHASH_DESC_ON_STACK(desc, ctx->fallback);
+    u8 pad[SHA256_BLOCK_SIZE];
+    int ret = 0;
+    int i;
+
+    desc->tfm = ctx->fallback;
+    memset(pad, 0, sizeof(pad));
+    if (keylen > SHA256_BLOCK_SIZE)
+        ret = crypto_shash_digest(desc, key, keylen, pad);
+    else
+        memcpy(pad, key, keylen);
+
+    for (i=0; i<SHA256_BLOCK_SIZE; i++)
+        pad[i] ^= 0x36;
+    if (ret == 0)
+        ret = crypto_shash_init(desc) ?: crypto_shash_update(desc, pad, sizeof(pad)) ?:
+              crypto_shash_export(desc, &ctx->ipad);
+
+    for (i=0; i<SHA256_BLOCK_SIZE; i++)
+        pad[i] ^= 0x36 ^ 0x5c;
+    if (ret == 0)
+        ret = crypto_shash_init(desc) ?: crypto_shash_update(desc, pad, sizeof(pad)) ?:
+              crypto_shash_export(desc, &ctx->opad);
+
+    memzero_explicit(pad, sizeof(pad));
+    shash_desc_zero(desc);
+    return ret;
+}
+
+
+static int wscrypto_sha_cra_init_common(struct crypto_tfm *tfm, int hmac)
+{
+    struct wscrypto_sha_ctx *ctx = crypto_tfm_ctx(tfm);
+
+    spin_lock(&opslock);
+    ctx->ops = shaops;
+    if (ctx->ops == NULL || !try_module_get(ctx->ops->owner))
+        ctx->ops = NULL;
+    spin_unlock(&opslock);
+    if (ctx->ops == NULL)
+        return -ENODEV;
+
+    ctx->fallback = crypto_alloc_shash("sha256", 0, CRYPTO_ALG_NEED_FALLBACK);
+    if (IS_ERR(ctx->fallback))
+    {
+        printk(KERN_ALERT "wscrypto: no software sha256 to fall back to\n");
+        module_put(ctx->ops->owner);
+        return PTR_ERR(ctx->fallback);
+    }
+    ctx->hmac = hmac;
+
+    crypto_ahash_set_reqsize(__crypto_ahash_cast(tfm), sizeof(struct wscrypto_sha_reqctx));
+    return 0;
+}
+
+
+static int wscrypto_sha_cra_init(struct crypto_tfm *tfm)
+{
+    return wscrypto_sha_cra_init_common(tfm, 0);
+}
+
+
+static int wscrypto_hmac_cra_init(struct crypto_tfm *tfm)
+{
+    return wscrypto_sha_cra_init_common(tfm, 1);
+}
+
+
+static void wscrypto_sha_cra_exit(struct crypto_tfm *tfm)
+{
+    struct wscrypto_sha_ctx *ctx = crypto_tfm_ctx(tfm);
+
+    memzero_explicit(&ctx->ipad, sizeof(ctx->ipad));
+    memzero_explicit(&ctx->opad, sizeof(ctx->opad));
+    crypto_free_shash(ctx->fallback);
+    module_put(ctx->ops->owner);
+}
+
+
+static struct ahash_alg wscrypto_sha_algs[] = {
+    {
+        .init = wscrypto_sha_init,
+        .update = wscrypto_sha_update,
+        .final = wscrypto_sha_final,
+        .finup = wscrypto_sha_finup,
+        .digest = wscrypto_sha_digest,
+        .export = wscrypto_sha_export,
+        .import = wscrypto_sha_import,
+        .halg = {
+            .digestsize = SHA256_DIGEST_SIZE,
+            .statesize = sizeof(struct sha256_state),
+            .base = {
+                .cra_name = "sha256",
+                .cra_driver_name = "sha256-wscrypto",
+                .cra_priority = WSCRYPTO_PRIORITY,
+                .cra_flags = CRYPTO_ALG_ASYNC | CRYPTO_ALG_NEED_FALLBACK | CRYPTO_ALG_KERN_DRIVER_ONLY,
+                .cra_blocksize = SHA256_BLOCK_SIZE,
+                .cra_ctxsize = sizeof(struct wscrypto_sha_ctx),
+                .cra_module = THIS_MODULE,
+                .cra_init = wscrypto_sha_cra_init,
+                .cra_exit = wscrypto_sha_cra_exit,
+            },
+        },
+    },
+    {
+        .init = wscrypto_sha_init,
+        .update = wscrypto_sha_update,
+        .final = wscrypto_sha_final,
+        .finup = wscrypto_sha_finup,
+        .digest = wscrypto_sha_digest,
+        .export = wscrypto_sha_export,
+        .import = wscrypto_sha_import,
+        .setkey = wscrypto_hmac_setkey,
+        .halg = {
+            .digestsize = SHA256_DIGEST_SIZE,
+            .statesize = sizeof(struct sha256_state),
+            .base = {
+                .cra_name = "hmac(sha256)",
+                .cra_driver_name = "hmac-sha256-wscrypto",
+                .cra_priority = WSCRYPTO_PRIORITY,
+                .cra_flags = CRYPTO_ALG_ASYNC | CRYPTO_ALG_NEED_FALLBACK | CRYPTO_ALG_KERN_DRIVER_ONLY,
+                .cra_blocksize = SHA256_BLOCK_SIZE,
+                .cra_ctxsize = sizeof(struct wscrypto_sha_ctx),
+                .cra_module = THIS_MODULE,
+                .cra_init = wscrypto_hmac_cra_init,
+                .cra_exit = wscrypto_sha_cra_exit,
+            },
+        },
+    },
+};
+
+
+/*
+ * Registration by the block drivers. The algorithms' self-tests run during crypto_register_*()
+ * and already go through the block, so the ops are published before and withdrawn on failure.
+ */
+
+int wscrypto_register_aes(const struct wscrypto_aes_ops *ops)
+{
+    int ret;
+
+    mutex_lock(&reglock);
+    if (aesops != NULL)
+    {
+        mutex_unlock(&reglock);
+        return -EBUSY;
+    }
+    spin_lock(&opslock);
+    aesops = ops;
+    aesloaded = 0;
+    spin_unlock(&opslock);
+
+    ret = crypto_register_skcipher(&wscrypto_cbc_aes);
+    if (ret)
+    {
+        printk(KERN_ALERT "wscrypto: failed to register cbc(aes) (%d)\n", ret);
+        spin_lock(&opslock);
+        aesops = NULL;
+        spin_unlock(&opslock);
+    }
+    else
+        printk(KERN_INFO "wscrypto: cbc(aes) registered on the AES block\n");
+    mutex_unlock(&reglock);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(wscrypto_register_aes);
+
+
+void wscrypto_unregister_aes(const struct wscrypto_aes_ops *ops)
+{
+    mutex_lock(&reglock);
+    if (aesops == ops)
+    {
+        crypto_unregister_skcipher(&wscrypto_cbc_aes);
+        flush_work(&aesq.work);
+        spin_lock(&opslock);
+        aesops = NULL;
+        spin_unlock(&opslock);
+    }
+    mutex_unlock(&reglock);
+}
+EXPORT_SYMBOL_GPL(wscrypto_unregister_aes);
+
+
+/*
+ * Tells the glue that the key in the AES block was replaced behind its back, so the next request
+ * loads its own again. Does nothing for ops that are not the registered ones.
+ */
+void wscrypto_aes_invalidate(const struct wscrypto_aes_ops *ops)
+{
+    spin_lock(&opslock);
+    if (ops == aesops)
+        atomic_inc(&aesinval);
+    spin_unlock(&opslock);
+}
+EXPORT_SYMBOL_GPL(wscrypto_aes_invalidate);
+
+
+int wscrypto_register_sha256(const struct wscrypto_sha256_ops *ops)
+{
+    int ret;
+
+    mutex_lock(&reglock);
+    if (shaops != NULL)
+    {
+        mutex_unlock(&reglock);
+        return -EBUSY;
+    }
+    spin_lock(&opslock);
+    shaops = ops;
+    spin_unlock(&opslock);
+
+    ret = crypto_register_ahashes(wscrypto_sha_algs, ARRAY_SIZE(wscrypto_sha_algs));
+    if (ret)
+    {
+        printk(KERN_ALERT "wscrypto: failed to register sha256 (%d)\n", ret);
+        spin_lock(&opslock);
+        shaops = NULL;
+        spin_unlock(&opslock);
+    }
+    else
+        printk(KERN_INFO "wscrypto: sha256 and hmac(sha256) registered on the SHA256 block\n");
+    mutex_unlock(&reglock);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(wscrypto_register_sha256);
+
+
+void wscrypto_unregister_sha256(const struct wscrypto_sha256_ops *ops)
+{
+    mutex_lock(&reglock);
+    if (shaops == ops)
+    {
+        crypto_unregister_ahashes(wscrypto_sha_algs, ARRAY_SIZE(wscrypto_sha_algs));
+        flush_work(&shaq.work);
+        spin_lock(&opslock);
+        shaops = NULL;
+        spin_unlock(&opslock);
+    }
+    mutex_unlock(&reglock);
+}
+EXPORT_SYMBOL_GPL(wscrypto_unregister_sha256);
+
+
+/**  The LKM initialization function. Nothing is registered with the crypto API until a block
+ *  driver registers its ops.
+ */
+static int __init wscrypto_init(void)
+{
+    wscrypto_wq = alloc_workqueue("wscrypto", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+    if (wscrypto_wq == NULL)
+    {
+        printk(KERN_ALERT "wscrypto: failed to create the request workqueue\n");
+        return -ENOMEM;
+    }
+    wscrypto_queue_init(&aesq, wscrypto_aes_handle);
+    wscrypto_queue_init(&shaq, wscrypto_sha_handle);
+    printk(KERN_INFO "wscrypto: waiting for the block drivers to register\n");
+    return 0;
+}
+
+
+/**  The LKM cleanup function. The block drivers use our symbols, so they, and their algorithms,
+ *  are gone by now.
+ */
+static void __exit wscrypto_exit(void)
+{
+    destroy_workqueue(wscrypto_wq);
+    printk(KERN_INFO "wscrypto: Exiting\n");
+}
+
+
+module_init(wscrypto_init);
+module_exit(wscrypto_exit);
@@ -0,0 +1,49 @@
+/**
+ * @file   wscryptokern.h
+ * @brief
+ * Interface between the kernel crypto API glue (wscryptokern.ko) and the drivers of the AES-CBC
+ * and SHA256 blocks. A driver that owns a block fills in one of these ops tables and registers it
+ * from its module init; from then on "cbc(aes)", or "sha256" and "hmac(sha256)", are offered to
+ * kernel users (xfrm, dm-crypt, AF_ALG) on that block. Unregister from the module exit: crypto
+ * transforms in use hold a reference on the owner, so that is only reached once they are gone.
+ *
+ * The ops are called from one worker at a time per block, in process context, and may sleep, but
+ * the driver must still serialize them against its own character device users.
+ *
+ * The glue keeps its key loaded in the AES block between requests. Whenever the driver loads a
+ * key for someone else (a SET_KEY on its character device), it must call wscrypto_aes_invalidate()
+ * with its registered ops, under the same lock that serializes it with the ops; the glue then
+ * reloads its key before the next cbc call.
+ */
+
+#ifndef WSCRYPTOKERN_H
+#define WSCRYPTOKERN_H
+
+#include <linux/module.h>
+#include <linux/types.h>
+
+struct wscrypto_aes_ops {
+    struct module *owner;
+    void *priv;
+    /* Loads a 256-bit key into the block */
+    int (*setkey)(void *priv, const u8 *key);
+    /* CBC over nblocks whole blocks, without padding. iv is the chaining value going in and is
+     * left holding the one to continue with. in and out may be the same memory. */
+    int (*cbc)(void *priv, int decrypt, u8 *iv, const u8 *in, u8 *out, unsigned int nblocks);
+};
+
+struct wscrypto_sha256_ops {
+    struct module *owner;
+    void *priv;
+    /* Runs nblocks 64-byte blocks (4-byte aligned) through the compression function, starting
+     * from and updating the chaining value h */
+    int (*compress)(void *priv, u32 *h, const u8 *blocks, unsigned int nblocks);
+};
+
+int wscrypto_register_aes(const struct wscrypto_aes_ops *ops);
+void wscrypto_unregister_aes(const struct wscrypto_aes_ops *ops);
+void wscrypto_aes_invalidate(const struct wscrypto_aes_ops *ops);
+int wscrypto_register_sha256(const struct wscrypto_sha256_ops *ops);
+void wscrypto_unregister_sha256(const struct wscrypto_sha256_ops *ops);
+
+#endif
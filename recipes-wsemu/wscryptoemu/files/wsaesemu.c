@@ -0,0 +1,255 @@
+/**
+ * @file   wsaesemu.c
+ * @brief  CUSE emulator for the wsaes kernel module. Creates a character device that speaks the
+ * same ioctl/read/write protocol as /dev/wsaeschar and computes AES-256-CBC in software, so
+ * libwsaescbc and its tests can run on a machine without the Zynq AES block.
+ *
+ * Like the hardware, the emulated block holds a single key, IV and CBC chain shared by everyone
+ * who has the device open.
+ *
+ * usage: wsaesemu [-f] [--name=wsaeschar] [--latency=usec] [--maj=N] [--min=N]
+ *
+ * Then point libwsaescbc at it with WSAES_DEVICE=/dev/<name>.
+ */
+#define FUSE_USE_VERSION 29
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <cuse_lowlevel.h>
+#include <fuse_opt.h>
+
+#include "wsaescbc.h"
+#include "wsaeskern.h"
+#include "wsaessw.h"
+
+typedef struct {
+    unsigned major;
+    unsigned minor;
+    unsigned latency;   // microseconds added to every processed block
+    char *name;
+    int help;
+} emuparam_t;
+
+// state of the emulated block
+static pthread_mutex_t blocklock = PTHREAD_MUTEX_INITIALIZER;
+static int mode = RESET;
+static aes256swkey_t ks;
+static uint8_t iv[AESIVSIZE];
+static uint8_t chain[AESBLKSIZE];
+static uint8_t result[AESBLKSIZE];
+static unsigned latency;
+
+
+static void emu_open(fuse_req_t req, struct fuse_file_info *fi)
+{
+    fuse_reply_open(req, fi);
+}
+
+
+/*
+ * Returns the last processed block, as the driver does regardless of the size asked for
+ */
+static void emu_read(fuse_req_t req, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    uint8_t out[AESBLKSIZE];
+
+    (void)off;
+    (void)fi;
+
+    pthread_mutex_lock(&blocklock);
+    memcpy(out, result, AESBLKSIZE);
+    pthread_mutex_unlock(&blocklock);
+
+    fuse_reply_buf(req, (const char *)out, (size < AESBLKSIZE) ? size : AESBLKSIZE);
+}
+
+
+/*
+ * Loads the key or IV, or runs one block through the cipher, depending on the current mode
+ */
+static void emu_write(fuse_req_t req, const char *buf, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    uint8_t tmp[AESBLKSIZE];
+
+    (void)off;
+    (void)fi;
+
+    pthread_mutex_lock(&blocklock);
+    switch (mode)
+    {
+        case SET_KEY:
+            if (size < AESKEYSIZE)
+                goto inval;
+            aes256sw_expandkey(&ks, (const uint8_t *)buf);
+            break;
+
+        case SET_IV:
+            if (size < AESIVSIZE)
+                goto inval;
+            memcpy(iv, buf, AESIVSIZE);
+            break;
+
+        case ENCRYPT:
+            if (size < AESBLKSIZE)
+                goto inval;
+            for (int i=0; i<AESBLKSIZE; i++)
+                tmp[i] = buf[i] ^ chain[i];
+            aes256sw_encblock(&ks, tmp, result);
+            memcpy(chain, result, AESBLKSIZE);
+            break;
+
+        case DECRYPT:
+            if (size < AESBLKSIZE)
+                goto inval;
+            aes256sw_decblocks(&ks, (const uint8_t *)buf, result, 1);
+            for (int i=0; i<AESBLKSIZE; i++)
+                result[i] ^= chain[i];
+            memcpy(chain, buf, AESBLKSIZE);
+            break;
+
+        default:
+            goto inval;
+    }
+
+    // the block is busy for the whole delay, as the real one would be
+    if (latency && (mode == ENCRYPT || mode == DECRYPT))
+        usleep(latency);
+    pthread_mutex_unlock(&blocklock);
+
+    fuse_reply_write(req, size);
+    return;
+
+inval:
+    pthread_mutex_unlock(&blocklock);
+    fuse_reply_err(req, EINVAL);
+}
+
+
+/*
+ * IOCTL_SET_MODE passes the mode by value, so the device is registered with unrestricted ioctls
+ * and the argument arrives untouched. IOCTL_GET_MODE has to ask the kernel for the user buffer.
+ */
+static void emu_ioctl(fuse_req_t req, int cmd, void *arg, struct fuse_file_info *fi,
+                      unsigned flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz)
+{
+    (void)fi;
+    (void)flags;
+    (void)in_buf;
+    (void)in_bufsz;
+
+    switch ((unsigned)cmd)
+    {
+        case IOCTL_SET_MODE:
+        {
+            int newmode = (int)(uintptr_t)arg;
+
+            if (newmode < RESET || newmode > SET_KEY)
+            {
+                fuse_reply_err(req, EINVAL);
+                return;
+            }
+            pthread_mutex_lock(&blocklock);
+            mode = newmode;
+            if (mode == RESET)
+                memcpy(chain, iv, AESBLKSIZE);
+            pthread_mutex_unlock(&blocklock);
+            fuse_reply_ioctl(req, 0, NULL, 0);
+            break;
+        }
+
+        case IOCTL_GET_MODE:
+        {
+            ciphermode_t cur;
+            struct iovec iov = { arg, sizeof(cur) };
+
+            if (out_bufsz == 0)
+            {
+                fuse_reply_ioctl_retry(req, NULL, 0, &iov, 1);
+                return;
+            }
+            pthread_mutex_lock(&blocklock);
+            cur = (ciphermode_t)mode;
+            pthread_mutex_unlock(&blocklock);
+            fuse_reply_ioctl(req, 0, &cur, sizeof(cur));
+            break;
+        }
+
+        default:
+            fuse_reply_err(req, ENOTTY);
+            break;
+    }
+}
+
+
+static const struct cuse_lowlevel_ops emu_ops = {
+    .open  = emu_open,
+    .read  = emu_read,
+    .write = emu_write,
+    .ioctl = emu_ioctl,
+};
+
+#define EMU_OPT(t, p) { t, offsetof(emuparam_t, p), 1 }
+
+static const struct fuse_opt emu_opts[] = {
+    EMU_OPT("-M %u",        major),
+    EMU_OPT("--maj=%u",     major),
+    EMU_OPT("-m %u",        minor),
+    EMU_OPT("--min=%u",     minor),
+    EMU_OPT("-n %s",        name),
+    EMU_OPT("--name=%s",    name),
+    EMU_OPT("-l %u",        latency),
+    EMU_OPT("--latency=%u", latency),
+    FUSE_OPT_KEY("-h",      0),
+    FUSE_OPT_KEY("--help",  0),
+    FUSE_OPT_END
+};
+
+static int emu_processarg(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+    emuparam_t *param = data;
+
+    (void)arg;
+    if (key != 0)
+        return 1;
+
+    param->help = 1;
+    fprintf(stderr, "usage: wsaesemu [options]\n"
+            "  -n NAME  --name=NAME     device name under /dev (default wsaeschar)\n"
+            "  -l USEC  --latency=USEC  delay added to every block (default 0)\n"
+            "  -M MAJ   --maj=MAJ       device major number (default dynamic)\n"
+            "  -m MIN   --min=MIN       device minor number (default dynamic)\n");
+    return fuse_opt_add_arg(outargs, "-ho");
+}
+
+int main(int argc, char **argv)
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    emuparam_t param = { 0, 0, 0, NULL, 0 };
+    char devname[128];
+    const char *devinfo[] = { devname };
+    struct cuse_info ci;
+
+    if (fuse_opt_parse(&args, &param, emu_opts, emu_processarg))
+    {
+        fprintf(stderr, "ERROR: failed to parse options\n");
+        return 1;
+    }
+
+    snprintf(devname, sizeof(devname), "DEVNAME=%s", param.name ? param.name : "wsaeschar");
+    latency = param.latency;
+
+    memset(&ci, 0, sizeof(ci));
+    ci.dev_major = param.major;
+    ci.dev_minor = param.minor;
+    ci.dev_info_argc = 1;
+    ci.dev_info_argv = devinfo;
+    ci.flags = CUSE_UNRESTRICTED_IOCTL;
+
+    return cuse_lowlevel_main(args.argc, args.argv, &ci, &emu_ops, NULL);
+}
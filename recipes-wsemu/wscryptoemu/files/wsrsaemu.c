@@ -0,0 +1,364 @@
+/**
+ * @file   wsrsaemu.c
+ * @brief  CUSE emulator for the wsrsa kernel module. Creates a character device that speaks the
+ * same protocol as /dev/wsrsachar: an RSAPublic_t is written, IOCTL_SET_MODE runs the block once,
+ * and a read returns the 128-byte result base^exponent mod modulus. The modular exponentiation is
+ * done in software with Montgomery multiplication over little-endian 32-bit words, the same
+ * layout the driver copies into the hardware registers. xbar and Mbar are accepted but not
+ * needed, since the Montgomery constants are derived from the modulus.
+ *
+ * There is no private key BRAM to load, so SET_PRIVKEY and DECRYPT simply use whatever exponent
+ * was last written. As with the driver, only one process may have the device open.
+ *
+ * usage: wsrsaemu [-f] [--name=wsrsachar] [--latency=usec] [--maj=N] [--min=N]
+ *
+ * Then run wsrsatest against it with WSRSA_DEVICE=/dev/<name>.
+ */
+#define FUSE_USE_VERSION 29
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <cuse_lowlevel.h>
+#include <fuse_opt.h>
+
+#include "wsrsakern.h"
+
+#define RSA_WORDS (RSA_SIZE_BYTES / 4)
+
+typedef struct {
+    unsigned major;
+    unsigned minor;
+    unsigned latency;   // microseconds added to every exponentiation
+    char *name;
+    int help;
+} emuparam_t;
+
+// state of the emulated block
+static pthread_mutex_t blocklock = PTHREAD_MUTEX_INITIALIZER;
+static int opened = 0;
+static rsamode_t mode = ENCRYPT;
+static RSAPublic_t regs;
+static uint32_t result[RSA_WORDS];
+static unsigned latency;
+
+
+/*
+ * r = a - b over RSA_WORDS words, returns the borrow
+ */
+static uint32_t bn_sub(uint32_t *r, const uint32_t *a, const uint32_t *b)
+{
+    uint64_t borrow = 0;
+
+    for (int i=0; i<RSA_WORDS; i++)
+    {
+        uint64_t d = (uint64_t)a[i] - b[i] - borrow;
+        r[i] = (uint32_t)d;
+        borrow = (d >> 32) & 1;
+    }
+    return (uint32_t)borrow;
+}
+
+
+/*
+ * r = a * b * 2^-1024 mod n, with n odd (CIOS Montgomery multiplication)
+ */
+static void bn_montmul(uint32_t *r, const uint32_t *a, const uint32_t *b, const uint32_t *n, uint32_t n0inv)
+{
+    uint32_t t[RSA_WORDS + 2];
+    uint32_t sub[RSA_WORDS];
+
+    memset(t, 0, sizeof(t));
+    for (int i=0; i<RSA_WORDS; i++)
+    {
+        uint64_t s, carry = 0;
+
+        for (int j=0; j<RSA_WORDS; j++)
+        {
+            s = (uint64_t)a[j] * b[i] + t[j] + carry;
+            t[j] = (uint32_t)s;
+            carry = s >> 32;
+        }
+        s = (uint64_t)t[RSA_WORDS] + carry;
+        t[RSA_WORDS] = (uint32_t)s;
+        t[RSA_WORDS + 1] = (uint32_t)(s >> 32);
+
+        // add m*n so the low word cancels, then drop it
+        uint32_t m = t[0] * n0inv;
+        s = (uint64_t)m * n[0] + t[0];
+        carry = s >> 32;
+        for (int j=1; j<RSA_WORDS; j++)
+        {
+            s = (uint64_t)m * n[j] + t[j] + carry;
+            t[j - 1] = (uint32_t)s;
+            carry = s >> 32;
+        }
+        s = (uint64_t)t[RSA_WORDS] + carry;
+        t[RSA_WORDS - 1] = (uint32_t)s;
+        t[RSA_WORDS] = t[RSA_WORDS + 1] + (uint32_t)(s >> 32);
+    }
+
+    // t < 2n, so one conditional subtraction brings it into range
+    if (bn_sub(sub, t, n) <= t[RSA_WORDS])
+        memcpy(r, sub, sizeof(sub));
+    else
+        memcpy(r, t, sizeof(sub));
+}
+
+
+/*
+ * r = base^exp mod n
+ */
+static void bn_modexp(uint32_t *r, const uint32_t *base, const uint32_t *exp, const uint32_t *n)
+{
+    uint32_t r2[RSA_WORDS], acc[RSA_WORDS], xm[RSA_WORDS], one[RSA_WORDS];
+    uint32_t inv = 1;
+    int top;
+
+    // -n^-1 mod 2^32 by Newton iteration
+    for (int i=0; i<5; i++)
+        inv *= 2 - n[0] * inv;
+
+    // R^2 mod n by doubling 1 2048 times
+    memset(r2, 0, sizeof(r2));
+    r2[0] = 1;
+    for (int i=0; i<2 * RSA_SIZE_BYTES * 8; i++)
+    {
+        uint32_t carry = r2[RSA_WORDS - 1] >> 31;
+        uint32_t sub[RSA_WORDS];
+
+        for (int j=RSA_WORDS-1; j>0; j--)
+            r2[j] = (r2[j] << 1) | (r2[j - 1] >> 31);
+        r2[0] <<= 1;
+        if (bn_sub(sub, r2, n) <= carry)
+            memcpy(r2, sub, sizeof(sub));
+    }
+
+    memset(one, 0, sizeof(one));
+    one[0] = 1;
+    bn_montmul(xm, base, r2, n, -inv);
+    bn_montmul(acc, one, r2, n, -inv);
+
+    for (top=RSA_SIZE_BYTES*8-1; top>=0; top--)
+        if ((exp[top / 32] >> (top % 32)) & 1)
+            break;
+
+    for (int bit=top; bit>=0; bit--)
+    {
+        bn_montmul(acc, acc, acc, n, -inv);
+        if ((exp[bit / 32] >> (bit % 32)) & 1)
+            bn_montmul(acc, acc, xm, n, -inv);
+    }
+
+    bn_montmul(r, acc, one, n, -inv);
+}
+
+
+/*
+ * Runs the loaded operands through the "block", as wsrsa_runonce_blocking() does
+ */
+static void emu_runonce(void)
+{
+    uint32_t base[RSA_WORDS], exp[RSA_WORDS], n[RSA_WORDS];
+
+    memcpy(base, regs.base, RSA_SIZE_BYTES);
+    memcpy(exp, regs.exponent, RSA_SIZE_BYTES);
+    memcpy(n, regs.modulus, RSA_SIZE_BYTES);
+
+    // an even modulus has no Montgomery form; the hardware would return garbage too
+    if ((n[0] & 1) == 0)
+        memset(result, 0, sizeof(result));
+    else
+        bn_modexp(result, base, exp, n);
+
+    if (latency)
+        usleep(latency);
+}
+
+
+static void emu_open(fuse_req_t req, struct fuse_file_info *fi)
+{
+    pthread_mutex_lock(&blocklock);
+    if (opened)
+    {
+        pthread_mutex_unlock(&blocklock);
+        fuse_reply_err(req, EBUSY);
+        return;
+    }
+    opened = 1;
+    pthread_mutex_unlock(&blocklock);
+    fuse_reply_open(req, fi);
+}
+
+
+static void emu_release(fuse_req_t req, struct fuse_file_info *fi)
+{
+    (void)fi;
+
+    pthread_mutex_lock(&blocklock);
+    opened = 0;
+    pthread_mutex_unlock(&blocklock);
+    fuse_reply_err(req, 0);
+}
+
+
+static void emu_read(fuse_req_t req, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    uint8_t out[RSA_SIZE_BYTES];
+
+    (void)off;
+    (void)fi;
+
+    pthread_mutex_lock(&blocklock);
+    memcpy(out, result, RSA_SIZE_BYTES);
+    pthread_mutex_unlock(&blocklock);
+
+    fuse_reply_buf(req, (const char *)out, (size < RSA_SIZE_BYTES) ? size : RSA_SIZE_BYTES);
+}
+
+
+static void emu_write(fuse_req_t req, const char *buf, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    (void)off;
+    (void)fi;
+
+    if (size < sizeof(RSAPublic_t))
+    {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+
+    pthread_mutex_lock(&blocklock);
+    memcpy(&regs, buf, sizeof(RSAPublic_t));
+    pthread_mutex_unlock(&blocklock);
+    fuse_reply_write(req, size);
+}
+
+
+/*
+ * The mode is passed by value, so the device is registered with unrestricted ioctls and the
+ * argument arrives untouched. IOCTL_GET_MODE has to ask the kernel for the user buffer.
+ */
+static void emu_ioctl(fuse_req_t req, int cmd, void *arg, struct fuse_file_info *fi,
+                      unsigned flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz)
+{
+    (void)fi;
+    (void)flags;
+    (void)in_buf;
+    (void)in_bufsz;
+
+    switch ((unsigned)cmd)
+    {
+        case IOCTL_SET_MODE:
+        {
+            int newmode = (int)(uintptr_t)arg;
+
+            if (newmode < ENCRYPT || newmode > INIT)
+            {
+                fuse_reply_err(req, EINVAL);
+                return;
+            }
+            pthread_mutex_lock(&blocklock);
+            mode = (rsamode_t)newmode;
+            emu_runonce();
+            pthread_mutex_unlock(&blocklock);
+            fuse_reply_ioctl(req, 0, NULL, 0);
+            break;
+        }
+
+        case IOCTL_GET_MODE:
+        {
+            rsamode_t cur;
+            struct iovec iov = { arg, sizeof(cur) };
+
+            if (out_bufsz == 0)
+            {
+                fuse_reply_ioctl_retry(req, NULL, 0, &iov, 1);
+                return;
+            }
+            pthread_mutex_lock(&blocklock);
+            cur = mode;
+            pthread_mutex_unlock(&blocklock);
+            fuse_reply_ioctl(req, 0, &cur, sizeof(cur));
+            break;
+        }
+
+        default:
+            fuse_reply_err(req, ENOTTY);
+            break;
+    }
+}
+
+
+static const struct cuse_lowlevel_ops emu_ops = {
+    .open    = emu_open,
+    .release = emu_release,
+    .read    = emu_read,
+    .write   = emu_write,
+    .ioctl   = emu_ioctl,
+};
+
+#define EMU_OPT(t, p) { t, offsetof(emuparam_t, p), 1 }
+
+static const struct fuse_opt emu_opts[] = {
+    EMU_OPT("-M %u",        major),
+    EMU_OPT("--maj=%u",     major),
+    EMU_OPT("-m %u",        minor),
+    EMU_OPT("--min=%u",     minor),
+    EMU_OPT("-n %s",        name),
+    EMU_OPT("--name=%s",    name),
+    EMU_OPT("-l %u",        latency),
+    EMU_OPT("--latency=%u", latency),
+    FUSE_OPT_KEY("-h",      0),
+    FUSE_OPT_KEY("--help",  0),
+    FUSE_OPT_END
+};
+
+static int emu_processarg(void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+    emuparam_t *param = data;
+
+    (void)arg;
+    if (key != 0)
+        return 1;
+
+    param->help = 1;
+    fprintf(stderr, "usage: wsrsaemu [options]\n"
+            "  -n NAME  --name=NAME     device name under /dev (default wsrsachar)\n"
+            "  -l USEC  --latency=USEC  delay added to every exponentiation (default 0)\n"
+            "  -M MAJ   --maj=MAJ       device major number (default dynamic)\n"
+            "  -m MIN   --min=MIN       device minor number (default dynamic)\n");
+    return fuse_opt_add_arg(outargs, "-ho");
+}
+
+int main(int argc, char **argv)
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    emuparam_t param = { 0, 0, 0, NULL, 0 };
+    char devname[128];
+    const char *devinfo[] = { devname };
+    struct cuse_info ci;
+
+    if (fuse_opt_parse(&args, &param, emu_opts, emu_processarg))
+    {
+        fprintf(stderr, "ERROR: failed to parse options\n");
+        return 1;
+    }
+
+    snprintf(devname, sizeof(devname), "DEVNAME=%s", param.name ? param.name : "wsrsachar");
+    latency = param.latency;
+
+    memset(&ci, 0, sizeof(ci));
+    ci.dev_major = param.major;
+    ci.dev_minor = param.minor;
+    ci.dev_info_argc = 1;
+    ci.dev_info_argv = devinfo;
+    ci.flags = CUSE_UNRESTRICTED_IOCTL;
+
+    return cuse_lowlevel_main(args.argc, args.argv, &ci, &emu_ops, NULL);
+}
@@ -0,0 +1,150 @@
+/**
+ * @file   wsprov.c
+ * @brief  OpenSSL 3 provider for the wscrypto blocks, replacing the wsaes and wssha256 ENGINEs.
+ *
+ * Exposes AES-256-CBC, run on the AES block through libwsaescbc's completion queues, and SHA256,
+ * run through libwssha256ctx on an offload thread. Neither blocks the calling thread inside an
+ * ASYNC_JOB: the job pauses on the operation's eventfd until it completes, so a single-threaded
+ * TLS or IKE server using SSL_MODE_ASYNC can keep many operations in flight. Outside a job the
+ * calls simply block.
+ *
+ * Load it with e.g.
+ *   openssl enc -provider-path /usr/lib/ossl-modules -provider wsprov -provider default \
+ *       -propquery provider=wsprov -aes-256-cbc ...
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#include <openssl/async.h>
+#include <openssl/crypto.h>
+
+#include "wsprov.h"
+
+
+int wsprov_wait(int fd, const void *key)
+{
+    ASYNC_JOB *job = ASYNC_get_current_job();
+
+    if (job != NULL)
+    {
+        ASYNC_WAIT_CTX *waitctx = ASYNC_get_wait_ctx(job);
+        OSSL_ASYNC_FD curfd;
+        void *custom;
+
+        // publish the fd once per operation, the application polls it between resumes
+        if (waitctx != NULL && !ASYNC_WAIT_CTX_get_fd(waitctx, key, &curfd, &custom) &&
+            !ASYNC_WAIT_CTX_set_wait_fd(waitctx, key, fd, NULL, NULL))
+            return 0;
+        return ASYNC_pause_job();
+    }
+
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    while (poll(&pfd, 1, -1) < 0)
+    {
+        if (errno != EINTR)
+            return 0;
+    }
+    return 1;
+}
+
+
+void wsprov_waitdone(const void *key)
+{
+    ASYNC_JOB *job = ASYNC_get_current_job();
+    ASYNC_WAIT_CTX *waitctx;
+
+    if (job != NULL && (waitctx = ASYNC_get_wait_ctx(job)) != NULL)
+        ASYNC_WAIT_CTX_clear_fd(waitctx, key);
+}
+
+
+static const OSSL_ALGORITHM wsprov_ciphers[] = {
+    { "AES-256-CBC:AES256:2.16.840.1.101.3.4.1.42", "provider=" WSPROV_NAME, wsprov_aes256cbc_functions,
+      "AES-256-CBC on the wsaes block" },
+    { NULL, NULL, NULL, NULL }
+};
+
+static const OSSL_ALGORITHM wsprov_digests[] = {
+    { "SHA2-256:SHA-256:SHA256:2.16.840.1.101.3.4.2.1", "provider=" WSPROV_NAME, wsprov_sha256_functions,
+      "SHA256 on the offload thread" },
+    { NULL, NULL, NULL, NULL }
+};
+
+static const OSSL_ALGORITHM *wsprov_query(void *provctx, int operation_id, int *no_cache)
+{
+    *no_cache = 0;
+    switch (operation_id)
+    {
+        case OSSL_OP_CIPHER:
+            return wsprov_ciphers;
+        case OSSL_OP_DIGEST:
+            return wsprov_digests;
+    }
+    return NULL;
+}
+
+static const OSSL_PARAM wsprov_param_types[] = {
+    OSSL_PARAM_DEFN(OSSL_PROV_PARAM_NAME, OSSL_PARAM_UTF8_PTR, NULL, 0),
+    OSSL_PARAM_DEFN(OSSL_PROV_PARAM_VERSION, OSSL_PARAM_UTF8_PTR, NULL, 0),
+    OSSL_PARAM_DEFN(OSSL_PROV_PARAM_BUILDINFO, OSSL_PARAM_UTF8_PTR, NULL, 0),
+    OSSL_PARAM_DEFN(OSSL_PROV_PARAM_STATUS, OSSL_PARAM_INTEGER, NULL, 0),
+    OSSL_PARAM_END
+};
+
+static const OSSL_PARAM *wsprov_gettable_params(void *provctx)
+{
+    return wsprov_param_types;
+}
+
+static int wsprov_get_params(void *provctx, OSSL_PARAM params[])
+{
+    OSSL_PARAM *p;
+
+    p = OSSL_PARAM_locate(params, OSSL_PROV_PARAM_NAME);
+    if (p != NULL && !OSSL_PARAM_set_utf8_ptr(p, "wscrypto hardware provider"))
+        return 0;
+    p = OSSL_PARAM_locate(params, OSSL_PROV_PARAM_VERSION);
+    if (p != NULL && !OSSL_PARAM_set_utf8_ptr(p, WSPROV_VERSION))
+        return 0;
+    p = OSSL_PARAM_locate(params, OSSL_PROV_PARAM_BUILDINFO);
+    if (p != NULL && !OSSL_PARAM_set_utf8_ptr(p, OPENSSL_VERSION_TEXT))
+        return 0;
+    p = OSSL_PARAM_locate(params, OSSL_PROV_PARAM_STATUS);
+    if (p != NULL && !OSSL_PARAM_set_int(p, 1))
+        return 0;
+    return 1;
+}
+
+static void wsprov_teardown(void *provctx)
+{
+    wsprov_ctx_t *ctx = (wsprov_ctx_t *)provctx;
+
+    wsprov_sha256_shutdown();
+    free(ctx);
+}
+
+static const OSSL_DISPATCH wsprov_dispatch[] = {
+    { OSSL_FUNC_PROVIDER_TEARDOWN, (void (*)(void))wsprov_teardown },
+    { OSSL_FUNC_PROVIDER_QUERY_OPERATION, (void (*)(void))wsprov_query },
+    { OSSL_FUNC_PROVIDER_GETTABLE_PARAMS, (void (*)(void))wsprov_gettable_params },
+    { OSSL_FUNC_PROVIDER_GET_PARAMS, (void (*)(void))wsprov_get_params },
+    { 0, NULL }
+};
+
+int OSSL_provider_init(const OSSL_CORE_HANDLE *handle, const OSSL_DISPATCH *in,
+                       const OSSL_DISPATCH **out, void **provctx)
+{
+    wsprov_ctx_t *ctx = calloc(1, sizeof(wsprov_ctx_t));
+
+    if (ctx == NULL)
+        return 0;
+    ctx->handle = handle;
+
+    *out = wsprov_dispatch;
+    *provctx = ctx;
+    return 1;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+/*
+ * wsprov: OpenSSL 3 provider for the wscrypto blocks. Shared between the provider's translation
+ * units only; applications just load the "wsprov" module.
+ */
+
+#include <stdint.h>
+#include <openssl/core.h>
+#include <openssl/core_dispatch.h>
+
+#define WSPROV_NAME "wsprov"
+#define WSPROV_VERSION "0.1"
+
+typedef struct {
+    const OSSL_CORE_HANDLE *handle;
+} wsprov_ctx_t;
+
+extern const OSSL_DISPATCH wsprov_aes256cbc_functions[];
+extern const OSSL_DISPATCH wsprov_sha256_functions[];
+
+/*
+ * Waits until fd is readable. Inside an ASYNC_JOB the job is paused instead, with fd published
+ * in the job's wait context under key, so the application's event loop can get on with other
+ * work and resume the job once fd fires. Returns 0 on failure.
+ */
+int wsprov_wait(int fd, const void *key);
+
+/* Removes the fd published by wsprov_wait() from the current job's wait context, if any */
+void wsprov_waitdone(const void *key);
+
+/* Stops the SHA256 offload thread, from provider teardown */
+void wsprov_sha256_shutdown(void);
@@ -0,0 +1,439 @@
+/**
+ * @file   wsprov_aes.c
+ * @brief  AES-256-CBC for the wsprov provider, on the AES block through libwsaescbc.
+ *
+ * Each cipher context owns a libwsaescbc key context and completion queue. Data is cut into
+ * AESMAXDATASIZE pieces and submitted unpadded; the provider keeps the CBC chaining value and does
+ * the PKCS#7 padding itself, since the EVP interface streams a message over several updates.
+ * Encryption has to go one piece at a time, each piece's IV being the previous piece's last
+ * ciphertext block; decryption knows every IV up front and keeps up to WSPROV_AES_WINDOW pieces
+ * queued on the block at once.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#include <openssl/evp.h>
+
+#include "wsaescbc.h"
+#include "wsprov.h"
+
+#define WSPROV_AES_WINDOW 16
+
+typedef struct {
+    wsprov_ctx_t *provctx;
+    aes256keyctx_t *key;
+    aes256cq_t *cq;
+    int enc;
+    int pad;
+    uint8_t iv[AESIVSIZE];          // chaining value for the next block
+    uint8_t oiv[AESIVSIZE];         // as set at init
+    uint8_t buf[AESBLKSIZE];        // partial block, or the held back last block when decrypting
+    uint32_t buflen;
+} wsprov_aesctx_t;
+
+
+static void *wsprov_aes_newctx(void *provctx)
+{
+    wsprov_aesctx_t *ctx = calloc(1, sizeof(wsprov_aesctx_t));
+
+    if (ctx == NULL)
+        return NULL;
+    ctx->cq = aes256cq_new();
+    if (ctx->cq == NULL)
+    {
+        free(ctx);
+        return NULL;
+    }
+    ctx->provctx = (wsprov_ctx_t *)provctx;
+    ctx->pad = 1;
+    return ctx;
+}
+
+static void wsprov_aes_freectx(void *vctx)
+{
+    wsprov_aesctx_t *ctx = (wsprov_aesctx_t *)vctx;
+
+    if (ctx->key != NULL)
+        aes256keyctx_free(ctx->key);
+    aes256cq_free(ctx->cq);
+    OPENSSL_cleanse(ctx, sizeof(*ctx));
+    free(ctx);
+}
+
+static void *wsprov_aes_dupctx(void *vctx)
+{
+    wsprov_aesctx_t *src = (wsprov_aesctx_t *)vctx;
+    wsprov_aesctx_t *ctx = wsprov_aes_newctx(src->provctx);
+    aes256cq_t *cq;
+
+    if (ctx == NULL)
+        return NULL;
+    cq = ctx->cq;
+    memcpy(ctx, src, sizeof(*ctx));
+    ctx->cq = cq;
+    if (src->key != NULL && (ctx->key = aes256keyctx_new(aes256keyctx_key(src->key))) == NULL)
+    {
+        ctx->key = NULL;
+        wsprov_aes_freectx(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+static int wsprov_aes_init(wsprov_aesctx_t *ctx, int enc, const unsigned char *key, size_t keylen,
+                           const unsigned char *iv, size_t ivlen, const OSSL_PARAM params[]);
+
+static int wsprov_aes_einit(void *vctx, const unsigned char *key, size_t keylen,
+                            const unsigned char *iv, size_t ivlen, const OSSL_PARAM params[])
+{
+    return wsprov_aes_init((wsprov_aesctx_t *)vctx, 1, key, keylen, iv, ivlen, params);
+}
+
+static int wsprov_aes_dinit(void *vctx, const unsigned char *key, size_t keylen,
+                            const unsigned char *iv, size_t ivlen, const OSSL_PARAM params[])
+{
+    return wsprov_aes_init((wsprov_aesctx_t *)vctx, 0, key, keylen, iv, ivlen, params);
+}
+
+static int wsprov_aes_set_ctx_params(void *vctx, const OSSL_PARAM params[]);
+
+static int wsprov_aes_init(wsprov_aesctx_t *ctx, int enc, const unsigned char *key, size_t keylen,
+                           const unsigned char *iv, size_t ivlen, const OSSL_PARAM params[])
+{
+    ctx->enc = enc;
+    ctx->buflen = 0;
+
+    if (key != NULL)
+    {
+        if (keylen != AESKEYSIZE)
+            return 0;
+        if (ctx->key != NULL)
+            aes256keyctx_free(ctx->key);
+        ctx->key = aes256keyctx_new((uint8_t *)key);
+        if (ctx->key == NULL)
+            return 0;
+    }
+    if (iv != NULL)
+    {
+        if (ivlen != AESIVSIZE)
+            return 0;
+        memcpy(ctx->oiv, iv, AESIVSIZE);
+    }
+    memcpy(ctx->iv, ctx->oiv, AESIVSIZE);
+    return wsprov_aes_set_ctx_params(ctx, params);
+}
+
+
+/*
+ * Runs len bytes (a block multiple) through the block, in place if in == out, and advances the
+ * chaining value
+ */
+static int wsprov_aes_blocks(wsprov_aesctx_t *ctx, const uint8_t *in, size_t len, uint8_t *out)
+{
+    uint8_t ivs[WSPROV_AES_WINDOW][AESIVSIZE];
+    uint32_t olens[WSPROV_AES_WINDOW];
+    aes256completion_t comps[WSPROV_AES_WINDOW];
+    int32_t status = 0;
+
+    if (ctx->key == NULL)
+        return 0;
+
+    while (len > 0)
+    {
+        int npieces = 0, ndone = 0;
+        size_t pos = 0;
+
+        // encryption chains piece to piece, so only decryption fills the window
+        while (pos < len && npieces < (ctx->enc ? 1 : WSPROV_AES_WINDOW))
+        {
+            uint32_t n = (len - pos > AESMAXDATASIZE) ? AESMAXDATASIZE : (uint32_t)(len - pos);
+
+            // the IV is copied at submission, the next piece's is saved before an in-place overwrite
+            memcpy(ivs[npieces], ctx->iv, AESIVSIZE);
+            if (!ctx->enc)
+                memcpy(ctx->iv, in + pos + n - AESBLKSIZE, AESIVSIZE);
+            status = aes256cq_submit(ctx->cq, ctx->key, ctx->enc ? (ENCRYPT | AESNOPAD) : DECRYPT,
+                                     ivs[npieces], (uint8_t *)in + pos, n, out + pos, &olens[npieces], NULL);
+            if (status != 0)
+                break;
+            pos += n;
+            npieces++;
+        }
+
+        while (ndone < npieces)
+        {
+            int got = aes256cq_reap(ctx->cq, comps, WSPROV_AES_WINDOW);
+
+            for (int i=0; i<got; i++)
+            {
+                if (comps[i].status != 0 && status == 0)
+                    status = comps[i].status;
+            }
+            ndone += got;
+            if (ndone < npieces && !wsprov_wait(aes256cq_fd(ctx->cq), ctx))
+            {
+                // can't go back to the caller with requests still writing into its buffer
+                status = EIO;
+                while (ndone < npieces)
+                    ndone += aes256cq_reap(ctx->cq, comps, WSPROV_AES_WINDOW);
+            }
+        }
+        wsprov_waitdone(ctx);
+
+        if (status != 0)
+        {
+            fprintf(stderr, "ERROR: wsprov AES request failed: %d\n", status);
+            return 0;
+        }
+        if (ctx->enc)
+            memcpy(ctx->iv, out + pos - AESBLKSIZE, AESIVSIZE);
+        in += pos;
+        out += pos;
+        len -= pos;
+    }
+    return 1;
+}
+
+
+static int wsprov_aes_update(void *vctx, unsigned char *out, size_t *outl, size_t outsize,
+                             const unsigned char *in, size_t inl)
+{
+    wsprov_aesctx_t *ctx = (wsprov_aesctx_t *)vctx;
+    // when decrypting with padding the last full block has to wait for final()
+    int holdback = !ctx->enc && ctx->pad;
+    size_t done = 0, nbulk;
+
+    *outl = 0;
+
+    // complete a partial block left by the previous update first
+    if (ctx->buflen > 0 && (ctx->buflen < AESBLKSIZE || inl > 0))
+    {
+        size_t take = AESBLKSIZE - ctx->buflen;
+
+        if (take > inl)
+            take = inl;
+        memcpy(ctx->buf + ctx->buflen, in, take);
+        ctx->buflen += take;
+        in += take;
+        inl -= take;
+
+        if (ctx->buflen == AESBLKSIZE && !(holdback && inl == 0))
+        {
+            if (outsize < AESBLKSIZE || !wsprov_aes_blocks(ctx, ctx->buf, AESBLKSIZE, out))
+                return 0;
+            ctx->buflen = 0;
+            done = AESBLKSIZE;
+        }
+    }
+
+    nbulk = inl / AESBLKSIZE * AESBLKSIZE;
+    if (holdback && nbulk > 0 && nbulk == inl)
+        nbulk -= AESBLKSIZE;
+    if (nbulk > 0)
+    {
+        if (outsize < done + nbulk || !wsprov_aes_blocks(ctx, in, nbulk, out + done))
+            return 0;
+        done += nbulk;
+    }
+
+    if (inl > nbulk)
+    {
+        memcpy(ctx->buf, in + nbulk, inl - nbulk);
+        ctx->buflen = inl - nbulk;
+    }
+
+    *outl = done;
+    return 1;
+}
+
+
+static int wsprov_aes_final(void *vctx, unsigned char *out, size_t *outl, size_t outsize)
+{
+    wsprov_aesctx_t *ctx = (wsprov_aesctx_t *)vctx;
+    uint8_t last[AESBLKSIZE];
+    uint8_t npad;
+
+    *outl = 0;
+    if (!ctx->pad)
+        return ctx->buflen == 0;
+
+    if (ctx->enc)
+    {
+        npad = AESBLKSIZE - ctx->buflen;
+        memset(ctx->buf + ctx->buflen, npad, npad);
+        if (outsize < AESBLKSIZE || !wsprov_aes_blocks(ctx, ctx->buf, AESBLKSIZE, out))
+            return 0;
+        ctx->buflen = 0;
+        *outl = AESBLKSIZE;
+        return 1;
+    }
+
+    if (ctx->buflen != AESBLKSIZE || !wsprov_aes_blocks(ctx, ctx->buf, AESBLKSIZE, last))
+        return 0;
+    ctx->buflen = 0;
+
+    npad = last[AESBLKSIZE - 1];
+    if (npad == 0 || npad > AESBLKSIZE)
+        return 0;
+    for (int i=AESBLKSIZE - npad; i<AESBLKSIZE; i++)
+    {
+        if (last[i] != npad)
+            return 0;
+    }
+    if (outsize < (size_t)(AESBLKSIZE - npad))
+        return 0;
+    memcpy(out, last, AESBLKSIZE - npad);
+    *outl = AESBLKSIZE - npad;
+    OPENSSL_cleanse(last, sizeof(last));
+    return 1;
+}
+
+
+/*
+ * EVP_Cipher(): whole blocks only, no padding or buffering
+ */
+static int wsprov_aes_cipher(void *vctx, unsigned char *out, size_t *outl, size_t outsize,
+                             const unsigned char *in, size_t inl)
+{
+    wsprov_aesctx_t *ctx = (wsprov_aesctx_t *)vctx;
+
+    if (inl % AESBLKSIZE != 0 || outsize < inl || !wsprov_aes_blocks(ctx, in, inl, out))
+        return 0;
+    *outl = inl;
+    return 1;
+}
+
+
+static int wsprov_aes_get_params(OSSL_PARAM params[])
+{
+    OSSL_PARAM *p;
+
+    if ((p = OSSL_PARAM_locate(params, OSSL_CIPHER_PARAM_MODE)) != NULL && !OSSL_PARAM_set_uint(p, EVP_CIPH_CBC_MODE))
+        return 0;
+    if ((p = OSSL_PARAM_locate(params, OSSL_CIPHER_PARAM_KEYLEN)) != NULL && !OSSL_PARAM_set_size_t(p, AESKEYSIZE))
+        return 0;
+    if ((p = OSSL_PARAM_locate(params, OSSL_CIPHER_PARAM_IVLEN)) != NULL && !OSSL_PARAM_set_size_t(p, AESIVSIZE))
+        return 0;
+    if ((p = OSSL_PARAM_locate(params, OSSL_CIPHER_PARAM_BLOCK_SIZE)) != NULL && !OSSL_PARAM_set_size_t(p, AESBLKSIZE))
+        return 0;
+    if ((p = OSSL_PARAM_locate(params, OSSL_CIPHER_PARAM_AEAD)) != NULL && !OSSL_PARAM_set_int(p, 0))
+        return 0;
+    if ((p = OSSL_PARAM_locate(params, OSSL_CIPHER_PARAM_CUSTOM_IV)) != NULL && !OSSL_PARAM_set_int(p, 0))
+        return 0;
+    if ((p = OSSL_PARAM_locate(params, OSSL_CIPHER_PARAM_CTS)) != NULL && !OSSL_PARAM_set_int(p, 0))
+        return 0;
+    if ((p = OSSL_PARAM_locate(params, OSSL_CIPHER_PARAM_TLS1_MULTIBLOCK)) != NULL && !OSSL_PARAM_set_int(p, 0))
+        return 0;
+    if ((p = OSSL_PARAM_locate(params, OSSL_CIPHER_PARAM_HAS_RAND_KEY)) != NULL && !OSSL_PARAM_set_int(p, 0))
+        return 0;
+    return 1;
+}
+
+static const OSSL_PARAM wsprov_aes_known_params[] = {
+    OSSL_PARAM_uint(OSSL_CIPHER_PARAM_MODE, NULL),
+    OSSL_PARAM_size_t(OSSL_CIPHER_PARAM_KEYLEN, NULL),
+    OSSL_PARAM_size_t(OSSL_CIPHER_PARAM_IVLEN, NULL),
+    OSSL_PARAM_size_t(OSSL_CIPHER_PARAM_BLOCK_SIZE, NULL),
+    OSSL_PARAM_int(OSSL_CIPHER_PARAM_AEAD, NULL),
+    OSSL_PARAM_int(OSSL_CIPHER_PARAM_CUSTOM_IV, NULL),
+    OSSL_PARAM_int(OSSL_CIPHER_PARAM_CTS, NULL),
+    OSSL_PARAM_int(OSSL_CIPHER_PARAM_TLS1_MULTIBLOCK, NULL),
+    OSSL_PARAM_int(OSSL_CIPHER_PARAM_HAS_RAND_KEY, NULL),
+    OSSL_PARAM_END
+};
+
+static const OSSL_PARAM *wsprov_aes_gettable_params(void *provctx)
+{
+    return wsprov_aes_known_params;
+}
+
+static int wsprov_aes_get_ctx_params(void *vctx, OSSL_PARAM params[])
+{
+    wsprov_aesctx_t *ctx = (wsprov_aesctx_t *)vctx;
+    OSSL_PARAM *p;
+
+    if ((p = OSSL_PARAM_locate(params, OSSL_CIPHER_PARAM_KEYLEN)) != NULL && !OSSL_PARAM_set_size_t(p, AESKEYSIZE))
+        return 0;
+    if ((p = OSSL_PARAM_locate(params, OSSL_CIPHER_PARAM_IVLEN)) != NULL && !OSSL_PARAM_set_size_t(p, AESIVSIZE))
+        return 0;
+    if ((p = OSSL_PARAM_locate(params, OSSL_CIPHER_PARAM_PADDING)) != NULL && !OSSL_PARAM_set_uint(p, ctx->pad))
+        return 0;
+    if ((p = OSSL_PARAM_locate(params, OSSL_CIPHER_PARAM_IV)) != NULL &&
+        !OSSL_PARAM_set_octet_string(p, ctx->oiv, AESIVSIZE))
+        return 0;
+    if ((p = OSSL_PARAM_locate(params, OSSL_CIPHER_PARAM_UPDATED_IV)) != NULL &&
+        !OSSL_PARAM_set_octet_string(p, ctx->iv, AESIVSIZE))
+        return 0;
+    return 1;
+}
+
+static int wsprov_aes_set_ctx_params(void *vctx, const OSSL_PARAM params[])
+{
+    wsprov_aesctx_t *ctx = (wsprov_aesctx_t *)vctx;
+    const OSSL_PARAM *p;
+
+    if (params == NULL)
+        return 1;
+    if ((p = OSSL_PARAM_locate_const(params, OSSL_CIPHER_PARAM_PADDING)) != NULL)
+    {
+        unsigned int pad;
+
+        if (!OSSL_PARAM_get_uint(p, &pad))
+            return 0;
+        ctx->pad = pad ? 1 : 0;
+    }
+    if ((p = OSSL_PARAM_locate_const(params, OSSL_CIPHER_PARAM_KEYLEN)) != NULL)
+    {
+        size_t keylen;
+
+        if (!OSSL_PARAM_get_size_t(p, &keylen) || keylen != AESKEYSIZE)
+            return 0;
+    }
+    return 1;
+}
+
+static const OSSL_PARAM wsprov_aes_known_gettable_ctx_params[] = {
+    OSSL_PARAM_size_t(OSSL_CIPHER_PARAM_KEYLEN, NULL),
+    OSSL_PARAM_size_t(OSSL_CIPHER_PARAM_IVLEN, NULL),
+    OSSL_PARAM_uint(OSSL_CIPHER_PARAM_PADDING, NULL),
+    OSSL_PARAM_octet_string(OSSL_CIPHER_PARAM_IV, NULL, 0),
+    OSSL_PARAM_octet_string(OSSL_CIPHER_PARAM_UPDATED_IV, NULL, 0),
+    OSSL_PARAM_END
+};
+
+static const OSSL_PARAM wsprov_aes_known_settable_ctx_params[] = {
+    OSSL_PARAM_uint(OSSL_CIPHER_PARAM_PADDING, NULL),
+    OSSL_PARAM_size_t(OSSL_CIPHER_PARAM_KEYLEN, NULL),
+    OSSL_PARAM_END
+};
+
+static const OSSL_PARAM *wsprov_aes_gettable_ctx_params(void *vctx, void *provctx)
+{
+    return wsprov_aes_known_gettable_ctx_params;
+}
+
+static const OSSL_PARAM *wsprov_aes_settable_ctx_params(void *vctx, void *provctx)
+{
+    return wsprov_aes_known_settable_ctx_params;
+}
+
+const OSSL_DISPATCH wsprov_aes256cbc_functions[] = {
+    { OSSL_FUNC_CIPHER_NEWCTX, (void (*)(void))wsprov_aes_newctx },
+    { OSSL_FUNC_CIPHER_FREECTX, (void (*)(void))wsprov_aes_freectx },
+    { OSSL_FUNC_CIPHER_DUPCTX, (void (*)(void))wsprov_aes_dupctx },
+    { OSSL_FUNC_CIPHER_ENCRYPT_INIT, (void (*)(void))wsprov_aes_einit },
+    { OSSL_FUNC_CIPHER_DECRYPT_INIT, (void (*)(void))wsprov_aes_dinit },
+    { OSSL_FUNC_CIPHER_UPDATE, (void (*)(void))wsprov_aes_update },
+    { OSSL_FUNC_CIPHER_FINAL, (void (*)(void))wsprov_aes_final },
+    { OSSL_FUNC_CIPHER_CIPHER, (void (*)(void))wsprov_aes_cipher },
+    { OSSL_FUNC_CIPHER_GET_PARAMS, (void (*)(void))wsprov_aes_get_params },
+    { OSSL_FUNC_CIPHER_GETTABLE_PARAMS, (void (*)(void))wsprov_aes_gettable_params },
+    { OSSL_FUNC_CIPHER_GET_CTX_PARAMS, (void (*)(void))wsprov_aes_get_ctx_params },
+    { OSSL_FUNC_CIPHER_SET_CTX_PARAMS, (void (*)(void))wsprov_aes_set_ctx_params },
+    { OSSL_FUNC_CIPHER_GETTABLE_CTX_PARAMS, (void (*)(void))wsprov_aes_gettable_ctx_params },
+    { OSSL_FUNC_CIPHER_SETTABLE_CTX_PARAMS, (void (*)(void))wsprov_aes_settable_ctx_params },
+    { 0, NULL }
+};
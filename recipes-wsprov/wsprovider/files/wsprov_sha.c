@@ -0,0 +1,447 @@
+/**
+ * @file   wsprov_sha.c
+ * @brief  SHA256 for the wsprov provider.
+ *
+ * Each context is a libwssha256ctx stream, so any number of EVP_MD_CTXs interleave on whatever
+ * compression engine that library has been given, 64-byte blocks at a time. The stream's midstate
+ * is readable and settable as the "midstate" context parameter, to park a stream and resume it
+ * later.
+ *
+ * Large updates are streamed: they are copied into a small per-context ring of slots and update()
+ * returns as soon as the copy is queued, while an offload thread hashes the slots in order. The
+ * caller can read its next piece of input meanwhile, and memory stays at one ring per context
+ * whatever the message length. update() only waits when every slot is still queued, and final()
+ * waits for the ring to drain; completions come back through a per-context eventfd, so inside an
+ * ASYNC_JOB those waits pause the job just like the AES block does. Short updates on an idle
+ * context and the final padding run inline, where a thread round trip would cost more than the
+ * hashing.
+ *
+ * The exception is a whole message shorter than a block finished inside an ASYNC_JOB, such as a
+ * fingerprint or KDF input on an async server: those are pooled across contexts in a
+ * sha256batchq, so many of them share one engine trip, and the job pauses until its batch is done.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+#include <openssl/evp.h>
+#include <openssl/async.h>
+
+#include "wssha256ctx.h"
+#include "wsprov.h"
+
+#define WSPROV_SHA_PARAM_MIDSTATE "midstate"
+#define WSPROV_SHA_INLINE 4096  // updates shorter than this are not worth offloading
+#define WSPROV_SHA_SLOTS 4
+#define WSPROV_SHA_SLOTSIZE (64 * 1024)
+#define WSPROV_SHA_BATCH 64         // tiny async finals per engine trip
+#define WSPROV_SHA_MINBATCH 4       // fewer than this are hashed on the CPU instead
+#define WSPROV_SHA_BATCHWAIT 50     // microseconds a tiny final waits for company
+
+typedef struct wsprov_shactx wsprov_shactx_t;
+
+// one ring slot waiting for or running on the offload thread
+typedef struct wsprov_shajob {
+    wsprov_shactx_t *ctx;
+    const unsigned char *data;
+    size_t len;
+    struct wsprov_shajob *next;
+} wsprov_shajob_t;
+
+struct wsprov_shactx {
+    wsprov_ctx_t *provctx;
+    sha256ctx_t sha;            // owned by the offload thread while slots are in flight
+    int efd;
+    int status;                 // first error from the offload thread
+    unsigned char *ring;        // WSPROV_SHA_SLOTS slots, allocated on the first large update
+    wsprov_shajob_t jobs[WSPROV_SHA_SLOTS];
+    uint32_t cur;               // slot being filled
+    size_t fill;                // bytes in it
+    uint32_t inflight;          // slots queued ahead of it, oldest at cur - inflight
+    sha256job_t batchjob;       // a tiny final waiting in the batch queue
+};
+
+// offload queue
+static pthread_mutex_t shalock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shacond = PTHREAD_COND_INITIALIZER;
+static wsprov_shajob_t *shahead = NULL;
+static wsprov_shajob_t *shatail = NULL;
+static pthread_t shathread;
+static int sharunning = 0;
+static int shastop = 0;
+static sha256batchq_t *shabatchq = NULL;
+
+
+static void *wsprov_sha_worker(void *arg)
+{
+    wsprov_shajob_t *job;
+    uint64_t one = 1;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&shalock);
+        while (shahead == NULL && !shastop)
+            pthread_cond_wait(&shacond, &shalock);
+        job = shahead;
+        if (job == NULL)
+        {
+            pthread_mutex_unlock(&shalock);
+            break;
+        }
+        shahead = job->next;
+        if (shahead == NULL)
+            shatail = NULL;
+        pthread_mutex_unlock(&shalock);
+
+        int ret = sha256update(&job->ctx->sha, job->data, job->len);
+        if (ret != 0 && job->ctx->status == 0)
+            job->ctx->status = ret;
+        // the context may be freed as soon as its owner has reaped this
+        if (write(job->ctx->efd, &one, sizeof(one)) < 0)
+            perror("wsprov: Error signalling SHA256 completion");
+    }
+    return NULL;
+}
+
+
+/*
+ * Reaps finished slots until at most maxinflight are left, pausing the ASYNC_JOB if in one
+ */
+static void wsprov_sha_reap(wsprov_shactx_t *ctx, uint32_t maxinflight)
+{
+    uint64_t count;
+    int waited = 0;
+
+    while (ctx->inflight > maxinflight)
+    {
+        // the eventfd counts this context's finished slots
+        if (read(ctx->efd, &count, sizeof(count)) == sizeof(count))
+        {
+            ctx->inflight -= (uint32_t)count;
+            continue;
+        }
+        if (errno == EAGAIN && wsprov_wait(ctx->efd, ctx))
+        {
+            waited = 1;
+            continue;
+        }
+        // can't pause: the worker still needs the ring, so wait it out
+        usleep(100);
+    }
+    if (waited)
+        wsprov_waitdone(ctx);
+}
+
+
+/*
+ * Queues the slot being filled on the offload thread and moves on to the next one, waiting for it
+ * to come free if the whole ring is in flight. Without an offload thread the slot is hashed here.
+ */
+static void wsprov_sha_submit(wsprov_shactx_t *ctx)
+{
+    wsprov_shajob_t *job = &ctx->jobs[ctx->cur];
+
+    job->ctx = ctx;
+    job->data = ctx->ring + (size_t)ctx->cur * WSPROV_SHA_SLOTSIZE;
+    job->len = ctx->fill;
+    job->next = NULL;
+
+    pthread_mutex_lock(&shalock);
+    if (!sharunning)
+    {
+        if (pthread_create(&shathread, NULL, wsprov_sha_worker, NULL) != 0)
+        {
+            pthread_mutex_unlock(&shalock);
+            int ret = sha256update(&ctx->sha, job->data, job->len);
+            if (ret != 0 && ctx->status == 0)
+                ctx->status = ret;
+            ctx->fill = 0;
+            return;
+        }
+        sharunning = 1;
+    }
+    if (shatail != NULL)
+        shatail->next = job;
+    else
+        shahead = job;
+    shatail = job;
+    pthread_cond_signal(&shacond);
+    pthread_mutex_unlock(&shalock);
+
+    ctx->inflight++;
+    ctx->cur = (ctx->cur + 1) % WSPROV_SHA_SLOTS;
+    ctx->fill = 0;
+    wsprov_sha_reap(ctx, WSPROV_SHA_SLOTS - 1);
+}
+
+
+/*
+ * Hands back ctx->sha: flushes the partly filled slot and waits for the ring to drain
+ */
+static int wsprov_sha_drain(wsprov_shactx_t *ctx)
+{
+    if (ctx->fill > 0)
+        wsprov_sha_submit(ctx);
+    wsprov_sha_reap(ctx, 0);
+    return ctx->status == 0;
+}
+
+
+/*
+ * Batch queue callback: the final is in, wake its context the same way a ring slot does
+ */
+static void wsprov_sha_batchdone(sha256job_t *job, void *arg)
+{
+    wsprov_shactx_t *ctx = (wsprov_shactx_t *)arg;
+    uint64_t one = 1;
+
+    if (job->status != 0 && ctx->status == 0)
+        ctx->status = job->status;
+    if (write(ctx->efd, &one, sizeof(one)) < 0)
+        perror("wsprov: Error signalling SHA256 completion");
+}
+
+
+/*
+ * Finishes a message that never filled a block through the shared batch queue, pausing the job
+ * until its batch has been through the engine. Returns -1 if the queue can't be used.
+ */
+static int wsprov_sha_batchfinal(wsprov_shactx_t *ctx, unsigned char *out)
+{
+    sha256job_t *job = &ctx->batchjob;
+
+    pthread_mutex_lock(&shalock);
+    if (shabatchq == NULL)
+        shabatchq = sha256batchq_new(WSPROV_SHA_BATCH, WSPROV_SHA_MINBATCH, WSPROV_SHA_BATCHWAIT);
+    pthread_mutex_unlock(&shalock);
+
+    *job = (sha256job_t){ ctx->sha.tail, ctx->sha.taillen, out, 0, wsprov_sha_batchdone, ctx, NULL };
+    if (shabatchq == NULL || sha256batchq_submit(shabatchq, job) != 0)
+        return -1;
+    ctx->inflight++;
+    wsprov_sha_reap(ctx, 0);
+    return ctx->status == 0;
+}
+
+
+void wsprov_sha256_shutdown(void)
+{
+    pthread_mutex_lock(&shalock);
+    sha256batchq_free(shabatchq);
+    shabatchq = NULL;
+    if (!sharunning)
+    {
+        pthread_mutex_unlock(&shalock);
+        return;
+    }
+    shastop = 1;
+    pthread_cond_signal(&shacond);
+    pthread_mutex_unlock(&shalock);
+
+    pthread_join(shathread, NULL);
+    sharunning = 0;
+    shastop = 0;
+}
+
+
+static void *wsprov_sha_newctx(void *provctx)
+{
+    wsprov_ctx_t *pctx = (wsprov_ctx_t *)provctx;
+    wsprov_shactx_t *ctx = calloc(1, sizeof(wsprov_shactx_t));
+
+    if (ctx == NULL)
+        return NULL;
+    ctx->provctx = pctx;
+    ctx->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ctx->efd < 0)
+    {
+        free(ctx);
+        return NULL;
+    }
+    sha256init(&ctx->sha);
+    return ctx;
+}
+
+static void wsprov_sha_freectx(void *vctx)
+{
+    wsprov_shactx_t *ctx = (wsprov_shactx_t *)vctx;
+
+    wsprov_sha_reap(ctx, 0);
+    close(ctx->efd);
+    OPENSSL_cleanse(&ctx->sha, sizeof(ctx->sha));
+    if (ctx->ring != NULL)
+    {
+        OPENSSL_cleanse(ctx->ring, WSPROV_SHA_SLOTS * WSPROV_SHA_SLOTSIZE);
+        free(ctx->ring);
+    }
+    free(ctx);
+}
+
+static void *wsprov_sha_dupctx(void *vctx)
+{
+    wsprov_shactx_t *src = (wsprov_shactx_t *)vctx;
+    wsprov_shactx_t *ctx;
+
+    if (!wsprov_sha_drain(src))
+        return NULL;
+    ctx = wsprov_sha_newctx(src->provctx);
+    if (ctx != NULL)
+        ctx->sha = src->sha;
+    return ctx;
+}
+
+static int wsprov_sha_init(void *vctx, const OSSL_PARAM params[])
+{
+    wsprov_shactx_t *ctx = (wsprov_shactx_t *)vctx;
+
+    // a context reused before its last final() may still have slots in flight
+    wsprov_sha_reap(ctx, 0);
+    ctx->fill = 0;
+    ctx->status = 0;
+    sha256init(&ctx->sha);
+    return 1;
+}
+
+static int wsprov_sha_update(void *vctx, const unsigned char *in, size_t inl)
+{
+    wsprov_shactx_t *ctx = (wsprov_shactx_t *)vctx;
+
+    // short updates on an idle context are cheaper inline than through the ring
+    if (ctx->inflight == 0 && ctx->fill == 0 && inl < WSPROV_SHA_INLINE)
+        return sha256update(&ctx->sha, in, inl) == 0;
+
+    if (ctx->ring == NULL)
+    {
+        ctx->ring = malloc(WSPROV_SHA_SLOTS * WSPROV_SHA_SLOTSIZE);
+        if (ctx->ring == NULL)
+            return sha256update(&ctx->sha, in, inl) == 0;
+    }
+
+    while (inl > 0)
+    {
+        size_t n = WSPROV_SHA_SLOTSIZE - ctx->fill;
+
+        if (n > inl)
+            n = inl;
+        memcpy(ctx->ring + (size_t)ctx->cur * WSPROV_SHA_SLOTSIZE + ctx->fill, in, n);
+        ctx->fill += n;
+        in += n;
+        inl -= n;
+        if (ctx->fill == WSPROV_SHA_SLOTSIZE)
+            wsprov_sha_submit(ctx);
+    }
+    return ctx->status == 0;
+}
+
+static int wsprov_sha_final(void *vctx, unsigned char *out, size_t *outl, size_t outsz)
+{
+    wsprov_shactx_t *ctx = (wsprov_shactx_t *)vctx;
+
+    if (!wsprov_sha_drain(ctx) || outsz < SHA256DIGESTSIZE)
+        return 0;
+    if (ctx->sha.nbytes < SHA256BLKSIZE && ASYNC_get_current_job() != NULL)
+    {
+        int ret = wsprov_sha_batchfinal(ctx, out);
+        if (ret == 0)
+            return 0;
+        if (ret > 0)
+        {
+            *outl = SHA256DIGESTSIZE;
+            return 1;
+        }
+    }
+    if (sha256final(&ctx->sha, out) != 0)
+        return 0;
+    *outl = SHA256DIGESTSIZE;
+    return 1;
+}
+
+static int wsprov_sha_get_params(OSSL_PARAM params[])
+{
+    OSSL_PARAM *p;
+
+    if ((p = OSSL_PARAM_locate(params, OSSL_DIGEST_PARAM_BLOCK_SIZE)) != NULL && !OSSL_PARAM_set_size_t(p, SHA256BLKSIZE))
+        return 0;
+    if ((p = OSSL_PARAM_locate(params, OSSL_DIGEST_PARAM_SIZE)) != NULL && !OSSL_PARAM_set_size_t(p, SHA256DIGESTSIZE))
+        return 0;
+    if ((p = OSSL_PARAM_locate(params, OSSL_DIGEST_PARAM_XOF)) != NULL && !OSSL_PARAM_set_int(p, 0))
+        return 0;
+    if ((p = OSSL_PARAM_locate(params, OSSL_DIGEST_PARAM_ALGID_ABSENT)) != NULL && !OSSL_PARAM_set_int(p, 1))
+        return 0;
+    return 1;
+}
+
+static const OSSL_PARAM wsprov_sha_known_params[] = {
+    OSSL_PARAM_size_t(OSSL_DIGEST_PARAM_BLOCK_SIZE, NULL),
+    OSSL_PARAM_size_t(OSSL_DIGEST_PARAM_SIZE, NULL),
+    OSSL_PARAM_int(OSSL_DIGEST_PARAM_XOF, NULL),
+    OSSL_PARAM_int(OSSL_DIGEST_PARAM_ALGID_ABSENT, NULL),
+    OSSL_PARAM_END
+};
+
+static const OSSL_PARAM *wsprov_sha_gettable_params(void *provctx)
+{
+    return wsprov_sha_known_params;
+}
+
+/*
+ * The midstate can only be read at a block boundary, see sha256export()
+ */
+static int wsprov_sha_get_ctx_params(void *vctx, OSSL_PARAM params[])
+{
+    wsprov_shactx_t *ctx = (wsprov_shactx_t *)vctx;
+    uint8_t state[SHA256STATESIZE];
+    OSSL_PARAM *p;
+
+    if ((p = OSSL_PARAM_locate(params, WSPROV_SHA_PARAM_MIDSTATE)) != NULL &&
+        (!wsprov_sha_drain(ctx) || sha256export(&ctx->sha, state) != 0 || !OSSL_PARAM_set_octet_string(p, state, sizeof(state))))
+        return 0;
+    return 1;
+}
+
+static int wsprov_sha_set_ctx_params(void *vctx, const OSSL_PARAM params[])
+{
+    wsprov_shactx_t *ctx = (wsprov_shactx_t *)vctx;
+    const OSSL_PARAM *p;
+    const void *state;
+    size_t len;
+
+    if (params == NULL)
+        return 1;
+    if ((p = OSSL_PARAM_locate_const(params, WSPROV_SHA_PARAM_MIDSTATE)) != NULL &&
+        (!wsprov_sha_drain(ctx) || !OSSL_PARAM_get_octet_string_ptr(p, &state, &len) ||
+         len != SHA256STATESIZE || sha256import(&ctx->sha, state) != 0))
+        return 0;
+    return 1;
+}
+
+static const OSSL_PARAM wsprov_sha_known_ctx_params[] = {
+    OSSL_PARAM_octet_string(WSPROV_SHA_PARAM_MIDSTATE, NULL, 0),
+    OSSL_PARAM_END
+};
+
+static const OSSL_PARAM *wsprov_sha_ctx_params(void *vctx, void *provctx)
+{
+    return wsprov_sha_known_ctx_params;
+}
+
+const OSSL_DISPATCH wsprov_sha256_functions[] = {
+    { OSSL_FUNC_DIGEST_NEWCTX, (void (*)(void))wsprov_sha_newctx },
+    { OSSL_FUNC_DIGEST_FREECTX, (void (*)(void))wsprov_sha_freectx },
+    { OSSL_FUNC_DIGEST_DUPCTX, (void (*)(void))wsprov_sha_dupctx },
+    { OSSL_FUNC_DIGEST_INIT, (void (*)(void))wsprov_sha_init },
+    { OSSL_FUNC_DIGEST_UPDATE, (void (*)(void))wsprov_sha_update },
+    { OSSL_FUNC_DIGEST_FINAL, (void (*)(void))wsprov_sha_final },
+    { OSSL_FUNC_DIGEST_GET_PARAMS, (void (*)(void))wsprov_sha_get_params },
+    { OSSL_FUNC_DIGEST_GETTABLE_PARAMS, (void (*)(void))wsprov_sha_gettable_params },
+    { OSSL_FUNC_DIGEST_GET_CTX_PARAMS, (void (*)(void))wsprov_sha_get_ctx_params },
+    { OSSL_FUNC_DIGEST_SET_CTX_PARAMS, (void (*)(void))wsprov_sha_set_ctx_params },
+    { OSSL_FUNC_DIGEST_GETTABLE_CTX_PARAMS, (void (*)(void))wsprov_sha_ctx_params },
+    { OSSL_FUNC_DIGEST_SETTABLE_CTX_PARAMS, (void (*)(void))wsprov_sha_ctx_params },
+    { 0, NULL }
+};
@@ -0,0 +1,346 @@
+/**
+ * @file   wsprovtest.c
+ * @brief  Self-checking test for the wsprov provider. Compares its AES-256-CBC and SHA256 against
+ * the default provider over a range of lengths and update splits, and resumes a SHA256 stream from
+ * its exported midstate. Then runs several encryptions as concurrent ASYNC_JOBs from one thread,
+ * polling their wait fds the way an async TLS server would, and checks that they paused and still
+ * produced the right ciphertext.
+ *
+ * usage: wsprovtest [module directory]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <poll.h>
+#include <openssl/evp.h>
+#include <openssl/provider.h>
+#include <openssl/async.h>
+#include <openssl/params.h>
+
+#define NJOBS 8
+#define JOBLEN 4096
+#define MAXLEN (1 << 20)
+
+static OSSL_PROVIDER *wsprov, *deflt;
+static EVP_CIPHER *wsaes, *swaes;
+static EVP_MD *wssha, *swsha;
+
+static const uint8_t key[32] = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+    0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F };
+static const uint8_t iv[16] = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+
+/*
+ * Runs inlen bytes through cipher, feeding it in pieces of at most step bytes
+ */
+static int runcipher(EVP_CIPHER *cipher, int enc, const uint8_t *in, int inlen, int step, uint8_t *out)
+{
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    int outlen = 0, n;
+
+    if (!EVP_CipherInit_ex2(ctx, cipher, key, iv, enc, NULL))
+        return -1;
+    for (int pos=0; pos<inlen; pos+=step)
+    {
+        if (!EVP_CipherUpdate(ctx, out + outlen, &n, in + pos, (inlen - pos < step) ? inlen - pos : step))
+            return -1;
+        outlen += n;
+    }
+    if (!EVP_CipherFinal_ex(ctx, out + outlen, &n))
+        return -1;
+    EVP_CIPHER_CTX_free(ctx);
+    return outlen + n;
+}
+
+static int rundigest(EVP_MD *md, const uint8_t *in, int inlen, int step, uint8_t *out)
+{
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    unsigned int n;
+
+    if (!EVP_DigestInit_ex2(ctx, md, NULL))
+        return -1;
+    for (int pos=0; pos<inlen; pos+=step)
+    {
+        if (!EVP_DigestUpdate(ctx, in + pos, (inlen - pos < step) ? inlen - pos : step))
+            return -1;
+    }
+    if (!EVP_DigestFinal_ex(ctx, out, &n))
+        return -1;
+    EVP_MD_CTX_free(ctx);
+    return (int)n;
+}
+
+static int testaes(uint8_t *msg)
+{
+    static const int lens[] = { 1, 15, 16, 17, 100, 256, 257, 1000, 4096, 65536 + 5 };
+    static const int steps[] = { 1 << 30, 7, 16, 300 };
+    static uint8_t ref[MAXLEN + 16], ct[MAXLEN + 16], pt[MAXLEN + 16];
+
+    for (int l=0; l<sizeof(lens)/sizeof(lens[0]); l++)
+    {
+        for (int s=0; s<sizeof(steps)/sizeof(steps[0]); s++)
+        {
+            int reflen = runcipher(swaes, 1, msg, lens[l], steps[s], ref);
+            int ctlen = runcipher(wsaes, 1, msg, lens[l], steps[s], ct);
+            int ptlen = runcipher(wsaes, 0, ct, ctlen, steps[s], pt);
+
+            if (ctlen != reflen || memcmp(ct, ref, reflen) != 0)
+            {
+                printf("ERROR: AES-256-CBC encryption of %d bytes in steps of %d differs from OpenSSL\n",
+                       lens[l], steps[s]);
+                return -1;
+            }
+            if (ptlen != lens[l] || memcmp(pt, msg, lens[l]) != 0)
+            {
+                printf("ERROR: AES-256-CBC decryption of %d bytes in steps of %d failed\n", lens[l], steps[s]);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int testsha(uint8_t *msg)
+{
+    static const int lens[] = { 0, 3, 64, 1000, 4096, 100000, MAXLEN };
+    static const int steps[] = { 1 << 30, 5000, 64 };
+    uint8_t ref[32], md[32];
+
+    for (int l=0; l<sizeof(lens)/sizeof(lens[0]); l++)
+    {
+        for (int s=0; s<sizeof(steps)/sizeof(steps[0]); s++)
+        {
+            if (rundigest(swsha, msg, lens[l], steps[s], ref) != 32 ||
+                rundigest(wssha, msg, lens[l], steps[s], md) != 32 || memcmp(md, ref, 32) != 0)
+            {
+                printf("ERROR: SHA256 of %d bytes in steps of %d differs from OpenSSL\n", lens[l], steps[s]);
+                return -1;
+            }
+        }
+    }
+
+    // small updates landing behind streamed ones, with a copy taken mid-stream
+    static const int mixed[] = { 70000, 10, 3, 200000, 64, 4096, 1, 150000 };
+    EVP_MD_CTX *m = EVP_MD_CTX_new(), *c;
+    int pos = 0;
+
+    if (!EVP_DigestInit_ex2(m, wssha, NULL))
+        return -1;
+    for (int i=0; i<sizeof(mixed)/sizeof(mixed[0]); i++)
+    {
+        if (!EVP_DigestUpdate(m, msg + pos, mixed[i]))
+            return -1;
+        pos += mixed[i];
+    }
+    c = EVP_MD_CTX_new();
+    if (!EVP_MD_CTX_copy_ex(c, m) || !EVP_DigestUpdate(m, msg + pos, 5) || !EVP_DigestFinal_ex(m, md, NULL) ||
+        rundigest(swsha, msg, pos + 5, pos + 5, ref) != 32 || memcmp(md, ref, 32) != 0 ||
+        !EVP_DigestFinal_ex(c, md, NULL) || rundigest(swsha, msg, pos, pos, ref) != 32 || memcmp(md, ref, 32) != 0)
+    {
+        printf("ERROR: SHA256 over mixed short and streamed updates differs from OpenSSL\n");
+        return -1;
+    }
+    EVP_MD_CTX_free(m);
+    EVP_MD_CTX_free(c);
+
+    // park a stream's midstate after two blocks and finish it in another context
+    EVP_MD_CTX *a = EVP_MD_CTX_new(), *b = EVP_MD_CTX_new();
+    uint8_t state[40];
+    OSSL_PARAM getp[] = { OSSL_PARAM_octet_string("midstate", state, sizeof(state)), OSSL_PARAM_END };
+    OSSL_PARAM setp[] = { OSSL_PARAM_octet_string("midstate", state, sizeof(state)), OSSL_PARAM_END };
+    unsigned int n;
+
+    if (!EVP_DigestInit_ex2(a, wssha, NULL) || !EVP_DigestUpdate(a, msg, 128) ||
+        !EVP_MD_CTX_get_params(a, getp) || !EVP_DigestInit_ex2(b, wssha, NULL) ||
+        !EVP_MD_CTX_set_params(b, setp) || !EVP_DigestUpdate(b, msg + 128, 1000) ||
+        !EVP_DigestFinal_ex(b, md, &n) || rundigest(swsha, msg, 1128, 1128, ref) != 32 ||
+        memcmp(md, ref, 32) != 0)
+    {
+        printf("ERROR: SHA256 stream resumed from its midstate gives the wrong digest\n");
+        return -1;
+    }
+    EVP_MD_CTX_free(a);
+    EVP_MD_CTX_free(b);
+    return 0;
+}
+
+typedef struct {
+    const uint8_t *in;
+    uint8_t out[JOBLEN + 16];
+    int outlen;
+} jobarg_t;
+
+static int asyncencrypt(void *arg)
+{
+    jobarg_t *ja = *(jobarg_t **)arg;
+
+    ja->outlen = runcipher(wsaes, 1, ja->in, JOBLEN, JOBLEN, ja->out);
+    return ja->outlen > 0;
+}
+
+// a 40-byte KDF-style input, short enough to go through the batch queue
+static int asyncdigest(void *arg)
+{
+    jobarg_t *ja = *(jobarg_t **)arg;
+
+    ja->outlen = rundigest(wssha, ja->in, 40, 40, ja->out);
+    return ja->outlen > 0;
+}
+
+/*
+ * Starts NJOBS encryptions (or digests) as ASYNC_JOBs and drives them to completion from this one
+ * thread
+ */
+static int testasync(uint8_t *msg, int digest)
+{
+    static jobarg_t args[NJOBS];
+    static uint8_t ref[JOBLEN + 16];
+    ASYNC_JOB *jobs[NJOBS] = { NULL };
+    ASYNC_WAIT_CTX *waitctx[NJOBS];
+    int done[NJOBS] = { 0 }, ndone = 0, pauses = 0;
+
+    if (!ASYNC_is_capable())
+    {
+        printf("\tASYNC_JOBs not supported on this platform, skipped\n");
+        return 0;
+    }
+
+    for (int j=0; j<NJOBS; j++)
+    {
+        args[j].in = msg + j * JOBLEN;
+        waitctx[j] = ASYNC_WAIT_CTX_new();
+    }
+
+    while (ndone < NJOBS)
+    {
+        struct pollfd pfds[NJOBS];
+        int npfds = 0;
+
+        for (int j=0; j<NJOBS; j++)
+        {
+            jobarg_t *ja = &args[j];
+            int ret;
+
+            if (done[j])
+                continue;
+            switch (ASYNC_start_job(&jobs[j], waitctx[j], &ret, digest ? asyncdigest : asyncencrypt, &ja,
+                                    sizeof(ja)))
+            {
+                case ASYNC_PAUSE:
+                    pauses++;
+                    break;
+                case ASYNC_FINISH:
+                    done[j] = 1;
+                    ndone++;
+                    if (!ret)
+                    {
+                        printf("ERROR: async job %d failed\n", j);
+                        return -1;
+                    }
+                    break;
+                default:
+                    printf("ERROR: can't start async job %d\n", j);
+                    return -1;
+            }
+        }
+
+        // wait for any paused job's fd before resuming them all
+        for (int j=0; j<NJOBS; j++)
+        {
+            OSSL_ASYNC_FD fds[4];
+            size_t nfds = 0;
+
+            if (done[j] || !ASYNC_WAIT_CTX_get_all_fds(waitctx[j], NULL, &nfds) || nfds > 4)
+                continue;
+            ASYNC_WAIT_CTX_get_all_fds(waitctx[j], fds, &nfds);
+            for (size_t f=0; f<nfds; f++)
+            {
+                pfds[npfds].fd = fds[f];
+                pfds[npfds].events = POLLIN;
+                npfds++;
+            }
+        }
+        if (npfds > 0)
+            poll(pfds, npfds, 1000);
+    }
+
+    for (int j=0; j<NJOBS; j++)
+    {
+        int reflen = digest ? rundigest(swsha, args[j].in, 40, 40, ref) : runcipher(swaes, 1, args[j].in, JOBLEN,
+                                                                                 JOBLEN, ref);
+        if (reflen != args[j].outlen || memcmp(ref, args[j].out, args[j].outlen) != 0)
+        {
+            printf("ERROR: async job %d produced the wrong %s\n", j, digest ? "digest" : "ciphertext");
+            return -1;
+        }
+        ASYNC_WAIT_CTX_free(waitctx[j]);
+    }
+    printf("\t%d jobs, %d pauses\n", NJOBS, pauses);
+    if (pauses == 0)
+    {
+        printf("ERROR: no job ever paused\n");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    uint8_t *msg = malloc(MAXLEN);
+
+    if (argc > 1)
+        OSSL_PROVIDER_set_default_search_path(NULL, argv[1]);
+
+    deflt = OSSL_PROVIDER_load(NULL, "default");
+    wsprov = OSSL_PROVIDER_load(NULL, "wsprov");
+    if (msg == NULL || deflt == NULL || wsprov == NULL)
+    {
+        printf("ERROR: failed to load the providers\n");
+        return -1;
+    }
+
+    wsaes = EVP_CIPHER_fetch(NULL, "AES-256-CBC", "provider=wsprov");
+    swaes = EVP_CIPHER_fetch(NULL, "AES-256-CBC", "provider=default");
+    wssha = EVP_MD_fetch(NULL, "SHA256", "provider=wsprov");
+    swsha = EVP_MD_fetch(NULL, "SHA256", "provider=default");
+    if (wsaes == NULL || swaes == NULL || wssha == NULL || swsha == NULL)
+    {
+        printf("ERROR: failed to fetch the algorithms\n");
+        return -1;
+    }
+
+    for (int i=0; i<MAXLEN; i++)
+        msg[i] = (uint8_t)(i * 7 + (i >> 8));
+
+    printf("Checking AES-256-CBC.....\n");
+    if (testaes(msg) != 0)
+        return -1;
+    printf("\tAES-256-CBC Success!\n");
+
+    printf("Checking SHA256.....\n");
+    if (testsha(msg) != 0)
+        return -1;
+    printf("\tSHA256 Success!\n");
+
+    printf("Checking ASYNC_JOB pausing.....\n");
+    if (testasync(msg, 0) != 0)
+        return -1;
+    printf("\tASYNC_JOB Success!\n");
+
+    printf("Checking batched SHA256 in ASYNC_JOBs.....\n");
+    if (testasync(msg, 1) != 0)
+        return -1;
+    printf("\tBatched SHA256 Success!\n");
+
+    EVP_CIPHER_free(wsaes);
+    EVP_CIPHER_free(swaes);
+    EVP_MD_free(wssha);
+    EVP_MD_free(swsha);
+    OSSL_PROVIDER_unload(wsprov);
+    OSSL_PROVIDER_unload(deflt);
+    free(msg);
+    return 0;
+}
@@ -0,0 +1,233 @@
+/**
+ * @file   wsaesbulk.c
+ * @brief  Whole-file AES-256-CBC for libwsaescbc, for backups and log archives.
+ *
+ * Input and output are mapped a window at a time, so neither the file size nor a 32-bit address
+ * space gets in the way, and every piece goes to the device straight from and to the page cache
+ * without a read()/write() copy. The output is the same as openssl enc -aes-256-cbc -K -iv:
+ * PKCS#7 padding, no header.
+ *
+ * Encryption runs the window in AESMAXDATASIZE pieces, each chained from the ciphertext block
+ * before it, so the CBC state carries across pieces and windows. Decryption has no such chain
+ * and each window goes through aes256pardecrypt(), shared between the device and CPU threads.
+ *
+ * While a window is worked on, the kernel is asked to read the next one ahead. Finished windows
+ * are not left in the page cache to push out everything else on the device: the input window is
+ * dropped straight away, the output window is written back asynchronously and dropped one window
+ * later, once that writeback has had time to complete. mmap rules out O_DIRECT, so this is done
+ * with madvise()/posix_fadvise() and sync_file_range().
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "wsaescbc.h"
+
+#define BULKWINDOW (1024 * 1024)
+
+
+/*
+ * Maps len bytes of fd at off, which must be page aligned
+ */
+static uint8_t *aes256bulkmap(int fd, off_t off, size_t len, int prot)
+{
+    void *p = mmap(NULL, len, prot, MAP_SHARED, fd, off);
+
+    if (p == MAP_FAILED)
+    {
+        perror("ERROR: failed to map the file");
+        return NULL;
+    }
+    madvise(p, len, MADV_SEQUENTIAL);
+    return p;
+}
+
+
+/*
+ * Starts writing back a finished output window (none if len is 0), and drops the one before it
+ * from the page cache once its own writeback is done
+ */
+static void aes256bulkflush(int fd, off_t off, size_t len, off_t prevoff, size_t prevlen)
+{
+    if (len > 0)
+        sync_file_range(fd, off, len, SYNC_FILE_RANGE_WRITE);
+    if (prevlen > 0)
+    {
+        sync_file_range(fd, prevoff, prevlen,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(fd, prevoff, prevlen, POSIX_FADV_DONTNEED);
+    }
+}
+
+
+/*
+ * Encrypts len bytes from in to out in AESMAXDATASIZE pieces, chaining from iv. With last set the
+ * final piece is padded.
+ */
+static int32_t aes256bulkenc(aes256keyctx_t *ctx, uint8_t *iv, const uint8_t *in, uint8_t *out,
+                             size_t len, int last)
+{
+    size_t pos = 0;
+    uint32_t piece, olen;
+    int32_t ret;
+
+    while (pos < len)
+    {
+        int mode = ENCRYPT | AESNOPAD;
+
+        piece = (len - pos > AESMAXDATASIZE) ? AESMAXDATASIZE : len - pos;
+        if (last && pos + piece == len)
+            mode = ENCRYPT;
+        ret = aes256ctx(ctx, mode, iv, (uint8_t *)&in[pos], piece, &out[pos], &olen);
+        if (ret != 0)
+            return ret;
+        memcpy(iv, &out[pos + olen - AESBLKSIZE], AESIVSIZE);
+        pos += piece;
+    }
+    return 0;
+}
+
+
+/*
+ * Encrypts or decrypts all of infd into outfd, which is truncated to fit and must be open for
+ * reading and writing. Both must be regular files: the size comes from fstat() and the data is
+ * mapped, neither of which works on a pipe or a terminal, so anything else is EINVAL. window is the number of bytes mapped at a time (0 for the default, rounded
+ * to whole pages); ncpu is the number of CPU threads helping the device decrypt. ivp is left
+ * holding the last ciphertext block. On a decryption whose padding is wrong, EBADMSG.
+ */
+int32_t aes256file(aes256keyctx_t *ctx, int mode, uint8_t *ivp, int infd, int outfd, uint32_t window, int ncpu)
+{
+    long pagesize = sysconf(_SC_PAGESIZE);
+    off_t insize, outsize, off, prevoff = 0;
+    size_t prevlen = 0;
+    uint8_t iv[AESIVSIZE];
+    struct stat st;
+    int32_t ret = 0;
+
+    if (mode != ENCRYPT && mode != DECRYPT)
+    {
+        fprintf(stderr, "ERROR: invalid mode. Must be either ENCRYPT or DECRYPT\n");
+        return EINVAL;
+    }
+    if (fstat(infd, &st) < 0)
+        return errno;
+    if (!S_ISREG(st.st_mode))
+    {
+        fprintf(stderr, "ERROR: input is not a regular file\n");
+        return EINVAL;
+    }
+    insize = st.st_size;
+    if (mode == DECRYPT && (insize == 0 || insize % AESBLKSIZE != 0))
+    {
+        fprintf(stderr, "ERROR: encrypted file of %lld bytes, not whole blocks\n", (long long)insize);
+        return EINVAL;
+    }
+
+    if (fstat(outfd, &st) < 0)
+        return errno;
+    if (!S_ISREG(st.st_mode))
+    {
+        fprintf(stderr, "ERROR: output is not a regular file\n");
+        return EINVAL;
+    }
+
+    if (window == 0)
+        window = BULKWINDOW;
+    window = (window + pagesize - 1) / pagesize * pagesize;
+    memcpy(iv, ivp, AESIVSIZE);
+
+    // room for the padding block when encrypting; decryption cuts it off at the end
+    outsize = (mode == ENCRYPT) ? (insize / AESBLKSIZE + 1) * AESBLKSIZE : insize;
+    if (ftruncate(outfd, outsize) < 0)
+        return errno;
+    posix_fadvise(infd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (insize == 0)
+    {
+        // nothing but a padding block
+        uint8_t pad[AESBLKSIZE];
+        uint32_t olen;
+
+        memset(pad, AESBLKSIZE, sizeof(pad));
+        ret = aes256ctx(ctx, ENCRYPT | AESNOPAD, iv, pad, AESBLKSIZE, pad, &olen);
+        if (ret == 0 && pwrite(outfd, pad, AESBLKSIZE, 0) != AESBLKSIZE)
+            ret = errno ? errno : EIO;
+        if (ret == 0)
+            memcpy(ivp, pad, AESIVSIZE);
+        return ret;
+    }
+
+    for (off=0; off<insize && ret==0; off+=window)
+    {
+        size_t len = (insize - off > window) ? window : insize - off;
+        int last = (off + len == insize);
+        size_t outlen = last ? outsize - off : len;
+        uint8_t *in, *out;
+
+        // read the next window ahead while this one is worked on
+        if (!last)
+            posix_fadvise(infd, off + len, (insize - off - len > window) ? window : insize - off - len,
+                          POSIX_FADV_WILLNEED);
+
+        in = aes256bulkmap(infd, off, len, PROT_READ);
+        out = aes256bulkmap(outfd, off, outlen, PROT_READ | PROT_WRITE);
+        if (in == NULL || out == NULL)
+        {
+            if (in != NULL)
+                munmap(in, len);
+            if (out != NULL)
+                munmap(out, outlen);
+            ret = ENOMEM;
+            break;
+        }
+
+        if (mode == ENCRYPT)
+            ret = aes256bulkenc(ctx, iv, in, out, len, last);
+        else
+        {
+            uint8_t nextiv[AESIVSIZE];
+            uint32_t olen;
+
+            memcpy(nextiv, &in[len - AESBLKSIZE], AESIVSIZE);
+            ret = aes256pardecrypt(ctx, iv, in, len, out, &olen, ncpu);
+            memcpy(iv, nextiv, AESIVSIZE);
+
+            if (ret == 0 && last)
+            {
+                // check the padding in constant time over the last block
+                uint8_t padlen = out[len - 1], bad = (padlen == 0) | (padlen > AESBLKSIZE);
+
+                for (int i=0; i<AESBLKSIZE; i++)
+                    bad |= (i >= AESBLKSIZE - padlen) & (out[len - AESBLKSIZE + i] != padlen);
+                if (bad)
+                    ret = EBADMSG;
+                else
+                    outsize -= padlen;
+            }
+        }
+
+        munmap(in, len);
+        munmap(out, outlen);
+        posix_fadvise(infd, off, len, POSIX_FADV_DONTNEED);
+        aes256bulkflush(outfd, off, outlen, prevoff, prevlen);
+        prevoff = off;
+        prevlen = outlen;
+    }
+
+    // no plaintext is left behind from a file that did not decrypt
+    if (mode == DECRYPT && ftruncate(outfd, (ret == 0) ? outsize : 0) < 0 && ret == 0)
+        ret = errno;
+    if (ret == 0)
+    {
+        aes256bulkflush(outfd, 0, 0, prevoff, prevlen);
+        memcpy(ivp, iv, AESIVSIZE);
+    }
+    return ret;
+}
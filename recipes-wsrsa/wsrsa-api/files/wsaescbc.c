@@ -7,6 +7,15 @@
  * string to the LKM and reads the response from the LKM. For this example to work the device
  * must be called /dev/wsaeschar.
  * @see http://www.derekmolloy.ie/ for a full description and follow-up descriptions.
+ *
+ * The AES block holds a single key, IV and mode at a time, so all device access goes through one
+ * worker thread. Callers from any thread queue requests carrying their own key and IV, and the
+ * worker drains the queue in batches. Other processes, the broker and the kernel's own crypto
+ * users load keys into the same block, so the worker loads the key and IV afresh for every
+ * batch and only skips the reload for later requests of that batch whose key or IV is the same.
+ *
+ * Small requests from aes256() are not worth that round trip and run on the software
+ * implementation in wsaessw.c instead; see aes256usesw() for the crossover model.
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,22 +24,166 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
 
 #include "wsaescbc.h"
 #include "wsaeskern.h"
+#include "wsaessw.h"
+
+// USDT probes under the "wsaescbc" provider, for perf and bpftrace. Without <sys/sdt.h> they
+// compile to nothing.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define WSAES_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef WSAES_HAVE_SDT
+#define WSAES_PROBE(name)              DTRACE_PROBE(wsaescbc, name)
+#define WSAES_PROBE1(name, a)          DTRACE_PROBE1(wsaescbc, name, a)
+#define WSAES_PROBE2(name, a, b)       DTRACE_PROBE2(wsaescbc, name, a, b)
+#else
+#define WSAES_PROBE(name)              do { } while (0)
+#define WSAES_PROBE1(name, a)          do { (void)(a); } while (0)
+#define WSAES_PROBE2(name, a, b)       do { (void)(a); (void)(b); } while (0)
+#endif
 
+// WSAES_DEVICE in the environment overrides this, e.g. to point at the CUSE emulator
 static const char *devicefname = "/dev/wsaeschar";
 
+// key and IV set by aes256setkey()/aes256setiv() belong to the calling thread
+static __thread uint8_t threadkey[AESKEYSIZE];
+static __thread uint8_t threadiv[AESIVSIZE];
+static __thread aes256swkey_t threadks;  // threadkey expanded for the software path
+static __thread int threadksvalid = 0;
+static __thread int threadkeyset = 0;    // aes256setkey() called from this thread
+static __thread int threadivset = 0;     // aes256setiv() called from this thread
+
+// A key context, for callers juggling many keys (one per tunnel): the key plus its schedule
+// for the software path, expanded once up front
+struct aes256keyctx {
+    uint8_t key[AESKEYSIZE];
+    aes256swkey_t ks;
+};
+
+// A completion queue for event-driven callers: finished requests are collected here and
+// announced through an eventfd
+struct aes256cqentry {
+    aes256completion_t comp;
+    aes256cq_t *cq;
+    struct aes256cqentry *next;
+};
+
+struct aes256cq {
+    int efd;
+    pthread_mutex_t lock;
+    struct aes256cqentry *head;
+    struct aes256cqentry *tail;
+    int inflight;  // submitted and not yet reaped
+    int ready;     // completed and not yet reaped
+};
+
+// A queued request. The key and IV are copied in at submission time, so the caller is free to
+// change them again before the request runs
+struct aes256req {
+    int mode;
+    uint8_t key[AESKEYSIZE];
+    uint8_t iv[AESIVSIZE];
+    uint8_t *inp;
+    uint32_t inlen;
+    uint8_t *outp;
+    uint32_t *lenp;
+    aes256cb_t cb;
+    void *cbarg;
+    int32_t status;
+    int done;
+    double submitns;  // for the queue wait counter
+    struct aes256req *next;
+};
+
+// submission queue shared by the callers and the device worker
+static pthread_mutex_t qlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t qcond = PTHREAD_COND_INITIALIZER;    // signalled when work is queued
+static pthread_cond_t donecond = PTHREAD_COND_INITIALIZER; // signalled when a request completes
+static aes256req_t *qhead = NULL;
+static aes256req_t *qtail = NULL;
+static pthread_t workerthread;
+static int workerrunning = 0;
+static int workerstop = 0;
+static int qdepth = 0;  // requests submitted but not yet completed
+
+// Finished requests kept for reuse, so steady-state traffic does not go through malloc. Protected
+// by qlock.
+#define REQCACHEMAX 64
+static aes256req_t *reqcache = NULL;
+static int reqcached = 0;
+
+// Device state as last loaded by the worker, which is the only thread touching these. RESET
+// restarts chaining from the loaded IV without changing it, so the IV survives a request too.
+// Only trusted within one batch: between batches anyone else may have reprogrammed the block.
+static int devfd = -1;
+static int devkeyvalid = 0;
+static int devivvalid = 0;
+static uint8_t devkey[AESKEYSIZE];
+static uint8_t deviv[AESIVSIZE];
+static aes256cachestats_t cachestats;
+
+// Per-process performance counters, see aes256perfstats()
+static aes256perfstats_t perf;
+
+#define PERFADD(field, n) __atomic_add_fetch(&perf.field, (n), __ATOMIC_RELAXED)
+
+// Crossover model filled in by aes256init(). A hardware request costs a fixed round trip plus a
+// per-block cost, and first waits for everything already queued ahead of it. Software costs a
+// per-block amount only. Until calibrated, everything goes to the hardware.
+static struct {
+    int calibrated;
+    double hwfixedns;
+    double hwblockns;
+    double swencns;
+    double swdecns;
+} xover;
+
+static void *aes256worker(void *arg);
+static int32_t aes256run(int fd, aes256req_t *req);
+static int32_t aes256loadstate(int fd, aes256req_t *req);
+static void aes256calibrate(void);
+static double nowns(void);
+static void aes256reqrelease(aes256req_t *req);
+
+
+/*
+ * Picks up $WSAES_DEVICE. Also done by the worker, for callers that never call aes256init()
+ */
+static void aes256devicename(void)
+{
+    const char *envdev = getenv("WSAES_DEVICE");
+
+    if (envdev != NULL && envdev[0] != '\0')
+        devicefname = envdev;
+}
+
+
 /*
  *
  */
 int32_t aes256init(void)
 {
+    aes256devicename();
+
     printf("Checking for kernel module...\n");
     if( access( devicefname, F_OK ) != -1 ) 
     {
         printf("Found device!\n");
+        aes256calibrate();
+        if (xover.calibrated && aes256crossover() == UINT32_MAX)
+            printf("Software AES is faster than the device at every size\n");
+        else if (xover.calibrated)
+            printf("Software/hardware crossover at %u bytes\n", aes256crossover());
         return 0;
     } 
     else 
@@ -42,100 +195,986 @@ int32_t aes256init(void)
 
 
 /*
- *
+ * Sets the key used by subsequent aes256() calls from this thread
  */
 int32_t aes256setkey(uint8_t *keyp)
 {
-    int fd, ret = 0;
-    
-    // Open the device with read/write access
-    fd = open("/dev/wsaeschar", O_RDWR);             
-    if (fd < 0){
-        perror("ERROR: Failed to open the device...");
-        return errno;
+    memcpy(threadkey, keyp, AESKEYSIZE);
+    threadksvalid = 0;
+    threadkeyset = 1;
+    return 0;
+}
+
+
+/*
+ * Sets the IV used by subsequent aes256() calls from this thread
+ */
+int32_t aes256setiv(uint8_t *ivp)
+{
+    memcpy(threadiv, ivp, AESIVSIZE);
+    threadivset = 1;
+    return 0;
+}
+
+
+/*
+ * Checks that the calling thread has set whatever of its key and IV a request is about to use. A
+ * thread that never did would otherwise run under an all-zero key or IV without any error.
+ */
+static int32_t aes256thread(int needkey, int neediv)
+{
+    if ((needkey && !threadkeyset) || (neediv && !threadivset))
+    {
+        fprintf(stderr, "ERROR: no %s set from this thread, see aes256setkey()/aes256setiv()\n",
+                (needkey && !threadkeyset) ? "key" : "IV");
+        return EINVAL;
     }
+    return 0;
+}
 
-    //printf("setting key\n");
-    ret = ioctl(fd, IOCTL_SET_MODE, SET_KEY); // switch mode 
-    if (ret < 0) {
-        perror("Failed to set mode.");
-        return errno;
+
+/*
+ * Argument checks shared by the hardware and software paths
+ */
+static int32_t aes256checkargs(int mode, uint32_t inlen)
+{
+    // check bounds against max length 
+    if (inlen > AESMAXDATASIZE)
+    {
+        fprintf(stderr, "ERROR: Provided data length (%d) too large, must be less than %d bytes\n",
+                inlen, AESMAXDATASIZE);
+        return -1;
     }
-    ret = write(fd, keyp, AESKEYSIZE); // write key 
-    if (ret < 0) {
-        perror("Failed to write KEY to the device.");
-        return errno;
+    else if (0 >= inlen)
+    {
+        fprintf(stderr, "ERROR: Provided data length (%d) too small, must be at least 1 bytes\n",
+                inlen);
+        return -1;
     }
 
-    // close and exit
-    if(close(fd)<0)
-        perror("aescbc: Error closing file");
+    if ((mode & ~AESNOPAD) != ENCRYPT && (mode & ~AESNOPAD) != DECRYPT)
+    {
+        fprintf(stderr, "ERROR: invalid mode. Must be either ENCRYPT or DECRYPT\n");
+        return -1;
+    }
+
+    if ((mode & AESNOPAD) && inlen % AESBLKSIZE != 0)
+    {
+        fprintf(stderr, "ERROR: Provided data length (%d) must be a multiple of %d bytes without padding\n",
+                inlen, AESBLKSIZE);
+        return -1;
+    }
+
+    // the device moves whole blocks, so a partial one would be read and written past the buffers
+    if ((mode & ~AESNOPAD) == DECRYPT && inlen % AESBLKSIZE != 0)
+    {
+        fprintf(stderr, "ERROR: Provided data length (%d) must be a multiple of %d bytes to decrypt\n",
+                inlen, AESBLKSIZE);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Takes a request from the cache, or allocates one
+ */
+static aes256req_t *aes256reqnew(void)
+{
+    aes256req_t *req;
+
+    pthread_mutex_lock(&qlock);
+    req = reqcache;
+    if (req != NULL)
+    {
+        reqcache = req->next;
+        reqcached--;
+    }
+    pthread_mutex_unlock(&qlock);
+    if (req == NULL)
+    {
+        req = malloc(sizeof(aes256req_t));
+        if (req != NULL)
+            PERFADD(reqallocs, 1);
+    }
+    return req;
+}
+
+
+/*
+ * Appends the n linked requests first..last to the device queue in one go, starting the worker
+ * if needed
+ */
+static int32_t aes256enqueue(aes256req_t *first, aes256req_t *last, int n)
+{
+    int32_t ret;
+
+    pthread_mutex_lock(&qlock);
+    if (!workerrunning)
+    {
+        ret = pthread_create(&workerthread, NULL, aes256worker, NULL);
+        if (ret != 0)
+        {
+            pthread_mutex_unlock(&qlock);
+            fprintf(stderr, "ERROR: failed to start AES worker thread\n");
+            return ret;
+        }
+        workerrunning = 1;
+    }
+    if (qtail != NULL)
+        qtail->next = first;
+    else
+        qhead = first;
+    qtail = last;
+    __atomic_add_fetch(&qdepth, n, __ATOMIC_RELAXED);
+    pthread_cond_signal(&qcond);
+    pthread_mutex_unlock(&qlock);
 
     return 0;
 }
 
 
+/*
+ * Queues a request for the device worker and returns without waiting for it. A NULL keyp/ivp
+ * uses the value set from the calling thread, EINVAL if it has not set one. Buffers must stay
+ * valid until completion.
+ */
+int32_t aes256submit(int mode, uint8_t *keyp, uint8_t *ivp, uint8_t *inp, uint32_t inlen,
+                     uint8_t *outp, uint32_t *lenp, aes256cb_t cb, void *cbarg, aes256req_t **reqp)
+{
+    aes256req_t *req;
+    int32_t ret;
+
+    ret = aes256checkargs(mode, inlen);
+    if (ret != 0)
+        return ret;
+    ret = aes256thread(keyp == NULL, ivp == NULL);
+    if (ret != 0)
+        return ret;
+
+    req = aes256reqnew();
+    if (req == NULL)
+        return ENOMEM;
+
+    req->mode = mode;
+    memcpy(req->key, keyp ? keyp : threadkey, AESKEYSIZE);
+    memcpy(req->iv, ivp ? ivp : threadiv, AESIVSIZE);
+    req->inp = inp;
+    req->inlen = inlen;
+    req->outp = outp;
+    req->lenp = lenp;
+    req->cb = cb;
+    req->cbarg = cbarg;
+    req->status = 0;
+    req->done = 0;
+    req->submitns = nowns();
+    req->next = NULL;
+    if (reqp != NULL)
+        *reqp = req;
+
+    ret = aes256enqueue(req, req, 1);
+    if (ret != 0)
+        aes256reqrelease(req);
+    return ret;
+}
+
+
+/*
+ * Blocks until a request submitted without a callback completes, then releases it
+ */
+int32_t aes256wait(aes256req_t *req)
+{
+    int32_t status;
+
+    pthread_mutex_lock(&qlock);
+    while (!req->done)
+        pthread_cond_wait(&donecond, &qlock);
+    status = req->status;
+    pthread_mutex_unlock(&qlock);
+
+    aes256reqrelease(req);
+    return status;
+}
+
+
+/*
+ * Puts a finished request back in the cache, or frees it if the cache is full
+ */
+static void aes256reqrelease(aes256req_t *req)
+{
+    pthread_mutex_lock(&qlock);
+    if (reqcached < REQCACHEMAX)
+    {
+        req->next = reqcache;
+        reqcache = req;
+        reqcached++;
+        req = NULL;
+    }
+    pthread_mutex_unlock(&qlock);
+    free(req);
+}
+
+
+/*
+ * Decides whether a request of inlen bytes finishes sooner in software than on the hardware,
+ * given the requests currently queued for the device
+ */
+static int aes256usesw(int mode, uint32_t inlen)
+{
+    uint32_t nblocks = (mode == ENCRYPT) ? inlen / AESBLKSIZE + 1 : (inlen + AESBLKSIZE - 1) / AESBLKSIZE;
+    int pending;
+    double hwns, swns;
+
+    if (!xover.calibrated)
+        return 0;
+
+    pending = __atomic_load_n(&qdepth, __ATOMIC_RELAXED);
+    hwns = xover.hwfixedns * (1 + pending) + xover.hwblockns * nblocks;
+    swns = (((mode & ~AESNOPAD) == ENCRYPT) ? xover.swencns : xover.swdecns) * nblocks;
+    return swns < hwns;
+}
+
+
+/*
+ * Smallest encryption input, in bytes, that is faster on an idle hardware block than in software
+ */
+uint32_t aes256crossover(void)
+{
+    uint32_t nblocks;
+
+    if (!xover.calibrated)
+        return 0;
+    if (xover.swencns <= xover.hwblockns)
+        return UINT32_MAX;
+
+    // encrypting inlen bytes takes inlen/16 + 1 blocks
+    nblocks = (uint32_t)(xover.hwfixedns / (xover.swencns - xover.hwblockns)) + 1;
+    return (nblocks - 1) * AESBLKSIZE;
+}
+
+
+/*
+ * Runs a request synchronously on whichever path aes256usesw() picks
+ */
+static int32_t aes256dispatch(int mode, uint8_t *keyp, const aes256swkey_t *ks, uint8_t *ivp,
+                              uint8_t *inp, uint32_t inlen, uint8_t *outp, uint32_t *lenp)
+{
+    aes256req_t *req;
+    int32_t ret;
+
+    if (aes256usesw(mode, inlen))
+    {
+        double t;
+
+        ret = aes256checkargs(mode, inlen);
+        if (ret != 0)
+            return ret;
+
+        WSAES_PROBE2(sw__start, mode, inlen);
+        t = nowns();
+        ret = aes256sw(mode, ks, ivp, inp, inlen, outp, lenp);
+        PERFADD(phasens[AESPHASE_SOFTWARE], (uint64_t)(nowns() - t));
+        PERFADD(swcalls, 1);
+        PERFADD(bytesin, inlen);
+        if (ret == 0)
+            PERFADD(bytesout, *lenp);
+        else
+            PERFADD(errors, 1);
+        WSAES_PROBE1(sw__done, ret);
+        return ret;
+    }
+
+    ret = aes256submit(mode, keyp, ivp, inp, inlen, outp, lenp, NULL, NULL, &req);
+    if (ret != 0)
+        return ret;
+
+    return aes256wait(req);
+}
+
+
 /*
  *
  */
-int32_t aes256setiv(uint8_t *ivp)
+int32_t aes256(int mode, uint8_t *inp, uint32_t inlen, uint8_t *outp, uint32_t *lenp)
 {
-    int fd, ret = 0;
-    // Open the device with read/write access
-    fd = open("/dev/wsaeschar", O_RDWR);             
-    if (fd < 0){
-        perror("ERROR: Failed to open the device...");
-        return errno;
+    int32_t ret = aes256thread(1, 1);
+
+    if (ret != 0)
+        return ret;
+    if (!threadksvalid)
+    {
+        aes256sw_expandkey(&threadks, threadkey);
+        threadksvalid = 1;
     }
+    return aes256dispatch(mode, threadkey, &threadks, threadiv, inp, inlen, outp, lenp);
+}
 
-    //printf("setting IV\n");
-    ret = ioctl(fd, IOCTL_SET_MODE, SET_IV); // switch mode 
-    if (ret < 0) {
-        perror("Failed to set mode.");
-        return errno;
+
+/*
+ * Creates a context for one key. Contexts are independent of the per-thread key and can be
+ * shared between threads.
+ */
+aes256keyctx_t *aes256keyctx_new(uint8_t *keyp)
+{
+    aes256keyctx_t *ctx = malloc(sizeof(aes256keyctx_t));
+    if (ctx == NULL)
+        return NULL;
+
+    memcpy(ctx->key, keyp, AESKEYSIZE);
+    aes256sw_expandkey(&ctx->ks, keyp);
+    return ctx;
+}
+
+
+uint8_t *aes256keyctx_key(aes256keyctx_t *ctx)
+{
+    return ctx->key;
+}
+
+
+void aes256keyctx_free(aes256keyctx_t *ctx)
+{
+    if (ctx == NULL)
+        return;
+    memset(ctx, 0, sizeof(aes256keyctx_t));
+    free(ctx);
+}
+
+
+/*
+ * Same as aes256(), using the key held by ctx and an explicit IV
+ */
+int32_t aes256ctx(aes256keyctx_t *ctx, int mode, uint8_t *ivp, uint8_t *inp, uint32_t inlen,
+                  uint8_t *outp, uint32_t *lenp)
+{
+    return aes256dispatch(mode, ctx->key, &ctx->ks, ivp, inp, inlen, outp, lenp);
+}
+
+
+// A pipeline in flight: its records report here, and the last one to finish wakes the caller
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t left;
+} aes256pipe_t;
+
+typedef struct {
+    aes256pipe_t *pipe;
+    aes256pipebuf_t *buf;
+} aes256pipeent_t;
+
+static void aes256pipecomplete(aes256req_t *req, int32_t status, void *arg)
+{
+    aes256pipeent_t *ent = (aes256pipeent_t *)arg;
+    aes256pipe_t *pipe = ent->pipe;
+
+    ent->buf->status = status;
+    pthread_mutex_lock(&pipe->lock);
+    if (--pipe->left == 0)
+        pthread_cond_signal(&pipe->cond);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+
+/*
+ * Runs n records as one batch on the device and waits for all of them
+ */
+int32_t aes256pipeline(aes256keyctx_t *ctx, int mode, aes256pipebuf_t *bufs, uint32_t n)
+{
+    aes256pipe_t pipe = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, n };
+    aes256pipeent_t ents[AESMAXPIPELINE];
+    aes256req_t *first = NULL, *last = NULL, *req;
+    double t = nowns();
+    int32_t ret;
+
+    if (n == 0)
+        return 0;
+    if (n > AESMAXPIPELINE)
+    {
+        fprintf(stderr, "ERROR: pipeline of %u records, at most %d supported\n", n, AESMAXPIPELINE);
+        return EINVAL;
     }
-    ret = write(fd, ivp, AESIVSIZE); // write IV
-    if (ret < 0) {
-        perror("Failed to write IV to the device.");
-        return errno;
+
+    // check everything before queueing anything, so a bad record fails the call as a whole
+    for (uint32_t i=0; i<n; i++)
+    {
+        ret = aes256checkargs(mode, bufs[i].inlen);
+        if (ret != 0)
+            return ret;
     }
-    
-    // close and exit
-    if(close(fd)<0)
-        perror("aescbc: Error closing file");
 
+    for (uint32_t i=0; i<n; i++)
+    {
+        req = aes256reqnew();
+        if (req == NULL)
+        {
+            for (req = first; req != NULL; req = first)
+            {
+                first = req->next;
+                aes256reqrelease(req);
+            }
+            return ENOMEM;
+        }
+
+        ents[i].pipe = &pipe;
+        ents[i].buf = &bufs[i];
+        bufs[i].status = EINPROGRESS;
+        req->mode = mode;
+        memcpy(req->key, ctx->key, AESKEYSIZE);
+        memcpy(req->iv, bufs[i].ivp, AESIVSIZE);
+        req->inp = bufs[i].inp;
+        req->inlen = bufs[i].inlen;
+        req->outp = bufs[i].outp;
+        req->lenp = &bufs[i].outlen;
+        req->cb = aes256pipecomplete;
+        req->cbarg = &ents[i];
+        req->status = 0;
+        req->done = 0;
+        req->submitns = t;
+        req->next = NULL;
+        if (last != NULL)
+            last->next = req;
+        else
+            first = req;
+        last = req;
+    }
+
+    ret = aes256enqueue(first, last, n);
+    if (ret != 0)
+    {
+        for (req = first; req != NULL; req = first)
+        {
+            first = req->next;
+            aes256reqrelease(req);
+        }
+        return ret;
+    }
+
+    pthread_mutex_lock(&pipe.lock);
+    while (pipe.left > 0)
+        pthread_cond_wait(&pipe.cond, &pipe.lock);
+    pthread_mutex_unlock(&pipe.lock);
+
+    for (uint32_t i=0; i<n; i++)
+    {
+        if (bufs[i].status != 0)
+            return bufs[i].status;
+    }
     return 0;
 }
 
 
+uint32_t aes256queued(void)
+{
+    return __atomic_load_n(&qdepth, __ATOMIC_RELAXED);
+}
+
+
 /*
- * 
+ * Snapshot of how often requests found their key/IV already loaded in the device by an earlier
+ * request of the same batch
  */
-int32_t aes256(int mode, uint8_t *inp, uint32_t inlen, uint8_t *outp, uint32_t *lenp) 
+void aes256cachestats(aes256cachestats_t *stats)
 {
-    int32_t fd, ret;
+    stats->keyhits = __atomic_load_n(&cachestats.keyhits, __ATOMIC_RELAXED);
+    stats->keymisses = __atomic_load_n(&cachestats.keymisses, __ATOMIC_RELAXED);
+    stats->ivhits = __atomic_load_n(&cachestats.ivhits, __ATOMIC_RELAXED);
+    stats->ivmisses = __atomic_load_n(&cachestats.ivmisses, __ATOMIC_RELAXED);
+}
 
-    // check bounds against max length 
-    if (inlen > AESMAXDATASIZE)
+
+/*
+ * Copies the per-process performance counters. They are updated with relaxed atomics, so a copy
+ * taken while requests are running may be off by the requests in progress.
+ */
+void aes256perfstats(aes256perfstats_t *stats)
+{
+    uint64_t *dst = (uint64_t *)stats;
+    uint64_t *src = (uint64_t *)&perf;
+
+    for (size_t i=0; i<sizeof(perf)/sizeof(uint64_t); i++)
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+}
+
+
+void aes256perfreset(void)
+{
+    uint64_t *p = (uint64_t *)&perf;
+
+    for (size_t i=0; i<sizeof(perf)/sizeof(uint64_t); i++)
+        __atomic_store_n(&p[i], 0, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Prints the counters to stderr, with the average time per call of each phase
+ */
+void aes256perfdump(void)
+{
+    static const char *phasenames[AESNUMPHASES] = {
+        "queue wait", "open", "key/iv load", "reset+mode", "padding", "block i/o", "software"
+    };
+    aes256perfstats_t s;
+
+    aes256perfstats(&s);
+    fprintf(stderr, "libwsaescbc: %llu hardware calls, %llu software calls, %llu errors\n",
+            (unsigned long long)s.hwcalls, (unsigned long long)s.swcalls, (unsigned long long)s.errors);
+    fprintf(stderr, "libwsaescbc: %llu bytes in, %llu bytes out, %llu device syscalls, %llu request allocations\n",
+            (unsigned long long)s.bytesin, (unsigned long long)s.bytesout, (unsigned long long)s.syscalls,
+            (unsigned long long)s.reqallocs);
+    for (int p=0; p<AESNUMPHASES; p++)
     {
-        fprintf(stderr, "ERROR: Provided data length (%d) too large, must be less than %d bytes\n",
-                inlen, AESMAXDATASIZE);
-        return -1;
+        uint64_t calls = (p == AESPHASE_SOFTWARE) ? s.swcalls : s.hwcalls;
+        fprintf(stderr, "libwsaescbc: %-12s %14.3f ms total %10.2f us/call\n", phasenames[p],
+                s.phasens[p] / 1e6, calls ? s.phasens[p] / 1e3 / calls : 0.0);
     }
-    else if (0 >= inlen)
+}
+
+
+/*
+ * Creates a completion queue. Its eventfd becomes readable whenever completions are waiting.
+ */
+aes256cq_t *aes256cq_new(void)
+{
+    aes256cq_t *cq = calloc(1, sizeof(aes256cq_t));
+    if (cq == NULL)
+        return NULL;
+
+    cq->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (cq->efd < 0)
     {
-        fprintf(stderr, "ERROR: Provided data length (%d) too small, must be at least 1 bytes\n",
-                inlen);
+        perror("ERROR: failed to create completion eventfd");
+        free(cq);
+        return NULL;
+    }
+    pthread_mutex_init(&cq->lock, NULL);
+    return cq;
+}
+
+
+/*
+ * Releases a completion queue. Fails with EBUSY while requests are still outstanding.
+ */
+int32_t aes256cq_free(aes256cq_t *cq)
+{
+    pthread_mutex_lock(&cq->lock);
+    if (cq->inflight > 0)
+    {
+        pthread_mutex_unlock(&cq->lock);
+        return EBUSY;
+    }
+    pthread_mutex_unlock(&cq->lock);
+
+    close(cq->efd);
+    pthread_mutex_destroy(&cq->lock);
+    free(cq);
+    return 0;
+}
+
+
+int aes256cq_fd(aes256cq_t *cq)
+{
+    return cq->efd;
+}
+
+
+/*
+ * Worker callback: files the completion on its queue and bumps the eventfd. Both happen under the
+ * queue's lock, as once the entry is visible a reaper may take it and free the queue, and
+ * aes256cq_free() takes the lock before it closes the eventfd.
+ */
+static void aes256cqcomplete(aes256req_t *req, int32_t status, void *arg)
+{
+    struct aes256cqentry *ent = (struct aes256cqentry *)arg;
+    aes256cq_t *cq = ent->cq;
+    uint64_t one = 1;
+
+    ent->comp.status = status;
+
+    pthread_mutex_lock(&cq->lock);
+    if (cq->tail != NULL)
+        cq->tail->next = ent;
+    else
+        cq->head = ent;
+    cq->tail = ent;
+    cq->ready++;
+    if (write(cq->efd, &one, sizeof(one)) < 0)
+        perror("aescbc: Error signalling completion eventfd");
+    pthread_mutex_unlock(&cq->lock);
+}
+
+
+/*
+ * Queues a request on the device and returns immediately. Its completion, tagged with userdata,
+ * is later returned by aes256cq_reap(). Buffers must stay valid until then.
+ */
+int32_t aes256cq_submit(aes256cq_t *cq, aes256keyctx_t *ctx, int mode, uint8_t *ivp, uint8_t *inp,
+                        uint32_t inlen, uint8_t *outp, uint32_t *lenp, void *userdata)
+{
+    struct aes256cqentry *ent;
+    int32_t ret;
+
+    ent = malloc(sizeof(struct aes256cqentry));
+    if (ent == NULL)
+        return ENOMEM;
+    ent->comp.userdata = userdata;
+    ent->comp.status = 0;
+    ent->cq = cq;
+    ent->next = NULL;
+
+    pthread_mutex_lock(&cq->lock);
+    cq->inflight++;
+    pthread_mutex_unlock(&cq->lock);
+
+    ret = aes256submit(mode, ctx->key, ivp, inp, inlen, outp, lenp, aes256cqcomplete, ent, NULL);
+    if (ret != 0)
+    {
+        pthread_mutex_lock(&cq->lock);
+        cq->inflight--;
+        pthread_mutex_unlock(&cq->lock);
+        free(ent);
+    }
+    return ret;
+}
+
+
+/*
+ * Non-blocking: copies up to max finished requests into comps and returns how many. Leaves the
+ * eventfd readable if more are still waiting.
+ */
+int aes256cq_reap(aes256cq_t *cq, aes256completion_t *comps, int max)
+{
+    struct aes256cqentry *ent;
+    uint64_t count, left;
+    int n = 0;
+
+    // reset the counter first, so a completion racing with us re-arms it
+    if (read(cq->efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("aescbc: Error reading completion eventfd");
+
+    pthread_mutex_lock(&cq->lock);
+    while (n < max && cq->head != NULL)
+    {
+        ent = cq->head;
+        cq->head = ent->next;
+        if (cq->head == NULL)
+            cq->tail = NULL;
+        comps[n++] = ent->comp;
+        free(ent);
+    }
+    cq->ready -= n;
+    cq->inflight -= n;
+    left = cq->ready;
+    pthread_mutex_unlock(&cq->lock);
+
+    if (left > 0 && write(cq->efd, &left, sizeof(left)) < 0)
+        perror("aescbc: Error signalling completion eventfd");
+
+    return n;
+}
+
+
+/*
+ * A slice of a large CBC decryption handled by one CPU thread
+ */
+typedef struct {
+    const aes256swkey_t *ks;
+    uint8_t iv[AESIVSIZE];  // ciphertext block preceding the slice
+    uint8_t *inp;
+    uint8_t *outp;
+    uint32_t len;
+} aes256slice_t;
+
+static void *aes256slicethread(void *arg)
+{
+    aes256slice_t *sl = (aes256slice_t *)arg;
+    uint32_t olen;
+
+    aes256sw(DECRYPT, sl->ks, sl->iv, sl->inp, sl->len, sl->outp, &olen);
+    return NULL;
+}
+
+
+/*
+ * Bytes of an inlen byte decryption to give the hardware so it finishes together with ncpu
+ * software threads, from the calibrated per-block costs. Hardware requests carry at most
+ * AESMAXDATASIZE bytes, so their fixed cost is spread over that many blocks.
+ */
+static uint32_t aes256hwshare(uint32_t inlen, int ncpu)
+{
+    uint32_t nblocks = inlen / AESBLKSIZE;
+    double hwrate, swrate;
+
+    if (ncpu <= 0)
+        return inlen;
+    if (!xover.calibrated)
+        return (nblocks / (ncpu + 1)) * AESBLKSIZE;
+
+    hwrate = 1.0 / (xover.hwblockns + xover.hwfixedns / (AESMAXDATASIZE / AESBLKSIZE));
+    swrate = ncpu / xover.swdecns;
+    return (uint32_t)(nblocks * hwrate / (hwrate + swrate)) * AESBLKSIZE;
+}
+
+
+/*
+ * CBC decryption of a large buffer split between the hardware block and ncpu CPU threads. Each
+ * plaintext block only depends on two ciphertext blocks, so the buffer is cut into ranges that
+ * each start from the ciphertext block before them as IV. The hardware takes the leading range
+ * in AESMAXDATASIZE requests queued back to back, the CPU threads share the rest. inlen must be
+ * a multiple of the block size; inp and outp may be the same buffer. No padding is removed.
+ */
+int32_t aes256pardecrypt(aes256keyctx_t *ctx, uint8_t *ivp, uint8_t *inp, uint32_t inlen,
+                         uint8_t *outp, uint32_t *lenp, int ncpu)
+{
+    uint32_t hwlen, swlen, pos, chunk, nreqs = 0;
+    uint32_t *olens = NULL;
+    aes256req_t **reqs = NULL;
+    aes256slice_t slices[ncpu > 0 ? ncpu : 1];
+    pthread_t tids[ncpu > 0 ? ncpu : 1];
+    int started[ncpu > 0 ? ncpu : 1];
+    int32_t ret = 0, status;
+    int nslices = 0;
+
+    if (inlen == 0 || inlen % AESBLKSIZE != 0)
+    {
+        fprintf(stderr, "ERROR: Provided data length (%d) must be a non-zero multiple of %d bytes\n",
+                inlen, AESBLKSIZE);
         return -1;
     }
+    if (ncpu < 0)
+        ncpu = 0;
 
-    // Open the device with read/write access
-    fd = open("/dev/wsaeschar", O_RDWR);             
-    if (fd < 0){
-        perror("ERROR: Failed to open the device...");
-        return errno;
+    *lenp = inlen;
+    hwlen = aes256hwshare(inlen, ncpu);
+    swlen = inlen - hwlen;
+
+    if (hwlen > 0)
+    {
+        uint32_t maxreqs = (hwlen + AESMAXDATASIZE - 1) / AESMAXDATASIZE;
+        olens = malloc(maxreqs * sizeof(uint32_t));
+        reqs = malloc(maxreqs * sizeof(aes256req_t *));
+        if (olens == NULL || reqs == NULL)
+        {
+            free(olens);
+            free(reqs);
+            return ENOMEM;
+        }
+    }
+
+    // Capture every range's starting IV before anything runs, in case of in-place decryption
+    if (swlen > 0)
+    {
+        uint32_t nblocks = swlen / AESBLKSIZE;
+        uint32_t per = nblocks / ncpu, extra = nblocks % ncpu;
+
+        pos = hwlen;
+        for (int t=0; t<ncpu; t++)
+        {
+            uint32_t len = (per + (t < extra ? 1 : 0)) * AESBLKSIZE;
+            if (len == 0)
+                continue;
+            slices[nslices].ks = &ctx->ks;
+            memcpy(slices[nslices].iv, (pos == 0) ? ivp : &inp[pos - AESBLKSIZE], AESIVSIZE);
+            slices[nslices].inp = &inp[pos];
+            slices[nslices].outp = &outp[pos];
+            slices[nslices].len = len;
+            nslices++;
+            pos += len;
+        }
+    }
+
+    // Queue the hardware range; each request takes its IV from the ciphertext at submission
+    for (pos=0; pos<hwlen; pos+=chunk)
+    {
+        chunk = (hwlen - pos < AESMAXDATASIZE) ? hwlen - pos : AESMAXDATASIZE;
+        ret = aes256submit(DECRYPT, ctx->key, (pos == 0) ? ivp : &inp[pos - AESBLKSIZE], &inp[pos],
+                           chunk, &outp[pos], &olens[nreqs], NULL, NULL, &reqs[nreqs]);
+        if (ret != 0)
+            break;
+        nreqs++;
+    }
+
+    // The calling thread takes the first CPU slice itself, and any slice no thread could be
+    // started for
+    started[0] = 0;
+    for (int t=1; t<nslices; t++)
+        started[t] = (pthread_create(&tids[t], NULL, aes256slicethread, &slices[t]) == 0);
+    for (int t=0; t<nslices; t++)
+    {
+        if (!started[t])
+            aes256slicethread(&slices[t]);
+    }
+    for (int t=1; t<nslices; t++)
+    {
+        if (started[t])
+            pthread_join(tids[t], NULL);
+    }
+
+    for (uint32_t r=0; r<nreqs; r++)
+    {
+        status = aes256wait(reqs[r]);
+        if (ret == 0)
+            ret = status;
+    }
+
+    free(olens);
+    free(reqs);
+    return ret;
+}
+
+
+/*
+ * Stops the device worker once the queue has drained. A later submission restarts it.
+ */
+void aes256shutdown(void)
+{
+    pthread_mutex_lock(&qlock);
+    if (!workerrunning)
+    {
+        pthread_mutex_unlock(&qlock);
+        return;
+    }
+    workerstop = 1;
+    pthread_cond_signal(&qcond);
+    pthread_mutex_unlock(&qlock);
+
+    pthread_join(workerthread, NULL);
+
+    pthread_mutex_lock(&qlock);
+    workerrunning = 0;
+    workerstop = 0;
+    pthread_mutex_unlock(&qlock);
+
+    if (getenv("WSAES_PERFDUMP") != NULL)
+        aes256perfdump();
+}
+
+
+/*
+ * Hands a finished request back to its owner: either through the callback, after which the
+ * request is released, or by waking whoever is blocked in aes256wait()
+ */
+static void aes256complete(aes256req_t *req, int32_t status)
+{
+    __atomic_sub_fetch(&qdepth, 1, __ATOMIC_RELAXED);
+
+    if (req->cb != NULL)
+    {
+        req->cb(req, status, req->cbarg);
+        aes256reqrelease(req);
+        return;
+    }
+
+    pthread_mutex_lock(&qlock);
+    req->status = status;
+    req->done = 1;
+    pthread_cond_broadcast(&donecond);
+    pthread_mutex_unlock(&qlock);
+}
+
+
+/*
+ * Device worker: takes everything queued so far as one batch and runs it back to back. The
+ * device stays open until aes256shutdown(), but the block is not ours alone, so what was loaded
+ * into it is forgotten at the start of every batch.
+ */
+static void *aes256worker(void *arg)
+{
+    aes256req_t *batch, *req, *next;
+    int openerr = 0;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&qlock);
+        while (qhead == NULL && !workerstop)
+            pthread_cond_wait(&qcond, &qlock);
+        if (qhead == NULL)
+        {
+            pthread_mutex_unlock(&qlock);
+            break;
+        }
+        batch = qhead;
+        qhead = qtail = NULL;
+        pthread_mutex_unlock(&qlock);
+
+        // Open the device with read/write access
+        if (devfd < 0)
+        {
+            double t = nowns();
+
+            WSAES_PROBE(open__start);
+            aes256devicename();
+            devfd = open(devicefname, O_RDWR);
+            openerr = errno;
+            if (devfd < 0)
+                perror("ERROR: Failed to open the device...");
+            PERFADD(syscalls, 1);
+            PERFADD(phasens[AESPHASE_OPEN], (uint64_t)(nowns() - t));
+            WSAES_PROBE1(open__done, devfd);
+        }
+        devkeyvalid = devivvalid = 0;
+
+        for (req = batch; req != NULL; req = next)
+        {
+            int32_t status;
+
+            PERFADD(phasens[AESPHASE_QUEUE], (uint64_t)(nowns() - req->submitns));
+            WSAES_PROBE2(request__start, req->mode, req->inlen);
+            status = (devfd < 0) ? openerr : aes256run(devfd, req);
+
+            PERFADD(hwcalls, 1);
+            PERFADD(bytesin, req->inlen);
+            if (status == 0)
+                PERFADD(bytesout, *req->lenp);
+            else
+                PERFADD(errors, 1);
+            WSAES_PROBE1(request__done, status);
+
+            // a failed request leaves the block in an unknown state, reload everything next time
+            if (status != 0)
+                devkeyvalid = devivvalid = 0;
+            next = req->next;
+            aes256complete(req, status);
+        }
     }
 
+    // close and exit
+    if (devfd >= 0 && close(devfd) < 0)
+        perror("aescbc: Error closing file");
+    devfd = -1;
+
+    return NULL;
+}
+
+
+/*
+ * Loads the request's key and IV into the block, unless already there, and runs its data
+ * through it
+ */
+static int32_t aes256run(int fd, aes256req_t *req)
+{
+    int mode = req->mode & ~AESNOPAD;
+    int pad = (req->mode == ENCRYPT);
+    uint8_t *inp = req->inp;
+    uint32_t inlen = req->inlen;
+    uint8_t *outp = req->outp;
+    uint32_t *lenp = req->lenp;
+    int32_t ret;
+    double t0, t1;
+
+    t0 = nowns();
+    WSAES_PROBE(loadstate__start);
+    ret = aes256loadstate(fd, req);
+    t1 = nowns();
+    PERFADD(phasens[AESPHASE_LOADSTATE], (uint64_t)(t1 - t0));
+    WSAES_PROBE1(loadstate__done, ret);
+    if (ret != 0)
+        return ret;
+
+    WSAES_PROBE1(setmode__start, mode);
+    PERFADD(syscalls, 2);
+
     // Reset block 
     ret = ioctl(fd, IOCTL_SET_MODE, RESET); 
     if (ret < 0) {
@@ -144,25 +1183,21 @@ int32_t aes256(int mode, uint8_t *inp, uint32_t inlen, uint8_t *outp, uint32_t *
     }
 
     // Set mode to ENCRYPT/DECRYPT
-    if (mode != ENCRYPT && mode != DECRYPT)
-    {
-        fprintf(stderr, "ERROR: invalid mode. Must be either ENCRYPT or DECRYPT\n");
-        return -1;
-    }
-    else
-    {
-        ret = ioctl(fd, IOCTL_SET_MODE, (ciphermode_t)mode); 
-        if (ret < 0) {
-            perror("ERROR: failed to set mode, ioctl returns errno \n");
-            return errno;
-        }
+    ret = ioctl(fd, IOCTL_SET_MODE, (ciphermode_t)mode);
+    if (ret < 0) {
+        perror("ERROR: failed to set mode, ioctl returns errno \n");
+        return errno;
     }
+    t0 = nowns();
+    PERFADD(phasens[AESPHASE_SETMODE], (uint64_t)(t0 - t1));
+    WSAES_PROBE(setmode__done);
+    WSAES_PROBE1(pad__start, pad);
 
     int orignumbytes; // The original number of bytes in the input data
     uint8_t lastblock[AESBLKSIZE]; // the last block to send if we are encrypting ONLY.  
 
     // if we are encrypting the data, we must deal with padding the data to encrypt
-    if (mode == ENCRYPT)
+    if (pad)
     {
         int modlen = inlen % AESBLKSIZE;     // number of data bytes in last block
         int numpadbytes = AESBLKSIZE-modlen; // number of padding bytes in last block
@@ -189,8 +1224,12 @@ int32_t aes256(int mode, uint8_t *inp, uint32_t inlen, uint8_t *outp, uint32_t *
         orignumbytes = inlen;
     }
 
-    // initialize output memory to all zeros
-    memset((void*)outp,0,*lenp);
+    // every output byte is written below, and inp may be outp, so no clearing here
+    t1 = nowns();
+    PERFADD(phasens[AESPHASE_PAD], (uint64_t)(t1 - t0));
+    WSAES_PROBE(pad__done);
+    WSAES_PROBE1(blockio__start, *lenp / AESBLKSIZE);
+    PERFADD(syscalls, 2 * (*lenp / AESBLKSIZE));
    
     // MAIN DATA SENDING LOOP: 
     // send each complete 16-byte block of data to the LKM for processing and read back the result
@@ -212,7 +1251,7 @@ int32_t aes256(int mode, uint8_t *inp, uint32_t inlen, uint8_t *outp, uint32_t *
     }    
 
     // if we are encrypting the data, deal with the extra padding bytes
-    if (mode == ENCRYPT)
+    if (pad)
     {
         // send final padded block
         ret = write(fd, lastblock, AESBLKSIZE); 
@@ -228,13 +1267,129 @@ int32_t aes256(int mode, uint8_t *inp, uint32_t inlen, uint8_t *outp, uint32_t *
         }
     }
 
-    // close and exit
-    if(close(fd)<0)
+    PERFADD(phasens[AESPHASE_BLOCKIO], (uint64_t)(nowns() - t1));
+    WSAES_PROBE1(blockio__done, *lenp / AESBLKSIZE);
+    return 0;
+}
+
+
+static double nowns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/*
+ * Times a one block and a full size request on both paths to fit the crossover model. Best of
+ * several runs, to keep scheduler noise out of the fixed cost.
+ */
+static void aes256calibrate(void)
+{
+    static uint8_t zeros[AESKEYSIZE];
+    uint8_t in[AESMAXDATASIZE] = { 0 }, out[AESMAXDATASIZE + AESBLKSIZE];
+    const uint32_t nblocks = AESMAXDATASIZE / AESBLKSIZE;
+    double hw1 = 1e18, hwn = 1e18, swenc = 1e18, swdec = 1e18, t;
+    aes256swkey_t ks;
+    aes256req_t *req;
+    uint32_t olen;
+
+    xover.calibrated = 0;
+    aes256sw_expandkey(&ks, zeros);
+
+    for (int rep=0; rep<8; rep++)
     {
-        perror("aescbc: Error closing file");
-        return errno;
+        t = nowns();
+        if (aes256submit(DECRYPT, zeros, zeros, in, AESBLKSIZE, out, &olen, NULL, NULL, &req) != 0 ||
+            aes256wait(req) != 0)
+            return;
+        t = nowns() - t;
+        hw1 = (t < hw1) ? t : hw1;
+
+        t = nowns();
+        if (aes256submit(DECRYPT, zeros, zeros, in, AESMAXDATASIZE, out, &olen, NULL, NULL, &req) != 0 ||
+            aes256wait(req) != 0)
+            return;
+        t = nowns() - t;
+        hwn = (t < hwn) ? t : hwn;
+
+        t = nowns();
+        aes256sw(ENCRYPT, &ks, zeros, in, AESMAXDATASIZE - 1, out, &olen);
+        t = nowns() - t;
+        swenc = (t < swenc) ? t : swenc;
+
+        t = nowns();
+        aes256sw(DECRYPT, &ks, zeros, in, AESMAXDATASIZE, out, &olen);
+        t = nowns() - t;
+        swdec = (t < swdec) ? t : swdec;
     }
 
-    return 0;
+    xover.hwblockns = (hwn - hw1) / (nblocks - 1);
+    xover.hwfixedns = hw1 - xover.hwblockns;
+    if (xover.hwfixedns < 0)
+        xover.hwfixedns = 0;
+    xover.swencns = swenc / nblocks;
+    xover.swdecns = swdec / nblocks;
+    xover.calibrated = 1;
+
+    // the counters are for the application's traffic, not ours
+    aes256perfreset();
 }
 
+
+/*
+ * Writes the request's key and IV to the block where they differ from what it already holds
+ */
+static int32_t aes256loadstate(int fd, aes256req_t *req)
+{
+    int32_t ret;
+
+    if (devkeyvalid && memcmp(devkey, req->key, AESKEYSIZE) == 0)
+    {
+        __atomic_add_fetch(&cachestats.keyhits, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_add_fetch(&cachestats.keymisses, 1, __ATOMIC_RELAXED);
+        PERFADD(syscalls, 2);
+
+        ret = ioctl(fd, IOCTL_SET_MODE, SET_KEY); // switch mode
+        if (ret < 0) {
+            perror("Failed to set mode.");
+            return errno;
+        }
+        ret = write(fd, req->key, AESKEYSIZE); // write key
+        if (ret < 0) {
+            perror("Failed to write KEY to the device.");
+            return errno;
+        }
+        memcpy(devkey, req->key, AESKEYSIZE);
+        devkeyvalid = 1;
+    }
+
+    if (devivvalid && memcmp(deviv, req->iv, AESIVSIZE) == 0)
+    {
+        __atomic_add_fetch(&cachestats.ivhits, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_add_fetch(&cachestats.ivmisses, 1, __ATOMIC_RELAXED);
+        PERFADD(syscalls, 2);
+
+        ret = ioctl(fd, IOCTL_SET_MODE, SET_IV); // switch mode
+        if (ret < 0) {
+            perror("Failed to set mode.");
+            return errno;
+        }
+        ret = write(fd, req->iv, AESIVSIZE); // write IV
+        if (ret < 0) {
+            perror("Failed to write IV to the device.");
+            return errno;
+        }
+        memcpy(deviv, req->iv, AESIVSIZE);
+        devivvalid = 1;
+    }
+
+    return 0;
+}
@@ -12,7 +12,228 @@
 
 typedef enum { RESET = 0, ENCRYPT, DECRYPT, SET_IV, SET_KEY } ciphermode_t;
 
+/* OR into ENCRYPT for input that is already a block multiple and must not get a padding block,
+ * e.g. all but the last piece of a message encrypted in several calls */
+#define AESNOPAD 0x100
+
+/* Uses $WSAES_DEVICE instead of /dev/wsaeschar when it is set */
 int32_t aes256init(void);
+/* Key and IV for aes256() from the calling thread only; aes256() fails with EINVAL in a thread
+ * that has not set both */
 int32_t aes256setkey(uint8_t *keyp);
 int32_t aes256setiv(uint8_t *ivp); 
+/* outp may be the same buffer as inp; for ENCRYPT it needs room for a padding block */
 int32_t aes256(int mode,uint8_t *inp, uint32_t inlen,uint8_t *outp,uint32_t *outlenp);
+
+/* Input size (bytes) above which aes256() prefers the idle hardware over software, 0 if uncalibrated */
+uint32_t aes256crossover(void);
+
+/*
+ * Thread-safe request queue. All device access is serialized through a single worker thread;
+ * the key and IV set above are per-thread and travel with each request.
+ */
+typedef struct aes256req aes256req_t;
+typedef void (*aes256cb_t)(aes256req_t *req, int32_t status, void *arg);
+
+int32_t aes256submit(int mode, uint8_t *keyp, uint8_t *ivp, uint8_t *inp, uint32_t inlen,
+                     uint8_t *outp, uint32_t *outlenp, aes256cb_t cb, void *cbarg, aes256req_t **reqp);
+int32_t aes256wait(aes256req_t *req);
+void aes256shutdown(void);
+
+/*
+ * Key contexts for callers with many keys, e.g. one per IPsec SA. Within a batch of queued
+ * requests the device only reloads its key or IV when a request's differs from the one before.
+ */
+typedef struct aes256keyctx aes256keyctx_t;
+
+typedef struct {
+    uint64_t keyhits;
+    uint64_t keymisses;
+    uint64_t ivhits;
+    uint64_t ivmisses;
+} aes256cachestats_t;
+
+aes256keyctx_t *aes256keyctx_new(uint8_t *keyp);
+void aes256keyctx_free(aes256keyctx_t *ctx);
+uint8_t *aes256keyctx_key(aes256keyctx_t *ctx);
+int32_t aes256ctx(aes256keyctx_t *ctx, int mode, uint8_t *ivp, uint8_t *inp, uint32_t inlen,
+                  uint8_t *outp, uint32_t *outlenp);
+void aes256cachestats(aes256cachestats_t *stats);
+
+/*
+ * Pipelined records under one key, each with its own IV and buffers, e.g. the TLS records or ESP
+ * packets of one write. All of them go onto the device queue at once, so the worker runs them
+ * back to back with the key loaded once and a single wakeup each way. Always uses the hardware.
+ * Each record gets its own status and output length; returns the first failure.
+ */
+#define AESMAXPIPELINE 32       // as OpenSSL's SSL_MAX_PIPELINES
+
+typedef struct {
+    uint8_t *ivp;
+    uint8_t *inp;
+    uint32_t inlen;
+    uint8_t *outp;
+    uint32_t outlen;
+    int32_t status;
+} aes256pipebuf_t;
+
+int32_t aes256pipeline(aes256keyctx_t *ctx, int mode, aes256pipebuf_t *bufs, uint32_t n);
+
+/*
+ * Per-process counters, cheap enough to leave on. Phase times are summed nanoseconds; syscalls
+ * counts the open/ioctl/read/write calls made on the device. Setting WSAES_PERFDUMP dumps them
+ * to stderr from aes256shutdown(). The same phases are marked by USDT probes (provider
+ * "wsaescbc") when built with <sys/sdt.h>.
+ */
+typedef enum {
+    AESPHASE_QUEUE = 0,   // submitted until the worker picked it up
+    AESPHASE_OPEN,        // opening the device
+    AESPHASE_LOADSTATE,   // loading key and IV
+    AESPHASE_SETMODE,     // reset and mode ioctls
+    AESPHASE_PAD,         // building the padding block
+    AESPHASE_BLOCKIO,     // per-block write/read
+    AESPHASE_SOFTWARE,    // requests run on the software path
+    AESNUMPHASES
+} aes256phase_t;
+
+typedef struct {
+    uint64_t hwcalls;
+    uint64_t swcalls;
+    uint64_t bytesin;
+    uint64_t bytesout;
+    uint64_t syscalls;
+    uint64_t errors;
+    uint64_t reqallocs;   // request structures taken from the heap, the rest are recycled
+    uint64_t phasens[AESNUMPHASES];
+} aes256perfstats_t;
+
+void aes256perfstats(aes256perfstats_t *stats);
+void aes256perfreset(void);
+void aes256perfdump(void);
+
+/* CBC decryption of inlen bytes (a block multiple) split between the device and ncpu threads */
+int32_t aes256pardecrypt(aes256keyctx_t *ctx, uint8_t *ivp, uint8_t *inp, uint32_t inlen,
+                         uint8_t *outp, uint32_t *outlenp, int ncpu);
+
+/*
+ * Asynchronous submission for event loops. aes256cq_fd() is an eventfd that can be added to
+ * epoll; it turns readable when completions are waiting to be reaped.
+ */
+typedef struct aes256cq aes256cq_t;
+
+typedef struct {
+    void *userdata;
+    int32_t status;
+} aes256completion_t;
+
+aes256cq_t *aes256cq_new(void);
+int32_t aes256cq_free(aes256cq_t *cq);
+int aes256cq_fd(aes256cq_t *cq);
+int32_t aes256cq_submit(aes256cq_t *cq, aes256keyctx_t *ctx, int mode, uint8_t *ivp, uint8_t *inp,
+                        uint32_t inlen, uint8_t *outp, uint32_t *outlenp, void *userdata);
+int aes256cq_reap(aes256cq_t *cq, aes256completion_t *comps, int max);
+
+/*
+ * Encrypt-then-MAC with the MAC (normally HMAC-SHA256 on the SHA256 block) overlapped with the
+ * AES block. The MAC is driven through these callbacks on a state the caller has already keyed,
+ * and which may already hold a header such as the ESP SPI and sequence number. As ESP's ICV, the
+ * MAC covers the IV and then the ciphertext. taglen is 1 to AESMAXTAGLEN bytes.
+ */
+#define AESMAXTAGLEN 64
+
+typedef struct {
+    void *state;
+    void (*update)(void *state, const uint8_t *data, uint32_t len);
+    void (*final)(void *state, uint8_t *tag);
+    uint32_t taglen;
+} aes256mac_t;
+
+int32_t aes256etm_encrypt(aes256keyctx_t *ctx, uint8_t *ivp, uint8_t *inp, uint32_t inlen,
+                          uint8_t *outp, uint32_t *outlenp, aes256mac_t *mac, uint8_t *tagp);
+int32_t aes256etm_decrypt(aes256keyctx_t *ctx, uint8_t *ivp, uint8_t *inp, uint32_t inlen,
+                          uint8_t *outp, uint32_t *outlenp, aes256mac_t *mac, const uint8_t *tagp);
+
+/*
+ * Pool of payload buffers, for callers that would otherwise malloc one per packet. Buffers are
+ * cache-line aligned and hold maxlen bytes rounded up to whole blocks plus a block of headroom
+ * for the padding, so a payload can be encrypted in place. Nothing is allocated or cleared after
+ * aes256pool_new(); an empty pool falls back to the heap and counts a miss.
+ */
+#define AESCACHELINE 64
+
+typedef struct aes256pool aes256pool_t;
+
+typedef struct {
+    uint64_t gets;
+    uint64_t hits;
+    uint64_t misses;
+    uint32_t inuse;
+    uint32_t highwater;
+} aes256poolstats_t;
+
+aes256pool_t *aes256pool_new(uint32_t nbufs, uint32_t maxlen);
+int32_t aes256pool_free(aes256pool_t *pool);
+uint32_t aes256pool_bufsize(aes256pool_t *pool);
+uint8_t *aes256pool_get(aes256pool_t *pool);
+void aes256pool_put(aes256pool_t *pool, uint8_t *buf);
+void aes256pool_stats(aes256pool_t *pool, aes256poolstats_t *stats);
+
+/* Requests queued for or running on the device; 0 when it is idle */
+uint32_t aes256queued(void);
+
+/*
+ * AES-256-CTR (NIST SP 800-38A, 128-bit big-endian counter) on the CBC block. A single block run
+ * through CBC under a zero IV is the raw cipher, so keystream for the counters ahead of the
+ * stream is made in pipelines of such blocks and kept in a cache of up to cacheblocks blocks;
+ * encrypting or decrypting is then an XOR against it. With background refill a thread tops the
+ * cache up whenever it drops below half, waiting for the device to go idle first unless the
+ * cache is empty. A stream that outruns its cache makes the missing keystream on the spot.
+ * Consecutive calls continue the stream at any byte offset. ctx must outlive the stream.
+ */
+typedef struct aes256ctr aes256ctr_t;
+
+typedef struct {
+    uint64_t bytes;
+    uint64_t cachedblocks;  // keystream blocks taken from the cache
+    uint64_t inlineblocks;  // made on demand because the cache ran dry
+    uint64_t refills;       // pipelines run to fill the cache
+    uint32_t cached;
+    uint32_t capacity;
+} aes256ctrstats_t;
+
+aes256ctr_t *aes256ctr_new(aes256keyctx_t *ctx, const uint8_t *ctrp, uint32_t cacheblocks, int background);
+void aes256ctr_free(aes256ctr_t *ctr);
+int32_t aes256ctr_refill(aes256ctr_t *ctr);
+int32_t aes256ctr(aes256ctr_t *ctr, const uint8_t *inp, uint32_t inlen, uint8_t *outp);
+void aes256ctr_stats(aes256ctr_t *ctr, aes256ctrstats_t *stats);
+
+/*
+ * Forwarding from one fd to another, e.g. TUN device to UDP socket, with the payload copied by
+ * the CPU only once: each packet is read into a page of a fixed pool, en/decrypted in place and
+ * handed to outfd with vmsplice()/splice() instead of write(). A page is reused nbufs packets
+ * later, so nbufs should cover what outfd may still hold by reference. Each encrypted packet is
+ * a random IV followed by its ciphertext; packets are not chained.
+ */
+typedef struct aes256splice aes256splice_t;
+
+typedef struct {
+    uint64_t packets;
+    uint64_t bytesin;
+    uint64_t bytesout;
+    uint64_t copies;      // payload copies made by the CPU, besides the device I/O
+    uint64_t spliced;     // packets handed to outfd by reference
+    uint64_t written;     // packets written to outfd, which could not splice
+} aes256splicestats_t;
+
+aes256splice_t *aes256splice_new(aes256keyctx_t *ctx, uint32_t nbufs, uint32_t maxlen);
+void aes256splice_free(aes256splice_t *sp);
+int32_t aes256splice(aes256splice_t *sp, int mode, int infd, int outfd, uint32_t maxpackets, uint32_t *movedp);
+void aes256splice_stats(aes256splice_t *sp, aes256splicestats_t *stats);
+
+/*
+ * Whole-file encryption or decryption, compatible with openssl enc -aes-256-cbc -K -iv. Files are
+ * mapped window bytes at a time (0 for 1 MiB), read ahead, and kept out of the page cache once
+ * done; ncpu CPU threads help the device decrypt. outfd must be open read/write, and both must be
+ * regular files (EINVAL for a pipe, FIFO or terminal).
+ */
+int32_t aes256file(aes256keyctx_t *ctx, int mode, uint8_t *ivp, int infd, int outfd, uint32_t window, int ncpu);
@@ -1,12 +1,696 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <stdint.h>
 #include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
 #include "wsaescbc.h"
+#include "wsaessw.h"
 
+#define ETMMSGLEN 600 // spans three AESMAXDATASIZE pieces
 
+// FNV-1a, standing in for HMAC-SHA256 to exercise the encrypt-then-MAC plumbing
+static void testmac_update(void *state, const uint8_t *data, uint32_t len)
+{
+    uint64_t *h = (uint64_t *)state;
+    for (uint32_t i=0; i<len; i++)
+        *h = (*h ^ data[i]) * 0x100000001B3ULL;
+}
+
+static void testmac_final(void *state, uint8_t *tag)
+{
+    memcpy(tag, state, sizeof(uint64_t));
+}
+
+// a thread that never set a key must not get the all-zero one
+static void *nokeythread(void *arg)
+{
+    uint8_t in[AESBLKSIZE] = { 0 }, out[2 * AESBLKSIZE];
+    uint32_t olen;
+
+    *(int *)arg = aes256(ENCRYPT, in, sizeof(in), out, &olen);
+    return NULL;
+}
+
+#define KEYTHREADS 4
+#define KEYTHREADRUNS 200
+
+// threads with keys and IVs of their own, each output checked against the software path under
+// that thread's key and IV
+static void *keythread(void *arg)
+{
+    int id = *(int *)arg;
+    uint8_t key[AESKEYSIZE], iv[AESIVSIZE], in[240], out[256], ref[256];
+    uint32_t olen, rlen;
+    aes256swkey_t ks;
+
+    for (int i=0; i<AESKEYSIZE; i++)
+        key[i] = (uint8_t)(id * 31 + i);
+    for (int i=0; i<AESIVSIZE; i++)
+        iv[i] = (uint8_t)(id * 17 + i);
+    aes256setkey(key);
+    aes256setiv(iv);
+    aes256sw_expandkey(&ks, key);
+
+    *(int *)arg = 0;
+    for (int r=0; r<KEYTHREADRUNS; r++)
+    {
+        // short and long requests, for both the software and the device path
+        uint32_t len = (r % 2) ? sizeof(in) : 16;
+
+        for (int i=0; i<len; i++)
+            in[i] = (uint8_t)(id + r + i);
+        aes256sw(ENCRYPT, &ks, iv, in, len, ref, &rlen);
+        if (aes256(ENCRYPT, in, len, out, &olen) != 0 || olen != rlen || memcmp(out, ref, rlen) != 0)
+            (*(int *)arg)++;
+
+        // and queued for the device worker, which always takes the hardware path
+        aes256req_t *req;
+        memset(out, 0, sizeof(out));
+        if (aes256submit(ENCRYPT, NULL, NULL, in, len, out, &olen, NULL, NULL, &req) != 0 ||
+            aes256wait(req) != 0 || olen != rlen || memcmp(out, ref, rlen) != 0)
+            (*(int *)arg)++;
+    }
+    return NULL;
+}
+
+static int testkeythreads(void)
+{
+    pthread_t tids[KEYTHREADS];
+    int results[KEYTHREADS], bad = 0;
+
+    for (int t=0; t<KEYTHREADS; t++)
+    {
+        results[t] = t;
+        if (pthread_create(&tids[t], NULL, keythread, &results[t]) != 0)
+        {
+            printf("ERROR: failed to start thread %d\n", t);
+            return -1;
+        }
+    }
+    for (int t=0; t<KEYTHREADS; t++)
+    {
+        pthread_join(tids[t], NULL);
+        bad += results[t];
+    }
+    if (bad != 0)
+    {
+        printf("ERROR: %d outputs were not under their own thread's key and IV\n", bad);
+        return -1;
+    }
+    return 0;
+}
+
+static int testetm(const uint8_t *key, const uint8_t *iv)
+{
+    static uint8_t msg[ETMMSGLEN], ct[ETMMSGLEN + AESBLKSIZE], pt[ETMMSGLEN + AESBLKSIZE];
+    uint64_t state;
+    uint8_t tag[sizeof(uint64_t)];
+    aes256mac_t mac = { &state, testmac_update, testmac_final, sizeof(tag) };
+    aes256keyctx_t *ctx = aes256keyctx_new((uint8_t*)key);
+    uint32_t clen, plen;
+    int ret;
+
+    for (int i=0; i<ETMMSGLEN; i++)
+        msg[i] = (uint8_t)i;
+
+    state = 0xCBF29CE484222325ULL;
+    ret = aes256etm_encrypt(ctx, (uint8_t*)iv, msg, ETMMSGLEN, ct, &clen, &mac, tag);
+    if (ret != 0 || clen != ETMMSGLEN + AESBLKSIZE - (ETMMSGLEN % AESBLKSIZE))
+    {
+        printf("ERROR: encrypt-then-MAC failed (%d)\n", ret);
+        return -1;
+    }
+
+    state = 0xCBF29CE484222325ULL;
+    ret = aes256etm_decrypt(ctx, (uint8_t*)iv, ct, clen, pt, &plen, &mac, tag);
+    if (ret != 0 || memcmp(pt, msg, ETMMSGLEN) != 0)
+    {
+        printf("ERROR: verify-then-decrypt failed (%d)\n", ret);
+        return -1;
+    }
+
+    // a flipped ciphertext bit must be rejected and no plaintext released
+    ct[clen / 2] ^= 0x01;
+    state = 0xCBF29CE484222325ULL;
+    ret = aes256etm_decrypt(ctx, (uint8_t*)iv, ct, clen, pt, &plen, &mac, tag);
+    if (ret != EBADMSG || pt[0] != 0)
+    {
+        printf("ERROR: verify-then-decrypt accepted a modified message (%d)\n", ret);
+        return -1;
+    }
+
+    // so must a flipped IV bit, which would flip the same bit of the first plaintext block
+    uint8_t badiv[AESIVSIZE];
+    ct[clen / 2] ^= 0x01;
+    memcpy(badiv, iv, AESIVSIZE);
+    badiv[3] ^= 0x10;
+    memset(pt, 0xff, clen);
+    state = 0xCBF29CE484222325ULL;
+    ret = aes256etm_decrypt(ctx, badiv, ct, clen, pt, &plen, &mac, tag);
+    for (uint32_t i=0; i<clen && ret == EBADMSG; i++)
+    {
+        if (pt[i] != 0)
+            ret = -1;
+    }
+    if (ret != EBADMSG)
+    {
+        printf("ERROR: verify-then-decrypt accepted a modified IV (%d)\n", ret);
+        return -1;
+    }
+
+    // tag lengths the library cannot hold are refused up front
+    mac.taglen = AESMAXTAGLEN + 1;
+    if (aes256etm_decrypt(ctx, (uint8_t*)iv, ct, clen, pt, &plen, &mac, tag) != EINVAL)
+    {
+        printf("ERROR: verify-then-decrypt accepted a %u byte tag\n", mac.taglen);
+        return -1;
+    }
+
+    aes256keyctx_free(ctx);
+    return 0;
+}
+
+// encrypts and decrypts in place in pool buffers, taking one more buffer than the pool holds
+static int testpool(const uint8_t *key, const uint8_t *iv)
+{
+    aes256pool_t *pool = aes256pool_new(2, 100);
+    aes256keyctx_t *ctx = aes256keyctx_new((uint8_t*)key);
+    aes256poolstats_t stats;
+    uint8_t *bufs[3];
+    uint32_t clen, plen;
+    int ret = 0;
+
+    if (pool == NULL || aes256pool_bufsize(pool) != 128)
+    {
+        printf("ERROR: failed to create buffer pool\n");
+        return -1;
+    }
+
+    for (int b=0; b<3; b++)
+    {
+        bufs[b] = aes256pool_get(pool);
+        if (bufs[b] == NULL || ((uintptr_t)bufs[b] % AESCACHELINE) != 0)
+        {
+            printf("ERROR: bad pool buffer %p\n", (void*)bufs[b]);
+            return -1;
+        }
+        for (int i=0; i<100; i++)
+            bufs[b][i] = (uint8_t)(b + i);
+
+        if (aes256ctx(ctx, ENCRYPT, (uint8_t*)iv, bufs[b], 100, bufs[b], &clen) != 0 || clen != 112 ||
+            aes256ctx(ctx, DECRYPT, (uint8_t*)iv, bufs[b], clen, bufs[b], &plen) != 0)
+            ret = -1;
+        for (int i=0; i<100; i++)
+            if (bufs[b][i] != (uint8_t)(b + i))
+                ret = -1;
+    }
+    if (ret != 0)
+        printf("ERROR: in-place round trip failed\n");
+
+    for (int b=0; b<3; b++)
+        aes256pool_put(pool, bufs[b]);
+    aes256pool_stats(pool, &stats);
+    if (stats.gets != 3 || stats.hits != 2 || stats.misses != 1 || stats.inuse != 0 || stats.highwater != 3)
+    {
+        printf("ERROR: unexpected pool statistics\n");
+        ret = -1;
+    }
+
+    aes256keyctx_free(ctx);
+    if (aes256pool_free(pool) != 0)
+        ret = -1;
+    return ret;
+}
+
+
+// a pipeline of records with their own IVs and lengths must match encrypting them one by one
+static int testpipeline(const uint8_t *key)
+{
+    static const uint32_t lens[] = { 1, 16, 100, 255, 37 };
+    const uint32_t n = sizeof(lens) / sizeof(lens[0]);
+    aes256keyctx_t *ctx = aes256keyctx_new((uint8_t*)key);
+    uint8_t ivs[5][AESIVSIZE], pts[5][AESMAXDATASIZE], cts[5][AESMAXDATASIZE + AESBLKSIZE];
+    uint8_t ref[AESMAXDATASIZE + AESBLKSIZE];
+    aes256pipebuf_t bufs[5];
+    uint32_t rlen;
+
+    for (uint32_t r=0; r<n; r++)
+    {
+        for (int i=0; i<AESIVSIZE; i++)
+            ivs[r][i] = (uint8_t)(r * 41 + i);
+        for (int i=0; i<lens[r]; i++)
+            pts[r][i] = (uint8_t)(r + i * 3);
+        bufs[r] = (aes256pipebuf_t){ ivs[r], pts[r], lens[r], cts[r], 0, 0 };
+    }
+
+    if (aes256pipeline(ctx, ENCRYPT, bufs, n) != 0)
+    {
+        printf("ERROR: pipelined encryption failed\n");
+        return -1;
+    }
+    for (uint32_t r=0; r<n; r++)
+    {
+        if (aes256ctx(ctx, ENCRYPT, ivs[r], pts[r], lens[r], ref, &rlen) != 0 || bufs[r].status != 0 ||
+            bufs[r].outlen != rlen || memcmp(cts[r], ref, rlen) != 0)
+        {
+            printf("ERROR: pipelined record %u differs from encrypting it alone\n", r);
+            return -1;
+        }
+        // decrypt in place through the pipeline
+        bufs[r] = (aes256pipebuf_t){ ivs[r], cts[r], rlen, cts[r], 0, 0 };
+    }
+
+    if (aes256pipeline(ctx, DECRYPT, bufs, n) != 0)
+    {
+        printf("ERROR: pipelined decryption failed\n");
+        return -1;
+    }
+    for (uint32_t r=0; r<n; r++)
+    {
+        if (memcmp(cts[r], pts[r], lens[r]) != 0)
+        {
+            printf("ERROR: pipelined record %u does not decrypt back\n", r);
+            return -1;
+        }
+    }
+
+    // one bad record fails the whole call before anything is queued
+    bufs[2].inlen = AESMAXDATASIZE + 1;
+    if (aes256pipeline(ctx, DECRYPT, bufs, n) == 0)
+    {
+        printf("ERROR: pipeline with an oversized record accepted\n");
+        return -1;
+    }
+
+    aes256keyctx_free(ctx);
+    return 0;
+}
+
+#define CACHERECORDS 4
+
+// records queued as one batch load the key once; the next batch loads it again
+static int testcache(const uint8_t *key)
+{
+    aes256keyctx_t *ctx = aes256keyctx_new((uint8_t*)key);
+    uint8_t ivs[CACHERECORDS][AESIVSIZE], pts[CACHERECORDS][64], cts[CACHERECORDS][64 + AESBLKSIZE];
+    aes256pipebuf_t bufs[CACHERECORDS];
+    aes256cachestats_t before, after;
+
+    for (int r=0; r<CACHERECORDS; r++)
+    {
+        for (int i=0; i<AESIVSIZE; i++)
+            ivs[r][i] = (uint8_t)(r * 13 + i);
+        memset(pts[r], r, sizeof(pts[r]));
+        bufs[r] = (aes256pipebuf_t){ ivs[r], pts[r], sizeof(pts[r]), cts[r], 0, 0 };
+    }
+
+    for (int batch=0; batch<2; batch++)
+    {
+        aes256cachestats(&before);
+        if (aes256pipeline(ctx, ENCRYPT, bufs, CACHERECORDS) != 0)
+        {
+            printf("ERROR: pipelined encryption failed\n");
+            return -1;
+        }
+        aes256cachestats(&after);
+        if (after.keymisses - before.keymisses != 1 || after.keyhits - before.keyhits != CACHERECORDS - 1)
+        {
+            printf("ERROR: batch %d loaded the key %llu times with %llu hits, expected once\n", batch,
+                   (unsigned long long)(after.keymisses - before.keymisses),
+                   (unsigned long long)(after.keyhits - before.keyhits));
+            return -1;
+        }
+    }
+
+    aes256keyctx_free(ctx);
+    return 0;
+}
+
+#define PARDECLEN 4096
+
+// a buffer decrypted by the device and CPU threads together, against the software path
+static int testpardecrypt(const uint8_t *key, const uint8_t *iv)
+{
+    static const int ncpus[] = { 0, 1, 4 };
+    static uint8_t pt[PARDECLEN], ct[PARDECLEN], ref[PARDECLEN], out[PARDECLEN];
+    aes256keyctx_t *ctx = aes256keyctx_new((uint8_t*)key);
+    pthread_attr_t attr, noattr;
+    aes256swkey_t ks;
+    uint32_t len;
+    int32_t ret;
+
+    for (int i=0; i<PARDECLEN; i++)
+        pt[i] = (uint8_t)(i * 7 + (i >> 9));
+    aes256sw_expandkey(&ks, key);
+    aes256sw(ENCRYPT | AESNOPAD, &ks, iv, pt, PARDECLEN, ct, &len);
+    aes256sw(DECRYPT, &ks, iv, ct, PARDECLEN, ref, &len);
+
+    for (int c=0; c<sizeof(ncpus) / sizeof(ncpus[0]); c++)
+    {
+        memset(out, 0, sizeof(out));
+        if (aes256pardecrypt(ctx, (uint8_t*)iv, ct, PARDECLEN, out, &len, ncpus[c]) != 0 || len != PARDECLEN ||
+            memcmp(out, ref, PARDECLEN) != 0 || memcmp(out, pt, PARDECLEN) != 0)
+        {
+            printf("ERROR: decryption with %d CPU threads differs from the software path\n", ncpus[c]);
+            return -1;
+        }
+    }
+
+    // in place, with no thread to be had: every slice runs on the calling thread
+    memcpy(out, ct, PARDECLEN);
+    pthread_getattr_default_np(&noattr);
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, (SIZE_MAX / 2) & ~(size_t)0xffff);
+    pthread_setattr_default_np(&attr);
+    ret = aes256pardecrypt(ctx, (uint8_t*)iv, out, PARDECLEN, out, &len, 4);
+    pthread_setattr_default_np(&noattr);
+    pthread_attr_destroy(&attr);
+    pthread_attr_destroy(&noattr);
+    if (ret != 0 || memcmp(out, ref, PARDECLEN) != 0)
+    {
+        printf("ERROR: decryption without CPU threads differs from the software path\n");
+        return -1;
+    }
+
+    aes256keyctx_free(ctx);
+    return 0;
+}
+
+#define CQREQS 6
+
+// requests through a completion queue, reaped a few at a time when its eventfd turns readable
+static int testcq(const uint8_t *key)
+{
+    aes256keyctx_t *ctx = aes256keyctx_new((uint8_t*)key);
+    aes256cq_t *cq = aes256cq_new();
+    uint8_t ivs[CQREQS][AESIVSIZE], pts[CQREQS][100], cts[CQREQS][100 + AESBLKSIZE], ref[100 + AESBLKSIZE];
+    uint32_t olens[CQREQS], rlen;
+    int tags[CQREQS], seen[CQREQS] = { 0 }, reaped = 0;
+    aes256completion_t comps[4];
+    aes256swkey_t ks;
+
+    if (ctx == NULL || cq == NULL)
+    {
+        printf("ERROR: failed to create the completion queue\n");
+        return -1;
+    }
+    for (int r=0; r<CQREQS; r++)
+    {
+        tags[r] = r;
+        for (int i=0; i<AESIVSIZE; i++)
+            ivs[r][i] = (uint8_t)(r * 19 + i);
+        memset(pts[r], 0xa0 + r, sizeof(pts[r]));
+        if (aes256cq_submit(cq, ctx, ENCRYPT, ivs[r], pts[r], sizeof(pts[r]), cts[r], &olens[r], &tags[r]) != 0)
+        {
+            printf("ERROR: completion queue submission %d failed\n", r);
+            return -1;
+        }
+    }
+
+    // not before every request has been reaped
+    if (aes256cq_free(cq) != EBUSY)
+    {
+        printf("ERROR: completion queue freed with requests outstanding\n");
+        return -1;
+    }
+
+    aes256sw_expandkey(&ks, key);
+    while (reaped < CQREQS)
+    {
+        struct pollfd pfd = { aes256cq_fd(cq), POLLIN, 0 };
+        int n;
+
+        if (poll(&pfd, 1, 5000) != 1)
+        {
+            printf("ERROR: completion eventfd never turned readable\n");
+            return -1;
+        }
+        n = aes256cq_reap(cq, comps, 4);
+        for (int c=0; c<n; c++)
+        {
+            int r = *(int *)comps[c].userdata;
+
+            aes256sw(ENCRYPT, &ks, ivs[r], pts[r], sizeof(pts[r]), ref, &rlen);
+            if (seen[r]++ || comps[c].status != 0 || olens[r] != rlen || memcmp(cts[r], ref, rlen) != 0)
+            {
+                printf("ERROR: completion of request %d is wrong\n", r);
+                return -1;
+            }
+        }
+        reaped += n;
+    }
+
+    if (aes256cq_free(cq) != 0)
+    {
+        printf("ERROR: drained completion queue not freed\n");
+        return -1;
+    }
+    aes256keyctx_free(ctx);
+    return 0;
+}
+
+// NIST SP 800-38A F.5.5, CTR-AES256.Encrypt
+static int testctr(void)
+{
+    static const uint8_t key[AESKEYSIZE] = {
+        0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe, 0x2b, 0x73, 0xae, 0xf0, 0x85, 0x7d, 0x77, 0x81,
+        0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7, 0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4 };
+    static const uint8_t ctr0[AESBLKSIZE] = {
+        0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff };
+    static const uint8_t pt[64] = {
+        0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+        0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+        0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+        0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10 };
+    static const uint8_t ct[64] = {
+        0x60, 0x1e, 0xc3, 0x13, 0x77, 0x57, 0x89, 0xa5, 0xb7, 0xa7, 0xf5, 0x04, 0xbb, 0xf3, 0xd2, 0x28,
+        0xf4, 0x43, 0xe3, 0xca, 0x4d, 0x62, 0xb5, 0x9a, 0xca, 0x84, 0xe9, 0x90, 0xca, 0xca, 0xf5, 0xc5,
+        0x2b, 0x09, 0x30, 0xda, 0xa2, 0x3d, 0xe9, 0x4c, 0xe8, 0x70, 0x17, 0xba, 0x2d, 0x84, 0x98, 0x8d,
+        0xdf, 0xc9, 0xc5, 0x8d, 0xb6, 0x7a, 0xad, 0xa6, 0x13, 0xc2, 0xdd, 0x08, 0x45, 0x79, 0x41, 0xa6 };
+    static const uint32_t pieces[] = { 5, 30, 1, 28 };
+    aes256keyctx_t *ctx = aes256keyctx_new((uint8_t*)key);
+    aes256ctrstats_t stats;
+    aes256ctr_t *ctr;
+    uint8_t buf[64];
+    uint32_t pos = 0;
+
+    // a two-block cache and no refill thread: cached, inline and partial blocks all get used
+    ctr = aes256ctr_new(ctx, ctr0, 2, 0);
+    if (ctr == NULL || aes256ctr_refill(ctr) != 0)
+    {
+        printf("ERROR: failed to start a CTR stream\n");
+        return -1;
+    }
+    for (int p=0; p<sizeof(pieces)/sizeof(pieces[0]); pos+=pieces[p++])
+    {
+        if (aes256ctr(ctr, &pt[pos], pieces[p], &buf[pos]) != 0)
+        {
+            printf("ERROR: CTR encryption failed\n");
+            return -1;
+        }
+    }
+    aes256ctr_stats(ctr, &stats);
+    aes256ctr_free(ctr);
+    if (memcmp(buf, ct, sizeof(ct)) != 0 || stats.bytes != sizeof(ct) || stats.cachedblocks != 2 ||
+        stats.inlineblocks != 2)
+    {
+        printf("ERROR: CTR output or keystream accounting does not match SP 800-38A\n");
+        return -1;
+    }
+
+    // decrypt in place with the refill thread keeping the cache warm
+    ctr = aes256ctr_new(ctx, ctr0, 64, 1);
+    if (ctr == NULL || aes256ctr(ctr, buf, sizeof(buf), buf) != 0 || memcmp(buf, pt, sizeof(pt)) != 0)
+    {
+        printf("ERROR: CTR decryption with background refill failed\n");
+        return -1;
+    }
+    aes256ctr_free(ctr);
+    aes256keyctx_free(ctx);
+    return 0;
+}
+
+// packets through the fd to fd path, each checked against decrypting it alone under its IV
+static int testsplice(const uint8_t *key)
+{
+    static const uint32_t lens[] = { 60, 16, 200 };
+    const uint32_t n = sizeof(lens) / sizeof(lens[0]);
+    aes256keyctx_t *ctx = aes256keyctx_new((uint8_t*)key);
+    aes256splice_t *sp = aes256splice_new(ctx, 4, AESMAXDATASIZE);
+    uint8_t pkt[AESIVSIZE + AESMAXDATASIZE + AESBLKSIZE], ref[AESMAXDATASIZE + AESBLKSIZE];
+    uint8_t ivs[3][AESIVSIZE];
+    aes256splicestats_t stats;
+    int in[2], out[2], back[2];
+    uint32_t moved, rlen;
+
+    if (sp == NULL || socketpair(AF_UNIX, SOCK_DGRAM, 0, in) < 0 || socketpair(AF_UNIX, SOCK_DGRAM, 0, out) < 0 ||
+        socketpair(AF_UNIX, SOCK_DGRAM, 0, back) < 0)
+    {
+        printf("ERROR: failed to set up the splice path\n");
+        return -1;
+    }
+    // datagram sockets have no end of file, so the path stops when they run empty
+    fcntl(in[0], F_SETFL, O_NONBLOCK);
+    fcntl(back[0], F_SETFL, O_NONBLOCK);
+
+    for (uint32_t r=0; r<n; r++)
+    {
+        for (int i=0; i<lens[r]; i++)
+            pkt[i] = (uint8_t)(r * 7 + i);
+        send(in[1], pkt, lens[r], 0);
+    }
+    if (aes256splice(sp, ENCRYPT, in[0], out[1], n + 1, &moved) != 0 || moved != n)
+    {
+        printf("ERROR: splice path encryption failed after %u packets\n", moved);
+        return -1;
+    }
+
+    for (uint32_t r=0; r<n; r++)
+    {
+        ssize_t got = recv(out[0], pkt, sizeof(pkt), 0);
+
+        // IV in front, ciphertext of the padded packet behind it, no chaining between packets
+        memcpy(ivs[r], pkt, AESIVSIZE);
+        if (got != AESIVSIZE + (lens[r] / AESBLKSIZE + 1) * AESBLKSIZE ||
+            (r > 0 && memcmp(ivs[r], ivs[r - 1], AESIVSIZE) == 0) ||
+            aes256ctx(ctx, DECRYPT, ivs[r], &pkt[AESIVSIZE], got - AESIVSIZE, ref, &rlen) != 0 || rlen != got - AESIVSIZE)
+        {
+            printf("ERROR: spliced packet %u is not an IV and its own ciphertext\n", r);
+            return -1;
+        }
+        for (int i=0; i<lens[r]; i++)
+        {
+            if (ref[i] != (uint8_t)(r * 7 + i))
+            {
+                printf("ERROR: spliced packet %u differs from encrypting it alone\n", r);
+                return -1;
+            }
+        }
+        send(back[1], pkt, got, 0);
+    }
+    // a packet lost on the way leaves the next one intact; one that is not an IV and whole
+    // blocks is refused
+    recv(back[0], pkt, sizeof(pkt), 0);
+    if (aes256splice(sp, DECRYPT, back[0], out[1], n, &moved) != 0 || moved != n - 1)
+    {
+        printf("ERROR: splice path decryption failed after %u packets\n", moved);
+        return -1;
+    }
+    for (uint32_t r=1; r<n; r++)
+    {
+        recv(out[0], pkt, sizeof(pkt), 0);
+        for (int i=0; i<lens[r]; i++)
+        {
+            if (pkt[i] != (uint8_t)(r * 7 + i))
+            {
+                printf("ERROR: spliced packet %u does not decrypt back\n", r);
+                return -1;
+            }
+        }
+    }
+    send(back[1], pkt, AESIVSIZE, 0);
+    if (aes256splice(sp, DECRYPT, back[0], out[1], 1, &moved) != EINVAL || moved != 0)
+    {
+        printf("ERROR: splice path decrypted a packet with no ciphertext\n");
+        return -1;
+    }
+
+    aes256splice_stats(sp, &stats);
+    // the refused packet was read but never went out
+    if (stats.packets != 2 * n - 1 || stats.copies + stats.spliced != 2 * stats.packets + 1)
+    {
+        printf("ERROR: splice path accounting is off\n");
+        return -1;
+    }
+    printf("\t%.1f CPU copies per packet, %llu of %llu packets spliced\n", (double)stats.copies / stats.packets,
+           (unsigned long long)stats.spliced, (unsigned long long)stats.packets);
+
+    for (int i=0; i<2; i++)
+    {
+        close(in[i]);
+        close(out[i]);
+        close(back[i]);
+    }
+    aes256splice_free(sp);
+    aes256keyctx_free(ctx);
+    return 0;
+}
+
+// a file spanning two mapping windows, against the software path over the whole of it
+static int testfile(const uint8_t *key, const uint8_t *iv)
+{
+    enum { FILELEN = 5000 };
+    static uint8_t data[FILELEN], ref[FILELEN + AESBLKSIZE], got[FILELEN + AESBLKSIZE];
+    char pname[] = "/tmp/wsaesfileXXXXXX", cname[] = "/tmp/wsaesfileXXXXXX", dname[] = "/tmp/wsaesfileXXXXXX";
+    int pfd = mkstemp(pname), cfd = mkstemp(cname), dfd = mkstemp(dname);
+    aes256keyctx_t *ctx = aes256keyctx_new((uint8_t*)key);
+    uint8_t fiv[AESIVSIZE];
+    aes256swkey_t ks;
+    uint32_t rlen;
+    int pipefd[2] = { -1, -1 };
+    int ret = -1;
+
+    unlink(pname);
+    unlink(cname);
+    unlink(dname);
+    for (int i=0; i<FILELEN; i++)
+        data[i] = (uint8_t)(i * 13 + (i >> 8));
+    aes256sw_expandkey(&ks, key);
+    aes256sw(ENCRYPT, &ks, iv, data, FILELEN, ref, &rlen);
+
+    memcpy(fiv, iv, AESIVSIZE);
+    if (pfd < 0 || cfd < 0 || dfd < 0 || write(pfd, data, FILELEN) != FILELEN ||
+        aes256file(ctx, ENCRYPT, fiv, pfd, cfd, 4096, 0) != 0 ||
+        pread(cfd, got, sizeof(got), 0) != rlen || memcmp(got, ref, rlen) != 0)
+    {
+        printf("ERROR: file encryption differs from encrypting it in one go\n");
+        goto out;
+    }
+
+    memcpy(fiv, iv, AESIVSIZE);
+    if (aes256file(ctx, DECRYPT, fiv, cfd, dfd, 4096, 1) != 0 ||
+        pread(dfd, got, sizeof(got), 0) != FILELEN || memcmp(got, data, FILELEN) != 0)
+    {
+        printf("ERROR: file does not decrypt back\n");
+        goto out;
+    }
+
+    // a flipped bit in the last block breaks the padding
+    got[0] = ref[rlen - 1] ^ 0x80;
+    pwrite(cfd, got, 1, rlen - 1);
+    memcpy(fiv, iv, AESIVSIZE);
+    if (aes256file(ctx, DECRYPT, fiv, cfd, dfd, 4096, 0) != EBADMSG || lseek(dfd, 0, SEEK_END) != 0)
+    {
+        printf("ERROR: file with bad padding decrypted\n");
+        goto out;
+    }
+
+    // a pipe has no size to go by and cannot be mapped
+    memcpy(fiv, iv, AESIVSIZE);
+    if (pipe(pipefd) < 0 || write(pipefd[1], data, 100) != 100 ||
+        aes256file(ctx, ENCRYPT, fiv, pipefd[0], cfd, 4096, 0) != EINVAL ||
+        aes256file(ctx, ENCRYPT, fiv, pfd, pipefd[1], 4096, 0) != EINVAL)
+    {
+        printf("ERROR: file encryption took a pipe\n");
+        goto out;
+    }
+    ret = 0;
+
+out:
+    close(pipefd[0]);
+    close(pipefd[1]);
+    close(pfd);
+    close(cfd);
+    close(dfd);
+    aes256keyctx_free(ctx);
+    return ret;
+}
 
 int main (void)
 {
@@ -17,10 +701,13 @@ int main (void)
 		0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F };
 	const uint8_t iv[AESIVSIZE] =   { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
 		0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
-	//const char openSSL_result[32] = { 0xA8, 0x87, 0x01, 0xE4, 0x43, 0x4F, 0x59, 0x00, 
-	//	0x9F, 0xF8, 0x9A, 0x40, 0x29, 0x98, 0x49, 0x57,
-	//	0x99, 0x29, 0x0C, 0x6C, 0xB1, 0xB1, 0x6D, 0x1A, 
-	//	0x8B, 0x0A, 0xF7, 0xAF, 0x2D, 0x96, 0x7E, 0xF1 };
+	// openssl enc -aes-256-cbc of "The Quick Brown Fox Jumped Over " with the key/iv above
+	const uint8_t openSSL_result[48] = { 0xA8, 0x87, 0x01, 0xE4, 0x43, 0x4F, 0x59, 0x00, 
+		0x9F, 0xF8, 0x9A, 0x40, 0x29, 0x98, 0x49, 0x57,
+		0x99, 0x29, 0x0C, 0x6C, 0xB1, 0xB1, 0x6D, 0x1A, 
+		0x8B, 0x0A, 0xF7, 0xAF, 0x2D, 0x96, 0x7E, 0xF1,
+		0xC7, 0x26, 0x87, 0xFD, 0xB1, 0x7F, 0x92, 0xB0,
+		0xB2, 0xA4, 0x95, 0xF0, 0xE0, 0xB3, 0x25, 0xD4 };
 
 
 
@@ -39,6 +726,19 @@ int main (void)
 	memset(buf0,0,olen);
 	memset(buf1,0,olen);
 
+	// check the software fallback against OpenSSL before touching the hardware
+	aes256swkey_t ks;
+	uint8_t swbuf[48];
+	uint32_t swlen;
+	aes256sw_expandkey(&ks, key);
+	aes256sw(ENCRYPT, &ks, iv, (uint8_t*)"The Quick Brown Fox Jumped Over ", 32, swbuf, &swlen);
+	if (swlen != 48 || memcmp(swbuf, openSSL_result, swlen) != 0)
+	{
+		printf("ERROR: software AES does not match OpenSSL\n");
+		return -1;
+	}
+	printf("Software AES matches OpenSSL\n");
+
 	int ret = aes256init();
 	if (0 != ret)
 	{
@@ -97,6 +797,88 @@ int main (void)
 	}
     printf("\tDecryption Success!\n");
     
+    printf("Checking a thread without a key.....\n");
+    pthread_t tid;
+    int nokeyret = 0;
+    pthread_create(&tid, NULL, nokeythread, &nokeyret);
+    pthread_join(tid, NULL);
+    if (nokeyret != EINVAL)
+    {
+        printf("ERROR: aes256() without a key returned %d\n", nokeyret);
+        return -1;
+    }
+    printf("\tRejected Success!\n");
+
+    printf("Checking per-thread keys.....\n");
+    if (testkeythreads() != 0)
+        return -1;
+    printf("\tPer-thread keys Success!\n");
+
+    // a ciphertext that is not whole blocks must be refused before it reaches the device
+    aes256req_t *req;
+    if (aes256submit(DECRYPT, NULL, NULL, (uint8_t*)buf0, olen - 1, (uint8_t*)buf1, &olen, NULL, NULL, &req) == 0)
+    {
+        printf("ERROR: partial block accepted for decryption\n");
+        aes256wait(req);
+        return -1;
+    }
+
+    printf("Checking encrypt-then-MAC.....\n");
+    if (testetm(key, iv) != 0)
+        return -1;
+    printf("\tEncrypt-then-MAC Success!\n");
+
+    printf("Checking buffer pool.....\n");
+    if (testpool(key, iv) != 0)
+        return -1;
+    printf("\tBuffer pool Success!\n");
+
+    printf("Checking pipelined records.....\n");
+    if (testpipeline(key) != 0)
+        return -1;
+    printf("\tPipelined records Success!\n");
+
+    printf("Checking the device key cache.....\n");
+    if (testcache(key) != 0)
+        return -1;
+    printf("\tKey cache Success!\n");
+
+    printf("Checking parallel decryption.....\n");
+    if (testpardecrypt(key, iv) != 0)
+        return -1;
+    printf("\tParallel decryption Success!\n");
+
+    printf("Checking completion queue.....\n");
+    if (testcq(key) != 0)
+        return -1;
+    printf("\tCompletion queue Success!\n");
+
+    printf("Checking CTR mode.....\n");
+    if (testctr() != 0)
+        return -1;
+    printf("\tCTR mode Success!\n");
+
+    printf("Checking splice path.....\n");
+    if (testsplice(key) != 0)
+        return -1;
+    printf("\tSplice path Success!\n");
+
+    printf("Checking file encryption.....\n");
+    if (testfile(key, iv) != 0)
+        return -1;
+    printf("\tFile encryption Success!\n");
+
+    printf("Checking performance counters.....\n");
+    aes256perfstats_t perf;
+    aes256perfstats(&perf);
+    if (perf.hwcalls + perf.swcalls == 0 || perf.bytesin == 0 || perf.bytesout == 0)
+    {
+        printf("ERROR: performance counters did not move\n");
+        return -1;
+    }
+    aes256perfdump();
+    printf("\tPerformance counters Success!\n");
+
 	return 0;
 }
 
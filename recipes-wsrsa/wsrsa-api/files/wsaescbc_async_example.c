@@ -0,0 +1,152 @@
+/**
+ * @file   wsaescbc_async_example.c
+ * @brief  Example single-threaded event loop keeping several libwsaescbc requests in flight.
+ * Each slot encrypts a message, then decrypts the result and checks it against the original,
+ * and is then reused for the next message. Completions are picked up through epoll on the
+ * completion queue's eventfd.
+ *
+ * usage: wsaescbc_async_example [inflight] [messages]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include "wsaescbc.h"
+
+#define DEFAULT_INFLIGHT 8
+#define DEFAULT_MESSAGES 1000
+#define MSGLEN 100
+
+typedef struct {
+    int id;
+    int decrypting;  // 0 while the encryption is in flight, 1 for the decryption
+    uint8_t iv[AESIVSIZE];
+    uint8_t plain[MSGLEN];
+    uint8_t cipher[AESMAXDATASIZE];
+    uint8_t check[AESMAXDATASIZE];
+    uint32_t clen;
+    uint32_t plen;
+} slot_t;
+
+static aes256keyctx_t *ctx;
+static aes256cq_t *cq;
+
+static int32_t startmsg(slot_t *slot, int msgnum)
+{
+    for (int i=0; i<MSGLEN; i++)
+        slot->plain[i] = (uint8_t)(msgnum + i);
+    for (int i=0; i<AESIVSIZE; i++)
+        slot->iv[i] = (uint8_t)(msgnum * 7 + i);
+    slot->decrypting = 0;
+    return aes256cq_submit(cq, ctx, ENCRYPT, slot->iv, slot->plain, MSGLEN, slot->cipher, &slot->clen, slot);
+}
+
+int main(int argc, char **argv)
+{
+    int inflight = DEFAULT_INFLIGHT, messages = DEFAULT_MESSAGES;
+    int started = 0, finished = 0, errors = 0;
+    uint8_t key[AESKEYSIZE];
+    struct epoll_event ev;
+    int epfd;
+
+    if (argc > 1)
+        inflight = atoi(argv[1]);
+    if (argc > 2)
+        messages = atoi(argv[2]);
+    if (inflight < 1 || messages < 1)
+    {
+        fprintf(stderr, "usage: %s [inflight] [messages]\n", argv[0]);
+        return 1;
+    }
+
+    if (aes256init() != 0)
+        return 1;
+
+    for (int i=0; i<AESKEYSIZE; i++)
+        key[i] = (uint8_t)i;
+    ctx = aes256keyctx_new(key);
+    cq = aes256cq_new();
+    if (ctx == NULL || cq == NULL)
+        return 1;
+
+    epfd = epoll_create1(0);
+    ev.events = EPOLLIN;
+    ev.data.ptr = cq;
+    if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, aes256cq_fd(cq), &ev) < 0)
+    {
+        perror("ERROR: epoll setup failed");
+        return 1;
+    }
+
+    slot_t *slots = calloc(inflight, sizeof(slot_t));
+    for (int i=0; i<inflight && started<messages; i++)
+    {
+        slots[i].id = i;
+        if (startmsg(&slots[i], started++) != 0)
+            return 1;
+    }
+
+    // the event loop; a real daemon would have its sockets in the same epoll set
+    while (finished < messages)
+    {
+        aes256completion_t comps[16];
+        struct epoll_event events[4];
+        int nev = epoll_wait(epfd, events, 4, -1);
+
+        if (nev < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("ERROR: epoll_wait failed");
+            return 1;
+        }
+
+        int n;
+        while ((n = aes256cq_reap(cq, comps, 16)) > 0)
+        {
+            for (int i=0; i<n; i++)
+            {
+                slot_t *slot = (slot_t *)comps[i].userdata;
+
+                if (comps[i].status != 0)
+                {
+                    errors++;
+                    finished++;
+                }
+                else if (!slot->decrypting)
+                {
+                    slot->decrypting = 1;
+                    if (aes256cq_submit(cq, ctx, DECRYPT, slot->iv, slot->cipher, slot->clen,
+                                        slot->check, &slot->plen, slot) != 0)
+                    {
+                        errors++;
+                        finished++;
+                    }
+                    continue;
+                }
+                else
+                {
+                    if (memcmp(slot->check, slot->plain, MSGLEN) != 0)
+                        errors++;
+                    finished++;
+                }
+
+                if (started < messages && startmsg(slot, started++) != 0)
+                {
+                    errors++;
+                    finished++;
+                }
+            }
+        }
+    }
+
+    printf("%d messages, %d requests in flight, %d errors\n", messages, inflight, errors);
+
+    aes256cq_free(cq);
+    aes256keyctx_free(ctx);
+    free(slots);
+    aes256shutdown();
+    return errors ? 1 : 0;
+}
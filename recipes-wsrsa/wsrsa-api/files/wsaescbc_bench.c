@@ -0,0 +1,429 @@
+/**
+ * @file   wsaescbc_bench.c
+ * @brief  Thread scaling benchmark for libwsaescbc. Runs the same encryption workload from 1 up to
+ * N threads, each thread with its own key and IV, and reports the aggregate request rate. Then
+ * decrypts a large buffer on the hardware alone and split with 1 to N-1 CPU threads, and runs
+ * the N-thread workload again with each packet encrypted in place in a pool buffer. Finally
+ * encrypts records in pipelines of 1 to AESMAXPIPELINE, each record with its own IV, on 1 and on
+ * N threads at once, in the style of openssl speed -multi. Last, packets arriving with idle gaps
+ * between them are encrypted in CBC and in CTR without and with a keystream cache, timing only
+ * the encryption of each packet, and packets are forwarded from a datagram socket (standing in for
+ * a TUN device) to a UDP socket through read()/aes256()/write() and through aes256splice().
+ *
+ * usage: wsaescbc_bench [maxthreads] [msglen] [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "wsaescbc.h"
+#include "wsaessw.h"
+
+#define DEFAULT_MAXTHREADS 8
+#define DEFAULT_MSGLEN 64
+#define DEFAULT_ITERATIONS 1000
+#define PARDECRYPT_LEN (64 * 1024)
+#define CTRGAPNS 500000     // idle time between packets in the CTR comparison
+#define CTRCACHEBLOCKS 256
+#define FWDBATCH 32         // packets queued on the input socket at a time
+
+static uint32_t msglen = DEFAULT_MSGLEN;
+static int iterations = DEFAULT_ITERATIONS;
+static aes256pool_t *pool = NULL;  // set for the pooled pass
+
+typedef struct {
+    int id;
+    int errors;
+} benchthread_t;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *benchthread(void *arg)
+{
+    benchthread_t *bt = (benchthread_t *)arg;
+    uint8_t key[AESKEYSIZE], iv[AESIVSIZE];
+    uint8_t in[AESMAXDATASIZE], out[AESMAXDATASIZE + AESBLKSIZE], ref[AESMAXDATASIZE + AESBLKSIZE];
+    uint32_t olen, rlen;
+    aes256swkey_t ks;
+
+    // give every thread a distinct key and IV, and check every output against the software path
+    // under them, so cross-talk shows up as errors
+    for (int i=0; i<AESKEYSIZE; i++)
+        key[i] = (uint8_t)(bt->id * 31 + i);
+    for (int i=0; i<AESIVSIZE; i++)
+        iv[i] = (uint8_t)(bt->id * 17 + i);
+    for (int i=0; i<msglen; i++)
+        in[i] = (uint8_t)i;
+    aes256sw_expandkey(&ks, key);
+    aes256sw(ENCRYPT, &ks, iv, in, msglen, ref, &rlen);
+
+    aes256setkey(key);
+    aes256setiv(iv);
+
+    for (int n=0; n<iterations; n++)
+    {
+        if (pool != NULL)
+        {
+            // a packet arriving in a pool buffer, encrypted where it lies
+            uint8_t *buf = aes256pool_get(pool);
+            if (buf == NULL)
+            {
+                bt->errors++;
+                continue;
+            }
+            memcpy(buf, in, msglen);
+            if (aes256(ENCRYPT, buf, msglen, buf, &olen) != 0 || olen != rlen || memcmp(buf, ref, rlen) != 0)
+                bt->errors++;
+            aes256pool_put(pool, buf);
+        }
+        else if (aes256(ENCRYPT, in, msglen, out, &olen) != 0 || olen != rlen || memcmp(out, ref, rlen) != 0)
+            bt->errors++;
+    }
+    return NULL;
+}
+
+/*
+ * Runs the encryption workload on nthreads threads and prints one row of results
+ */
+static void runthreads(int nthreads)
+{
+    pthread_t tids[nthreads];
+    benchthread_t bts[nthreads];
+    int errors = 0;
+    double start = now();
+
+    for (int t=0; t<nthreads; t++)
+    {
+        bts[t].id = t;
+        bts[t].errors = 0;
+        pthread_create(&tids[t], NULL, benchthread, &bts[t]);
+    }
+    for (int t=0; t<nthreads; t++)
+    {
+        pthread_join(tids[t], NULL);
+        errors += bts[t].errors;
+    }
+
+    double elapsed = now() - start;
+    long requests = (long)nthreads * iterations;
+    printf("%8d %10ld %10.3f %12.1f %10.3f %8d\n", nthreads, requests, elapsed,
+           requests / elapsed, (double)requests * msglen / elapsed / 1e6, errors);
+}
+
+typedef struct {
+    int id;
+    uint32_t depth;
+    int errors;
+} pipethread_t;
+
+static void *pipethread(void *arg)
+{
+    pipethread_t *pt = (pipethread_t *)arg;
+    uint8_t key[AESKEYSIZE];
+    static __thread uint8_t ivs[AESMAXPIPELINE][AESIVSIZE];
+    static __thread uint8_t in[AESMAXPIPELINE][AESMAXDATASIZE];
+    static __thread uint8_t out[AESMAXPIPELINE][AESMAXDATASIZE + AESBLKSIZE];
+    aes256pipebuf_t bufs[AESMAXPIPELINE];
+    aes256keyctx_t *ctx;
+
+    for (int i=0; i<AESKEYSIZE; i++)
+        key[i] = (uint8_t)(pt->id * 31 + i);
+    ctx = aes256keyctx_new(key);
+    if (ctx == NULL)
+    {
+        pt->errors++;
+        return NULL;
+    }
+
+    for (int n=0; n<iterations; n+=pt->depth)
+    {
+        // every record carries its own explicit IV, as TLS 1.1+ and ESP do
+        for (uint32_t r=0; r<pt->depth; r++)
+        {
+            memcpy(ivs[r], &n, sizeof(n));
+            ivs[r][AESIVSIZE - 1] = (uint8_t)r;
+            bufs[r] = (aes256pipebuf_t){ ivs[r], in[r], msglen, out[r], 0, 0 };
+        }
+        if (aes256pipeline(ctx, ENCRYPT, bufs, pt->depth) != 0)
+            pt->errors++;
+    }
+    aes256keyctx_free(ctx);
+    return NULL;
+}
+
+/*
+ * Encrypts iterations records per thread on nthreads threads, depth records per pipeline
+ */
+static void runpipeline(int nthreads, uint32_t depth)
+{
+    pthread_t tids[nthreads];
+    pipethread_t pts[nthreads];
+    int errors = 0;
+    double start = now();
+
+    for (int t=0; t<nthreads; t++)
+    {
+        pts[t].id = t;
+        pts[t].depth = depth;
+        pts[t].errors = 0;
+        pthread_create(&tids[t], NULL, pipethread, &pts[t]);
+    }
+    for (int t=0; t<nthreads; t++)
+    {
+        pthread_join(tids[t], NULL);
+        errors += pts[t].errors;
+    }
+
+    double elapsed = now() - start;
+    long records = (long)nthreads * ((iterations + depth - 1) / depth) * depth;
+    printf("%8d %6u %10ld %10.3f %12.1f %10.3f %8d\n", nthreads, depth, records, elapsed,
+           records / elapsed, (double)records * msglen / elapsed / 1e6, errors);
+}
+
+/*
+ * Encrypts iterations packets one at a time with an idle gap before each, in CBC when ctr is
+ * NULL, and prints the time spent encrypting per packet
+ */
+static void runpackets(const char *mode, aes256keyctx_t *ctx, aes256ctr_t *ctr)
+{
+    uint8_t iv[AESIVSIZE] = { 0 };
+    uint8_t in[AESMAXDATASIZE] = { 0 }, out[AESMAXDATASIZE + AESBLKSIZE];
+    struct timespec gap = { 0, CTRGAPNS };
+    aes256ctrstats_t cs = { 0 };
+    double busy = 0;
+    uint32_t olen;
+    int errors = 0;
+
+    for (int n=0; n<iterations; n++)
+    {
+        double t;
+        int32_t ret;
+
+        nanosleep(&gap, NULL);
+        t = now();
+        if (ctr != NULL)
+            ret = aes256ctr(ctr, in, msglen, out);
+        else
+            ret = aes256ctx(ctx, ENCRYPT, iv, in, msglen, out, &olen);
+        busy += now() - t;
+        if (ret != 0)
+            errors++;
+    }
+
+    if (ctr != NULL)
+        aes256ctr_stats(ctr, &cs);
+    printf("%-16s %10d %12.2f %10.3f %10.1f %8d\n", mode, iterations, busy / iterations * 1e6,
+           (double)iterations * msglen / busy / 1e6,
+           (cs.cachedblocks + cs.inlineblocks) ? 100.0 * cs.cachedblocks / (cs.cachedblocks + cs.inlineblocks) : 0.0,
+           errors);
+}
+
+/*
+ * Forwards iterations packets from a datagram socketpair to a UDP socket on the loopback, in
+ * batches of FWDBATCH, either the usual way or through aes256splice(), and prints the rate and
+ * the CPU copies of the payload per packet
+ */
+static void runforward(const char *path, aes256keyctx_t *ctx, int usesplice)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t alen = sizeof(addr);
+    uint8_t ivs[FWDBATCH][AESIVSIZE];
+    uint8_t pkt[AESMAXDATASIZE + AESBLKSIZE], out[AESIVSIZE + AESMAXDATASIZE + AESBLKSIZE];
+    aes256splice_t *sp = NULL;
+    aes256splicestats_t ss = { 0 };
+    uint64_t copies = 0;
+    int tun[2], rx, tx, errors = 0;
+    long packets = 0;
+    double start;
+
+    rx = socket(AF_INET, SOCK_DGRAM, 0);
+    tx = socket(AF_INET, SOCK_DGRAM, 0);
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, tun) < 0 || rx < 0 || tx < 0 ||
+        bind(rx, (struct sockaddr *)&addr, sizeof(addr)) < 0 || getsockname(rx, (struct sockaddr *)&addr, &alen) < 0 ||
+        connect(tx, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror("ERROR: failed to set up the forwarding sockets");
+        return;
+    }
+    fcntl(tun[0], F_SETFL, O_NONBLOCK);
+    fcntl(rx, F_SETFL, O_NONBLOCK);
+    if (usesplice)
+        sp = aes256splice_new(ctx, 2 * FWDBATCH, msglen);
+
+    memset(pkt, 0x5a, msglen);
+    start = now();
+    while (packets < iterations)
+    {
+        uint32_t moved = 0;
+
+        for (int b=0; b<FWDBATCH; b++)
+            send(tun[1], pkt, msglen, 0);
+
+        if (sp != NULL)
+        {
+            if (aes256splice(sp, ENCRYPT, tun[0], tx, FWDBATCH, &moved) != 0)
+                errors++;
+        }
+        else
+        {
+            // a random IV in front of each packet, as aes256splice() sends them
+            if (getrandom(ivs, sizeof(ivs), 0) != sizeof(ivs))
+                errors++;
+            for (; moved<FWDBATCH; moved++)
+            {
+                uint8_t buf[AESMAXDATASIZE];
+                ssize_t n = read(tun[0], buf, sizeof(buf));
+                uint32_t olen;
+
+                memcpy(out, ivs[moved], AESIVSIZE);
+                if (n <= 0 || aes256ctx(ctx, ENCRYPT, ivs[moved], buf, n, &out[AESIVSIZE], &olen) != 0)
+                {
+                    errors++;
+                    break;
+                }
+                if (write(tx, out, AESIVSIZE + olen) != AESIVSIZE + olen)
+                    errors++;
+                copies += 2;
+            }
+        }
+        packets += moved;
+
+        while (recv(rx, out, sizeof(out), 0) > 0)
+            ;
+    }
+    double elapsed = now() - start;
+
+    if (sp != NULL)
+    {
+        aes256splice_stats(sp, &ss);
+        copies = ss.copies;
+        aes256splice_free(sp);
+    }
+    printf("%-16s %10ld %10.3f %12.1f %10.3f %12.2f %8d\n", path, packets, elapsed, packets / elapsed,
+           (double)packets * msglen / elapsed / 1e6, (double)copies / packets, errors);
+    close(tun[0]);
+    close(tun[1]);
+    close(rx);
+    close(tx);
+}
+
+int main(int argc, char **argv)
+{
+    int maxthreads = DEFAULT_MAXTHREADS;
+
+    if (argc > 1)
+        maxthreads = atoi(argv[1]);
+    if (argc > 2)
+        msglen = atoi(argv[2]);
+    if (argc > 3)
+        iterations = atoi(argv[3]);
+
+    if (maxthreads < 1 || msglen < 1 || msglen > AESMAXDATASIZE || iterations < 1)
+    {
+        fprintf(stderr, "usage: %s [maxthreads] [msglen 1-%d] [iterations]\n", argv[0], AESMAXDATASIZE);
+        return 1;
+    }
+
+    if (aes256init() != 0)
+        return 1;
+
+    printf("%8s %10s %10s %12s %10s %8s\n", "threads", "requests", "seconds", "requests/s", "MB/s", "errors");
+    for (int nthreads=1; nthreads<=maxthreads; nthreads++)
+        runthreads(nthreads);
+
+
+    aes256cachestats_t stats;
+    aes256cachestats(&stats);
+    printf("device key cache: %llu hits, %llu misses; iv cache: %llu hits, %llu misses\n",
+           (unsigned long long)stats.keyhits, (unsigned long long)stats.keymisses,
+           (unsigned long long)stats.ivhits, (unsigned long long)stats.ivmisses);
+
+    uint8_t key[AESKEYSIZE] = { 0 }, iv[AESIVSIZE] = { 0 };
+    uint8_t *big = calloc(1, PARDECRYPT_LEN);
+    aes256keyctx_t *ctx = aes256keyctx_new(key);
+    uint32_t olen;
+
+    printf("\n%10s %10s %10s %8s\n", "cputhreads", "seconds", "MB/s", "status");
+    for (int ncpu=0; ncpu<maxthreads; ncpu++)
+    {
+        int32_t status = 0;
+        double start = now();
+
+        for (int n=0; n<iterations / 100 + 1; n++)
+        {
+            int32_t ret = aes256pardecrypt(ctx, iv, big, PARDECRYPT_LEN, big, &olen, ncpu);
+            if (status == 0)
+                status = ret;
+        }
+
+        double elapsed = now() - start;
+        printf("%10d %10.3f %10.3f %8d\n", ncpu, elapsed,
+               (double)(iterations / 100 + 1) * PARDECRYPT_LEN / elapsed / 1e6, status);
+    }
+    aes256keyctx_free(ctx);
+    free(big);
+
+    // one buffer per thread, so every get after warm-up should be a hit
+    pool = aes256pool_new(maxthreads, msglen);
+    if (pool != NULL)
+    {
+        aes256poolstats_t pstats;
+
+        printf("\nin place, pool buffers\n");
+        printf("%8s %10s %10s %12s %10s %8s\n", "threads", "requests", "seconds", "requests/s", "MB/s", "errors");
+        runthreads(maxthreads);
+        aes256pool_stats(pool, &pstats);
+        printf("buffer pool: %llu gets, %.1f%% hits, %llu misses, %u buffers at most in use\n",
+               (unsigned long long)pstats.gets, pstats.gets ? 100.0 * pstats.hits / pstats.gets : 0.0,
+               (unsigned long long)pstats.misses, pstats.highwater);
+        aes256pool_free(pool);
+        pool = NULL;
+    }
+
+    printf("\npipelined records, one key and IV per record\n");
+    printf("%8s %6s %10s %10s %12s %10s %8s\n", "threads", "depth", "records", "seconds", "records/s", "MB/s",
+           "errors");
+    for (uint32_t depth=1; depth<=AESMAXPIPELINE; depth*=2)
+        runpipeline(1, depth);
+    for (uint32_t depth=1; depth<=AESMAXPIPELINE && maxthreads > 1; depth*=2)
+        runpipeline(maxthreads, depth);
+
+    uint8_t ctr0[AESBLKSIZE] = { 0 };
+    aes256ctr_t *ctr;
+
+    ctx = aes256keyctx_new(key);
+    printf("\npackets %d us apart, encryption time only\n", CTRGAPNS / 1000);
+    printf("%-16s %10s %12s %10s %10s %8s\n", "mode", "packets", "us/packet", "MB/s", "cached %", "errors");
+    runpackets("cbc", ctx, NULL);
+    ctr = aes256ctr_new(ctx, ctr0, 0, 0);
+    if (ctr != NULL)
+        runpackets("ctr", ctx, ctr);
+    aes256ctr_free(ctr);
+    ctr = aes256ctr_new(ctx, ctr0, CTRCACHEBLOCKS, 1);
+    if (ctr != NULL)
+        runpackets("ctr, keystream", ctx, ctr);
+    aes256ctr_free(ctr);
+
+    printf("\nforwarding datagram socket to UDP\n");
+    printf("%-16s %10s %10s %12s %10s %12s %8s\n", "path", "packets", "seconds", "packets/s", "MB/s", "copies/packet",
+           "errors");
+    runforward("read/write", ctx, 0);
+    runforward("splice", ctx, 1);
+    aes256keyctx_free(ctx);
+
+    aes256shutdown();
+    return 0;
+}
@@ -0,0 +1,356 @@
+/**
+ * @file   wsaesctr.c
+ * @brief  AES-256-CTR with a precomputed keystream cache for libwsaescbc.
+ *
+ * The block only does CBC, but CBC over a single block with a zero IV is E(K, block), so the
+ * keystream block for counter i is one ENCRYPT|AESNOPAD record of the counter itself. Such
+ * records are independent, so up to AESMAXPIPELINE of them go to the device as one pipeline,
+ * and since they all share the zero IV the device never has to reload it between them.
+ *
+ * Keystream lives in a ring of cacheblocks blocks holding the blocks for the counters right
+ * after the stream's position. Only one pipeline of keystream is made at a time, by whoever holds
+ * the making flag (the refill thread, aes256ctr_refill() or a caller that ran dry), so blocks land
+ * in counter order. The flag is taken per pipeline rather than per refill, so a caller waiting on
+ * an empty ring gets going as soon as the first pipeline is in. lock covers everything else and
+ * is never held across a device call.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "wsaescbc.h"
+
+#define CTRIDLEWAITNS 50000   // background refill waits this long at a time for an idle device
+
+struct aes256ctr {
+    aes256keyctx_t *ctx;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;      // wakes the refill thread
+    pthread_cond_t madecond;  // making was dropped, maybe with new keystream in the ring
+    pthread_t refiller;
+    int background;
+    int kick;
+    int stop;
+    int making;               // a pipeline of keystream is being made
+    uint8_t *ring;            // capacity keystream blocks
+    uint32_t head;            // oldest unused block
+    uint32_t count;
+    uint8_t genctr[AESBLKSIZE];      // counter of the next block to make, owned by making
+    uint8_t partial[AESBLKSIZE];     // keystream left over from a block the stream is inside
+    uint32_t partlen;
+    aes256ctrstats_t stats;
+};
+
+static const uint8_t zeroiv[AESIVSIZE];
+
+
+static void aes256ctrinc(uint8_t *ctr)
+{
+    for (int i=AESBLKSIZE-1; i>=0; i--)
+    {
+        if (++ctr[i] != 0)
+            break;
+    }
+}
+
+
+static void aes256ctrxor(uint8_t *outp, const uint8_t *inp, const uint8_t *ks, uint32_t len)
+{
+    uint32_t i = 0;
+
+    for (; i+sizeof(uint64_t)<=len; i+=sizeof(uint64_t))
+    {
+        uint64_t a, b;
+
+        memcpy(&a, inp + i, sizeof(a));
+        memcpy(&b, ks + i, sizeof(b));
+        a ^= b;
+        memcpy(outp + i, &a, sizeof(a));
+    }
+    for (; i<len; i++)
+        outp[i] = inp[i] ^ ks[i];
+}
+
+
+/*
+ * Makes the keystream for the next n (at most AESMAXPIPELINE) counters into outp. Caller has set
+ * making.
+ */
+static int32_t aes256ctrgen(aes256ctr_t *ctr, uint8_t *outp, uint32_t n)
+{
+    uint8_t ctrs[AESMAXPIPELINE][AESBLKSIZE];
+    aes256pipebuf_t bufs[AESMAXPIPELINE];
+    int32_t ret;
+
+    for (uint32_t i=0; i<n; i++)
+    {
+        memcpy(ctrs[i], ctr->genctr, AESBLKSIZE);
+        aes256ctrinc(ctr->genctr);
+        bufs[i] = (aes256pipebuf_t){ (uint8_t *)zeroiv, ctrs[i], AESBLKSIZE, &outp[i * AESBLKSIZE], 0, 0 };
+    }
+
+    ret = aes256pipeline(ctr->ctx, ENCRYPT | AESNOPAD, bufs, n);
+    if (ret != 0)
+    {
+        // those counters were not consumed, make them again next time
+        memcpy(ctr->genctr, ctrs[0], AESBLKSIZE);
+    }
+    return ret;
+}
+
+
+/*
+ * Fills the ring up to capacity, one pipeline at a time. With idlewait set, each pipeline first
+ * waits for the device to have nothing else queued, as long as the ring is not empty.
+ */
+static int32_t aes256ctrfill(aes256ctr_t *ctr, int idlewait)
+{
+    int32_t ret = 0;
+
+    pthread_mutex_lock(&ctr->lock);
+    for (;;)
+    {
+        uint32_t tail, n;
+
+        while (ctr->making && !ctr->stop)
+            pthread_cond_wait(&ctr->madecond, &ctr->lock);
+        if (ctr->stop || ctr->count == ctr->stats.capacity)
+            break;
+        if (idlewait && ctr->count > 0 && aes256queued() > 0)
+        {
+            struct timespec ts = { 0, CTRIDLEWAITNS };
+
+            pthread_mutex_unlock(&ctr->lock);
+            nanosleep(&ts, NULL);
+            pthread_mutex_lock(&ctr->lock);
+            continue;
+        }
+
+        // the free run after the tail is the maker's until count is raised
+        tail = (ctr->head + ctr->count) % ctr->stats.capacity;
+        n = ctr->stats.capacity - ctr->count;
+        if (n > ctr->stats.capacity - tail)
+            n = ctr->stats.capacity - tail;
+        if (n > AESMAXPIPELINE)
+            n = AESMAXPIPELINE;
+        ctr->making = 1;
+        pthread_mutex_unlock(&ctr->lock);
+
+        ret = aes256ctrgen(ctr, &ctr->ring[tail * AESBLKSIZE], n);
+
+        pthread_mutex_lock(&ctr->lock);
+        ctr->making = 0;
+        pthread_cond_broadcast(&ctr->madecond);
+        if (ret != 0)
+            break;
+        ctr->count += n;
+        ctr->stats.refills++;
+    }
+    pthread_mutex_unlock(&ctr->lock);
+    return ret;
+}
+
+
+static void *aes256ctrrefiller(void *arg)
+{
+    aes256ctr_t *ctr = (aes256ctr_t *)arg;
+
+    pthread_mutex_lock(&ctr->lock);
+    for (;;)
+    {
+        while (!ctr->kick && !ctr->stop)
+            pthread_cond_wait(&ctr->cond, &ctr->lock);
+        if (ctr->stop)
+            break;
+        ctr->kick = 0;
+        pthread_mutex_unlock(&ctr->lock);
+
+        // a failure shows up in the caller, which then makes its keystream itself
+        aes256ctrfill(ctr, 1);
+        pthread_mutex_lock(&ctr->lock);
+    }
+    pthread_mutex_unlock(&ctr->lock);
+    return NULL;
+}
+
+
+/*
+ * Starts a CTR stream at the 16-byte initial counter ctrp, with room for cacheblocks blocks of
+ * keystream (0 for none). The cache is not filled until aes256ctr_refill() or, with background
+ * set, by the refill thread straight away.
+ */
+aes256ctr_t *aes256ctr_new(aes256keyctx_t *ctx, const uint8_t *ctrp, uint32_t cacheblocks, int background)
+{
+    aes256ctr_t *ctr;
+    void *ring = NULL;
+
+    ctr = calloc(1, sizeof(aes256ctr_t));
+    if (ctr == NULL)
+        return NULL;
+    if (cacheblocks > 0 && posix_memalign(&ring, AESCACHELINE, (size_t)cacheblocks * AESBLKSIZE) != 0)
+    {
+        perror("ERROR: failed to allocate the keystream cache");
+        free(ctr);
+        return NULL;
+    }
+
+    ctr->ctx = ctx;
+    ctr->ring = ring;
+    ctr->stats.capacity = cacheblocks;
+    memcpy(ctr->genctr, ctrp, AESBLKSIZE);
+    pthread_mutex_init(&ctr->lock, NULL);
+    pthread_cond_init(&ctr->cond, NULL);
+    pthread_cond_init(&ctr->madecond, NULL);
+
+    if (background && cacheblocks > 0)
+    {
+        ctr->kick = 1;
+        if (pthread_create(&ctr->refiller, NULL, aes256ctrrefiller, ctr) != 0)
+        {
+            fprintf(stderr, "ERROR: failed to start the keystream refill thread\n");
+            aes256ctr_free(ctr);
+            return NULL;
+        }
+        ctr->background = 1;
+    }
+    return ctr;
+}
+
+
+/*
+ * Stops the refill thread and wipes the keystream
+ */
+void aes256ctr_free(aes256ctr_t *ctr)
+{
+    if (ctr == NULL)
+        return;
+
+    if (ctr->background)
+    {
+        pthread_mutex_lock(&ctr->lock);
+        ctr->stop = 1;
+        pthread_cond_signal(&ctr->cond);
+        pthread_cond_broadcast(&ctr->madecond);
+        pthread_mutex_unlock(&ctr->lock);
+        pthread_join(ctr->refiller, NULL);
+    }
+
+    pthread_cond_destroy(&ctr->madecond);
+    pthread_cond_destroy(&ctr->cond);
+    pthread_mutex_destroy(&ctr->lock);
+    if (ctr->ring != NULL)
+    {
+        memset(ctr->ring, 0, (size_t)ctr->stats.capacity * AESBLKSIZE);
+        free(ctr->ring);
+    }
+    memset(ctr, 0, sizeof(aes256ctr_t));
+    free(ctr);
+}
+
+
+/*
+ * Fills the keystream cache now, e.g. from an event loop with nothing else to do
+ */
+int32_t aes256ctr_refill(aes256ctr_t *ctr)
+{
+    if (ctr->stats.capacity == 0)
+        return 0;
+    return aes256ctrfill(ctr, 0);
+}
+
+
+/*
+ * Encrypts or decrypts inlen bytes at the stream's position and moves it on. inp and outp may be
+ * the same buffer. A failure can leave the stream part way through the call.
+ */
+int32_t aes256ctr(aes256ctr_t *ctr, const uint8_t *inp, uint32_t inlen, uint8_t *outp)
+{
+    uint8_t ks[AESMAXPIPELINE * AESBLKSIZE];
+    uint32_t pos = 0, n;
+    int32_t ret = 0;
+
+    pthread_mutex_lock(&ctr->lock);
+    n = (inlen < ctr->partlen) ? inlen : ctr->partlen;
+    aes256ctrxor(outp, inp, &ctr->partial[AESBLKSIZE - ctr->partlen], n);
+    ctr->partlen -= n;
+    pos = n;
+
+    while (pos < inlen)
+    {
+        uint32_t want = (inlen - pos + AESBLKSIZE - 1) / AESBLKSIZE;
+
+        if (ctr->count > 0)
+        {
+            // straight from the ring, as far as it runs without wrapping
+            n = ctr->stats.capacity - ctr->head;
+            if (n > ctr->count)
+                n = ctr->count;
+            if (n > want)
+                n = want;
+            ctr->stats.cachedblocks += n;
+        }
+        else if (ctr->making)
+        {
+            // the ring is dry but keystream is on its way
+            pthread_cond_wait(&ctr->madecond, &ctr->lock);
+            continue;
+        }
+        else
+        {
+            n = (want > AESMAXPIPELINE) ? AESMAXPIPELINE : want;
+            ctr->making = 1;
+            pthread_mutex_unlock(&ctr->lock);
+
+            ret = aes256ctrgen(ctr, ks, n);
+
+            pthread_mutex_lock(&ctr->lock);
+            ctr->making = 0;
+            pthread_cond_broadcast(&ctr->madecond);
+            if (ret != 0)
+                break;
+            ctr->stats.inlineblocks += n;
+        }
+
+        for (uint32_t b=0; b<n && pos<inlen; b++)
+        {
+            const uint8_t *blk = (ctr->count > 0) ? &ctr->ring[(ctr->head + b) * AESBLKSIZE] : &ks[b * AESBLKSIZE];
+            uint32_t len = (inlen - pos < AESBLKSIZE) ? inlen - pos : AESBLKSIZE;
+
+            aes256ctrxor(&outp[pos], &inp[pos], blk, len);
+            pos += len;
+            if (len < AESBLKSIZE)
+            {
+                memcpy(ctr->partial, blk, AESBLKSIZE);
+                ctr->partlen = AESBLKSIZE - len;
+            }
+        }
+        if (ctr->count > 0)
+        {
+            ctr->head = (ctr->head + n) % ctr->stats.capacity;
+            ctr->count -= n;
+        }
+    }
+
+    if (ret == 0)
+        ctr->stats.bytes += inlen;
+    if (ctr->background && ctr->count < ctr->stats.capacity / 2)
+    {
+        ctr->kick = 1;
+        pthread_cond_signal(&ctr->cond);
+    }
+    pthread_mutex_unlock(&ctr->lock);
+    return ret;
+}
+
+
+void aes256ctr_stats(aes256ctr_t *ctr, aes256ctrstats_t *stats)
+{
+    pthread_mutex_lock(&ctr->lock);
+    *stats = ctr->stats;
+    stats->cached = ctr->count;
+    pthread_mutex_unlock(&ctr->lock);
+}
@@ -0,0 +1,176 @@
+/**
+ * @file   wsaesetm.c
+ * @brief  Encrypt-then-MAC and verify-then-decrypt pipelines for libwsaescbc.
+ *
+ * The message is cut into AESMAXDATASIZE pieces. On encryption the next piece is queued on the
+ * AES block as soon as the previous one has come back (CBC needs its last ciphertext block as
+ * IV), and the returned piece is then fed to the MAC while the AES block works on the next one.
+ * On decryption every piece can be queued at once, and the MAC runs over the ciphertext while
+ * the AES block decrypts it. Either way a packet costs roughly the slower of the two engines
+ * rather than their sum.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "wsaescbc.h"
+
+
+static int32_t aes256etmchecktag(const aes256mac_t *mac)
+{
+    if (mac->taglen == 0 || mac->taglen > AESMAXTAGLEN)
+    {
+        fprintf(stderr, "ERROR: MAC tag of %u bytes, must be 1 to %d bytes\n", mac->taglen, AESMAXTAGLEN);
+        return EINVAL;
+    }
+    return 0;
+}
+
+
+/*
+ * Encrypts inlen bytes (padded as by aes256()) and computes the MAC over the IV and the ciphertext.
+ * mac must already be keyed and may have absorbed a header; its tag is written to tagp.
+ */
+int32_t aes256etm_encrypt(aes256keyctx_t *ctx, uint8_t *ivp, uint8_t *inp, uint32_t inlen,
+                          uint8_t *outp, uint32_t *lenp, aes256mac_t *mac, uint8_t *tagp)
+{
+    uint32_t pos = 0, len, olen, total = 0;
+    aes256req_t *req;
+    int32_t ret;
+
+    if (inlen == 0)
+    {
+        fprintf(stderr, "ERROR: Provided data length (%d) too small, must be at least 1 bytes\n", inlen);
+        return -1;
+    }
+    ret = aes256etmchecktag(mac);
+    if (ret != 0)
+        return ret;
+
+    // the IV is authenticated too, or flipping its bits would flip the first plaintext block's
+    mac->update(mac->state, ivp, AESIVSIZE);
+
+    // all pieces but the last are full and unpadded
+    len = (inlen > AESMAXDATASIZE) ? AESMAXDATASIZE : inlen;
+    ret = aes256submit((len < inlen) ? (ENCRYPT | AESNOPAD) : ENCRYPT, aes256keyctx_key(ctx), ivp,
+                       inp, len, outp, &olen, NULL, NULL, &req);
+    if (ret != 0)
+        return ret;
+
+    for (;;)
+    {
+        uint32_t done, donelen;
+
+        ret = aes256wait(req);
+        if (ret != 0)
+            return ret;
+
+        done = total;
+        donelen = olen;
+        total += olen;
+        pos += len;
+
+        // start the next piece before hashing this one
+        if (pos < inlen)
+        {
+            len = (inlen - pos > AESMAXDATASIZE) ? AESMAXDATASIZE : inlen - pos;
+            ret = aes256submit((pos + len < inlen) ? (ENCRYPT | AESNOPAD) : ENCRYPT, aes256keyctx_key(ctx),
+                               &outp[pos - AESBLKSIZE], &inp[pos], len, &outp[pos], &olen, NULL, NULL, &req);
+            if (ret != 0)
+                return ret;
+        }
+
+        mac->update(mac->state, &outp[done], donelen);
+
+        if (pos >= inlen)
+            break;
+    }
+
+    mac->final(mac->state, tagp);
+    *lenp = total;
+    return 0;
+}
+
+
+/*
+ * Computes the MAC over the IV and inlen bytes of ciphertext while decrypting them, and only hands back the
+ * plaintext if the MAC matches tagp. On a mismatch outp is wiped and EBADMSG returned. inp and
+ * outp must not overlap, since the MAC is still reading the ciphertext while plaintext lands.
+ */
+int32_t aes256etm_decrypt(aes256keyctx_t *ctx, uint8_t *ivp, uint8_t *inp, uint32_t inlen,
+                          uint8_t *outp, uint32_t *lenp, aes256mac_t *mac, const uint8_t *tagp)
+{
+    uint32_t npieces = (inlen + AESMAXDATASIZE - 1) / AESMAXDATASIZE;
+    uint32_t pos, len, nreqs = 0;
+    uint32_t *olens;
+    aes256req_t **reqs;
+    uint8_t tag[AESMAXTAGLEN];
+    uint8_t diff = 0;
+    int32_t ret = 0, status;
+
+    if (inlen == 0 || inlen % AESBLKSIZE != 0)
+    {
+        fprintf(stderr, "ERROR: Provided data length (%d) must be a non-zero multiple of %d bytes\n",
+                inlen, AESBLKSIZE);
+        return -1;
+    }
+    ret = aes256etmchecktag(mac);
+    if (ret != 0)
+        return ret;
+
+    olens = malloc(npieces * sizeof(uint32_t));
+    reqs = malloc(npieces * sizeof(aes256req_t *));
+    if (olens == NULL || reqs == NULL)
+    {
+        free(olens);
+        free(reqs);
+        return ENOMEM;
+    }
+
+    // pieces are independent given their IVs, so queue them all up front
+    for (pos=0; pos<inlen; pos+=len)
+    {
+        len = (inlen - pos > AESMAXDATASIZE) ? AESMAXDATASIZE : inlen - pos;
+        ret = aes256submit(DECRYPT, aes256keyctx_key(ctx), (pos == 0) ? ivp : &inp[pos - AESBLKSIZE],
+                           &inp[pos], len, &outp[pos], &olens[nreqs], NULL, NULL, &reqs[nreqs]);
+        if (ret != 0)
+            break;
+        nreqs++;
+    }
+
+    if (ret == 0)
+    {
+        mac->update(mac->state, ivp, AESIVSIZE);
+        mac->update(mac->state, inp, inlen);
+        mac->final(mac->state, tag);
+    }
+
+    for (uint32_t r=0; r<nreqs; r++)
+    {
+        status = aes256wait(reqs[r]);
+        if (ret == 0)
+            ret = status;
+    }
+    free(olens);
+    free(reqs);
+
+    if (ret == 0)
+    {
+        // compare in constant time
+        for (uint32_t i=0; i<mac->taglen; i++)
+            diff |= tag[i] ^ tagp[i];
+        if (diff != 0)
+            ret = EBADMSG;
+    }
+
+    if (ret != 0)
+    {
+        memset(outp, 0, inlen);
+        return ret;
+    }
+
+    *lenp = inlen;
+    return 0;
+}
@@ -0,0 +1,119 @@
+/**
+ * @file   wsaesfile.c
+ * @brief  Encrypts or decrypts a whole file on the AES block with aes256file(), the way
+ * openssl enc -aes-256-cbc -K key -iv iv [-d] -in infile -out outfile does, and prints the rate.
+ *
+ * usage: wsaesfile [-d] [-w window KiB] [-t cputhreads] -k hexkey -v hexiv infile outfile
+ *
+ * Both files must be regular files; pipes and /dev/stdin cannot be mapped.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "wsaescbc.h"
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Parses exactly len bytes of hex, as openssl enc takes -K and -iv
+ */
+static int parsehex(const char *hex, uint8_t *out, int len)
+{
+    if (strlen(hex) != 2 * len)
+        return -1;
+    for (int i=0; i<len; i++)
+    {
+        if (sscanf(&hex[2 * i], "%2hhx", &out[i]) != 1)
+            return -1;
+    }
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-d] [-w window KiB] [-t cputhreads] -k hexkey -v hexiv infile outfile\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    uint8_t key[AESKEYSIZE], iv[AESIVSIZE];
+    int mode = ENCRYPT, ncpu = 0, havekey = 0, haveiv = 0, opt;
+    uint32_t window = 0;
+    aes256keyctx_t *ctx;
+    struct stat st;
+    int infd, outfd;
+    int32_t ret;
+    double start, elapsed;
+
+    while ((opt = getopt(argc, argv, "dw:t:k:v:h")) != -1)
+    {
+        switch (opt)
+        {
+            case 'd': mode = DECRYPT; break;
+            case 'w': window = atoi(optarg) * 1024; break;
+            case 't': ncpu = atoi(optarg); break;
+            case 'k': havekey = (parsehex(optarg, key, AESKEYSIZE) == 0); break;
+            case 'v': haveiv = (parsehex(optarg, iv, AESIVSIZE) == 0); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (!havekey || !haveiv || ncpu < 0 || optind + 2 != argc)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    infd = open(argv[optind], O_RDONLY);
+    if (infd < 0 || fstat(infd, &st) < 0)
+    {
+        perror(argv[optind]);
+        return 1;
+    }
+    outfd = open(argv[optind + 1], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (outfd < 0)
+    {
+        perror(argv[optind + 1]);
+        return 1;
+    }
+
+    if (aes256init() != 0)
+        return 1;
+    ctx = aes256keyctx_new(key);
+    if (ctx == NULL)
+        return 1;
+
+    start = now();
+    ret = aes256file(ctx, mode, iv, infd, outfd, window, ncpu);
+    if (ret == 0 && fsync(outfd) < 0)
+        ret = errno;
+    elapsed = now() - start;
+
+    aes256keyctx_free(ctx);
+    aes256shutdown();
+    close(infd);
+    if (close(outfd) < 0 && ret == 0)
+        ret = errno;
+
+    if (ret != 0)
+    {
+        fprintf(stderr, "ERROR: %s failed: %s\n", (mode == DECRYPT) ? "decryption" : "encryption",
+                (ret == EBADMSG) ? "bad padding, wrong key or IV?" : strerror(ret));
+        return 1;
+    }
+    printf("%s %lld bytes in %.3f s: %.2f MB/s\n", (mode == DECRYPT) ? "decrypted" : "encrypted",
+           (long long)st.st_size, elapsed, st.st_size / elapsed / 1e6);
+    return 0;
+}
@@ -0,0 +1,161 @@
+/**
+ * @file   wsaespool.c
+ * @brief  Payload buffer pool for libwsaescbc.
+ *
+ * All buffers are carved out of one cache-line aligned allocation made up front, each starting
+ * on its own cache line so two threads working on neighbouring buffers never share a line. Free
+ * buffers are kept on a LIFO stack, which hands out the most recently released (and most likely
+ * still cached) buffer first. Buffers are never cleared: a payload is written over them anyway.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "wsaescbc.h"
+
+struct aes256pool {
+    pthread_mutex_t lock;
+    uint8_t *base;       // nbufs * stride bytes
+    uint32_t stride;     // bufsize rounded up to a cache line
+    uint32_t bufsize;
+    uint32_t nbufs;
+    uint32_t nfree;
+    uint8_t **freelist;
+    aes256poolstats_t stats;
+};
+
+
+/*
+ * Creates a pool of nbufs buffers, each big enough for a maxlen-byte payload encrypted in place
+ */
+aes256pool_t *aes256pool_new(uint32_t nbufs, uint32_t maxlen)
+{
+    aes256pool_t *pool;
+    void *base;
+
+    if (nbufs == 0 || maxlen == 0 || maxlen > AESMAXDATASIZE)
+    {
+        fprintf(stderr, "ERROR: pool needs at least one buffer of 1 to %d bytes\n", AESMAXDATASIZE);
+        return NULL;
+    }
+
+    pool = calloc(1, sizeof(aes256pool_t));
+    if (pool == NULL)
+        return NULL;
+
+    // round the payload up to whole blocks, then add a block of headroom for the padding
+    pool->bufsize = (maxlen + AESBLKSIZE - 1) / AESBLKSIZE * AESBLKSIZE + AESBLKSIZE;
+    pool->stride = (pool->bufsize + AESCACHELINE - 1) / AESCACHELINE * AESCACHELINE;
+    pool->nbufs = nbufs;
+
+    pool->freelist = malloc(nbufs * sizeof(uint8_t *));
+    if (pool->freelist == NULL || posix_memalign(&base, AESCACHELINE, (size_t)nbufs * pool->stride) != 0)
+    {
+        perror("ERROR: failed to allocate buffer pool");
+        free(pool->freelist);
+        free(pool);
+        return NULL;
+    }
+    pool->base = base;
+
+    // stacked so that the first buffer is handed out first
+    for (uint32_t i=0; i<nbufs; i++)
+        pool->freelist[i] = pool->base + (size_t)(nbufs - 1 - i) * pool->stride;
+    pool->nfree = nbufs;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+
+/*
+ * Releases a pool. Fails with EBUSY while buffers are still out.
+ */
+int32_t aes256pool_free(aes256pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (pool->stats.inuse > 0)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        return EBUSY;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->base);
+    free(pool->freelist);
+    free(pool);
+    return 0;
+}
+
+
+uint32_t aes256pool_bufsize(aes256pool_t *pool)
+{
+    return pool->bufsize;
+}
+
+
+/*
+ * Takes a buffer from the pool, or from the heap (a miss) when the pool is empty
+ */
+uint8_t *aes256pool_get(aes256pool_t *pool)
+{
+    uint8_t *buf = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stats.gets++;
+    if (pool->nfree > 0)
+    {
+        buf = pool->freelist[--pool->nfree];
+        pool->stats.hits++;
+    }
+    else
+        pool->stats.misses++;
+    if (++pool->stats.inuse > pool->stats.highwater)
+        pool->stats.highwater = pool->stats.inuse;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (buf == NULL)
+    {
+        void *p;
+
+        if (posix_memalign(&p, AESCACHELINE, pool->stride) != 0)
+        {
+            pthread_mutex_lock(&pool->lock);
+            pool->stats.inuse--;
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        buf = p;
+    }
+    return buf;
+}
+
+
+/*
+ * Returns a buffer; one that came from the heap goes back to the heap
+ */
+void aes256pool_put(aes256pool_t *pool, uint8_t *buf)
+{
+    int ours = (buf >= pool->base && buf < pool->base + (size_t)pool->nbufs * pool->stride);
+
+    pthread_mutex_lock(&pool->lock);
+    if (ours)
+        pool->freelist[pool->nfree++] = buf;
+    pool->stats.inuse--;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!ours)
+        free(buf);
+}
+
+
+void aes256pool_stats(aes256pool_t *pool, aes256poolstats_t *stats)
+{
+    pthread_mutex_lock(&pool->lock);
+    memcpy(stats, &pool->stats, sizeof(aes256poolstats_t));
+    pthread_mutex_unlock(&pool->lock);
+}
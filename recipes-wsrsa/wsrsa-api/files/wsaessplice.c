@@ -0,0 +1,275 @@
+/**
+ * @file   wsaessplice.c
+ * @brief  fd to fd packet path for libwsaescbc, for forwarders between a TUN device and a socket.
+ *
+ * The AES block is driven through write()/read() on user memory, so a packet has to be in user
+ * memory once; the point is to have it there only once. Each packet is read straight into a
+ * page of a fixed buffer pool, encrypted in place, and then handed to the output fd by
+ * reference: vmsplice() puts the page into a pipe without copying it and splice() moves it on to
+ * outfd, which for a socket means the page itself goes into the skb. The usual path, read into
+ * one buffer, aes256() into another and write() from there, copies the payload twice on the CPU
+ * besides the device I/O; this one copies it once.
+ *
+ * Every packet is encrypted on its own under a fresh random IV, which goes on the wire in front of
+ * its ciphertext as in ESP. Nothing is chained from one datagram to the next: an IV taken from
+ * the previous ciphertext is known to whoever sees the wire before the next plaintext is chosen
+ * (the TLS 1.0 CBC attack), and a lost or reordered datagram would garble the one after it. The
+ * IVs come from a pool of getrandom() bytes, refilled a page at a time.
+ *
+ * A page handed over by reference may still sit in outfd's queue after splice() returns, so pages
+ * are taken round robin and a page is only written again nbufs packets later. If outfd cannot
+ * splice (EINVAL), packets go out with write() instead, and that copy is counted.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/random.h>
+
+#include "wsaescbc.h"
+
+#define SPLICEPAGE 4096
+#define SPLICERANDOM 4096    // random bytes fetched at a time, 256 IVs
+
+struct aes256splice {
+    aes256keyctx_t *ctx;
+    int pipefd[2];
+    int nosplice;        // outfd refused splice(), write() from now on
+    uint8_t *base;       // nbufs pages
+    uint32_t nbufs;
+    uint32_t next;
+    uint32_t maxlen;
+    uint8_t random[SPLICERANDOM];
+    uint32_t randompos;  // bytes of random used, SPLICERANDOM when empty
+    aes256splicestats_t stats;
+};
+
+
+/*
+ * Creates the path for plaintext packets of up to maxlen bytes under ctx, with nbufs pages to rotate
+ * through; ctx must outlive it
+ */
+aes256splice_t *aes256splice_new(aes256keyctx_t *ctx, uint32_t nbufs, uint32_t maxlen)
+{
+    aes256splice_t *sp;
+    void *base;
+
+    if (nbufs == 0 || maxlen == 0 || maxlen > AESMAXDATASIZE)
+    {
+        fprintf(stderr, "ERROR: splice path needs at least one buffer of 1 to %d bytes\n", AESMAXDATASIZE);
+        return NULL;
+    }
+
+    sp = calloc(1, sizeof(aes256splice_t));
+    if (sp == NULL)
+        return NULL;
+    if (posix_memalign(&base, SPLICEPAGE, (size_t)nbufs * SPLICEPAGE) != 0)
+    {
+        perror("ERROR: failed to allocate splice buffers");
+        free(sp);
+        return NULL;
+    }
+    if (pipe2(sp->pipefd, O_CLOEXEC) < 0)
+    {
+        perror("ERROR: failed to create the splice pipe");
+        free(base);
+        free(sp);
+        return NULL;
+    }
+
+    sp->ctx = ctx;
+    sp->base = base;
+    sp->nbufs = nbufs;
+    sp->maxlen = maxlen;
+    sp->randompos = SPLICERANDOM;
+    return sp;
+}
+
+
+void aes256splice_free(aes256splice_t *sp)
+{
+    if (sp == NULL)
+        return;
+    close(sp->pipefd[0]);
+    close(sp->pipefd[1]);
+    free(sp->base);
+    explicit_bzero(sp->random, SPLICERANDOM);
+    free(sp);
+}
+
+
+/*
+ * Takes a fresh random IV from the pool, refilling it when it runs out
+ */
+static int32_t aes256spliceiv(aes256splice_t *sp, uint8_t *iv)
+{
+    if (sp->randompos == SPLICERANDOM)
+    {
+        for (uint32_t got=0; got<SPLICERANDOM; )
+        {
+            ssize_t n = getrandom(sp->random + got, SPLICERANDOM - got, 0);
+
+            if (n < 0 && errno != EINTR)
+            {
+                perror("ERROR: failed to get random IVs");
+                return errno;
+            }
+            if (n > 0)
+                got += n;
+        }
+        sp->randompos = 0;
+    }
+    memcpy(iv, sp->random + sp->randompos, AESIVSIZE);
+    explicit_bzero(sp->random + sp->randompos, AESIVSIZE);
+    sp->randompos += AESIVSIZE;
+    return 0;
+}
+
+
+/*
+ * Hands len bytes at buf to outfd by reference, or writes them if outfd cannot splice. A packet
+ * outfd refuses is dropped, leaving the pipe empty for the next one.
+ */
+static int32_t aes256spliceout(aes256splice_t *sp, int outfd, uint8_t *buf, uint32_t len)
+{
+    struct iovec iov = { buf, len };
+    uint32_t done = 0;
+    ssize_t n = 0;
+    int32_t ret;
+
+    if (!sp->nosplice)
+    {
+        // the pipe is empty between packets, so a packet always fits
+        if (vmsplice(sp->pipefd[1], &iov, 1, 0) != (ssize_t)len)
+            return errno ? errno : EIO;
+
+        for (; done<len; done+=n)
+        {
+            n = splice(sp->pipefd[0], NULL, outfd, NULL, len - done, 0);
+            if (n <= 0)
+                break;
+        }
+        if (done == len)
+        {
+            sp->stats.spliced++;
+            return 0;
+        }
+
+        ret = (n < 0) ? errno : EIO;
+        if (read(sp->pipefd[0], buf + done, len - done) != (ssize_t)(len - done))
+            return errno ? errno : EIO;
+        if (done > 0 || ret != EINVAL)
+            return ret;
+
+        // outfd has no splice_write, stop trying
+        sp->nosplice = 1;
+    }
+
+    n = write(outfd, buf, len);
+    if (n != (ssize_t)len)
+        return (n < 0) ? errno : EIO;
+    sp->stats.copies++;
+    sp->stats.written++;
+    return 0;
+}
+
+
+/*
+ * Moves up to maxpackets packets from infd to outfd, encrypting or decrypting each on its own. A
+ * packet is whatever one read() of infd returns, as from a TUN device or a datagram socket.
+ * Encryption puts a fresh random IV in front of each packet's ciphertext; decryption expects
+ * packets in that form and takes each one's IV from its first block. Stops early, returning 0, at
+ * end of file or when a non-blocking infd has nothing more; *movedp says how many packets went
+ * through.
+ */
+int32_t aes256splice(aes256splice_t *sp, int mode, int infd, int outfd, uint32_t maxpackets, uint32_t *movedp)
+{
+    int decrypt = ((mode & ~AESNOPAD) == DECRYPT);
+    uint32_t moved = 0;
+    int32_t ret = 0;
+
+    if ((mode & ~AESNOPAD) != ENCRYPT && !decrypt)
+    {
+        fprintf(stderr, "ERROR: invalid mode. Must be either ENCRYPT or DECRYPT\n");
+        return EINVAL;
+    }
+
+    while (moved < maxpackets)
+    {
+        uint8_t *buf = sp->base + (size_t)sp->next * SPLICEPAGE;
+        uint8_t *data = buf + AESIVSIZE;
+        uint8_t iv[AESIVSIZE];
+        uint32_t inlen, outlen;
+        ssize_t n;
+
+        // the only CPU copy of the payload, out of the kernel into the pool page, after room for
+        // the IV or together with it
+        if (decrypt)
+            n = read(infd, buf, AESIVSIZE + sp->maxlen + 1);
+        else
+            n = read(infd, data, sp->maxlen + 1);
+        if (n == 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)))
+            break;
+        if (n < 0)
+        {
+            ret = errno;
+            break;
+        }
+        sp->stats.copies++;
+        inlen = decrypt ? n - AESIVSIZE : n;
+        if (decrypt && (n < AESIVSIZE + AESBLKSIZE || inlen % AESBLKSIZE != 0))
+        {
+            fprintf(stderr, "ERROR: encrypted packet of %zd bytes, not an IV and whole blocks\n", n);
+            ret = EINVAL;
+            break;
+        }
+        if (inlen > sp->maxlen)
+        {
+            fprintf(stderr, "ERROR: packet longer than %u bytes\n", sp->maxlen);
+            ret = EMSGSIZE;
+            break;
+        }
+
+        if (decrypt)
+            memcpy(iv, buf, AESIVSIZE);
+        else
+        {
+            ret = aes256spliceiv(sp, iv);
+            if (ret != 0)
+                break;
+            memcpy(buf, iv, AESIVSIZE);
+        }
+
+        ret = aes256ctx(sp->ctx, mode, iv, data, inlen, data, &outlen);
+        if (ret != 0)
+            break;
+
+        // ciphertext goes out behind its IV, plaintext on its own
+        if (decrypt)
+            ret = aes256spliceout(sp, outfd, data, outlen);
+        else
+            ret = aes256spliceout(sp, outfd, buf, AESIVSIZE + outlen);
+        if (ret != 0)
+            break;
+
+        sp->next = (sp->next + 1) % sp->nbufs;
+        sp->stats.packets++;
+        sp->stats.bytesin += n;
+        sp->stats.bytesout += decrypt ? outlen : AESIVSIZE + outlen;
+        moved++;
+    }
+
+    *movedp = moved;
+    return ret;
+}
+
+
+void aes256splice_stats(aes256splice_t *sp, aes256splicestats_t *stats)
+{
+    *stats = sp->stats;
+}
@@ -0,0 +1,370 @@
+/**
+ * @file   wsaessw.c
+ * @brief  Constant-time software AES-256-CBC matching the output of the wsaes hardware block.
+ *
+ * SubBytes is computed on a bitsliced copy of the state: bit j of word i holds bit i of byte j,
+ * so up to 32 bytes (two blocks) go through the S-box with the same sequence of AND/XOR
+ * operations. The S-box itself is the GF(2^8) inverse (x^254) followed by the affine map. The
+ * remaining round steps only use shifts and XORs on bytes. Written in plain C so the compiler can
+ * schedule it onto NEON on the Cortex-A9 without secret-dependent table lookups.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "wsaescbc.h"
+#include "wsaessw.h"
+
+#define BSMAXBYTES 32 // bytes per bitsliced batch, one bit per byte in a 32-bit word
+
+typedef uint32_t bs8_t[8];
+
+
+/*
+ * 8x8 bit matrix transpose: bit i of byte j moves to bit j of byte i
+ */
+static uint64_t transpose8(uint64_t x)
+{
+    uint64_t t;
+    t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;  x ^= t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL; x ^= t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL; x ^= t ^ (t << 28);
+    return x;
+}
+
+
+/*
+ * Transposes n bytes into bitsliced form and back
+ */
+static void bs_pack(bs8_t w, const uint8_t *bytes, int n)
+{
+    uint8_t buf[BSMAXBYTES] = { 0 };
+
+    memcpy(buf, bytes, n);
+    memset(w, 0, sizeof(bs8_t));
+    for (int g=0; g<(n + 7) / 8; g++)
+    {
+        uint64_t x = 0;
+        for (int j=0; j<8; j++)
+            x |= (uint64_t)buf[8 * g + j] << (8 * j);
+        x = transpose8(x);
+        for (int i=0; i<8; i++)
+            w[i] |= (uint32_t)((x >> (8 * i)) & 0xFF) << (8 * g);
+    }
+}
+
+static void bs_unpack(uint8_t *bytes, const bs8_t w, int n)
+{
+    uint8_t buf[BSMAXBYTES];
+
+    for (int g=0; g<(n + 7) / 8; g++)
+    {
+        uint64_t x = 0;
+        for (int i=0; i<8; i++)
+            x |= (uint64_t)((w[i] >> (8 * g)) & 0xFF) << (8 * i);
+        x = transpose8(x);
+        for (int j=0; j<8; j++)
+            buf[8 * g + j] = (uint8_t)(x >> (8 * j));
+    }
+    memcpy(bytes, buf, n);
+}
+
+
+/*
+ * Folds a bitsliced product of up to 15 bits back into GF(2^8) modulo the AES polynomial,
+ * using x^8 = x^4 + x^3 + x + 1
+ */
+static void bs_reduce(bs8_t r, uint32_t *p)
+{
+    for (int k=14; k>=8; k--)
+    {
+        p[k - 4] ^= p[k];
+        p[k - 5] ^= p[k];
+        p[k - 7] ^= p[k];
+        p[k - 8] ^= p[k];
+    }
+    memcpy(r, p, sizeof(bs8_t));
+}
+
+/*
+ * Bitsliced multiply in GF(2^8)
+ */
+static void bs_gfmul(bs8_t r, const bs8_t a, const bs8_t b)
+{
+    uint32_t p[15] = { 0 };
+
+    for (int i=0; i<8; i++)
+        for (int j=0; j<8; j++)
+            p[i + j] ^= a[i] & b[j];
+    bs_reduce(r, p);
+}
+
+/*
+ * Bitsliced square in GF(2^8), which is linear: bit i moves to bit 2i before reduction
+ */
+static void bs_gfsqr(bs8_t r, const bs8_t a)
+{
+    uint32_t p[15] = { 0 };
+
+    for (int i=0; i<8; i++)
+        p[2 * i] = a[i];
+    bs_reduce(r, p);
+}
+
+
+/*
+ * Bitsliced inverse in GF(2^8) as x^254 (maps 0 to 0 as AES requires)
+ */
+static void bs_gfinv(bs8_t r, const bs8_t x)
+{
+    bs8_t x2, x3, x12, x15, t;
+
+    bs_gfsqr(x2, x);         // x^2
+    bs_gfmul(x3, x2, x);     // x^3
+    bs_gfsqr(t, x3);         // x^6
+    bs_gfsqr(x12, t);        // x^12
+    bs_gfmul(x15, x12, x3);  // x^15
+    bs_gfsqr(t, x15);        // x^30
+    bs_gfsqr(t, t);          // x^60
+    bs_gfsqr(t, t);          // x^120
+    bs_gfsqr(t, t);          // x^240
+    bs_gfmul(t, t, x12);     // x^252
+    bs_gfmul(r, t, x2);      // x^254
+}
+
+
+/*
+ * Runs n bytes (n <= 32) through the forward or inverse S-box in place
+ */
+static void subbytes(uint8_t *bytes, int n, int inverse)
+{
+    bs8_t x, y;
+    uint32_t ones = (n == 32) ? 0xFFFFFFFF : ((1u << n) - 1);
+
+    bs_pack(x, bytes, n);
+
+    if (inverse)
+    {
+        // inverse affine map: b_i = s_(i+2) ^ s_(i+5) ^ s_(i+7) ^ 0x05_i, then invert
+        for (int i=0; i<8; i++)
+            y[i] = x[(i + 2) & 7] ^ x[(i + 5) & 7] ^ x[(i + 7) & 7] ^ ((0x05 >> i) & 1 ? ones : 0);
+        bs_gfinv(x, y);
+    }
+    else
+    {
+        // invert, then affine map: s_i = b_i ^ b_(i+4) ^ b_(i+5) ^ b_(i+6) ^ b_(i+7) ^ 0x63_i
+        bs_gfinv(y, x);
+        for (int i=0; i<8; i++)
+            x[i] = y[i] ^ y[(i + 4) & 7] ^ y[(i + 5) & 7] ^ y[(i + 6) & 7] ^ y[(i + 7) & 7] ^
+                   ((0x63 >> i) & 1 ? ones : 0);
+    }
+
+    bs_unpack(bytes, x, n);
+}
+
+
+static uint8_t xtime(uint8_t x)
+{
+    return (uint8_t)((x << 1) ^ (0x1B & -(x >> 7)));
+}
+
+/*
+ * State layout follows the FIPS-197 byte order: byte 4*c + r is row r of column c
+ */
+static void shiftrows(uint8_t *s, int inverse)
+{
+    uint8_t t[16];
+    for (int c=0; c<4; c++)
+        for (int r=0; r<4; r++)
+        {
+            if (inverse)
+                t[4 * ((c + r) & 3) + r] = s[4 * c + r];
+            else
+                t[4 * c + r] = s[4 * ((c + r) & 3) + r];
+        }
+    memcpy(s, t, 16);
+}
+
+static void mixcolumns(uint8_t *s, int inverse)
+{
+    for (int c=0; c<4; c++)
+    {
+        uint8_t *col = s + 4 * c;
+
+        // InvMixColumns is MixColumns after a pre-multiplication by {04}x^2 + {05}
+        if (inverse)
+        {
+            uint8_t u = xtime(xtime(col[0] ^ col[2]));
+            uint8_t v = xtime(xtime(col[1] ^ col[3]));
+            col[0] ^= u;
+            col[1] ^= v;
+            col[2] ^= u;
+            col[3] ^= v;
+        }
+
+        uint8_t a0 = col[0], a1 = col[1], a2 = col[2], a3 = col[3];
+        uint8_t all = a0 ^ a1 ^ a2 ^ a3;
+        col[0] ^= all ^ xtime(a0 ^ a1);
+        col[1] ^= all ^ xtime(a1 ^ a2);
+        col[2] ^= all ^ xtime(a2 ^ a3);
+        col[3] ^= all ^ xtime(a3 ^ a0);
+    }
+}
+
+static void addroundkey(uint8_t *s, const uint8_t *rk)
+{
+    for (int i=0; i<16; i++)
+        s[i] ^= rk[i];
+}
+
+
+/*
+ * AES-256 key expansion (FIPS-197 section 5.2)
+ */
+void aes256sw_expandkey(aes256swkey_t *ks, const uint8_t *keyp)
+{
+    uint8_t *w = &ks->rk[0][0];
+    uint8_t rcon = 0x01;
+
+    memcpy(w, keyp, AESKEYSIZE);
+    for (int i=8; i<4 * (AESNUMROUNDS + 1); i++)
+    {
+        uint8_t t[4];
+        memcpy(t, w + 4 * (i - 1), 4);
+        if (i % 8 == 0)
+        {
+            uint8_t t0 = t[0];
+            t[0] = t[1]; t[1] = t[2]; t[2] = t[3]; t[3] = t0;
+            subbytes(t, 4, 0);
+            t[0] ^= rcon;
+            rcon = xtime(rcon);
+        }
+        else if (i % 8 == 4)
+        {
+            subbytes(t, 4, 0);
+        }
+        for (int j=0; j<4; j++)
+            w[4 * i + j] = w[4 * (i - 8) + j] ^ t[j];
+    }
+}
+
+
+/*
+ * Encrypts a single 16 byte block
+ */
+void aes256sw_encblock(const aes256swkey_t *ks, const uint8_t *inp, uint8_t *outp)
+{
+    uint8_t s[AESBLKSIZE];
+
+    memcpy(s, inp, AESBLKSIZE);
+    addroundkey(s, ks->rk[0]);
+    for (int round=1; round<AESNUMROUNDS; round++)
+    {
+        subbytes(s, AESBLKSIZE, 0);
+        shiftrows(s, 0);
+        mixcolumns(s, 0);
+        addroundkey(s, ks->rk[round]);
+    }
+    subbytes(s, AESBLKSIZE, 0);
+    shiftrows(s, 0);
+    addroundkey(s, ks->rk[AESNUMROUNDS]);
+    memcpy(outp, s, AESBLKSIZE);
+}
+
+
+/*
+ * Decrypts nblocks independent 16 byte blocks (ECB, no chaining), two at a time so both share a
+ * bitsliced S-box pass
+ */
+void aes256sw_decblocks(const aes256swkey_t *ks, const uint8_t *inp, uint8_t *outp, uint32_t nblocks)
+{
+    uint8_t s[BSMAXBYTES];
+
+    for (uint32_t b=0; b<nblocks; b+=2)
+    {
+        int nb = (nblocks - b >= 2) ? 2 : 1;
+        int n = nb * AESBLKSIZE;
+
+        memcpy(s, inp + b * AESBLKSIZE, n);
+        for (int k=0; k<nb; k++)
+            addroundkey(s + k * AESBLKSIZE, ks->rk[AESNUMROUNDS]);
+        for (int round=AESNUMROUNDS-1; round>0; round--)
+        {
+            for (int k=0; k<nb; k++)
+                shiftrows(s + k * AESBLKSIZE, 1);
+            subbytes(s, n, 1);
+            for (int k=0; k<nb; k++)
+            {
+                addroundkey(s + k * AESBLKSIZE, ks->rk[round]);
+                mixcolumns(s + k * AESBLKSIZE, 1);
+            }
+        }
+        for (int k=0; k<nb; k++)
+            shiftrows(s + k * AESBLKSIZE, 1);
+        subbytes(s, n, 1);
+        for (int k=0; k<nb; k++)
+            addroundkey(s + k * AESBLKSIZE, ks->rk[0]);
+        memcpy(outp + b * AESBLKSIZE, s, n);
+    }
+}
+
+
+/*
+ * Same contract as aes256(): ENCRYPT pads the input out to the next block boundary (always adding
+ * at least one byte of padding) unless AESNOPAD is given, DECRYPT returns the padded plaintext
+ * unmodified
+ */
+int32_t aes256sw(int mode, const aes256swkey_t *ks, const uint8_t *ivp, uint8_t *inp, uint32_t inlen,
+                 uint8_t *outp, uint32_t *lenp)
+{
+    uint8_t chain[AESBLKSIZE], blk[AESBLKSIZE];
+    int pad = (mode == ENCRYPT);
+
+    mode &= ~AESNOPAD;
+    if (mode != ENCRYPT && mode != DECRYPT)
+        return -1;
+
+    memcpy(chain, ivp, AESBLKSIZE);
+
+    if (mode == ENCRYPT)
+    {
+        uint32_t modlen = inlen % AESBLKSIZE;
+        uint32_t numpadbytes = pad ? AESBLKSIZE - modlen : 0;
+        uint32_t fullbytes = inlen - modlen;
+
+        if (!pad && modlen != 0)
+            return -1;
+
+        *lenp = inlen + numpadbytes;
+        for (uint32_t i=0; i<*lenp; i+=AESBLKSIZE)
+        {
+            for (int j=0; j<AESBLKSIZE; j++)
+            {
+                uint8_t p = (i < fullbytes || j < modlen) ? inp[i + j] : (uint8_t)numpadbytes;
+                blk[j] = p ^ chain[j];
+            }
+            aes256sw_encblock(ks, blk, &outp[i]);
+            memcpy(chain, &outp[i], AESBLKSIZE);
+        }
+    }
+    else
+    {
+        if (inlen % AESBLKSIZE != 0)
+            return -1;
+
+        *lenp = inlen;
+        // two blocks per pass; keep the ciphertext needed for chaining before a possible in-place overwrite
+        for (uint32_t i=0; i<inlen; i+=2 * AESBLKSIZE)
+        {
+            uint8_t ct[2 * AESBLKSIZE];
+            uint32_t n = (inlen - i >= 2 * AESBLKSIZE) ? 2 * AESBLKSIZE : AESBLKSIZE;
+
+            memcpy(ct, &inp[i], n);
+            aes256sw_decblocks(ks, ct, &outp[i], n / AESBLKSIZE);
+            for (uint32_t j=0; j<n; j++)
+                outp[i + j] ^= (j < AESBLKSIZE) ? chain[j] : ct[j - AESBLKSIZE];
+            memcpy(chain, &ct[n - AESBLKSIZE], AESBLKSIZE);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+/*
+ * Software AES-256-CBC, used by libwsaescbc when a request is too small to be worth the round
+ * trip to the hardware block. Produces the same output as the block, including the padding
+ * applied on encrypt. The S-box is evaluated bitsliced instead of through lookup tables, so no
+ * memory access depends on key or data.
+ */
+
+#include <stdint.h>
+
+#define AESNUMROUNDS 14
+
+typedef struct {
+    uint8_t rk[AESNUMROUNDS + 1][16]; // expanded round keys
+} aes256swkey_t;
+
+void aes256sw_expandkey(aes256swkey_t *ks, const uint8_t *keyp);
+void aes256sw_encblock(const aes256swkey_t *ks, const uint8_t *inp, uint8_t *outp);
+void aes256sw_decblocks(const aes256swkey_t *ks, const uint8_t *inp, uint8_t *outp, uint32_t nblocks);
+int32_t aes256sw(int mode, const aes256swkey_t *ks, const uint8_t *ivp, uint8_t *inp, uint32_t inlen,
+                 uint8_t *outp, uint32_t *outlenp);
@@ -84,6 +84,10 @@ int main (void)
     printf("mbar = ");dumpmsg(pubdata.Mbar);
     printf("sizeof(RSAPublic_t) = %d\n",sizeof(RSAPublic_t));
 
+    // WSRSA_DEVICE overrides the device, e.g. to run against the CUSE emulator
+    if (getenv("WSRSA_DEVICE") != NULL)
+        devstr = getenv("WSRSA_DEVICE");
+
     // Open the device with read/write access
     printf("Beginning RSA test...\n");
     printf("Looking for <%s>\n",devstr);
@@ -0,0 +1,211 @@
+/**
+ * @file   wssha256batch.c
+ * @brief  Batching queue for small SHA256 jobs.
+ *
+ * Jobs are collected from any number of submitting threads and handed to sha256batch() by one
+ * flusher thread, which is the only thread that talks to the engine for them. A batch goes out
+ * when it is full or when its oldest job has waited long enough; a batch that is still small at
+ * that point is cheaper on the CPU than as an engine trip, so it is hashed in software.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "wssha256ctx.h"
+#include "wssha256sw.h"
+
+struct sha256batchq {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        // signalled on submission and on stop
+    sha256job_t *head;
+    sha256job_t *tail;
+    uint32_t pending;
+    struct timespec deadline;   // when the job at the head has waited maxwaitus
+    uint32_t batchsize;
+    uint32_t minbatch;
+    uint32_t maxwaitus;
+    int stop;
+    pthread_t tid;
+    sha256batchqstats_t stats;
+};
+
+
+static void sha256batchq_setdeadline(sha256batchq_t *q)
+{
+    clock_gettime(CLOCK_MONOTONIC, &q->deadline);
+    q->deadline.tv_nsec += (long)q->maxwaitus * 1000;
+    q->deadline.tv_sec += q->deadline.tv_nsec / 1000000000;
+    q->deadline.tv_nsec %= 1000000000;
+}
+
+
+static int sha256batchq_due(sha256batchq_t *q)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > q->deadline.tv_sec ||
+           (now.tv_sec == q->deadline.tv_sec && now.tv_nsec >= q->deadline.tv_nsec);
+}
+
+
+static void *sha256batchq_flusher(void *arg)
+{
+    sha256batchq_t *q = (sha256batchq_t *)arg;
+    sha256job_t batch[SHA256BATCHMAX];
+    sha256job_t *orig[SHA256BATCHMAX];
+
+    pthread_mutex_lock(&q->lock);
+    for (;;)
+    {
+        uint32_t cnt = 0;
+        int cpu;
+
+        // wait for a full batch, or for the oldest job's deadline
+        while (q->pending < q->batchsize && !q->stop)
+        {
+            if (q->pending == 0)
+                pthread_cond_wait(&q->cond, &q->lock);
+            else if (sha256batchq_due(q))
+                break;
+            else
+                pthread_cond_timedwait(&q->cond, &q->lock, &q->deadline);
+        }
+        if (q->pending == 0)
+            break;
+
+        while (cnt < q->batchsize && q->head != NULL)
+        {
+            orig[cnt] = q->head;
+            batch[cnt] = *q->head;
+            q->head = q->head->next;
+            cnt++;
+        }
+        if (q->head == NULL)
+            q->tail = NULL;
+        q->pending -= cnt;
+        if (q->pending > 0)
+            sha256batchq_setdeadline(q);
+        cpu = (cnt < q->minbatch);
+        if (cpu)
+            q->stats.cpujobs += cnt;
+        else
+        {
+            q->stats.batches++;
+            q->stats.enginejobs += cnt;
+        }
+        pthread_mutex_unlock(&q->lock);
+
+        sha256sw_thread(cpu);
+        sha256batch(batch, cnt);
+        for (uint32_t i=0; i<cnt; i++)
+        {
+            orig[i]->status = batch[i].status;
+            if (orig[i]->done != NULL)
+                orig[i]->done(orig[i], orig[i]->arg);
+        }
+
+        pthread_mutex_lock(&q->lock);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+
+/*
+ * batchsize is capped at SHA256BATCHMAX
+ */
+sha256batchq_t *sha256batchq_new(uint32_t batchsize, uint32_t minbatch, uint32_t maxwaitus)
+{
+    sha256batchq_t *q = calloc(1, sizeof(sha256batchq_t));
+    pthread_condattr_t attr;
+    int ret;
+
+    if (q == NULL)
+        return NULL;
+    q->batchsize = (batchsize == 0 || batchsize > SHA256BATCHMAX) ? SHA256BATCHMAX : batchsize;
+    q->minbatch = minbatch;
+    q->maxwaitus = maxwaitus;
+
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&q->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    ret = pthread_create(&q->tid, NULL, sha256batchq_flusher, q);
+    if (ret != 0)
+    {
+        errno = ret;
+        perror("Failed to start the SHA256 batch thread");
+        pthread_cond_destroy(&q->cond);
+        pthread_mutex_destroy(&q->lock);
+        free(q);
+        return NULL;
+    }
+    return q;
+}
+
+
+/*
+ * Finishes every job already submitted, then stops the flusher
+ */
+void sha256batchq_free(sha256batchq_t *q)
+{
+    if (q == NULL)
+        return;
+
+    pthread_mutex_lock(&q->lock);
+    q->stop = 1;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_join(q->tid, NULL);
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->lock);
+    free(q);
+}
+
+
+/*
+ * Queues job and returns; job->done() is called from the flusher thread once the digest is in
+ * job->md. The job and its data must stay valid until then.
+ */
+int32_t sha256batchq_submit(sha256batchq_t *q, sha256job_t *job)
+{
+    pthread_mutex_lock(&q->lock);
+    if (q->stop)
+    {
+        pthread_mutex_unlock(&q->lock);
+        return EINVAL;
+    }
+
+    job->status = EINPROGRESS;
+    job->next = NULL;
+    if (q->tail != NULL)
+        q->tail->next = job;
+    else
+        q->head = job;
+    q->tail = job;
+    if (q->pending++ == 0)
+        sha256batchq_setdeadline(q);
+    q->stats.jobs++;
+
+    // the flusher only needs waking to start a deadline or to send a full batch
+    if (q->pending == 1 || q->pending >= q->batchsize)
+        pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+
+void sha256batchq_stats(sha256batchq_t *q, sha256batchqstats_t *stats)
+{
+    pthread_mutex_lock(&q->lock);
+    *stats = q->stats;
+    pthread_mutex_unlock(&q->lock);
+}
@@ -0,0 +1,206 @@
+/**
+ * @file   wssha256batch_bench.c
+ * @brief  Small-message SHA256 benchmark. Hashes 32 to 1024 byte messages one sha256() call at a
+ * time, with sha256batch() in batches of 8 and 64, and through a sha256batchq fed by several
+ * threads, and reports digests/s and engine turns per digest for each.
+ *
+ * The engine is the software compression function, made to busy-wait turn cost nanoseconds per
+ * trip to stand in for the device round trip; a batch pays it once.
+ *
+ * usage: wssha256batch_bench [iterations] [turn cost in ns] [submitting threads]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+#include "wssha256ctx.h"
+#include "wssha256sw.h"
+
+#define DEFAULT_ITERATIONS 20000
+#define DEFAULT_TURNNS 2000
+#define DEFAULT_THREADS 4
+#define MAXMSGLEN 1024
+#define QWINDOW 64              // jobs each submitting thread keeps in the queue
+
+static const uint32_t msglens[] = { 32, 40, 64, 1024 };
+static long turnns = DEFAULT_TURNNS;
+static int iterations = DEFAULT_ITERATIONS;
+static uint8_t msg[MAXMSGLEN + SHA256BATCHMAX];
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void trip(void)
+{
+    double until = now() + turnns / 1e9;
+
+    while (now() < until)
+        ;
+}
+
+static int32_t slowengine(void *arg, uint32_t *h, const uint8_t *blocks, uint32_t nblocks)
+{
+    sha256sw_compress(h, blocks, nblocks);
+    trip();
+    return 0;
+}
+
+static int32_t slowenginev(void *arg, uint32_t **h, const uint8_t **blocks, const uint32_t *nblocks, uint32_t n)
+{
+    for (uint32_t i=0; i<n; i++)
+        sha256sw_compress(h[i], blocks[i], nblocks[i]);
+    trip();
+    return 0;
+}
+
+static void printrow(const char *mode, uint32_t len, long digests, double secs,
+                     const sha256enginestats_t *before)
+{
+    sha256enginestats_t after;
+
+    sha256enginestats(&after);
+    printf("%6u %-12s %12.0f %10.1f %12.3f\n", len, mode, digests / secs, digests * (double)len / secs / 1e6,
+           (double)(after.turns - before->turns) / digests);
+}
+
+static void runsingle(uint32_t len)
+{
+    uint8_t md[SHA256DIGESTSIZE];
+    sha256enginestats_t before;
+    double start;
+
+    sha256enginestats(&before);
+    start = now();
+    for (int n=0; n<iterations; n++)
+        sha256(msg + (n % SHA256BATCHMAX), len, md);
+    printrow("single", len, iterations, now() - start, &before);
+}
+
+static void runbatch(uint32_t len, uint32_t batch)
+{
+    sha256job_t jobs[SHA256BATCHMAX];
+    uint8_t mds[SHA256BATCHMAX][SHA256DIGESTSIZE];
+    sha256enginestats_t before;
+    char mode[24];
+    long digests = 0;
+    double start;
+
+    for (uint32_t j=0; j<batch; j++)
+        jobs[j] = (sha256job_t){ msg + j, len, mds[j], 0, NULL, NULL, NULL };
+
+    sha256enginestats(&before);
+    start = now();
+    for (; digests<iterations; digests+=batch)
+        sha256batch(jobs, batch);
+    snprintf(mode, sizeof(mode), "batch %u", batch);
+    printrow(mode, len, digests, now() - start, &before);
+}
+
+typedef struct {
+    sha256batchq_t *q;
+    uint32_t len;
+    int count;
+    int done;
+} qthread_t;
+
+static void qjobdone(sha256job_t *job, void *arg)
+{
+    __atomic_add_fetch(&((qthread_t *)arg)->done, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Keeps QWINDOW jobs in the queue, like an event loop with many small digests in flight
+ */
+static void *qthread(void *arg)
+{
+    qthread_t *qt = (qthread_t *)arg;
+    sha256job_t jobs[QWINDOW];
+    uint8_t mds[QWINDOW][SHA256DIGESTSIZE];
+
+    for (int n=0; n<qt->count; n++)
+    {
+        sha256job_t *job = &jobs[n % QWINDOW];
+
+        // reuse a slot only once its previous job is done
+        while (n - __atomic_load_n(&qt->done, __ATOMIC_ACQUIRE) >= QWINDOW)
+            sched_yield();
+        *job = (sha256job_t){ msg + (n % SHA256BATCHMAX), qt->len, mds[n % QWINDOW], 0, qjobdone, qt, NULL };
+        sha256batchq_submit(qt->q, job);
+    }
+    while (__atomic_load_n(&qt->done, __ATOMIC_ACQUIRE) < qt->count)
+        sched_yield();
+    return NULL;
+}
+
+static void runqueue(uint32_t len, int nthreads)
+{
+    sha256batchq_t *q = sha256batchq_new(SHA256BATCHMAX, 4, 50);
+    pthread_t tids[nthreads];
+    qthread_t qts[nthreads];
+    sha256enginestats_t before;
+    sha256batchqstats_t qs;
+    char mode[24];
+    double start;
+
+    if (q == NULL)
+        return;
+    sha256enginestats(&before);
+    start = now();
+    for (int t=0; t<nthreads; t++)
+    {
+        qts[t] = (qthread_t){ q, len, iterations / nthreads, 0 };
+        pthread_create(&tids[t], NULL, qthread, &qts[t]);
+    }
+    for (int t=0; t<nthreads; t++)
+        pthread_join(tids[t], NULL);
+    snprintf(mode, sizeof(mode), "queue x%d", nthreads);
+    printrow(mode, len, (long)nthreads * (iterations / nthreads), now() - start, &before);
+
+    sha256batchq_stats(q, &qs);
+    printf("%6s %-12s %llu batches of %.1f, %llu stragglers on the CPU\n", "", "",
+           (unsigned long long)qs.batches, qs.batches ? (double)qs.enginejobs / qs.batches : 0.0,
+           (unsigned long long)qs.cpujobs);
+    sha256batchq_free(q);
+}
+
+int main(int argc, char **argv)
+{
+    int nthreads = DEFAULT_THREADS;
+    sha256backend_t be = { slowengine, NULL, 0, 0, slowenginev };
+
+    if (argc > 1)
+        iterations = atoi(argv[1]);
+    if (argc > 2)
+        turnns = atol(argv[2]);
+    if (argc > 3)
+        nthreads = atoi(argv[3]);
+    if (iterations < 1 || turnns < 0 || nthreads < 1)
+    {
+        fprintf(stderr, "usage: %s [iterations] [turn cost in ns] [submitting threads]\n", argv[0]);
+        return 1;
+    }
+
+    for (int i=0; i<sizeof(msg); i++)
+        msg[i] = (uint8_t)(i * 7 + (i >> 8));
+    sha256setbackend(&be);
+
+    printf("SHA256 of small messages, %d per run, engine turn cost %ld ns\n", iterations, turnns);
+    printf("%6s %-12s %12s %10s %12s\n", "bytes", "mode", "digests/s", "MB/s", "turns/digest");
+    for (int m=0; m<sizeof(msglens)/sizeof(msglens[0]); m++)
+    {
+        runsingle(msglens[m]);
+        runbatch(msglens[m], 8);
+        runbatch(msglens[m], SHA256BATCHMAX);
+        runqueue(msglens[m], nthreads);
+    }
+
+    sha256setbackend(NULL);
+    return 0;
+}
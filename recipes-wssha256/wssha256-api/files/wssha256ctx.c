@@ -0,0 +1,413 @@
+/**
+ * @file   wssha256ctx.c
+ * @brief  SHA256 stream contexts multiplexed on one compression engine.
+ *
+ * The padding, length encoding and partial blocks are handled here, per stream, so the engine
+ * behind sha256setbackend() only has to run whole blocks from a given chaining value. That is
+ * what lets many streams share a single hardware block: between two turns nothing of a stream is
+ * left in the engine, and its midstate can even be exported and resumed somewhere else.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "wssha256ctx.h"
+#include "wssha256sw.h"
+
+static const uint32_t sha256iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+// the engine, NULL compress meaning software
+static sha256backend_t backend = { NULL, NULL, 0, 1, NULL };
+
+// turns on a non-shared engine are handed out in ticket order
+static pthread_mutex_t englock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t engcond = PTHREAD_COND_INITIALIZER;
+static uint64_t nextticket = 0;
+static uint64_t serving = 0;
+static sha256enginestats_t stats;
+
+// set on threads that hash on the CPU alongside the engine
+static __thread int swthread = 0;
+
+
+void sha256setbackend(const sha256backend_t *be)
+{
+    pthread_mutex_lock(&englock);
+    if (be != NULL)
+        backend = *be;
+    else
+        memset(&backend, 0, sizeof(backend));
+    pthread_mutex_unlock(&englock);
+}
+
+
+void sha256enginestats(sha256enginestats_t *s)
+{
+    s->turns = __atomic_load_n(&stats.turns, __ATOMIC_RELAXED);
+    s->waits = __atomic_load_n(&stats.waits, __ATOMIC_RELAXED);
+    s->blocks = __atomic_load_n(&stats.blocks, __ATOMIC_RELAXED);
+    s->batches = __atomic_load_n(&stats.batches, __ATOMIC_RELAXED);
+}
+
+
+int sha256sw_thread(int on)
+{
+    int prev = swthread;
+
+    swthread = on;
+    return prev;
+}
+
+
+/*
+ * The engine this thread should use, compress NULL meaning software
+ */
+static sha256backend_t sha256engine(void)
+{
+    sha256backend_t be = { NULL, NULL, 0, 1, NULL };
+
+    if (!swthread)
+    {
+        pthread_mutex_lock(&englock);
+        be = backend;
+        pthread_mutex_unlock(&englock);
+    }
+    return be;
+}
+
+
+/*
+ * Waits for this thread's turn on a non-shared engine
+ */
+static void sha256turnstart(const sha256backend_t *be)
+{
+    if (be->shared)
+        return;
+
+    pthread_mutex_lock(&englock);
+    uint64_t ticket = nextticket++;
+    if (ticket != serving)
+    {
+        __atomic_add_fetch(&stats.waits, 1, __ATOMIC_RELAXED);
+        while (ticket != serving)
+            pthread_cond_wait(&engcond, &englock);
+    }
+    pthread_mutex_unlock(&englock);
+}
+
+
+static void sha256turnend(const sha256backend_t *be)
+{
+    if (be->shared)
+        return;
+
+    pthread_mutex_lock(&englock);
+    serving++;
+    pthread_cond_broadcast(&engcond);
+    pthread_mutex_unlock(&englock);
+}
+
+
+/*
+ * Runs nblocks whole blocks from h through the engine, in turns of at most maxblocks
+ */
+static int32_t sha256compress(uint32_t *h, const uint8_t *blocks, uint64_t nblocks)
+{
+    sha256backend_t be = sha256engine();
+
+    if (be.compress == NULL)
+    {
+        sha256sw_compress(h, blocks, nblocks);
+        __atomic_add_fetch(&stats.blocks, nblocks, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    while (nblocks > 0)
+    {
+        uint32_t n = (be.maxblocks > 0 && nblocks > be.maxblocks) ? be.maxblocks : (uint32_t)nblocks;
+        int32_t ret;
+
+        sha256turnstart(&be);
+        ret = be.compress(be.arg, h, blocks, n);
+        __atomic_add_fetch(&stats.turns, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats.blocks, n, __ATOMIC_RELAXED);
+        sha256turnend(&be);
+
+        if (ret != 0)
+            return ret;
+        blocks += (uint64_t)n * SHA256BLKSIZE;
+        nblocks -= n;
+    }
+    return 0;
+}
+
+
+/*
+ * Runs n independent streams, nblocks[i] blocks from h[i] each, in a single turn: one
+ * compressv() trip where the engine has it, otherwise back to back without giving up the engine
+ */
+static int32_t sha256compressv(uint32_t **h, const uint8_t **blocks, const uint32_t *nblocks, uint32_t n)
+{
+    sha256backend_t be = sha256engine();
+    uint64_t total = 0;
+    int32_t ret = 0;
+
+    for (uint32_t i=0; i<n; i++)
+        total += nblocks[i];
+
+    if (be.compress == NULL)
+    {
+        for (uint32_t i=0; i<n; i++)
+            sha256sw_compress(h[i], blocks[i], nblocks[i]);
+        __atomic_add_fetch(&stats.blocks, total, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    sha256turnstart(&be);
+    if (be.compressv != NULL)
+        ret = be.compressv(be.arg, h, blocks, nblocks, n);
+    else
+    {
+        for (uint32_t i=0; i<n && ret == 0; i++)
+            ret = be.compress(be.arg, h[i], blocks[i], nblocks[i]);
+    }
+    __atomic_add_fetch(&stats.turns, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.batches, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.blocks, total, __ATOMIC_RELAXED);
+    sha256turnend(&be);
+    return ret;
+}
+
+
+void sha256init(sha256ctx_t *ctx)
+{
+    memcpy(ctx->h, sha256iv, sizeof(ctx->h));
+    ctx->nbytes = 0;
+    ctx->taillen = 0;
+}
+
+
+/*
+ * Absorbs len bytes. Whole blocks go to the engine straight from data; only a partial block is
+ * kept in the context.
+ */
+int32_t sha256update(sha256ctx_t *ctx, const uint8_t *data, uint64_t len)
+{
+    uint64_t nblocks;
+    int32_t ret;
+
+    ctx->nbytes += len;
+
+    if (ctx->taillen > 0)
+    {
+        uint32_t take = SHA256BLKSIZE - ctx->taillen;
+
+        if (take > len)
+            take = (uint32_t)len;
+        memcpy(ctx->tail + ctx->taillen, data, take);
+        ctx->taillen += take;
+        data += take;
+        len -= take;
+        if (ctx->taillen < SHA256BLKSIZE)
+            return 0;
+
+        ret = sha256compress(ctx->h, ctx->tail, 1);
+        if (ret != 0)
+            return ret;
+        ctx->taillen = 0;
+    }
+
+    nblocks = len / SHA256BLKSIZE;
+    if (nblocks > 0)
+    {
+        ret = sha256compress(ctx->h, data, nblocks);
+        if (ret != 0)
+            return ret;
+        data += nblocks * SHA256BLKSIZE;
+        len -= nblocks * SHA256BLKSIZE;
+    }
+
+    memcpy(ctx->tail, data, len);
+    ctx->taillen = (uint32_t)len;
+    return 0;
+}
+
+
+/*
+ * Lays out what is left of the message, the padding and the length as one or two blocks in last,
+ * and returns how many
+ */
+static uint32_t sha256lastblocks(const sha256ctx_t *ctx, uint8_t *last)
+{
+    uint64_t bits = ctx->nbytes * 8;
+    uint32_t n = ctx->taillen;
+    uint32_t lastlen;
+
+    // 0x80, zeros, then the bit length in the last 8 bytes of one or two blocks
+    memcpy(last, ctx->tail, n);
+    last[n++] = 0x80;
+    lastlen = (n + 8 <= SHA256BLKSIZE) ? SHA256BLKSIZE : 2 * SHA256BLKSIZE;
+    memset(last + n, 0, lastlen - n);
+    for (int i=0; i<8; i++)
+        last[lastlen - 1 - i] = (uint8_t)(bits >> (8 * i));
+    return lastlen / SHA256BLKSIZE;
+}
+
+
+static void sha256digest(const uint32_t *h, uint8_t *md)
+{
+    for (int i=0; i<8; i++)
+    {
+        md[4*i] = (uint8_t)(h[i] >> 24);
+        md[4*i+1] = (uint8_t)(h[i] >> 16);
+        md[4*i+2] = (uint8_t)(h[i] >> 8);
+        md[4*i+3] = (uint8_t)h[i];
+    }
+}
+
+
+int32_t sha256final(sha256ctx_t *ctx, uint8_t *md)
+{
+    uint8_t last[2 * SHA256BLKSIZE];
+    int32_t ret;
+
+    ret = sha256compress(ctx->h, last, sha256lastblocks(ctx, last));
+    if (ret != 0)
+        return ret;
+    sha256digest(ctx->h, md);
+    return 0;
+}
+
+
+/*
+ * A chunk takes at most two engine turns: one for the whole blocks of every message of up to
+ * SHA256BATCHBLOCKS blocks, read where they lie, and one for the last one or two blocks of every
+ * message, which is all there is of the shortest ones. Longer messages stream their whole blocks
+ * as usual, in turns of their own.
+ */
+int32_t sha256batch(sha256job_t *jobs, uint32_t n)
+{
+    static __thread sha256ctx_t ctxs[SHA256BATCHMAX];
+    static __thread uint8_t last[SHA256BATCHMAX][2 * SHA256BLKSIZE];
+    uint32_t *hs[SHA256BATCHMAX];
+    const uint8_t *blocks[SHA256BATCHMAX];
+    uint32_t nblocks[SHA256BATCHMAX];
+    int32_t first = 0;
+
+    for (uint32_t base=0; base<n; base+=SHA256BATCHMAX)
+    {
+        uint32_t cnt = (n - base < SHA256BATCHMAX) ? n - base : SHA256BATCHMAX;
+        uint32_t m = 0;
+        int32_t ret;
+
+        for (uint32_t i=0; i<cnt; i++)
+        {
+            sha256job_t *job = &jobs[base + i];
+            uint64_t whole = job->len / SHA256BLKSIZE;
+
+            sha256init(&ctxs[i]);
+            job->status = 0;
+            if (whole > SHA256BATCHBLOCKS)
+            {
+                job->status = sha256update(&ctxs[i], job->data, job->len);
+                continue;
+            }
+            ctxs[i].nbytes = job->len;
+            ctxs[i].taillen = job->len % SHA256BLKSIZE;
+            memcpy(ctxs[i].tail, job->data + whole * SHA256BLKSIZE, ctxs[i].taillen);
+            if (whole > 0)
+            {
+                hs[m] = ctxs[i].h;
+                blocks[m] = job->data;
+                nblocks[m] = (uint32_t)whole;
+                m++;
+            }
+        }
+        ret = (m > 0) ? sha256compressv(hs, blocks, nblocks, m) : 0;
+
+        m = 0;
+        for (uint32_t i=0; i<cnt; i++)
+        {
+            sha256job_t *job = &jobs[base + i];
+
+            if (job->status == 0)
+                job->status = ret;
+            if (job->status != 0)
+                continue;
+            hs[m] = ctxs[i].h;
+            blocks[m] = last[i];
+            nblocks[m] = sha256lastblocks(&ctxs[i], last[i]);
+            m++;
+        }
+        ret = (m > 0) ? sha256compressv(hs, blocks, nblocks, m) : 0;
+
+        for (uint32_t i=0; i<cnt; i++)
+        {
+            sha256job_t *job = &jobs[base + i];
+
+            if (job->status == 0)
+                job->status = ret;
+            if (job->status == 0)
+                sha256digest(ctxs[i].h, job->md);
+            else if (first == 0)
+                first = job->status;
+        }
+    }
+    return first;
+}
+
+
+int32_t sha256(const uint8_t *data, uint64_t len, uint8_t *md)
+{
+    sha256ctx_t ctx;
+    int32_t ret;
+
+    sha256init(&ctx);
+    ret = sha256update(&ctx, data, len);
+    if (ret != 0)
+        return ret;
+    return sha256final(&ctx, md);
+}
+
+
+int32_t sha256export(const sha256ctx_t *ctx, uint8_t *state)
+{
+    uint64_t bits = ctx->nbytes * 8;
+
+    if (ctx->taillen != 0)
+        return EINVAL;
+
+    for (int i=0; i<8; i++)
+    {
+        state[4*i] = (uint8_t)(ctx->h[i] >> 24);
+        state[4*i+1] = (uint8_t)(ctx->h[i] >> 16);
+        state[4*i+2] = (uint8_t)(ctx->h[i] >> 8);
+        state[4*i+3] = (uint8_t)ctx->h[i];
+    }
+    for (int i=0; i<8; i++)
+        state[32 + i] = (uint8_t)(bits >> (56 - 8 * i));
+    return 0;
+}
+
+
+int32_t sha256import(sha256ctx_t *ctx, const uint8_t *state)
+{
+    uint64_t bits = 0;
+
+    for (int i=0; i<8; i++)
+        bits = (bits << 8) | state[32 + i];
+    if (bits % (8 * SHA256BLKSIZE) != 0)
+        return EINVAL;
+
+    for (int i=0; i<8; i++)
+        ctx->h[i] = (uint32_t)state[4*i] << 24 | (uint32_t)state[4*i+1] << 16 |
+                    (uint32_t)state[4*i+2] << 8 | state[4*i+3];
+    ctx->nbytes = bits / 8;
+    ctx->taillen = 0;
+    return 0;
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+/*
+ * SHA256 stream contexts that share one compression engine. A context keeps its own chaining
+ * value, length and partial block, so any number of streams can be in progress at once; the
+ * engine only ever sees whole 64-byte blocks plus the chaining value to start from, and streams
+ * take turns on it a few blocks at a time instead of holding it for a whole message.
+ */
+
+#include <stdint.h>
+
+#define SHA256BLKSIZE 64
+#define SHA256DIGESTSIZE 32
+#define SHA256STATESIZE 40      // exported midstate: chaining value and bit count, big-endian
+
+typedef struct {
+    uint32_t h[8];              // chaining value after the last full block
+    uint64_t nbytes;            // message bytes absorbed, including the tail
+    uint8_t tail[SHA256BLKSIZE];
+    uint32_t taillen;
+} sha256ctx_t;
+
+void sha256init(sha256ctx_t *ctx);
+int32_t sha256update(sha256ctx_t *ctx, const uint8_t *data, uint64_t len);
+int32_t sha256final(sha256ctx_t *ctx, uint8_t *md);
+int32_t sha256(const uint8_t *data, uint64_t len, uint8_t *md);
+
+/*
+ * Saves or restores a stream's midstate, e.g. to park it while the engine serves other streams or
+ * to move it to another process. Only possible at a block boundary; EINVAL otherwise. A context
+ * is plain data, so a full copy also works at any point within one process.
+ */
+int32_t sha256export(const sha256ctx_t *ctx, uint8_t *state);
+int32_t sha256import(sha256ctx_t *ctx, const uint8_t *state);
+
+/*
+ * The compression engine. compress() starts from h, runs nblocks blocks and leaves the new
+ * chaining value in h. A stream holds the engine for at most maxblocks blocks per turn; turns
+ * are handed out first come, first served. The default is the software implementation, which
+ * needs no turns at all. A hardware block is plugged in with sha256setbackend(), e.g. around the
+ * wssha256-kmod userspace library.
+ */
+typedef struct {
+    int32_t (*compress)(void *arg, uint32_t *h, const uint8_t *blocks, uint32_t nblocks);
+    void *arg;
+    uint32_t maxblocks;
+    int shared;                 // 0 if compress() may run on several threads at once
+    // optional: runs n independent streams in one trip, nblocks[i] blocks from h[i] each
+    int32_t (*compressv)(void *arg, uint32_t **h, const uint8_t **blocks, const uint32_t *nblocks,
+                         uint32_t n);
+} sha256backend_t;
+
+void sha256setbackend(const sha256backend_t *backend);
+
+typedef struct {
+    uint64_t turns;             // times a stream got the engine
+    uint64_t waits;             // turns that had to queue behind another stream
+    uint64_t blocks;
+    uint64_t batches;           // turns that ran several messages, see sha256batch()
+} sha256enginestats_t;
+
+void sha256enginestats(sha256enginestats_t *stats);
+
+/*
+ * HMAC-SHA256. sha256hmac_setkey() hashes key^ipad and key^opad once and keeps the two midstates,
+ * so every MAC under that key starts from them and costs two compressions fewer.
+ */
+typedef struct {
+    sha256ctx_t inner;          // after the key^ipad block
+    sha256ctx_t outer;          // after the key^opad block
+} sha256hmackey_t;
+
+typedef struct {
+    sha256ctx_t ctx;
+    const sha256hmackey_t *key;
+} sha256hmacctx_t;
+
+int32_t sha256hmac_setkey(sha256hmackey_t *hk, const uint8_t *key, uint32_t keylen);
+void sha256hmac_init(sha256hmacctx_t *hc, const sha256hmackey_t *hk);
+int32_t sha256hmac_update(sha256hmacctx_t *hc, const uint8_t *data, uint64_t len);
+int32_t sha256hmac_final(sha256hmacctx_t *hc, uint8_t *mac);
+int32_t sha256hmac(const sha256hmackey_t *hk, const uint8_t *data, uint64_t len, uint8_t *mac);
+
+/*
+ * Merkle tree hash of a buffer, with leaves hashed in parallel: one thread feeds leaves to the
+ * engine while cputhreads more hash leaves in software, each taking the next unclaimed leaf.
+ * Leaves are SHA256(0x00 || chunk) over leafsize-byte chunks, inner nodes SHA256(0x01 || l || r)
+ * and an odd node is carried up a level unchanged, as in RFC 6962. The root is therefore not the
+ * file's plain SHA256; use sha256() on the whole buffer where that is needed.
+ */
+typedef struct {
+    uint32_t leafsize;          // bytes per leaf
+    uint32_t cputhreads;        // software threads besides the engine thread
+    int noengine;               // 1 to leave the engine out and hash on the CPU threads only
+} sha256treeopts_t;
+
+typedef struct {
+    uint64_t leaves;
+    uint64_t engineleaves;      // leaves hashed by the engine thread
+} sha256treestats_t;
+
+int32_t sha256tree(const uint8_t *data, uint64_t len, const sha256treeopts_t *opts, uint8_t *root,
+                   sha256treestats_t *stats);
+
+/* The same in two steps, for input that is mapped a window at a time: the leaves of each window
+ * (whole leaves but for the last), then the root over all of them */
+int32_t sha256treeleaves(const uint8_t *data, uint64_t len, const sha256treeopts_t *opts, uint8_t *leaves,
+                         sha256treestats_t *stats);
+int32_t sha256treeroot(uint8_t *nodes, uint64_t nleaves, uint8_t *root);
+
+/*
+ * Many small independent messages, e.g. fingerprints, nonces and KDF inputs, whose cost on the
+ * engine would otherwise be all round trip. sha256batch() runs up to SHA256BATCHMAX of them in
+ * two engine turns at most, through the backend's compressv() where it has one. Each job gets its
+ * status; returns the first failure.
+ */
+#define SHA256BATCHMAX 64
+#define SHA256BATCHBLOCKS 16    // longer messages are streamed rather than batched
+
+typedef struct sha256job {
+    const uint8_t *data;
+    uint64_t len;
+    uint8_t *md;                // SHA256DIGESTSIZE bytes
+    int32_t status;
+    // for sha256batchq_submit(): called on the queue's thread once md and status are set
+    void (*done)(struct sha256job *job, void *arg);
+    void *arg;
+    struct sha256job *next;     // used by the queue
+} sha256job_t;
+
+int32_t sha256batch(sha256job_t *jobs, uint32_t n);
+
+/*
+ * Collects jobs submitted from any thread into batches. A batch goes out once batchsize jobs are
+ * waiting or the oldest has waited maxwaitus; if fewer than minbatch have gathered by then, the
+ * stragglers are hashed on the CPU instead of paying for an engine trip.
+ */
+typedef struct sha256batchq sha256batchq_t;
+
+typedef struct {
+    uint64_t jobs;
+    uint64_t batches;           // sent to the engine
+    uint64_t enginejobs;
+    uint64_t cpujobs;           // stragglers hashed in software
+} sha256batchqstats_t;
+
+sha256batchq_t *sha256batchq_new(uint32_t batchsize, uint32_t minbatch, uint32_t maxwaitus);
+void sha256batchq_free(sha256batchq_t *q);
+int32_t sha256batchq_submit(sha256batchq_t *q, sha256job_t *job);
+void sha256batchq_stats(sha256batchq_t *q, sha256batchqstats_t *stats);
@@ -0,0 +1,332 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "wssha256ctx.h"
+#include "wssha256sw.h"
+
+#define NSTREAMS 8
+#define STREAMLEN (64 * 1024 + 13)
+
+// FIPS 180-2 examples
+static const struct {
+    const char *msg;
+    uint8_t md[SHA256DIGESTSIZE];
+} vectors[] = {
+    { "", { 0xe3, 0xb0, 0xc4, 0x42, 0x98, 0xfc, 0x1c, 0x14, 0x9a, 0xfb, 0xf4, 0xc8, 0x99, 0x6f, 0xb9, 0x24,
+            0x27, 0xae, 0x41, 0xe4, 0x64, 0x9b, 0x93, 0x4c, 0xa4, 0x95, 0x99, 0x1b, 0x78, 0x52, 0xb8, 0x55 } },
+    { "abc", { 0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+               0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad } },
+    { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+      { 0x24, 0x8d, 0x6a, 0x61, 0xd2, 0x06, 0x38, 0xb8, 0xe5, 0xc0, 0x26, 0x93, 0x0c, 0x3e, 0x60, 0x39,
+        0xa3, 0x3c, 0xe4, 0x59, 0x64, 0xff, 0x21, 0x67, 0xf6, 0xec, 0xed, 0xd4, 0x19, 0xdb, 0x06, 0xc1 } },
+};
+
+// RFC 4231 test cases 1, 2 and 6
+static const struct {
+    uint8_t key[131];
+    uint32_t keylen;
+    const char *msg;
+    uint8_t mac[SHA256DIGESTSIZE];
+} hmacvectors[] = {
+    { { [0 ... 19] = 0x0b }, 20, "Hi There",
+      { 0xb0, 0x34, 0x4c, 0x61, 0xd8, 0xdb, 0x38, 0x53, 0x5c, 0xa8, 0xaf, 0xce, 0xaf, 0x0b, 0xf1, 0x2b,
+        0x88, 0x1d, 0xc2, 0x00, 0xc9, 0x83, 0x3d, 0xa7, 0x26, 0xe9, 0x37, 0x6c, 0x2e, 0x32, 0xcf, 0xf7 } },
+    { "Jefe", 4, "what do ya want for nothing?",
+      { 0x5b, 0xdc, 0xc1, 0x46, 0xbf, 0x60, 0x75, 0x4e, 0x6a, 0x04, 0x24, 0x26, 0x08, 0x95, 0x75, 0xc7,
+        0x5a, 0x00, 0x3f, 0x08, 0x9d, 0x27, 0x39, 0x83, 0x9d, 0xec, 0x58, 0xb9, 0x64, 0xec, 0x38, 0x43 } },
+    { { [0 ... 130] = 0xaa }, 131, "Test Using Larger Than Block-Size Key - Hash Key First",
+      { 0x60, 0xe4, 0x31, 0x59, 0x1e, 0xe0, 0xb6, 0x7f, 0x0d, 0x8a, 0x26, 0xaa, 0xcb, 0xf5, 0xb7, 0x7f,
+        0x8e, 0x0b, 0xc6, 0x21, 0x37, 0x28, 0xc5, 0x14, 0x05, 0x46, 0x04, 0x0f, 0x0e, 0xe3, 0x7f, 0x54 } },
+};
+
+static uint8_t streams[NSTREAMS][STREAMLEN];
+static uint8_t refmd[NSTREAMS][SHA256DIGESTSIZE];
+static uint8_t gotmd[NSTREAMS][SHA256DIGESTSIZE];
+static int inengine = 0;
+static int overlaps = 0;
+
+// stands in for a single hardware block: complains if two streams are ever inside it together
+static int32_t testengine(void *arg, uint32_t *h, const uint8_t *blocks, uint32_t nblocks)
+{
+    if (__atomic_add_fetch(&inengine, 1, __ATOMIC_ACQ_REL) != 1)
+        __atomic_add_fetch(&overlaps, 1, __ATOMIC_RELAXED);
+    sha256sw_compress(h, blocks, nblocks);
+    __atomic_sub_fetch(&inengine, 1, __ATOMIC_ACQ_REL);
+    return 0;
+}
+
+/*
+ * RFC 6962 tree hash of leaves [first, first + n), splitting at the largest power of two below n
+ */
+static void reftree(const uint8_t *data, uint64_t len, uint32_t leafsize, uint64_t first, uint64_t n, uint8_t *md)
+{
+    uint8_t buf[1 + 2 * SHA256DIGESTSIZE];
+    uint64_t k = 1;
+
+    if (n == 1)
+    {
+        uint64_t off = first * leafsize;
+        uint64_t l = (len - off < leafsize) ? len - off : leafsize;
+        uint8_t *leaf = malloc(l + 1);
+
+        leaf[0] = 0x00;
+        memcpy(leaf + 1, data + off, l);
+        sha256(leaf, l + 1, md);
+        free(leaf);
+        return;
+    }
+    while (k * 2 < n)
+        k *= 2;
+    buf[0] = 0x01;
+    reftree(data, len, leafsize, first, k, buf + 1);
+    reftree(data, len, leafsize, first + k, n - k, buf + 1 + SHA256DIGESTSIZE);
+    sha256(buf, sizeof(buf), md);
+}
+
+static int vtrips = 0;
+
+// the same block taking several streams per trip
+static int32_t testenginev(void *arg, uint32_t **h, const uint8_t **blocks, const uint32_t *nblocks, uint32_t n)
+{
+    __atomic_add_fetch(&vtrips, 1, __ATOMIC_RELAXED);
+    for (uint32_t i=0; i<n; i++)
+        testengine(arg, h[i], blocks[i], nblocks[i]);
+    return 0;
+}
+
+#define NBATCHJOBS 150
+static sha256job_t batchjobs[NBATCHJOBS];
+static uint8_t batchmd[NBATCHJOBS][SHA256DIGESTSIZE];
+static int batchdone = 0;
+
+static void batchjobdone(sha256job_t *job, void *arg)
+{
+    __atomic_add_fetch(&batchdone, 1, __ATOMIC_RELEASE);
+}
+
+static void *batchthread(void *arg)
+{
+    sha256batchq_t *q = (sha256batchq_t *)arg;
+
+    for (int j=0; j<NBATCHJOBS; j++)
+    {
+        batchjobs[j] = (sha256job_t){ streams[j % NSTREAMS] + j, j % 200, batchmd[j], 0, batchjobdone, NULL, NULL };
+        sha256batchq_submit(q, &batchjobs[j]);
+    }
+    return NULL;
+}
+
+static void *streamthread(void *arg)
+{
+    int s = (int)(intptr_t)arg;
+    sha256ctx_t ctx;
+
+    // uneven updates so the tail handling gets exercised while taking turns
+    sha256init(&ctx);
+    for (uint32_t pos=0; pos<STREAMLEN; )
+    {
+        uint32_t n = 1 + (pos * 7 + s * 131) % 1500;
+        if (n > STREAMLEN - pos)
+            n = STREAMLEN - pos;
+        sha256update(&ctx, &streams[s][pos], n);
+        pos += n;
+    }
+    sha256final(&ctx, gotmd[s]);
+    return NULL;
+}
+
+int main(void)
+{
+    uint8_t md[SHA256DIGESTSIZE], md2[SHA256DIGESTSIZE], state[SHA256STATESIZE];
+    sha256ctx_t ctx, ctx2;
+
+    printf("Checking test vectors.....\n");
+    for (int v=0; v<sizeof(vectors)/sizeof(vectors[0]); v++)
+    {
+        sha256((const uint8_t *)vectors[v].msg, strlen(vectors[v].msg), md);
+        if (memcmp(md, vectors[v].md, SHA256DIGESTSIZE) != 0)
+        {
+            printf("ERROR: wrong digest for \"%s\"\n", vectors[v].msg);
+            return -1;
+        }
+    }
+    printf("\tTest vectors Success!\n");
+
+    for (int s=0; s<NSTREAMS; s++)
+    {
+        for (int i=0; i<STREAMLEN; i++)
+            streams[s][i] = (uint8_t)(i * (s + 3) + (i >> 9));
+        sha256(streams[s], STREAMLEN, refmd[s]);
+    }
+
+    printf("Checking midstate export/import.....\n");
+    sha256init(&ctx);
+    sha256update(&ctx, streams[0], 100);
+    if (sha256export(&ctx, state) != EINVAL)
+    {
+        printf("ERROR: exported a midstate with a partial block\n");
+        return -1;
+    }
+    sha256update(&ctx, streams[0] + 100, 3 * SHA256BLKSIZE - 100);
+    if (sha256export(&ctx, state) != 0 || sha256import(&ctx2, state) != 0)
+    {
+        printf("ERROR: midstate export/import failed\n");
+        return -1;
+    }
+    sha256update(&ctx2, streams[0] + 3 * SHA256BLKSIZE, STREAMLEN - 3 * SHA256BLKSIZE);
+    sha256final(&ctx2, md2);
+    if (memcmp(md2, refmd[0], SHA256DIGESTSIZE) != 0)
+    {
+        printf("ERROR: resumed stream gives the wrong digest\n");
+        return -1;
+    }
+    printf("\tMidstate export/import Success!\n");
+
+    printf("Checking HMAC-SHA256.....\n");
+    for (int v=0; v<sizeof(hmacvectors)/sizeof(hmacvectors[0]); v++)
+    {
+        sha256hmackey_t hk;
+        sha256hmacctx_t hc;
+        const uint8_t *msg = (const uint8_t *)hmacvectors[v].msg;
+        uint32_t len = strlen(hmacvectors[v].msg);
+
+        // one-shot, then the same key again split across updates, both from the cached pads
+        sha256hmac_setkey(&hk, hmacvectors[v].key, hmacvectors[v].keylen);
+        sha256hmac(&hk, msg, len, md);
+        sha256hmac_init(&hc, &hk);
+        sha256hmac_update(&hc, msg, 3);
+        sha256hmac_update(&hc, msg + 3, len - 3);
+        sha256hmac_final(&hc, md2);
+        if (memcmp(md, hmacvectors[v].mac, SHA256DIGESTSIZE) != 0 ||
+            memcmp(md2, hmacvectors[v].mac, SHA256DIGESTSIZE) != 0)
+        {
+            printf("ERROR: wrong HMAC for \"%s\"\n", hmacvectors[v].msg);
+            return -1;
+        }
+    }
+    printf("\tHMAC-SHA256 Success!\n");
+
+    printf("Checking %d streams sharing one engine.....\n", NSTREAMS);
+    sha256backend_t be = { testengine, NULL, 2, 0 };
+    sha256setbackend(&be);
+
+    pthread_t tids[NSTREAMS];
+    for (int s=0; s<NSTREAMS; s++)
+        pthread_create(&tids[s], NULL, streamthread, (void *)(intptr_t)s);
+    for (int s=0; s<NSTREAMS; s++)
+        pthread_join(tids[s], NULL);
+    sha256setbackend(NULL);
+
+    for (int s=0; s<NSTREAMS; s++)
+    {
+        if (memcmp(gotmd[s], refmd[s], SHA256DIGESTSIZE) != 0)
+        {
+            printf("ERROR: stream %d gives the wrong digest\n", s);
+            return -1;
+        }
+    }
+    if (overlaps != 0)
+    {
+        printf("ERROR: %d turns overlapped in the engine\n", overlaps);
+        return -1;
+    }
+
+    sha256enginestats_t stats;
+    sha256enginestats(&stats);
+    printf("\t%llu turns (%llu waited), %llu blocks\n", (unsigned long long)stats.turns,
+           (unsigned long long)stats.waits, (unsigned long long)stats.blocks);
+    printf("\tShared engine Success!\n");
+
+    printf("Checking batched small messages.....\n");
+    be.compressv = testenginev;
+    sha256setbackend(&be);
+    for (int j=0; j<NBATCHJOBS; j++)
+        batchjobs[j] = (sha256job_t){ streams[0] + j, j, batchmd[j], 0, NULL, NULL, NULL };
+    // two trips per chunk at most: whole blocks, then the padded last blocks
+    if (sha256batch(batchjobs, NBATCHJOBS) != 0 || vtrips > 2 * ((NBATCHJOBS + SHA256BATCHMAX - 1) / SHA256BATCHMAX))
+    {
+        printf("ERROR: batch of %d took %d engine trips\n", NBATCHJOBS, vtrips);
+        return -1;
+    }
+    for (int j=0; j<NBATCHJOBS; j++)
+    {
+        sha256(streams[0] + j, j, md);
+        if (batchjobs[j].status != 0 || memcmp(md, batchmd[j], SHA256DIGESTSIZE) != 0)
+        {
+            printf("ERROR: batched message %d gives the wrong digest\n", j);
+            return -1;
+        }
+    }
+
+    // submitted from another thread, a straggler or two left for the CPU at the end
+    sha256batchq_t *q = sha256batchq_new(32, 4, 1000);
+    sha256batchqstats_t qstats;
+    pthread_t btid;
+
+    pthread_create(&btid, NULL, batchthread, q);
+    pthread_join(btid, NULL);
+    for (int w=0; w<5000 && __atomic_load_n(&batchdone, __ATOMIC_ACQUIRE) < NBATCHJOBS; w++)
+        usleep(1000);
+    sha256batchq_stats(q, &qstats);
+    sha256batchq_free(q);
+    sha256setbackend(NULL);
+    for (int j=0; j<NBATCHJOBS; j++)
+    {
+        sha256(streams[j % NSTREAMS] + j, j % 200, md);
+        if (batchjobs[j].status != 0 || memcmp(md, batchmd[j], SHA256DIGESTSIZE) != 0)
+        {
+            printf("ERROR: queued message %d gives the wrong digest\n", j);
+            return -1;
+        }
+    }
+    printf("\t%d queued jobs, %llu engine batches\n", batchdone, (unsigned long long)qstats.batches);
+    if (batchdone != NBATCHJOBS || qstats.enginejobs + qstats.cpujobs != NBATCHJOBS || overlaps != 0)
+    {
+        printf("ERROR: batch queue lost jobs or overlapped in the engine\n");
+        return -1;
+    }
+    printf("\tBatched messages Success!\n");
+
+    printf("Checking tree hash on the engine and %d CPU threads.....\n", NSTREAMS - 1);
+    sha256treeopts_t topts = { 1024, NSTREAMS - 1, 0 };
+    sha256treestats_t tstats;
+    uint64_t treelen = sizeof(streams) - 77;
+    uint64_t nleaves = (treelen + topts.leafsize - 1) / topts.leafsize;
+
+    reftree(streams[0], treelen, topts.leafsize, 0, nleaves, md2);
+    sha256setbackend(&be);
+    if (sha256tree(streams[0], treelen, &topts, md, &tstats) != 0 || memcmp(md, md2, SHA256DIGESTSIZE) != 0)
+    {
+        printf("ERROR: tree hash of %llu bytes is wrong\n", (unsigned long long)treelen);
+        return -1;
+    }
+    sha256setbackend(NULL);
+    if (tstats.leaves != nleaves || overlaps != 0)
+    {
+        printf("ERROR: tree hash covered %llu of %llu leaves, %d overlaps\n",
+               (unsigned long long)tstats.leaves, (unsigned long long)nleaves, overlaps);
+        return -1;
+    }
+    printf("\t%llu leaves, %llu on the engine\n", (unsigned long long)tstats.leaves,
+           (unsigned long long)tstats.engineleaves);
+
+    // the same root from two windows hashed separately, as wssha256sum maps a file
+    uint64_t split = 7 * topts.leafsize;
+    uint8_t *leafmds = malloc(nleaves * SHA256DIGESTSIZE);
+    memset(&tstats, 0, sizeof(tstats));
+    if (leafmds == NULL || sha256treeleaves(streams[0], split, &topts, leafmds, &tstats) != 0 ||
+        sha256treeleaves(streams[0] + split, treelen - split, &topts, leafmds + 7 * SHA256DIGESTSIZE, &tstats) != 0 ||
+        sha256treeroot(leafmds, nleaves, md) != 0 || memcmp(md, md2, SHA256DIGESTSIZE) != 0 || tstats.leaves != nleaves)
+    {
+        printf("ERROR: tree hash in two windows is wrong\n");
+        return -1;
+    }
+    free(leafmds);
+    printf("\tTree hash Success!\n");
+
+    return 0;
+}
@@ -0,0 +1,83 @@
+/**
+ * @file   wssha256hmac.c
+ * @brief  HMAC-SHA256 (RFC 2104) on libwssha256ctx streams, with the padded key blocks hashed once
+ * per key instead of once per MAC.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "wssha256ctx.h"
+
+
+int32_t sha256hmac_setkey(sha256hmackey_t *hk, const uint8_t *key, uint32_t keylen)
+{
+    uint8_t k[SHA256BLKSIZE], pad[SHA256BLKSIZE];
+    int32_t ret;
+
+    // keys longer than a block are hashed first, shorter ones zero-padded
+    memset(k, 0, sizeof(k));
+    if (keylen > SHA256BLKSIZE)
+    {
+        ret = sha256(key, keylen, k);
+        if (ret != 0)
+            return ret;
+    }
+    else
+        memcpy(k, key, keylen);
+
+    for (int i=0; i<SHA256BLKSIZE; i++)
+        pad[i] = k[i] ^ 0x36;
+    sha256init(&hk->inner);
+    ret = sha256update(&hk->inner, pad, SHA256BLKSIZE);
+
+    for (int i=0; i<SHA256BLKSIZE && ret == 0; i++)
+        pad[i] = k[i] ^ 0x5c;
+    sha256init(&hk->outer);
+    if (ret == 0)
+        ret = sha256update(&hk->outer, pad, SHA256BLKSIZE);
+
+    memset(k, 0, sizeof(k));
+    memset(pad, 0, sizeof(pad));
+    return ret;
+}
+
+
+void sha256hmac_init(sha256hmacctx_t *hc, const sha256hmackey_t *hk)
+{
+    hc->ctx = hk->inner;
+    hc->key = hk;
+}
+
+
+int32_t sha256hmac_update(sha256hmacctx_t *hc, const uint8_t *data, uint64_t len)
+{
+    return sha256update(&hc->ctx, data, len);
+}
+
+
+int32_t sha256hmac_final(sha256hmacctx_t *hc, uint8_t *mac)
+{
+    uint8_t inner[SHA256DIGESTSIZE];
+    sha256ctx_t outer = hc->key->outer;
+    int32_t ret;
+
+    ret = sha256final(&hc->ctx, inner);
+    if (ret == 0)
+        ret = sha256update(&outer, inner, SHA256DIGESTSIZE);
+    if (ret == 0)
+        ret = sha256final(&outer, mac);
+    return ret;
+}
+
+
+int32_t sha256hmac(const sha256hmackey_t *hk, const uint8_t *data, uint64_t len, uint8_t *mac)
+{
+    sha256hmacctx_t hc;
+    int32_t ret;
+
+    sha256hmac_init(&hc, hk);
+    ret = sha256hmac_update(&hc, data, len);
+    if (ret != 0)
+        return ret;
+    return sha256hmac_final(&hc, mac);
+}
@@ -0,0 +1,189 @@
+/**
+ * @file   wssha256sum.c
+ * @brief  Hashes files through libwssha256ctx, by default as a Merkle tree with the leaves spread
+ * over the SHA256 engine and the CPU cores (sha256tree()), or with -s as one plain sequential
+ * SHA256 that matches sha256sum. Files are mapped a window at a time rather than read. Prints
+ * sha256sum-style lines on stdout and the rate on stderr.
+ *
+ * usage: wssha256sum [-s] [-n] [-t cputhreads] [-l leaf KiB] file...
+ *   -s  plain sequential SHA256 instead of the tree hash
+ *   -n  tree hash on the CPU threads only, leaving the engine out
+ *   -t  software threads besides the engine thread (default: online CPUs - 1)
+ *   -l  leaf size in KiB (default 1024)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "wssha256ctx.h"
+
+#define DEFAULT_LEAFKB 1024
+#define WINDOWSIZE (64 * 1024 * 1024)    // bytes mapped at a time, rounded up to whole leaves
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Maps len bytes of fd at off, which need not be page aligned; *mapp and *maplenp are what to
+ * unmap
+ */
+static const uint8_t *mapwindow(int fd, off_t off, size_t len, int sequential, void **mapp, size_t *maplenp)
+{
+    long pagesize = sysconf(_SC_PAGESIZE);
+    off_t start = off / pagesize * pagesize;
+    void *p;
+
+    *maplenp = len + (off - start);
+    p = mmap(NULL, *maplenp, PROT_READ, MAP_PRIVATE, fd, start);
+    if (p == MAP_FAILED)
+        return NULL;
+    madvise(p, *maplenp, sequential ? MADV_SEQUENTIAL : MADV_WILLNEED);
+    *mapp = p;
+    return (const uint8_t *)p + (off - start);
+}
+
+/*
+ * Hashes a file a window at a time, so neither its size nor a 32-bit address space gets in the way.
+ * A window is whole leaves, and the leaf digests of all of them are reduced to the root at the end.
+ */
+static int hashfile(const char *path, int sequential, const sha256treeopts_t *opts)
+{
+    uint8_t md[SHA256DIGESTSIZE];
+    sha256treestats_t ts = { 0, 0 };
+    uint64_t window = (WINDOWSIZE + opts->leafsize - 1) / opts->leafsize * (uint64_t)opts->leafsize;
+    uint64_t nleaves = 0;
+    uint8_t *leaves = NULL;
+    sha256ctx_t ctx;
+    struct stat st;
+    double start, secs;
+    int32_t ret = 0;
+    off_t off;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        return errno;
+    }
+    if (!S_ISREG(st.st_mode))
+    {
+        fprintf(stderr, "%s: not a regular file\n", path);
+        close(fd);
+        return EINVAL;
+    }
+
+    if (!sequential)
+    {
+        leaves = malloc(((st.st_size + opts->leafsize - 1) / opts->leafsize + 1) * SHA256DIGESTSIZE);
+        if (leaves == NULL)
+        {
+            perror(path);
+            close(fd);
+            return ENOMEM;
+        }
+    }
+    sha256init(&ctx);
+
+    start = now();
+    for (off=0; off<st.st_size && ret==0; off+=window)
+    {
+        size_t len = (st.st_size - off > window) ? window : st.st_size - off;
+        const uint8_t *data;
+        size_t maplen;
+        void *map;
+
+        data = mapwindow(fd, off, len, sequential, &map, &maplen);
+        if (data == NULL)
+        {
+            ret = errno;
+            perror(path);
+            break;
+        }
+        if (sequential)
+            ret = sha256update(&ctx, data, len);
+        else
+        {
+            ret = sha256treeleaves(data, len, opts, leaves + nleaves * SHA256DIGESTSIZE, &ts);
+            nleaves += (len + opts->leafsize - 1) / opts->leafsize;
+        }
+        munmap(map, maplen);
+    }
+    if (ret == 0)
+        ret = sequential ? sha256final(&ctx, md) : sha256treeroot(leaves, nleaves, md);
+    secs = now() - start;
+
+    free(leaves);
+    close(fd);
+
+    if (ret != 0)
+    {
+        fprintf(stderr, "%s: hashing failed (%d)\n", path, ret);
+        return ret;
+    }
+
+    for (int i=0; i<SHA256DIGESTSIZE; i++)
+        printf("%02x", md[i]);
+    printf("  %s\n", path);
+
+    fprintf(stderr, "%s: %lld bytes in %.3f s, %.2f GB/s", path, (long long)st.st_size, secs,
+            (secs > 0) ? st.st_size / secs / 1e9 : 0.0);
+    if (!sequential)
+        fprintf(stderr, ", %llu leaves (%llu on the engine)", (unsigned long long)ts.leaves,
+                (unsigned long long)ts.engineleaves);
+    fprintf(stderr, "\n");
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    sha256treeopts_t opts = { DEFAULT_LEAFKB * 1024, (ncpu > 1) ? ncpu - 1 : 1, 0 };
+    int sequential = 0, errors = 0, c;
+
+    while ((c = getopt(argc, argv, "snt:l:")) != -1)
+    {
+        switch (c)
+        {
+            case 's':
+                sequential = 1;
+                break;
+            case 'n':
+                opts.noengine = 1;
+                break;
+            case 't':
+                opts.cputhreads = atoi(optarg);
+                break;
+            case 'l':
+                opts.leafsize = atoi(optarg) * 1024;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-s] [-n] [-t cputhreads] [-l leaf KiB] file...\n", argv[0]);
+                return EINVAL;
+        }
+    }
+    if (optind >= argc || opts.leafsize == 0 || (opts.noengine && opts.cputhreads == 0))
+    {
+        fprintf(stderr, "usage: %s [-s] [-n] [-t cputhreads] [-l leaf KiB] file...\n", argv[0]);
+        return EINVAL;
+    }
+
+    for (int i=optind; i<argc; i++)
+    {
+        if (hashfile(argv[i], sequential, &opts) != 0)
+            errors++;
+    }
+    return errors ? 1 : 0;
+}
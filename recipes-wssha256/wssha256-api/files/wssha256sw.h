@@ -0,0 +1,15 @@
+#pragma once
+
+/*
+ * Software SHA256 compression function, the default engine behind wssha256ctx.h
+ */
+
+#include <stdint.h>
+
+void sha256sw_compress(uint32_t *h, const uint8_t *blocks, uint64_t nblocks);
+
+/*
+ * Makes the calling thread's streams compress in software whatever engine is set, e.g. for CPU
+ * workers sharing a job with the engine. Returns the previous setting.
+ */
+int sha256sw_thread(int on);
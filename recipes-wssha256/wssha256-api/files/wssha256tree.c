@@ -0,0 +1,211 @@
+/**
+ * @file   wssha256tree.c
+ * @brief  Merkle tree hashing of large buffers, with the leaves split between the SHA256 engine
+ * and CPU threads.
+ *
+ * Leaves are handed out one at a time from a shared counter, so the engine thread and the CPU
+ * threads each take as many as they can keep up with; nothing has to be tuned to their relative
+ * speeds. The inner nodes are a small fraction of the work and are hashed in software afterwards.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "wssha256ctx.h"
+#include "wssha256sw.h"
+
+typedef struct {
+    const uint8_t *data;
+    uint64_t len;
+    uint32_t leafsize;
+    uint64_t nleaves;
+    uint8_t *nodes;             // one digest per leaf
+    uint64_t next;              // next unclaimed leaf
+    int32_t err;
+} treejob_t;
+
+typedef struct {
+    treejob_t *job;
+    int engine;
+    uint64_t leaves;
+    pthread_t tid;
+} treeworker_t;
+
+
+/*
+ * SHA256(prefix || a || b)
+ */
+static int32_t hashnode(uint8_t prefix, const uint8_t *a, uint64_t alen, const uint8_t *b, uint64_t blen,
+                        uint8_t *md)
+{
+    sha256ctx_t ctx;
+    int32_t ret;
+
+    sha256init(&ctx);
+    ret = sha256update(&ctx, &prefix, 1);
+    if (ret == 0)
+        ret = sha256update(&ctx, a, alen);
+    if (ret == 0 && blen > 0)
+        ret = sha256update(&ctx, b, blen);
+    if (ret == 0)
+        ret = sha256final(&ctx, md);
+    return ret;
+}
+
+
+static void *treeworker(void *arg)
+{
+    treeworker_t *tw = (treeworker_t *)arg;
+    treejob_t *job = tw->job;
+
+    if (!tw->engine)
+        sha256sw_thread(1);
+
+    for (;;)
+    {
+        uint64_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        uint64_t off = i * job->leafsize;
+        int32_t ret;
+
+        if (i >= job->nleaves)
+            break;
+        ret = hashnode(0x00, job->data + off, (job->len - off < job->leafsize) ? job->len - off : job->leafsize,
+                       NULL, 0, job->nodes + i * SHA256DIGESTSIZE);
+        if (ret != 0)
+        {
+            // first error wins, and the others stop claiming leaves
+            int32_t none = 0;
+            __atomic_compare_exchange_n(&job->err, &none, ret, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            __atomic_store_n(&job->next, job->nleaves, __ATOMIC_RELAXED);
+            break;
+        }
+        tw->leaves++;
+    }
+    return NULL;
+}
+
+
+/*
+ * Hashes the leaves of len bytes into one digest each at leaves. A large input can go through a
+ * window at a time, as long as every window but the last is whole leaves. Adds to *stats.
+ */
+int32_t sha256treeleaves(const uint8_t *data, uint64_t len, const sha256treeopts_t *opts, uint8_t *leaves,
+                         sha256treestats_t *stats)
+{
+    uint32_t nworkers = opts->cputhreads + (opts->noengine ? 0 : 1);
+    treejob_t job = { data, len, opts->leafsize, 0, leaves, 0, 0 };
+    treeworker_t *workers;
+    uint32_t started = 0;
+    int32_t ret = 0;
+
+    if (opts->leafsize == 0 || nworkers == 0)
+        return EINVAL;
+    if (len == 0)
+        return 0;
+
+    job.nleaves = (len + opts->leafsize - 1) / opts->leafsize;
+    workers = calloc(nworkers, sizeof(treeworker_t));
+    if (workers == NULL)
+    {
+        perror("Failed to allocate the tree workers");
+        return ENOMEM;
+    }
+
+    for (uint32_t w=0; w<nworkers; w++)
+    {
+        workers[w].job = &job;
+        workers[w].engine = (w == 0 && !opts->noengine);
+        ret = pthread_create(&workers[w].tid, NULL, treeworker, &workers[w]);
+        if (ret != 0)
+        {
+            errno = ret;
+            perror("Failed to start a tree worker");
+            __atomic_store_n(&job.next, job.nleaves, __ATOMIC_RELAXED);
+            break;
+        }
+        started++;
+    }
+    for (uint32_t w=0; w<started; w++)
+    {
+        pthread_join(workers[w].tid, NULL);
+        if (stats != NULL)
+        {
+            stats->leaves += workers[w].leaves;
+            if (workers[w].engine)
+                stats->engineleaves += workers[w].leaves;
+        }
+    }
+    if (ret == 0)
+        ret = job.err;
+
+    free(workers);
+    return ret;
+}
+
+
+/*
+ * Reduces nleaves leaf digests to the root, overwriting them
+ */
+int32_t sha256treeroot(uint8_t *nodes, uint64_t nleaves, uint8_t *root)
+{
+    int prev = sha256sw_thread(1);
+    uint64_t n = nleaves;
+    int32_t ret = 0;
+
+    // the tree of nothing is the hash of nothing
+    if (nleaves == 0)
+    {
+        sha256sw_thread(prev);
+        return sha256(NULL, 0, root);
+    }
+
+    // pair up each level in place, carrying an odd node up unchanged
+    while (n > 1 && ret == 0)
+    {
+        for (uint64_t i=0; i<n/2 && ret == 0; i++)
+            ret = hashnode(0x01, nodes + 2 * i * SHA256DIGESTSIZE, SHA256DIGESTSIZE,
+                           nodes + (2 * i + 1) * SHA256DIGESTSIZE, SHA256DIGESTSIZE,
+                           nodes + i * SHA256DIGESTSIZE);
+        if (n & 1)
+            memmove(nodes + (n / 2) * SHA256DIGESTSIZE, nodes + (n - 1) * SHA256DIGESTSIZE, SHA256DIGESTSIZE);
+        n = (n + 1) / 2;
+    }
+    sha256sw_thread(prev);
+    if (ret == 0)
+        memcpy(root, nodes, SHA256DIGESTSIZE);
+    return ret;
+}
+
+
+int32_t sha256tree(const uint8_t *data, uint64_t len, const sha256treeopts_t *opts, uint8_t *root,
+                   sha256treestats_t *stats)
+{
+    uint64_t nleaves;
+    uint8_t *nodes;
+    int32_t ret;
+
+    if (opts->leafsize == 0 || opts->cputhreads + (opts->noengine ? 0 : 1) == 0)
+        return EINVAL;
+
+    if (stats != NULL)
+        memset(stats, 0, sizeof(*stats));
+    if (len == 0)
+        return sha256treeroot(NULL, 0, root);
+
+    nleaves = (len + opts->leafsize - 1) / opts->leafsize;
+    nodes = malloc(nleaves * SHA256DIGESTSIZE);
+    if (nodes == NULL)
+    {
+        perror("Failed to allocate the tree");
+        return ENOMEM;
+    }
+
+    ret = sha256treeleaves(data, len, opts, nodes, stats);
+    if (ret == 0)
+        ret = sha256treeroot(nodes, nleaves, root);
+    free(nodes);
+    return ret;
+}